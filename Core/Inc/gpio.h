@@ -45,6 +45,7 @@ void gpio_debug1(uint32_t enable);
 void gpio_debug2(uint32_t enable);
 void gpio_debug3(uint32_t enable);
 void gpio_NAND_CS(uint32_t ncs);
+void gpio_NAND1_CS(uint32_t ncs);
 /* USER CODE END Prototypes */
 
 #ifdef __cplusplus
@@ -1,7 +1,9 @@
-
 #ifndef __SPI_NAND_H__
 #define __SPI_NAND_H__
 #include <stdint.h>
+#include "spi_nand_engine.h"
+#include "spi_nand_bbt.h"
+#include "spi_nand_part.h"
 
 struct spi_nand_buffer_op {
 	uint32_t offset;
@@ -9,24 +11,206 @@ struct spi_nand_buffer_op {
 	uint32_t nbytes;
 };
 
-int spi_nand_read_page(uint32_t page,
+/*
+ * Per operation counts of the lock and write enable transactions issued
+ * and the ones that could be skipped. See spi_nand_lock_down().
+ */
+struct spi_nand_op_stats {
+	uint32_t n_ops;
+	uint32_t n_issued;
+	uint32_t n_saved;
+};
+
+struct spi_nand_session_stats {
+	struct spi_nand_op_stats program;
+	struct spi_nand_op_stats copy;
+	struct spi_nand_op_stats erase;
+	struct spi_nand_op_stats lock_down;
+};
+
+/*
+ * The block lock register and write enable latch as we last left them, so
+ * that write and erase only reissue them when they need to change.
+ * Anything that can change them behind our back (reset) invalidates them.
+ */
+struct spi_nand_session {
+	uint32_t lock_valid;
+	uint8_t lock;
+	uint32_t wel_valid;
+	uint32_t wel;
+	struct spi_nand_session_stats stats;
+};
+
+/*
+ * Cache read pipeline state.
+ * While active, the part is in cache read mode and the array is loading
+ * next_page into the data register.
+ */
+struct spi_nand_cache_read {
+	uint32_t active;
+	uint32_t next_page;
+};
+
+/*
+ * One SPI NAND chip: the bus it is on and its chip select, plus the driver
+ * state for it. The geometry is filled in by spi_nand_probe().
+ */
+struct spi_nand {
+	const char *name;
+	void *bus;					/* SPI_HandleTypeDef on the target */
+	void *timer;				/* TIM_TypeDef that paces status polls */
+	void (*cs)(uint32_t ncs);
+	uint32_t die;				/* Index for the timing statistics */
+	const char *part_name;
+	char model[21];				/* From the parameter page */
+	struct spi_nand_geometry geo;
+
+	struct spi_nand_engine engine;
+	struct spi_nand_session session;
+	struct spi_nand_cache_read cache_read;
+	struct spi_nand_bbt bbt;
+	uint32_t initialised;		/* Timing model and bus set up */
+};
+
+#define SPI_NAND_N_CHIPS	2
+
+/* nand0 is on SPI1, nand1 on SPI3. */
+extern struct spi_nand spi_nand_chips[SPI_NAND_N_CHIPS];
+
+int spi_nand_read_page(struct spi_nand *nand,
+					   uint32_t page,
 					   struct spi_nand_buffer_op *ops,
 					   uint32_t n_ops,
 					   uint8_t *statusptr);
 
-int spi_nand_write_page(uint32_t page,
+/*
+ * Pipelined page read using the cache read commands.
+ * Reads page into the buffers described by ops, and if next_page is not
+ * SPI_NAND_NO_PAGE starts loading next_page from the array while the
+ * caller is busy with this one.
+ * The next call should then ask for next_page, otherwise the pipeline is
+ * drained first.
+ */
+#define SPI_NAND_NO_PAGE	0xffffffff
+
+int spi_nand_read_page_pipelined(struct spi_nand *nand,
+								 uint32_t page,
+								 uint32_t next_page,
+								 struct spi_nand_buffer_op *ops,
+								 uint32_t n_ops,
+								 uint8_t *statusptr);
+
+int spi_nand_write_page(struct spi_nand *nand,
+						uint32_t page,
 		   	   	   	    struct spi_nand_buffer_op *ops,
 		   	   	   	    uint32_t n_ops,
 		   	   	   	    uint8_t *statusptr);
 
-int spi_nand_erase_block(uint32_t block, uint8_t *statusptr);
+/*
+ * Copy src_page to dst_page inside the chip, patching in the bytes
+ * described by ops on the way.
+ * Both pages must be on the same plane, see spi_nand_same_plane().
+ */
+int spi_nand_copy_page(struct spi_nand *nand,
+					   uint32_t src_page,
+					   uint32_t dst_page,
+					   struct spi_nand_buffer_op *ops,
+					   uint32_t n_ops,
+					   uint8_t *statusptr);
+
+int spi_nand_same_plane(struct spi_nand *nand, uint32_t page_a, uint32_t page_b);
+
+int spi_nand_erase_block(struct spi_nand *nand, uint32_t block, uint8_t *statusptr);
+
+/*
+ * Asynchronous page read and write, and block erase.
+ * The caller owns req and the buffers until done is called. done runs in
+ * interrupt context, spi_nand_request_wait() can be used instead.
+ * The sync and async calls share one queue per chip so they may be freely
+ * mixed.
+ */
+#define SPI_NAND_REQUEST_MAX_OPS	4
+#define SPI_NAND_REQUEST_MAX_SEGS	(2 * SPI_NAND_REQUEST_MAX_OPS)
+
+struct spi_nand_request;
+
+typedef void (*spi_nand_request_done_fn)(struct spi_nand_request *req, void *ctx);
+
+struct spi_nand_request {
+	/*
+	 * Read: page read + ops. Write: wren + unlock + ops + execute.
+	 * Erase: wren + unlock + erase.
+	 */
+	struct spi_nand_txn txn[SPI_NAND_REQUEST_MAX_OPS + 3];
+	struct spi_nand_seg seg[SPI_NAND_REQUEST_MAX_SEGS];
+	uint32_t n_txns;
+	uint32_t n_segs;
+	volatile uint32_t n_done;
+	volatile uint32_t complete;
+	uint8_t status;
+	uint8_t lock_value;
+	uint8_t op;					/* enum spi_nand_timing_op */
+	struct spi_nand *nand;
+	uint32_t die;
+	int result;
+	spi_nand_request_done_fn done;
+	void *ctx;
+};
+
+int spi_nand_read_page_async(struct spi_nand *nand,
+							 uint32_t page,
+							 struct spi_nand_buffer_op *ops,
+							 uint32_t n_ops,
+							 struct spi_nand_request *req,
+							 spi_nand_request_done_fn done,
+							 void *ctx);
+
+int spi_nand_write_page_async(struct spi_nand *nand,
+							  uint32_t page,
+							  struct spi_nand_buffer_op *ops,
+							  uint32_t n_ops,
+							  struct spi_nand_request *req,
+							  spi_nand_request_done_fn done,
+							  void *ctx);
+
+int spi_nand_erase_block_async(struct spi_nand *nand,
+							   uint32_t block,
+							   struct spi_nand_request *req,
+							   spi_nand_request_done_fn done,
+							   void *ctx);
+
+int spi_nand_request_wait(struct spi_nand_request *req, uint8_t *statusptr);
+
+int spi_nand_check_block_ok(struct spi_nand *nand, uint32_t block, uint32_t *is_ok);
+
+int spi_nand_mark_block_bad(struct spi_nand *nand, uint32_t block, uint8_t *status);
+
+/*
+ * Session control.
+ * Blocks stay unlocked between writes until spi_nand_lock_down(), which
+ * should be called on sync and unmount.
+ */
+int spi_nand_lock_down(struct spi_nand *nand);
+void spi_nand_get_session_stats(struct spi_nand *nand, struct spi_nand_session_stats *stats);
+void spi_nand_clear_session_stats(struct spi_nand *nand);
 
-int spi_nand_check_block_ok(uint32_t block, uint32_t *is_ok);
+/*
+ * Identify the part and fill in nand->geo, from the parameter page if it
+ * has one, otherwise from the part table. spi_nand_init() does this
+ * too if it has not been done, but the geometry is often needed before
+ * the chip is brought up.
+ */
+int spi_nand_probe(struct spi_nand *nand);
 
-int spi_nand_mark_block_bad(uint32_t block, uint8_t *status);
+int spi_nand_init(struct spi_nand *nand);
+int spi_nand_reset(struct spi_nand *nand);
 
-int spi_nand_init(void);
-int spi_nand_reset(void);
+/*
+ * The driver's clock, for timing things from outside: the DWT cycle
+ * counter, or simulated time on a host. It wraps, so take differences.
+ */
+uint32_t spi_nand_clock_cycles(void);
+uint32_t spi_nand_clock_cycles_per_us(void);
 
 
 void spi_nand_test(void);
@@ -0,0 +1,46 @@
+#ifndef __SPI_NAND_BBT_H__
+#define __SPI_NAND_BBT_H__
+#include <stdint.h>
+
+/*
+ * RAM resident bad block table for one SPI NAND chip.
+ *
+ * The table is a bitmap with a bit set for each bad block. It is kept on
+ * flash in page 0 of one of the last SPI_NAND_BBT_N_RESERVED blocks of the
+ * chip, with a version number and a checksum. Each save goes to the other
+ * block, so the previous table is intact until the new one is written.
+ *
+ * Loading reads page 0 of each reserved block and takes the valid table
+ * with the highest version. Only when neither is valid are the factory
+ * bad block markers of all the blocks scanned, and the result saved.
+ */
+
+#define SPI_NAND_BBT_MAX_BLOCKS		2048
+#define SPI_NAND_BBT_N_RESERVED		2
+
+struct spi_nand;
+
+struct spi_nand_bbt {
+	uint32_t loaded;
+	uint32_t version;
+	uint32_t copy;			/* Reserved block holding the current table */
+	uint8_t bad[SPI_NAND_BBT_MAX_BLOCKS / 8];
+};
+
+/* Load the table, scanning and saving it if there is none on flash. */
+int spi_nand_bbt_load(struct spi_nand *nand);
+
+/* Rebuild the table from the bad block markers and save it. */
+int spi_nand_bbt_scan(struct spi_nand *nand);
+
+/* Number of blocks usable for data, the reserved blocks excluded. */
+uint32_t spi_nand_bbt_usable_blocks(struct spi_nand *nand);
+
+int spi_nand_bbt_is_bad(struct spi_nand *nand, uint32_t block);
+
+/* Mark the block bad on flash and in the table, and save the table. */
+int spi_nand_bbt_mark_bad(struct spi_nand *nand, uint32_t block);
+
+uint32_t spi_nand_bbt_count_bad(struct spi_nand *nand);
+
+#endif /* __SPI_NAND_BBT_H__ */
@@ -0,0 +1,130 @@
+#ifndef __SPI_NAND_ENGINE_H__
+#define __SPI_NAND_ENGINE_H__
+#include <stdint.h>
+
+/*
+ * Interrupt driven SPI NAND transaction engine.
+ *
+ * A transaction is one CS framed command (opcode, address, dummy bytes),
+ * an optional data phase and optional status polling afterwards.
+ * Transactions are queued and run by a state machine that is stepped from
+ * the bus completion interrupt, so the CPU is free while they run.
+ *
+ * The data phase is either a single buffer or a list of segments that are
+ * all transferred within the one CS assertion, each one started from the
+ * completion interrupt of the one before. That lets a page's data, a gap
+ * and its OOB go in one command.
+ *
+ * Status polling can be paced. If the bus has a timer the engine stays off
+ * the bus for poll_delay_us after the command before the first poll, and
+ * poll_interval_us between polls, and passes back how long the part was
+ * busy so the caller can learn from it.
+ *
+ * The engine knows nothing about the hardware. It drives the bus through
+ * struct spi_nand_bus_ops, and the bus calls spi_nand_engine_xfer_done()
+ * each time a transfer it was asked to do completes and
+ * spi_nand_engine_timer_done() when a timer it started runs out.
+ */
+
+struct spi_nand_txn;
+
+typedef void (*spi_nand_txn_done_fn)(struct spi_nand_txn *txn, void *ctx);
+
+#define SPI_NAND_TXN_MAX_HEADER		6
+
+struct spi_nand_seg {
+	uint8_t *buffer;
+	uint32_t nbytes;
+	uint8_t is_tx;
+};
+
+struct spi_nand_txn {
+	uint8_t header[SPI_NAND_TXN_MAX_HEADER];
+	uint8_t header_size;	/* 0 means a status poll only */
+	uint8_t data_is_tx;
+	uint8_t poll_mask;		/* Poll status until these bits clear */
+	uint8_t status;			/* Last status read by polling */
+	uint8_t *data;
+	uint32_t data_size;
+	/* If set, used for the data phase instead of data/data_size. */
+	const struct spi_nand_seg *segs;
+	uint32_t n_segs;
+	uint32_t seg_index;
+	uint32_t n_polls;
+	uint32_t poll_delay_us;		/* Before the first poll */
+	uint32_t poll_interval_us;	/* Between polls after that */
+	uint32_t poll_start;		/* Clock when the command ended */
+	uint32_t busy_ticks;		/* Clock ticks until the poll saw it clear */
+	int result;
+
+	spi_nand_txn_done_fn done;	/* Called from interrupt context */
+	void *ctx;
+
+	struct spi_nand_txn *next;
+};
+
+struct spi_nand_bus_ops {
+	void (*select)(void *bus_ctx, int selected);
+	int (*transmit_async)(void *bus_ctx, const uint8_t *buffer, uint32_t nbytes);
+	int (*receive_async)(void *bus_ctx, uint8_t *buffer, uint32_t nbytes);
+	/* Mask and restore the bus completion interrupt. */
+	uint32_t (*lock)(void *bus_ctx);
+	void (*unlock)(void *bus_ctx, uint32_t flags);
+	/*
+	 * Optional. Call spi_nand_engine_timer_done() in us microseconds.
+	 * Without it status is polled back to back.
+	 */
+	void (*start_timer)(void *bus_ctx, uint32_t us);
+	/* Optional free running clock used to measure busy time. */
+	uint32_t (*clock)(void *bus_ctx);
+};
+
+enum spi_nand_engine_state {
+	SPI_NAND_ENGINE_IDLE,
+	SPI_NAND_ENGINE_HEADER,
+	SPI_NAND_ENGINE_DATA,
+	SPI_NAND_ENGINE_POLL_HEADER,
+	SPI_NAND_ENGINE_POLL_DATA,
+	SPI_NAND_ENGINE_POLL_WAIT,
+};
+
+struct spi_nand_engine {
+	const struct spi_nand_bus_ops *ops;
+	void *bus_ctx;
+
+	struct spi_nand_txn *head;
+	struct spi_nand_txn *tail;
+	volatile enum spi_nand_engine_state state;
+
+	uint8_t poll_cmd[2];
+
+	/* Statistics */
+	uint32_t n_txns;
+	uint32_t n_segs;
+	uint32_t n_polls;
+	uint32_t n_errors;
+};
+
+void spi_nand_engine_init(struct spi_nand_engine *eng,
+						  const struct spi_nand_bus_ops *ops,
+						  void *bus_ctx);
+
+/* Queue a transaction. It starts at once if the engine is idle. */
+void spi_nand_engine_submit(struct spi_nand_engine *eng,
+							struct spi_nand_txn *txn);
+
+/* Called by the bus, normally from its interrupt handler. */
+void spi_nand_engine_xfer_done(struct spi_nand_engine *eng);
+
+/* Called by the bus when the timer started by start_timer runs out. */
+void spi_nand_engine_timer_done(struct spi_nand_engine *eng);
+
+int spi_nand_engine_busy(struct spi_nand_engine *eng);
+
+/* Helper to fill in the command header of a transaction. */
+void spi_nand_txn_setup(struct spi_nand_txn *txn,
+						uint8_t opcode,
+						uint32_t n_addr, uint32_t address,
+						uint32_t n_dummy);
+
+#endif /* __SPI_NAND_ENGINE_H__ */
@@ -0,0 +1,65 @@
+#ifndef __SPI_NAND_PART_H__
+#define __SPI_NAND_PART_H__
+#include <stdint.h>
+
+/*
+ * Description of a SPI NAND part: its geometry, where the free bytes of
+ * the spare area are and how long its operations typically take.
+ *
+ * Parts we know about are in a built in table, looked up by their ID.
+ * Anything else that has an ONFI style parameter page can be described
+ * from that.
+ */
+
+struct spi_nand_geometry {
+	uint32_t data_bytes_per_page;
+	uint32_t spare_bytes_per_page;
+	uint32_t pages_per_block;
+	uint32_t n_blocks;
+	uint32_t n_planes;
+	uint32_t column_bits;		/* Plane select is the bit above these */
+	uint32_t oob_free_offset;	/* ECC protected free bytes, from the */
+	uint32_t oob_free_bytes;	/* start of the spare area */
+};
+
+struct spi_nand_part {
+	const char *name;
+	uint8_t mfr_id;
+	uint8_t dev_id;
+	struct spi_nand_geometry geo;
+	uint32_t t_read_us;			/* Typical times, 0 if unknown */
+	uint32_t t_prog_us;
+	uint32_t t_erase_us;
+};
+
+/*
+ * The biggest data page the build takes. The stripe and yaffs buffers are
+ * sized for it, parts in the table with bigger pages are left out and
+ * parameter pages describing them refused. Boards carrying the 4KB page
+ * MT29F4G01 define it to 4096, which costs about 25KB more of the yaffs
+ * arena, too much to leave room in RAM by default.
+ */
+#ifndef SPI_NAND_MAX_PAGE_BYTES
+#define SPI_NAND_MAX_PAGE_BYTES		2048
+#endif
+
+#define SPI_NAND_PARAM_PAGE			0x01
+#define SPI_NAND_PARAM_PAGE_SIZE	256
+#define SPI_NAND_PARAM_PAGE_COPIES	3
+
+const struct spi_nand_part *spi_nand_part_lookup(uint8_t mfr_id, uint8_t dev_id);
+
+/*
+ * Fill in part from one copy of the parameter page. Anything the parameter
+ * page does not say is kept from part, which the caller should have set up
+ * from the table or with defaults.
+ * Returns -1 if the copy is not valid, -2 if it describes a part with more
+ * than one LUN or more than two planes, which the driver cannot address,
+ * or with pages bigger than SPI_NAND_MAX_PAGE_BYTES.
+ */
+int spi_nand_part_from_param_page(const uint8_t *pp, struct spi_nand_part *part);
+
+/* Fill in the derived fields of geo: column bits and the default OOB layout. */
+void spi_nand_part_finish_geometry(struct spi_nand_geometry *geo);
+
+#endif /* __SPI_NAND_PART_H__ */
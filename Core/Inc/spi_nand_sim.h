@@ -0,0 +1,112 @@
+#ifndef __SPI_NAND_SIM_H__
+#define __SPI_NAND_SIM_H__
+#include <stdint.h>
+#include "spi_nand.h"
+
+/*
+ * Host simulator for the SPI NAND chips, so that the driver and yaffs can
+ * be run and benchmarked on a PC.
+ *
+ * It takes the place of the STM32 SPI bus under the transaction engine.
+ * The command bytes the engine sends are decoded as a Micron MT29F1G01
+ * style part would: page read into the data and cache registers, the
+ * cache read commands, program load and execute, block erase, the lock,
+ * configuration and status features, ID and parameter page. Program only
+ * clears bits, erase sets them, and writes and erases fail with P_FAIL or
+ * E_FAIL unless the write enable latch is set and the blocks are unlocked.
+ * The array is in memory, or in a file mapped into memory so it persists
+ * between runs.
+ *
+ * Time is simulated, in ns. Each bus transfer takes its bit time at the
+ * die's SPI clock plus a fixed overhead, and page reads, programs and
+ * erases keep the die busy for tRD, tPROG and tBERS. Each die has its own
+ * bus, so transfers on different dies overlap. CPU time is not counted:
+ * the clock only moves on while the driver waits for the bus or sleeps.
+ * The simulated clock is behind HAL_GetTick() and spi_nand_clock_cycles(),
+ * so the yaffs_bench.c benchmarks report simulated time.
+ *
+ * The engine sends each command header as a transfer of its own, which is
+ * how the simulator tells the header from the data.
+ *
+ * None of this is built unless SPI_NAND_HOST_SIM is defined. A host build
+ * compiles the spi_nand .c files (the simulator included), sim_main.c,
+ * yaffs_pr.c, yaffs_arena.c, yaffs_bench.c, yaffs_stress.c, yaffs_pfail.c
+ * and the yaffs sources with SPI_NAND_HOST_SIM and the same yaffs defines
+ * as the target, include paths Core/Inc and Core/Src/Yaffs, and links with
+ * --gc-sections as the target does. To run yaffs from many threads, sim
+ * -stress among them, also define YAFFS_PTHREAD_LOCKS, add
+ * yaffs_lock_pthread.c and link with pthreads.
+ */
+
+#define SPI_NAND_SIM_CYCLES_PER_US	1000	/* The cycle counter counts ns */
+
+struct spi_nand_sim_config {
+	uint8_t mfr_id;
+	uint8_t dev_id;
+	uint32_t spi_hz;
+	uint32_t xfer_overhead_ns;	/* Per transfer set up and interrupt */
+	uint32_t t_read_us;			/* tRD */
+	uint32_t t_cache_read_us;	/* tRCBSY */
+	uint32_t t_prog_us;			/* tPROG */
+	uint32_t t_erase_us;		/* tBERS */
+	uint32_t t_reset_us;
+	uint32_t n_factory_bad;		/* Blocks marked bad in a new image */
+	const char *image_path;		/* NULL keeps the array in memory */
+};
+
+struct spi_nand_sim_stats {
+	uint32_t n_page_reads;
+	uint32_t n_cache_reads;
+	uint32_t n_programs;
+	uint32_t n_erases;
+	uint32_t n_xfers;
+	uint64_t n_bytes;
+	uint64_t bus_ns;			/* Time the bus was busy */
+	uint64_t array_ns;			/* Time the array was busy */
+};
+
+/* The default config for die: an MT29F1G01 on SPI1 (42MHz) or SPI3 (21MHz). */
+void spi_nand_sim_default_config(uint32_t die, struct spi_nand_sim_config *cfg);
+
+/*
+ * Set up the die from cfg. Must be called before the die is probed.
+ * Dies that are not set up get the default config.
+ */
+int spi_nand_sim_setup(uint32_t die, const struct spi_nand_sim_config *cfg);
+
+/* Write the array back to the image file, if any, and free it. */
+void spi_nand_sim_close(uint32_t die);
+
+extern const struct spi_nand_bus_ops spi_nand_sim_bus_ops;
+
+/*
+ * Complete the next bus transfer due, moving the clock on to it.
+ * This is what the driver runs while it spins waiting for the bus.
+ */
+void spi_nand_sim_step(void);
+
+/* Let us go by, running the bus meanwhile. */
+void spi_nand_sim_delay_us(uint32_t us);
+
+/* The clock in ns, as a 32 bit cycle counter. */
+uint32_t spi_nand_sim_cycles(void);
+
+uint64_t spi_nand_sim_now_ns(void);
+
+/*
+ * Have reads of page report ecc_status (0..7, as in the status register
+ * bits 6:4) until it is next programmed or erased.
+ */
+int spi_nand_sim_set_ecc_status(uint32_t die, uint32_t page, uint8_t ecc_status);
+
+/*
+ * Have the next program of page fail with P_FAIL. The page is left half
+ * programmed and reads of it report an uncorrectable ECC error.
+ */
+int spi_nand_sim_set_program_fail(uint32_t die, uint32_t page);
+
+void spi_nand_sim_get_stats(uint32_t die, struct spi_nand_sim_stats *stats);
+
+void spi_nand_sim_print_stats(void);
+
+#endif /* __SPI_NAND_SIM_H__ */
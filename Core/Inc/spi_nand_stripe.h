@@ -0,0 +1,130 @@
+#ifndef __SPI_NAND_STRIPE_H__
+#define __SPI_NAND_STRIPE_H__
+#include <stdint.h>
+#include "spi_nand.h"
+
+/*
+ * Striping of several SPI NAND chips, each on its own bus, into one
+ * device.
+ *
+ * Chunks are interleaved across the chips, so a stripe block of
+ * n_chips * pages_per_block chunks is made of the same block on each chip:
+ *
+ *   chunk c of stripe block b is on chip (c % n_chips),
+ *   page b * pages_per_block + c / n_chips.
+ *
+ * Reads use the cache read pipeline on each chip, or can be issued
+ * asynchronously so that reads of consecutive chunks, which are on
+ * different chips, overlap.
+ *
+ * Writes either wait for their program, or are started with
+ * spi_nand_stripe_write_chunk_async() so that the program on one chip
+ * runs while the next chunk goes to the other. Each chip has at most one
+ * program in flight, and its status is collected from that program's own
+ * request before anything else is done on the chip, so a failure is
+ * always put down to the chunk that failed.
+ */
+
+#define SPI_NAND_STRIPE_MAX_CHIPS	SPI_NAND_N_CHIPS
+#define SPI_NAND_STRIPE_MAX_PAGE	(SPI_NAND_MAX_PAGE_BYTES + \
+									 SPI_NAND_MAX_PAGE_BYTES / 16)
+
+/* Failed async writes kept for spi_nand_stripe_finish_writes(). */
+#define SPI_NAND_STRIPE_MAX_FAILED	8
+
+struct spi_nand_stripe_chip {
+	struct spi_nand *nand;
+	struct spi_nand_request req;	/* Program or erase in flight */
+	uint32_t writing;				/* req is an async write of chunk */
+	uint32_t chunk;
+	/* Data of the async write, or of a copy from another chip */
+	uint8_t buffer[SPI_NAND_STRIPE_MAX_PAGE];
+};
+
+struct spi_nand_stripe {
+	uint32_t n_chips;
+	uint32_t pages_per_block;	/* Per chip */
+	uint32_t chunks_per_block;	/* Per stripe block */
+	uint32_t n_blocks;
+	uint32_t n_failed;
+	uint32_t failed[SPI_NAND_STRIPE_MAX_FAILED];
+	struct spi_nand_stripe_chip chip[SPI_NAND_STRIPE_MAX_CHIPS];
+};
+
+/* Set up the geometry. This does not touch the hardware. */
+int spi_nand_stripe_setup(struct spi_nand_stripe *s,
+						  struct spi_nand *chips,
+						  uint32_t n_chips);
+
+int spi_nand_stripe_init(struct spi_nand_stripe *s);
+
+/*
+ * Read chunk. If next_chunk is not SPI_NAND_NO_PAGE and is on the same
+ * chip it is loaded meanwhile, see spi_nand_read_page_pipelined().
+ */
+int spi_nand_stripe_read_chunk(struct spi_nand_stripe *s,
+							   uint32_t chunk,
+							   uint32_t next_chunk,
+							   struct spi_nand_buffer_op *ops,
+							   uint32_t n_ops,
+							   uint8_t *statusptr);
+
+/*
+ * Start reading chunk into the buffers described by ops, see
+ * spi_nand_read_page_async(). Reads of chunks on different chips run at
+ * the same time. Wait for it with spi_nand_request_wait().
+ */
+int spi_nand_stripe_read_chunk_async(struct spi_nand_stripe *s,
+									 uint32_t chunk,
+									 struct spi_nand_buffer_op *ops,
+									 uint32_t n_ops,
+									 struct spi_nand_request *req);
+
+/* Write chunk and wait for it. Returns -1 if the program failed. */
+int spi_nand_stripe_write_chunk(struct spi_nand_stripe *s,
+								uint32_t chunk,
+								struct spi_nand_buffer_op *ops,
+								uint32_t n_ops);
+
+/*
+ * Start writing chunk and return while it programs. The ops are copied,
+ * so the caller's buffers are free at once. If the chip's last program
+ * is still running it is waited for first. A failed program is kept for
+ * spi_nand_stripe_finish_writes(); once there is no room to keep another
+ * the write waits and returns -1 itself if it fails.
+ */
+int spi_nand_stripe_write_chunk_async(struct spi_nand_stripe *s,
+									  uint32_t chunk,
+									  struct spi_nand_buffer_op *ops,
+									  uint32_t n_ops);
+
+/*
+ * Wait for the async writes. Returns how many failed since the last call
+ * and puts up to max of those chunks in failed.
+ */
+int spi_nand_stripe_finish_writes(struct spi_nand_stripe *s,
+								  uint32_t *failed, uint32_t max);
+
+/*
+ * Copy src_chunk to dst_chunk, replacing the bytes described by ops.
+ * Uses the chip's internal data move when both are on the same chip.
+ * Waits for the program as writes do.
+ */
+int spi_nand_stripe_copy_chunk(struct spi_nand_stripe *s,
+							   uint32_t src_chunk,
+							   uint32_t dst_chunk,
+							   struct spi_nand_buffer_op *ops,
+							   uint32_t n_ops);
+
+/* Erase the block on all the chips at the same time. */
+int spi_nand_stripe_erase_block(struct spi_nand_stripe *s, uint32_t block);
+
+int spi_nand_stripe_check_block_ok(struct spi_nand_stripe *s,
+								   uint32_t block, uint32_t *is_ok);
+
+int spi_nand_stripe_mark_block_bad(struct spi_nand_stripe *s, uint32_t block);
+
+/* Wait for the async writes, keeping any failures, and lock the chips down. */
+int spi_nand_stripe_sync(struct spi_nand_stripe *s);
+
+#endif /* __SPI_NAND_STRIPE_H__ */
@@ -0,0 +1,56 @@
+#ifndef __SPI_NAND_TIMING_H__
+#define __SPI_NAND_TIMING_H__
+#include <stdint.h>
+
+/*
+ * Busy time model for SPI NAND operations.
+ *
+ * Keeps an exponentially weighted moving average of how long each kind of
+ * operation keeps each die busy. The driver uses this to stay off the bus
+ * for most of the expected time before it starts polling status, and then
+ * polls at an interval scaled to the operation.
+ *
+ * This module only does the bookkeeping. It does not know about the
+ * hardware or how time is measured.
+ */
+
+#define SPI_NAND_TIMING_N_DIES	2
+
+enum spi_nand_timing_op {
+	SPI_NAND_OP_READ,			/* tRD: array to cache */
+	SPI_NAND_OP_CACHE_READ,		/* tRCBSY: data to cache register */
+	SPI_NAND_OP_PROGRAM,		/* tPROG */
+	SPI_NAND_OP_ERASE,			/* tBERS */
+	SPI_NAND_OP_OTHER,			/* Reset, cache read stop... */
+	SPI_NAND_N_OPS
+};
+
+struct spi_nand_latency {
+	uint32_t n;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint32_t ewma_x16;		/* Average in 1/16 us */
+	uint32_t n_polls;
+	uint64_t total_us;
+};
+
+void spi_nand_timing_init(uint32_t die);
+
+/* Replace the built in typical time, until the op has been measured. */
+void spi_nand_timing_seed(uint32_t die, enum spi_nand_timing_op op, uint32_t us);
+
+/* How long to stay off the bus before the first poll. */
+uint32_t spi_nand_timing_first_poll_us(uint32_t die, enum spi_nand_timing_op op);
+
+/* How long to wait between polls after that. */
+uint32_t spi_nand_timing_poll_interval_us(uint32_t die, enum spi_nand_timing_op op);
+
+void spi_nand_timing_record(uint32_t die, enum spi_nand_timing_op op,
+							uint32_t busy_us, uint32_t n_polls);
+
+void spi_nand_timing_get(uint32_t die, enum spi_nand_timing_op op,
+						 struct spi_nand_latency *lat);
+
+void spi_nand_timing_print(void);
+
+#endif /* __SPI_NAND_TIMING_H__ */
@@ -0,0 +1,71 @@
+#ifndef __YAFFS_ARENA_H__
+#define __YAFFS_ARENA_H__
+#include <stdint.h>
+#include "yaffs_osglue.h"
+
+/*
+ * Allocator for all the memory yaffs uses, out of one static region the
+ * port sizes at build time, so there is no heap to fragment over a long
+ * uptime and running out shows up as a failed mount rather than later.
+ *
+ * Each allocation says what it is for (enum yaffs_mem_class):
+ *
+ * - Tnode and object batches and chunk buffers come from pools of blocks
+ *   of one exact size, one pool per class and size.
+ * - General allocations and directory index tables come from pools of
+ *   power of two sized blocks.
+ * - Mount allocations are bumped down from the top of the region. Freeing
+ *   the lowest one gives its space back along with any freed above it,
+ *   and once all are freed the whole top is given back.
+ *
+ * Pools carve new blocks up from the bottom of the region and keep freed
+ * blocks on a free list for the next allocation of the same size, so
+ * allocating and freeing are O(1). Blocks carry an 8 byte header.
+ * A class can be given a limit on the bytes its pools carve, so that it
+ * cannot take the space budgeted for the others.
+ *
+ * Built with YAFFS_ARENA_HEAP, tnode and object batches that no longer
+ * fit in the region come from malloc() instead, carrying the same header
+ * and counted in the stats and usage like the rest. It is off by default:
+ * the region is sized for the volume, and a full region fails the
+ * allocation.
+ *
+ * The arena does no locking, the port calls it under yaffsfs_LockMem().
+ */
+
+#define YAFFS_ARENA_ALIGN		8
+#define YAFFS_ARENA_HEADER		8
+#define YAFFS_ARENA_N_POOLS		24
+#define YAFFS_ARENA_MIN_GENERAL	32
+
+/* Bytes an allocation of size takes from a pool or the mount arena. */
+#define YAFFS_ARENA_BLOCK_BYTES(size) \
+	(YAFFS_ARENA_HEADER + (((size) + YAFFS_ARENA_ALIGN - 1) & \
+						   ~(YAFFS_ARENA_ALIGN - 1)))
+
+struct yaffs_arena_stats {
+	uint32_t cur_bytes;			/* Held in blocks of the class */
+	uint32_t peak_bytes;
+	uint32_t n_allocs;
+	uint32_t n_fails;
+	uint32_t heap_bytes;		/* Of cur_bytes, held in heap blocks */
+};
+
+/* Use size bytes at mem, which must be YAFFS_ARENA_ALIGN aligned. */
+void yaffs_arena_init(void *mem, uint32_t size);
+
+void *yaffs_arena_alloc(enum yaffs_mem_class mem_class, uint32_t size);
+void yaffs_arena_free(void *ptr);
+
+/* Limit the bytes, headers included, the pools of a class carve, 0 for none. */
+void yaffs_arena_set_limit(enum yaffs_mem_class mem_class, uint32_t bytes);
+
+void yaffs_arena_get_stats(enum yaffs_mem_class mem_class,
+						   struct yaffs_arena_stats *stats);
+
+/* Bytes in use, in pools, the mount arena or heap blocks, and the peak. */
+void yaffs_arena_get_usage(uint32_t *current, uint32_t *high_water);
+
+void yaffs_arena_print_stats(void);
+
+#endif /* __YAFFS_ARENA_H__ */
@@ -0,0 +1,95 @@
+#ifndef __YAFFS_BENCH_H__
+#define __YAFFS_BENCH_H__
+#include <stdint.h>
+
+/*
+ * Benchmark suite for yaffs on the SPI NAND, run through the yaffsfs API
+ * so that it runs the same on the target and on a host against the
+ * simulated chips (see spi_nand_sim.h), and any change can be compared
+ * on both.
+ *
+ * Each test prints a line with its throughput in MB/s, operations per
+ * second, the 50th, 90th and 99th percentile and the worst operation
+ * latency, and the page reads, page writes, erases and gc copies yaffs
+ * counted for the device meanwhile. Time comes from the driver's clock,
+ * so on a host it is simulated time.
+ *
+ * The device must be added, for instance by yaffs_spi_nand_load_driver(),
+ * but need not be mounted. The tests create their own files under the
+ * mount point, and delete them again, leaving the device mounted. The
+ * cache test also prints the short op cache's hits, misses, evictions and
+ * promotions for each replacement policy.
+ */
+
+enum yaffs_bench_test {
+	YAFFS_BENCH_SEQ = 1 << 0,		/* Sequential write then read, per io size */
+	YAFFS_BENCH_RANDOM = 1 << 1,	/* Random reads then writes, per io size */
+	YAFFS_BENCH_SMALL_FILES = 1 << 2,	/* Small files written, fsynced and closed */
+	YAFFS_BENCH_DIRS = 1 << 3,		/* Directories made, filled and removed */
+	YAFFS_BENCH_MOUNT = 1 << 4,		/* Unmount and mount */
+	YAFFS_BENCH_STEADY = 1 << 5,	/* Random rewrites with the volume part full */
+	YAFFS_BENCH_CACHE = 1 << 6,		/* Log, config and scan mix, per cache policy */
+	YAFFS_BENCH_HOT = 1 << 7,		/* A table reread whole, without and with page caching */
+	YAFFS_BENCH_ALL = 0xff
+};
+
+#define YAFFS_BENCH_MAX_SIZES	4
+#define YAFFS_BENCH_MAX_FILLS	4
+#define YAFFS_BENCH_MAX_IO		4096
+
+struct yaffs_bench_config {
+	const char *mount_point;
+	uint32_t tests;					/* enum yaffs_bench_test bits */
+
+	/*
+	 * io sizes for the sequential and random tests. Chunk sized and
+	 * aligned writes go straight to flash, past the cache.
+	 */
+	uint32_t io_size[YAFFS_BENCH_MAX_SIZES];
+	uint32_t n_io_sizes;
+
+	uint32_t seq_file_bytes;
+	uint32_t random_file_bytes;
+	uint32_t n_random_ops;			/* Per io size, each of reads and writes */
+
+	uint32_t n_small_files;
+	uint32_t small_file_bytes;
+
+	uint32_t n_dir_rounds;
+	uint32_t n_files_per_dir;
+
+	uint32_t n_mounts;
+
+	/* Percentages of the volume to fill before each steady state run. */
+	uint32_t fill_percent[YAFFS_BENCH_MAX_FILLS];
+	uint32_t n_fills;
+	uint32_t steady_file_bytes;		/* The file rewritten at random */
+	uint32_t steady_bytes;			/* How much of it to rewrite */
+	uint32_t steady_io_size;
+
+	/*
+	 * The cache test's ops are half log appends, two fifths reads of a
+	 * config file picked at random, in 128 byte reads, and a tenth 16KB
+	 * more of the scan file, in 1000 byte reads. It remounts the device
+	 * for each policy.
+	 */
+	uint32_t n_cache_ops;
+	uint32_t log_append_bytes;
+	uint32_t n_config_files;
+	uint32_t config_file_bytes;
+	uint32_t scan_file_bytes;
+
+	/* The hot test rereads a file of hot_file_bytes in chunk sized reads. */
+	uint32_t n_hot_reads;
+	uint32_t hot_file_bytes;
+
+	uint32_t seed;
+};
+
+void yaffs_bench_default_config(struct yaffs_bench_config *cfg,
+								const char *mount_point);
+
+/* Run the tests selected in cfg. Returns the number that failed. */
+int yaffs_bench_run(const struct yaffs_bench_config *cfg);
+
+#endif /* __YAFFS_BENCH_H__ */
@@ -111,7 +111,7 @@ static int yaffs_create_tnodes(struct yaffs_dev *dev, int n_tnodes)
 		return YAFFS_OK;
 
 	/* make these things */
-	new_tnodes = kmalloc(n_tnodes * dev->tnode_size, GFP_NOFS);
+	new_tnodes = kmalloc_class(n_tnodes * dev->tnode_size, YAFFS_MEM_TNODES);
 	mem = (u8 *) new_tnodes;
 
 	if (!new_tnodes) {
@@ -138,7 +138,7 @@ static int yaffs_create_tnodes(struct yaffs_dev *dev, int n_tnodes)
 	 * NB If we can't add this to the management list it isn't fatal
 	 * but it just means we can't free this bunch of tnodes later.
 	 */
-	tnl = kmalloc(sizeof(struct yaffs_tnode_list), GFP_NOFS);
+	tnl = kmalloc_class(sizeof(struct yaffs_tnode_list), YAFFS_MEM_TNODES);
 	if (!tnl) {
 		yaffs_trace(YAFFS_TRACE_ERROR,
 			"Could not add tnodes to management list");
@@ -254,8 +254,9 @@ static int yaffs_create_free_objs(struct yaffs_dev *dev, int n_obj)
 		return YAFFS_OK;
 
 	/* make these things */
-	new_objs = kmalloc(n_obj * sizeof(struct yaffs_obj), GFP_NOFS);
-	list = kmalloc(sizeof(struct yaffs_obj_list), GFP_NOFS);
+	new_objs = kmalloc_class(n_obj * sizeof(struct yaffs_obj),
+				 YAFFS_MEM_OBJECTS);
+	list = kmalloc_class(sizeof(struct yaffs_obj_list), YAFFS_MEM_OBJECTS);
 
 	if (!new_objs || !list) {
 		kfree(new_objs);
@@ -346,7 +347,8 @@ void yaffs_init_raw_tnodes_and_objs(struct yaffs_dev *dev)
 		return;
 	}
 
-	allocator = kmalloc(sizeof(struct yaffs_allocator), GFP_NOFS);
+	allocator = kmalloc_class(sizeof(struct yaffs_allocator),
+				  YAFFS_MEM_MOUNT);
 	if (allocator) {
 		dev->allocator = allocator;
 		yaffs_init_raw_tnodes(dev);
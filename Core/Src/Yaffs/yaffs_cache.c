@@ -21,30 +21,363 @@
  *   In Linux, the page cache provides read buffering and the short op cache
  *   provides write buffering.
  *
- *   There are a small number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Entries in use are hashed by (object, chunk_id), kept on a list per
+ *   object and on a replacement queue, and unused ones on a free list.
+ *   Finding a chunk and grabbing an entry are O(1) and flushing a file is
+ *   O(entries of the file), so a device can have many cache chunks without
+ *   slowing every read and write down.
+ *
+ *   Which entry to push out is up to the replacement policy, see below.
+ *
+ *   Dirty entries are written back in batches sorted by object and chunk,
+ *   see yaffs_wr_cache_batch(), so a file's chunks land together.
  */
 
-int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
+/*
+ * A replacement policy keeps the entries in use on the manager's queues,
+ * each oldest first, and says which queue to push out from.
+ */
+struct yaffs_cache_policy {
+	const char *name;
+	int n_ghosts_per_cache;	/* Ghosts to keep per cache entry */
+	/* A chunk was loaded into the cache. */
+	void (*insert)(struct yaffs_cache_manager *mgr,
+		       struct yaffs_cache *cache);
+	/* A cached chunk was used again. */
+	void (*touch)(struct yaffs_cache_manager *mgr,
+		      struct yaffs_cache *cache);
+	/* A cached chunk is being pushed out. */
+	void (*evict)(struct yaffs_cache_manager *mgr,
+		      struct yaffs_cache *cache);
+	/* The queue to push out from next. */
+	int (*victim_queue)(struct yaffs_cache_manager *mgr);
+};
+
+/* How many entries from the old end of a queue to look through for a
+ * clean one to push out in place of a dirty one.
+ */
+#define YAFFS_CACHE_CLEAN_SCAN(n_caches)	((n_caches) < 16 ? 2 : (n_caches) / 8)
+
+static inline u32 yaffs_cache_hash(u32 obj_id, int chunk_id)
+{
+	return obj_id * 0x9e3779b1 + (u32)chunk_id;
+}
+
+static inline struct list_head *yaffs_cache_bucket(struct yaffs_cache_manager *mgr,
+						   const struct yaffs_obj *obj,
+						   int chunk_id)
+{
+	return &mgr->hash[yaffs_cache_hash(obj->obj_id, chunk_id) &
+			  mgr->hash_mask];
+}
+
+static void yaffs_cache_queue_add(struct yaffs_cache_manager *mgr,
+				  struct yaffs_cache *cache, int queue)
+{
+	cache->queue = queue;
+	list_add_tail(&cache->queue_link, &mgr->queue[queue]);
+	mgr->queue_len[queue]++;
+}
+
+static void yaffs_cache_queue_del(struct yaffs_cache_manager *mgr,
+				  struct yaffs_cache *cache)
+{
+	list_del_init(&cache->queue_link);
+	mgr->queue_len[cache->queue]--;
+}
+
+/* Move the entry to the young end of its queue. */
+static void yaffs_cache_queue_refresh(struct yaffs_cache_manager *mgr,
+				      struct yaffs_cache *cache)
+{
+	list_del(&cache->queue_link);
+	list_add_tail(&cache->queue_link, &mgr->queue[cache->queue]);
+}
+
+/*------------------------ Ghosts ---------------------------------------------
+ * A ring of the (object id, chunk) of chunks recently pushed out, and the
+ * queue they were pushed out of, so that a policy can tell a chunk that
+ * comes back from one never seen before.
+ */
+
+static struct list_head *yaffs_ghost_bucket(struct yaffs_cache_manager *mgr,
+					    u32 obj_id, int chunk_id)
+{
+	return &mgr->ghost_hash[yaffs_cache_hash(obj_id, chunk_id) &
+				mgr->ghost_mask];
+}
+
+static void yaffs_ghost_del(struct yaffs_cache_manager *mgr,
+			    struct yaffs_cache_ghost *ghost)
+{
+	if (ghost->queue < 0)
+		return;
+	list_del_init(&ghost->hash_link);
+	mgr->ghost_len[ghost->queue]--;
+	ghost->queue = -1;
+}
+
+static void yaffs_ghost_add(struct yaffs_cache_manager *mgr,
+			    const struct yaffs_cache *cache)
+{
+	struct yaffs_cache_ghost *ghost;
+
+	if (mgr->n_ghosts < 1)
+		return;
+
+	ghost = &mgr->ghost[mgr->ghost_next];
+	mgr->ghost_next = (mgr->ghost_next + 1) % mgr->n_ghosts;
+
+	yaffs_ghost_del(mgr, ghost);
+	ghost->obj_id = cache->object->obj_id;
+	ghost->chunk_id = cache->chunk_id;
+	ghost->queue = cache->queue;
+	mgr->ghost_len[ghost->queue]++;
+	list_add(&ghost->hash_link,
+		 yaffs_ghost_bucket(mgr, ghost->obj_id, ghost->chunk_id));
+}
+
+/* Is the chunk a ghost? If so it is laid to rest, and the queue it was
+ * pushed out of returned, else -1.
+ */
+static int yaffs_ghost_take(struct yaffs_cache_manager *mgr,
+			    const struct yaffs_cache *cache)
+{
+	struct list_head *i;
+	u32 obj_id = cache->object->obj_id;
+	int queue;
+
+	if (mgr->n_ghosts < 1)
+		return -1;
+
+	list_for_each(i, yaffs_ghost_bucket(mgr, obj_id, cache->chunk_id)) {
+		struct yaffs_cache_ghost *ghost =
+			list_entry(i, struct yaffs_cache_ghost, hash_link);
+
+		if (ghost->obj_id == obj_id &&
+		    ghost->chunk_id == cache->chunk_id) {
+			queue = ghost->queue;
+			yaffs_ghost_del(mgr, ghost);
+			return queue;
+		}
+	}
+	return -1;
+}
+
+/*------------------------ LRU policy -----------------------------------------
+ * One queue, in order of last use.
+ */
+
+static void yaffs_lru_insert(struct yaffs_cache_manager *mgr,
+			     struct yaffs_cache *cache)
+{
+	yaffs_cache_queue_add(mgr, cache, 0);
+}
+
+static void yaffs_lru_touch(struct yaffs_cache_manager *mgr,
+			    struct yaffs_cache *cache)
+{
+	yaffs_cache_queue_refresh(mgr, cache);
+}
+
+static void yaffs_lru_evict(struct yaffs_cache_manager *mgr,
+			    struct yaffs_cache *cache)
+{
+	(void) mgr;
+	(void) cache;
+}
+
+static int yaffs_lru_victim_queue(struct yaffs_cache_manager *mgr)
+{
+	(void) mgr;
+	return 0;
+}
+
+/*------------------------ ARC policy -----------------------------------------
+ * Adaptive replacement, as in ARC, with 2Q's rule for what counts as a
+ * re-reference.
+ * Chunks loaded for the first time go on queue 0, and chunks that come
+ * back while they are still ghosts go on queue 1, both kept in order of
+ * last use. Using a chunk again while it is cached does not move it to
+ * queue 1, as short ops hit the same chunk many times in a row.
+ * Queue 0 is pushed out from once it holds more than the target, so a big
+ * read or write streaming through only ever takes that much of the cache.
+ * A ghost of queue 0 coming back means queue 0 is too short, and grows the
+ * target; a ghost of queue 1 shrinks it.
+ */
+
+static void yaffs_arc_insert(struct yaffs_cache_manager *mgr,
+			     struct yaffs_cache *cache)
+{
+	int queue = yaffs_ghost_take(mgr, cache);
+	int step;
+
+	if (queue < 0) {
+		yaffs_cache_queue_add(mgr, cache, 0);
+		return;
+	}
+
+	if (queue == 0) {
+		step = mgr->ghost_len[1] / (mgr->ghost_len[0] + 1);
+		mgr->target += step ? step : 1;
+		if (mgr->target > mgr->n_caches)
+			mgr->target = mgr->n_caches;
+	} else {
+		step = mgr->ghost_len[0] / (mgr->ghost_len[1] + 1);
+		mgr->target -= step ? step : 1;
+		if (mgr->target < 1)
+			mgr->target = 1;
+	}
+
+	mgr->stats.promotions++;
+	yaffs_cache_queue_add(mgr, cache, 1);
+}
+
+static void yaffs_arc_touch(struct yaffs_cache_manager *mgr,
+			    struct yaffs_cache *cache)
+{
+	yaffs_cache_queue_refresh(mgr, cache);
+}
+
+static void yaffs_arc_evict(struct yaffs_cache_manager *mgr,
+			    struct yaffs_cache *cache)
+{
+	yaffs_ghost_add(mgr, cache);
+}
+
+static int yaffs_arc_victim_queue(struct yaffs_cache_manager *mgr)
+{
+	if (mgr->queue_len[0] > mgr->target || !mgr->queue_len[1])
+		return 0;
+	return 1;
+}
+
+static const struct yaffs_cache_policy yaffs_cache_policies[] = {
+	[YAFFS_CACHE_POLICY_LRU] = {
+		.name = "lru",
+		.n_ghosts_per_cache = 0,
+		.insert = yaffs_lru_insert,
+		.touch = yaffs_lru_touch,
+		.evict = yaffs_lru_evict,
+		.victim_queue = yaffs_lru_victim_queue,
+	},
+	[YAFFS_CACHE_POLICY_ARC] = {
+		.name = "arc",
+		.n_ghosts_per_cache = 1,
+		.insert = yaffs_arc_insert,
+		.touch = yaffs_arc_touch,
+		.evict = yaffs_arc_evict,
+		.victim_queue = yaffs_arc_victim_queue,
+	},
+};
+
+const char *yaffs_cache_policy_name(u32 policy)
+{
+	if (policy >= YAFFS_CACHE_N_POLICIES)
+		return "?";
+	return yaffs_cache_policies[policy].name;
+}
+
+/*------------------------ Cache entries --------------------------------------*/
+
+static void yaffs_cache_set_page(struct yaffs_cache_manager *mgr,
+				 struct yaffs_cache *cache, int page)
+{
+	if (cache->page == page)
+		return;
+	cache->page = page;
+	if (page)
+		mgr->n_pages++;
+	else
+		mgr->n_pages--;
+}
+
+/* Take the entry out of use, onto the free list. */
+static void yaffs_cache_detach(struct yaffs_dev *dev, struct yaffs_cache *cache)
 {
-	struct yaffs_dev *dev = obj->my_dev;
-	int i;
 	struct yaffs_cache_manager *mgr = &dev->cache_mgr;
 
-	for (i = 0; i < mgr->n_caches; i++) {
-		struct yaffs_cache *cache = &mgr->cache[i];
+	if (!cache->object)
+		return;
+
+	list_del_init(&cache->hash_link);
+	list_del_init(&cache->obj_link);
+	yaffs_cache_queue_del(mgr, cache);
+	list_add(&cache->queue_link, &mgr->free);
+	yaffs_cache_set_page(mgr, cache, 0);
+	cache->object = NULL;
+	cache->dirty = 0;
+}
+
+void yaffs_cache_attach(struct yaffs_cache *cache, struct yaffs_obj *obj,
+			int chunk_id)
+{
+	struct yaffs_cache_manager *mgr = &obj->my_dev->cache_mgr;
+
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	cache->dirty = 0;
+	cache->locked = 0;
 
-		if (cache->object == obj && cache->dirty)
+	list_add(&cache->hash_link, yaffs_cache_bucket(mgr, obj, chunk_id));
+	list_add_tail(&cache->obj_link, &obj->cache_list);
+	list_del_init(&cache->queue_link);
+	mgr->policy->insert(mgr, cache);
+}
+
+int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
+{
+	struct list_head *i;
+
+	list_for_each(i, &obj->cache_list) {
+		struct yaffs_cache *cache =
+			list_entry(i, struct yaffs_cache, obj_link);
+
+		if (cache->dirty)
 			return 1;
 	}
 
 	return 0;
 }
 
+static int yaffs_cache_cmp(const void *a, const void *b)
+{
+	const struct yaffs_cache *ca = *(struct yaffs_cache * const *)a;
+	const struct yaffs_cache *cb = *(struct yaffs_cache * const *)b;
+
+	if (ca->object != cb->object)
+		return (ca->object->obj_id < cb->object->obj_id) ? -1 : 1;
+
+	return ca->chunk_id - cb->chunk_id;
+}
+
+/* Gather the entry into the write back batch if it needs writing. */
+static inline void yaffs_cache_gather(struct yaffs_cache_manager *mgr,
+				      struct yaffs_cache *cache, int *n)
+{
+	if (cache->object && cache->dirty && !cache->locked)
+		mgr->wb[(*n)++] = cache;
+}
+
+/* Write back the n entries gathered. */
+static void yaffs_cache_write_back(struct yaffs_dev *dev, int n)
+{
+	struct yaffs_cache_manager *mgr = &dev->cache_mgr;
+
+	if (n < 1)
+		return;
+
+	if (n > 1)
+		sort(mgr->wb, n, sizeof(struct yaffs_cache *),
+		     yaffs_cache_cmp, NULL);
+
+	yaffs_wr_cache_batch(dev, mgr->wb, n);
+}
+
 void yaffs_flush_single_cache(struct yaffs_cache *cache, int discard)
 {
 
-	if (!cache || cache->locked)
+	if (!cache || cache->locked || !cache->object)
 		return;
 
 	/* Write it out and free it up  if need be.*/
@@ -59,163 +392,316 @@ void yaffs_flush_single_cache(struct yaffs_cache *cache, int discard)
 	}
 
 	if (discard)
-		cache->object = NULL;
+		yaffs_cache_detach(cache->object->my_dev, cache);
 }
 
 void yaffs_flush_file_cache(struct yaffs_obj *obj, int discard)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
 	struct yaffs_cache_manager *mgr = &dev->cache_mgr;
+	struct list_head *i;
+	struct list_head *n;
+	int n_wb = 0;
 
 	if (mgr->n_caches < 1)
 		return;
 
+	/* Write back the dirty chunks of this object in one batch. */
+	list_for_each(i, &obj->cache_list)
+		yaffs_cache_gather(mgr,
+			list_entry(i, struct yaffs_cache, obj_link), &n_wb);
+	yaffs_cache_write_back(dev, n_wb);
 
-	/* Find the chunks for this object and flush them. */
-	for (i = 0; i < mgr->n_caches; i++) {
-		struct yaffs_cache *cache = &mgr->cache[i];
+	if (!discard)
+		return;
 
-		if (cache->object == obj)
-			yaffs_flush_single_cache(cache, discard);
-	}
+	list_for_each_safe(i, n, &obj->cache_list) {
+		struct yaffs_cache *cache =
+			list_entry(i, struct yaffs_cache, obj_link);
 
+		yaffs_flush_single_cache(cache, 1);
+	}
 }
 
 
 void yaffs_flush_whole_cache(struct yaffs_dev *dev, int discard)
 {
 	struct yaffs_cache_manager *mgr = &dev->cache_mgr;
-	struct yaffs_obj *obj;
+	int n_wb = 0;
 	int i;
 
-	/* Find a dirty object in the cache and flush it...
-	 * until there are no further dirty objects.
+	if (mgr->n_caches < 1)
+		return;
+
+	/* Write back all the dirty chunks in one batch, then drop the lot
+	 * if discarding.
 	 */
-	do {
-		obj = NULL;
-		for (i = 0; i < mgr->n_caches && !obj; i++) {
-			struct yaffs_cache *cache = &mgr->cache[i];
-			if (cache->object && cache->dirty)
-				obj = cache->object;
+	for (i = 0; i < mgr->n_caches; i++)
+		yaffs_cache_gather(mgr, &mgr->cache[i], &n_wb);
+	yaffs_cache_write_back(dev, n_wb);
+
+	if (!discard)
+		return;
+
+	for (i = 0; i < mgr->n_caches; i++)
+		yaffs_flush_single_cache(&mgr->cache[i], 1);
+}
+
+/*
+ * Pick the entry to push out: from the old end of the queue the policy
+ * says, the first clean one among the oldest few, else the oldest one
+ * that is not locked. The newest entry of a queue is never taken for
+ * being clean, it is likely the one being worked on. With clean_only,
+ * only a clean one will do, from either queue.
+ */
+static struct yaffs_cache *yaffs_cache_victim(struct yaffs_cache_manager *mgr,
+					      int clean_only)
+{
+	struct yaffs_cache *oldest;
+	struct list_head *i;
+	int queue;
+	int q;
+	int n_scan;
+	int n;
+
+	queue = mgr->policy->victim_queue(mgr);
+
+	for (q = 0; q < YAFFS_CACHE_N_QUEUES; q++) {
+		oldest = NULL;
+		n_scan = YAFFS_CACHE_CLEAN_SCAN(mgr->n_caches);
+		if (n_scan > mgr->queue_len[queue] - 1)
+			n_scan = mgr->queue_len[queue] - 1;
+		n = 0;
+		list_for_each(i, &mgr->queue[queue]) {
+			struct yaffs_cache *cache =
+				list_entry(i, struct yaffs_cache, queue_link);
+
+			if (cache->locked)
+				continue;
+			if (!oldest)
+				oldest = cache;
+			if (n++ >= n_scan)
+				break;
+			if (!cache->dirty)
+				return cache;
 		}
-		if (obj)
-			yaffs_flush_file_cache(obj, discard);
-	} while (obj);
+		if (oldest && !clean_only)
+			return oldest;
+		queue = (queue + 1) % YAFFS_CACHE_N_QUEUES;
+	}
 
+	return NULL;
 }
 
-/* Grab us an unused cache chunk for use.
- * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+/*
+ * Push an entry out. If it is dirty and the driver can overlap the
+ * programs of a write run, the other dirty entries holding whole chunks
+ * go back in the same batch: a writer has finished with those.
  */
-static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
+static void yaffs_cache_evict(struct yaffs_dev *dev, struct yaffs_cache *cache)
 {
 	struct yaffs_cache_manager *mgr = &dev->cache_mgr;
+	int n_wb = 0;
 	int i;
 
-	for (i = 0; i < mgr->n_caches; i++) {
-		struct yaffs_cache *cache = &mgr->cache[i];
-		if (!cache->object)
-			return cache;
+	mgr->stats.evictions++;
+	mgr->policy->evict(mgr, cache);
+
+	if (cache->dirty && dev->drv.drv_write_run_fn) {
+		yaffs_cache_gather(mgr, cache, &n_wb);
+		for (i = 0; i < mgr->n_caches; i++) {
+			if (&mgr->cache[i] != cache &&
+			    mgr->cache[i].n_bytes == (int)dev->data_bytes_per_chunk)
+				yaffs_cache_gather(mgr, &mgr->cache[i], &n_wb);
+		}
+		yaffs_cache_write_back(dev, n_wb);
 	}
 
-	return NULL;
+	yaffs_flush_single_cache(cache, 1);
 }
 
+/* Grab us an unused cache chunk for use.
+ * First take one off the free list.
+ * Else push out the one the policy picks, writing back only that one if it
+ * is dirty, and the whole chunks with it when the driver has write runs:
+ * the others may yet be rewritten, so batching is left to the flushes.
+ * The caller hands it to a chunk with yaffs_cache_attach().
+ */
 struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
 {
 	struct yaffs_cache_manager *mgr = &dev->cache_mgr;
 	struct yaffs_cache *cache;
-	int usage;
-	int i;
 
 	if (mgr->n_caches < 1)
 		return NULL;
 
-	/* First look for an unused cache */
-
-	cache = yaffs_grab_chunk_worker(dev);
+	if (!list_empty(&mgr->free))
+		return list_entry(mgr->free.next, struct yaffs_cache,
+				  queue_link);
 
-	if (cache)
-		return cache;
+	cache = yaffs_cache_victim(mgr, 0);
+	if (!cache)
+		return NULL;
 
-	/*
-	 * Thery were all in use.
-	 * Find the LRU cache and flush it if it is dirty.
-	 */
+	if (cache->dirty)
+		mgr->stats.dirty_evictions++;
 
-	usage = -1;
-	cache = NULL;
+	yaffs_cache_evict(dev, cache);
+	return cache;
+}
 
-	for (i = 0; i < mgr->n_caches; i++) {
-		struct yaffs_cache *this_cache = &mgr->cache[i];
+/* Grab a free cache chunk, or push out a clean one,
+ * so that speculative reads never cost a write.
+ */
+struct yaffs_cache *yaffs_grab_spare_chunk_cache(struct yaffs_dev *dev)
+{
+	struct yaffs_cache_manager *mgr = &dev->cache_mgr;
+	struct yaffs_cache *cache;
 
-		if (this_cache->object &&
-		    !this_cache->locked &&
-		    (this_cache->last_use < usage || !cache)) {
-				usage = this_cache->last_use;
-				cache = this_cache;
-		}
-	}
+	if (mgr->n_caches < 1)
+		return NULL;
 
-#if 1
-	yaffs_flush_single_cache(cache, 1);
-#else
-	yaffs_flush_file_cache(cache->object, 1);
-	cache = yaffs_grab_chunk_worker(dev);
-#endif
+	if (!list_empty(&mgr->free))
+		return list_entry(mgr->free.next, struct yaffs_cache,
+				  queue_link);
 
+	cache = yaffs_cache_victim(mgr, 1);
+	if (cache)
+		yaffs_cache_evict(dev, cache);
 	return cache;
 }
 
-/* Find a cached chunk */
-struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
-						  int chunk_id)
+/* Find a cached chunk, without counting a hit or a miss. */
+struct yaffs_cache *yaffs_peek_chunk_cache(const struct yaffs_obj *obj,
+					   int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
 	struct yaffs_cache_manager *mgr = &dev->cache_mgr;
-	int i;
+	struct list_head *i;
 
 	if (mgr->n_caches < 1)
 		return NULL;
 
-	for (i = 0; i < mgr->n_caches; i++) {
-		struct yaffs_cache *cache = &mgr->cache[i];
+	list_for_each(i, yaffs_cache_bucket(mgr, obj, chunk_id)) {
+		struct yaffs_cache *cache =
+			list_entry(i, struct yaffs_cache, hash_link);
 
 		if (cache->object == obj &&
-		    cache->chunk_id == chunk_id) {
-			dev->cache_hits++;
+		    cache->chunk_id == chunk_id)
 			return cache;
-		}
 	}
 	return NULL;
 }
 
-/* Mark the chunk for the least recently used algorithym */
+/* Find a cached chunk */
+struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
+						  int chunk_id)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_cache *cache;
+
+	if (dev->cache_mgr.n_caches < 1)
+		return NULL;
+
+	cache = yaffs_peek_chunk_cache(obj, chunk_id);
+	if (cache) {
+		dev->cache_hits++;
+		dev->cache_mgr.stats.hits++;
+	} else {
+		dev->cache_mgr.stats.misses++;
+	}
+	return cache;
+}
+
+/* Mark the chunk as used for the replacement policy */
 void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 			    int is_write)
 {
 	struct yaffs_cache_manager *mgr = &dev->cache_mgr;
-	int i;
 
 	if (mgr->n_caches < 1)
 		return;
 
-	if (mgr->cache_last_use < 0 ||
-		mgr->cache_last_use > 100000000) {
-		/* Reset the cache usages */
-		for (i = 1; i < mgr->n_caches; i++)
-			mgr->cache[i].last_use = 0;
+	mgr->policy->touch(mgr, cache);
 
-		mgr->cache_last_use = 0;
+	if (is_write) {
+		cache->dirty = 1;
+		yaffs_cache_set_page(mgr, cache, 0);
 	}
-	mgr->cache_last_use++;
-	cache->last_use = mgr->cache_last_use;
+}
 
-	if (is_write)
-		cache->dirty = 1;
+/*------------------------ Page caching ---------------------------------------
+ * Whole chunks are read and written past the cache, straight between the
+ * caller's buffer and flash. With page caching on, a clean copy of each is
+ * kept in the cache too, so that files read again and again are served
+ * from RAM whatever the size of the reads. The copies take at most
+ * page_cache_chunks entries, so they cannot push the short ops' chunks
+ * out of a small cache, and only ever push out clean entries.
+ */
+
+/*
+ * Grab an entry to keep a page in: a spare one while the pages are under
+ * budget, else the oldest page.
+ */
+static struct yaffs_cache *yaffs_grab_page_cache(struct yaffs_dev *dev)
+{
+	struct yaffs_cache_manager *mgr = &dev->cache_mgr;
+	struct list_head *i;
+	int queue;
+	int q;
+
+	if (mgr->n_pages < (int)dev->param.page_cache_chunks)
+		return yaffs_grab_spare_chunk_cache(dev);
+
+	queue = mgr->policy->victim_queue(mgr);
+	for (q = 0; q < YAFFS_CACHE_N_QUEUES; q++) {
+		list_for_each(i, &mgr->queue[queue]) {
+			struct yaffs_cache *cache =
+				list_entry(i, struct yaffs_cache, queue_link);
+
+			if (cache->page && !cache->locked) {
+				yaffs_cache_evict(dev, cache);
+				return cache;
+			}
+		}
+		queue = (queue + 1) % YAFFS_CACHE_N_QUEUES;
+	}
+	return NULL;
+}
+
+/*
+ * A whole chunk of the object was read or written past the cache.
+ * Keep a clean copy of it, updating the one cached if there is one.
+ * Returns 1 if the cache holds the new data, 0 if any copy it has of the
+ * chunk is stale.
+ */
+int yaffs_cache_keep_page(struct yaffs_obj *obj, int chunk_id,
+			  const u8 *data)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_cache_manager *mgr = &dev->cache_mgr;
+	struct yaffs_cache *cache;
+
+	if (mgr->n_caches < 1 || !dev->param.page_cache_chunks)
+		return 0;
+
+	cache = yaffs_peek_chunk_cache(obj, chunk_id);
+	if (cache) {
+		if (cache->locked)
+			return 0;
+		cache->dirty = 0;
+		yaffs_use_cache(dev, cache, 0);
+	} else {
+		cache = yaffs_grab_page_cache(dev);
+		if (!cache)
+			return 1;
+		yaffs_cache_attach(cache, obj, chunk_id);
+		yaffs_cache_set_page(mgr, cache, 1);
+		mgr->stats.page_fills++;
+	}
+	memcpy(cache->data, data, dev->data_bytes_per_chunk);
+	cache->n_bytes = 0;
+	return 1;
 }
 
 /* Invalidate a single cache page.
@@ -226,9 +712,9 @@ void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 {
 	struct yaffs_cache *cache;
 
-	cache = yaffs_find_chunk_cache(object, chunk_id);
+	cache = yaffs_peek_chunk_cache(object, chunk_id);
 	if (cache)
-		cache->object = NULL;
+		yaffs_cache_detach(object->my_dev, cache);
 }
 
 /* Invalidate all the cache pages associated with this object
@@ -236,33 +722,41 @@ void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
  */
 void yaffs_invalidate_file_cache(struct yaffs_obj *in)
 {
-	int i;
-	struct yaffs_dev *dev = in->my_dev;
-	struct yaffs_cache_manager *mgr = &dev->cache_mgr;
+	struct list_head *i;
+	struct list_head *n;
 
-	/* Invalidate it. */
-	for (i = 0; i < mgr->n_caches; i++) {
-		struct yaffs_cache *cache = &mgr->cache[i];
+	list_for_each_safe(i, n, &in->cache_list) {
+		struct yaffs_cache *cache =
+			list_entry(i, struct yaffs_cache, obj_link);
 
-		if (cache->object == in)
-			cache->object = NULL;
+		yaffs_cache_detach(in->my_dev, cache);
 	}
 }
 
 int yaffs_count_dirty_caches(struct yaffs_dev *dev)
 {
-	int n_dirty;
+	int n_dirty = 0;
 	int i;
 	struct yaffs_cache_manager *mgr = &dev->cache_mgr;
 
-	for (n_dirty= 0, i = 0; i < mgr->n_caches; i++) {
-		if (mgr->cache[i].dirty)
+	for (i = 0; i < mgr->n_caches; i++) {
+		if (mgr->cache[i].object && mgr->cache[i].dirty)
 			n_dirty++;
 	}
 
 	return n_dirty;
 }
 
+/* The smallest power of 2 at least n. */
+static u32 yaffs_cache_pow2(u32 n)
+{
+	u32 p;
+
+	for (p = 1; p < n; p <<= 1)
+		;
+	return p;
+}
+
 int yaffs_cache_init(struct yaffs_dev *dev)
 {
 	struct yaffs_cache_manager *mgr = &dev->cache_mgr;
@@ -270,36 +764,87 @@ int yaffs_cache_init(struct yaffs_dev *dev)
 
 	if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
+	if (dev->param.cache_policy >= YAFFS_CACHE_N_POLICIES)
+		dev->param.cache_policy = YAFFS_CACHE_POLICY_LRU;
+	if (dev->param.page_cache_chunks > dev->param.n_caches)
+		dev->param.page_cache_chunks = dev->param.n_caches;
 
+	memset(&mgr->stats, 0, sizeof(mgr->stats));
+	mgr->policy = &yaffs_cache_policies[dev->param.cache_policy];
 	mgr->n_caches = dev->param.n_caches;
+	mgr->n_pages = 0;
 	if (mgr->n_caches > 0) {
 		int i;
 		void *buf;
+		u32 n_buckets;
 		u32 cache_bytes =
 		    mgr->n_caches * sizeof(struct yaffs_cache);
 
+		/* A bucket per entry or so. */
+		n_buckets = yaffs_cache_pow2(mgr->n_caches);
+		mgr->hash_mask = n_buckets - 1;
 
-
-		mgr->cache = kmalloc(cache_bytes, GFP_NOFS);
+		for (i = 0; i < YAFFS_CACHE_N_QUEUES; i++) {
+			INIT_LIST_HEAD(&mgr->queue[i]);
+			mgr->queue_len[i] = 0;
+		}
+		INIT_LIST_HEAD(&mgr->free);
+
+		mgr->cache = kmalloc_class(cache_bytes, YAFFS_MEM_MOUNT);
+		mgr->hash = kmalloc_class(n_buckets * sizeof(struct list_head),
+					  YAFFS_MEM_MOUNT);
+		mgr->wb = kmalloc_class(mgr->n_caches *
+					sizeof(struct yaffs_cache *),
+					YAFFS_MEM_MOUNT);
+
+		mgr->n_ghosts = mgr->n_caches * mgr->policy->n_ghosts_per_cache;
+		mgr->ghost_next = 0;
+		mgr->ghost_len[0] = mgr->ghost_len[1] = 0;
+		mgr->target = (mgr->n_caches < 8) ? 2 : mgr->n_caches / 4;
+		if (mgr->n_ghosts > 0) {
+			mgr->ghost_mask = yaffs_cache_pow2(mgr->n_ghosts) - 1;
+			mgr->ghost = kmalloc_class(mgr->n_ghosts *
+					sizeof(struct yaffs_cache_ghost),
+					YAFFS_MEM_MOUNT);
+			mgr->ghost_hash = kmalloc_class((mgr->ghost_mask + 1) *
+					sizeof(struct list_head),
+					YAFFS_MEM_MOUNT);
+		}
 
 		buf = (u8 *) mgr->cache;
 
 		if (mgr->cache)
 			memset(mgr->cache, 0, cache_bytes);
+		if (!mgr->hash || !mgr->wb ||
+		    (mgr->n_ghosts > 0 && (!mgr->ghost || !mgr->ghost_hash)))
+			buf = NULL;
+
+		for (i = 0; i < (int)n_buckets && buf; i++)
+			INIT_LIST_HEAD(&mgr->hash[i]);
+
+		for (i = 0; i < mgr->n_ghosts && buf; i++) {
+			INIT_LIST_HEAD(&mgr->ghost[i].hash_link);
+			mgr->ghost[i].queue = -1;
+		}
+		for (i = 0; mgr->n_ghosts > 0 && i <= (int)mgr->ghost_mask &&
+		     buf; i++)
+			INIT_LIST_HEAD(&mgr->ghost_hash[i]);
 
 		for (i = 0; i < mgr->n_caches && buf; i++) {
 			struct yaffs_cache *cache = &mgr->cache[i];
 
 			cache->object = NULL;
-			cache->last_use = 0;
 			cache->dirty = 0;
+			cache->page = 0;
+			INIT_LIST_HEAD(&cache->hash_link);
+			INIT_LIST_HEAD(&cache->obj_link);
+			list_add_tail(&cache->queue_link, &mgr->free);
 			cache->data = buf =
-			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
+			    kmalloc_class(dev->param.total_bytes_per_chunk,
+					  YAFFS_MEM_CHUNK);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		mgr->cache_last_use = 0;
 	}
 
 	return init_failed ? -1 : 0;
@@ -310,7 +855,19 @@ void yaffs_cache_deinit(struct yaffs_dev *dev)
 	struct yaffs_cache_manager *mgr = &dev->cache_mgr;
 	int i;
 
-	if (mgr->n_caches < 1 || !mgr->cache)
+	if (mgr->n_caches < 1)
+		return;
+
+	kfree(mgr->hash);
+	mgr->hash = NULL;
+	kfree(mgr->wb);
+	mgr->wb = NULL;
+	kfree(mgr->ghost);
+	mgr->ghost = NULL;
+	kfree(mgr->ghost_hash);
+	mgr->ghost_hash = NULL;
+
+	if (!mgr->cache)
 		return;
 
 	for (i = 0; i < mgr->n_caches; i++) {
@@ -28,11 +28,22 @@ void yaffs_flush_whole_cache(struct yaffs_dev *dev, int discard);
 /* Grab a cache item during read or write. */
 struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev);
 
-/* Find a cached chunk */
+/* Grab a cache item without writing anything back, or NULL. */
+struct yaffs_cache *yaffs_grab_spare_chunk_cache(struct yaffs_dev *dev);
+
+/* Hand a grabbed cache item to chunk_id of obj. */
+void yaffs_cache_attach(struct yaffs_cache *cache, struct yaffs_obj *obj,
+			int chunk_id);
+
+/* Find a cached chunk, counting a hit or a miss. */
 struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 						  int chunk_id);
 
-/* Mark the chunk for the least recently used algorithym */
+/* Find a cached chunk without counting it, for looking ahead. */
+struct yaffs_cache *yaffs_peek_chunk_cache(const struct yaffs_obj *obj,
+					   int chunk_id);
+
+/* Mark the chunk as used for the replacement policy */
 void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 			    int is_write);
 
@@ -49,6 +60,15 @@ void yaffs_invalidate_file_cache(struct yaffs_obj *in);
 
 int yaffs_count_dirty_caches(struct yaffs_dev *dev);
 
+/* Keep a clean copy of a whole chunk read or written past the cache.
+ * Returns 0 if a cached copy of the chunk is left stale.
+ */
+int yaffs_cache_keep_page(struct yaffs_obj *obj, int chunk_id,
+			  const u8 *data);
+
+/* The name of an enum yaffs_cache_policy_id. */
+const char *yaffs_cache_policy_name(u32 policy);
+
 /* Init/deinit. */
 int yaffs_cache_init(struct yaffs_dev *dev);
 void yaffs_cache_deinit(struct yaffs_dev *dev);
@@ -225,7 +225,8 @@ int yaffs2_checkpt_open(struct yaffs_dev *dev, int writing)
 
 	if (!dev->checkpt_buffer)
 		dev->checkpt_buffer =
-		    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
+		    kmalloc_class(dev->param.total_bytes_per_chunk,
+				  YAFFS_MEM_CHUNK);
 	if (!dev->checkpt_buffer)
 		return 0;
 
@@ -101,5 +101,6 @@ void yaffs_endian_config(struct yaffs_dev *dev)
 	}
 
 	if (dev->swap_endian)
-		dev->tn_swap_buffer = kmalloc(dev->tnode_size, GFP_NOFS);
+		dev->tn_swap_buffer = kmalloc_class(dev->tnode_size,
+						    YAFFS_MEM_MOUNT);
 }
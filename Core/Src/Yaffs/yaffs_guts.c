@@ -31,6 +31,7 @@
 #include "yaffs_allocator.h"
 #include "yaffs_attribs.h"
 #include "yaffs_summary.h"
+#include "yaffs_health.h"
 
 /* Note YAFFS_GC_GOOD_ENOUGH must be <= YAFFS_GC_PASSIVE_THRESHOLD */
 #define YAFFS_GC_GOOD_ENOUGH 2
@@ -38,6 +39,12 @@
 
 #include "yaffs_ecc.h"
 
+/* Longest run of chunk reads we tell the driver about at a time. */
+#define YAFFS_MAX_RD_RUN 64
+
+/* Most chunk writes in a write run, see yaffs_wr_cache_batch(). */
+#define YAFFS_MAX_WR_RUN 8
+
 /* Forward declarations */
 
 static void yaffs_fix_null_name(struct yaffs_obj *obj, YCHAR *name,
@@ -130,7 +137,8 @@ static int yaffs_init_tmp_buffers(struct yaffs_dev *dev)
 
 	for (i = 0; buf && i < YAFFS_N_TEMP_BUFFERS; i++) {
 		dev->temp_buffer[i].in_use = 0;
-		buf = kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
+		buf = kmalloc_class(dev->param.total_bytes_per_chunk,
+				    YAFFS_MEM_CHUNK);
 		dev->temp_buffer[i].buffer = buf;
 	}
 
@@ -159,7 +167,7 @@ u8 *yaffs_get_temp_buffer(struct yaffs_dev * dev)
 	 */
 
 	dev->unmanaged_buffer_allocs++;
-	return kmalloc(dev->data_bytes_per_chunk, GFP_NOFS);
+	return kmalloc_class(dev->data_bytes_per_chunk, YAFFS_MEM_CHUNK);
 
 }
 
@@ -242,9 +250,13 @@ static void yaffs_handle_chunk_wr_error(struct yaffs_dev *dev, int nand_chunk,
 		  "**>> Block %d needs retiring", flash_block);
 	}
 
-	/* Delete the chunk */
+	/* Delete the chunk, and stop allocating from its block if we still
+	 * are. A failure found at the end of a write run may be in a block
+	 * that has already been left.
+	 */
 	yaffs_chunk_del(dev, nand_chunk, 1, __LINE__);
-	yaffs_skip_rest_of_block(dev);
+	if (flash_block == dev->alloc_block)
+		yaffs_skip_rest_of_block(dev);
 }
 
 /*
@@ -328,9 +340,10 @@ static int yaffs_verify_chunk_written(struct yaffs_dev *dev,
 	u8 *buffer = yaffs_get_temp_buffer(dev);
 	int result;
 
+	/* A copied chunk has no data in RAM to compare against. */
 	result = yaffs_rd_chunk_tags_nand(dev, nand_chunk, buffer, &temp_tags);
 	if (result == YAFFS_FAIL ||
-	    memcmp(buffer, data, dev->data_bytes_per_chunk) ||
+	    (data && memcmp(buffer, data, dev->data_bytes_per_chunk)) ||
 	    temp_tags.obj_id != tags->obj_id ||
 	    temp_tags.chunk_id != tags->chunk_id ||
 	    temp_tags.n_bytes != tags->n_bytes)
@@ -361,6 +374,10 @@ static int yaffs_find_alloc_block(struct yaffs_dev *dev)
 	u32 i;
 	struct yaffs_block_info *bi;
 
+	/* Only wait for an erase here if there is no erased block left. */
+	if (dev->n_erased_blocks < 1 && yaffs_erase_pending_blocks(dev, 1))
+		dev->n_forced_erases++;
+
 	if (dev->n_erased_blocks < 1) {
 		/* Hoosterman we've got a problem.
 		 * Can't get space to gc
@@ -484,9 +501,13 @@ void yaffs_skip_rest_of_block(struct yaffs_dev *dev)
 	}
 }
 
-static int yaffs_write_new_chunk(struct yaffs_dev *dev,
-				 const u8 *data,
-				 struct yaffs_ext_tags *tags, int use_reserver)
+/*
+ * Write data, or if copy_from is not -1 copy the data of chunk copy_from,
+ * to a newly allocated chunk.
+ */
+static int yaffs_put_new_chunk(struct yaffs_dev *dev,
+			       const u8 *data, int copy_from,
+			       struct yaffs_ext_tags *tags, int use_reserver)
 {
 	u32 attempts = 0;
 	int write_ok = 0;
@@ -550,7 +571,12 @@ static int yaffs_write_new_chunk(struct yaffs_dev *dev,
 			}
 		}
 
-		write_ok = yaffs_wr_chunk_tags_nand(dev, chunk, data, tags);
+		if (copy_from >= 0)
+			write_ok = yaffs_copy_chunk_tags_nand(dev, copy_from,
+							      chunk, tags);
+		else
+			write_ok = yaffs_wr_chunk_tags_nand(dev, chunk,
+							    data, tags);
 
 		if (!bi->skip_erased_check)
 			write_ok =
@@ -584,6 +610,19 @@ static int yaffs_write_new_chunk(struct yaffs_dev *dev,
 	return chunk;
 }
 
+static int yaffs_write_new_chunk(struct yaffs_dev *dev,
+				 const u8 *data,
+				 struct yaffs_ext_tags *tags, int use_reserver)
+{
+	return yaffs_put_new_chunk(dev, data, -1, tags, use_reserver);
+}
+
+static int yaffs_copy_new_chunk(struct yaffs_dev *dev, int old_chunk,
+				struct yaffs_ext_tags *tags, int use_reserver)
+{
+	return yaffs_put_new_chunk(dev, NULL, old_chunk, tags, use_reserver);
+}
+
 /*
  * Block retiring for handling a broken block.
  */
@@ -704,27 +743,172 @@ static void yaffs_load_oh_from_name(struct yaffs_dev *dev, YCHAR *oh_name,
 	}
 }
 
-static u16 yaffs_calc_name_sum(const YCHAR *name)
+/* FNV-1a over the part of the name that lookups compare. Never 0, which
+ * marks an object whose name is not known.
+ */
+static u32 yaffs_calc_name_sum(const YCHAR *name)
 {
-	u16 sum = 0;
-	u16 i = 1;
+	u32 sum = 2166136261U;
+	YCHAR c;
+	int i;
 
 	if (!name)
 		return 0;
 
-	while ((*name) && i < (YAFFS_MAX_NAME_LENGTH / 2)) {
+	for (i = 0; name[i] && i < YAFFS_MAX_NAME_LENGTH; i++) {
+		c = name[i];
+#ifdef CONFIG_YAFFS_CASE_INSENSITIVE
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+#endif
+		sum = (sum ^ (u32)c) * 16777619U;
+	}
+	return sum ? sum : 1;
+}
+
+/*
+ * Directory name index. Linear probing on the name sum, kept between an
+ * eighth and half full.
+ */
+#define YAFFS_DIR_INDEX_MIN_SLOTS	16
+
+static int yaffs_dir_index_resize(struct yaffs_obj *dir, u32 n_slots)
+{
+	struct yaffs_dir_var *dv = &dir->variant.dir_variant;
+	struct yaffs_obj **index;
+	struct yaffs_obj *obj;
+	u32 mask = n_slots - 1;
+	u32 i;
+	u32 j;
+
+	index = kmalloc_class(n_slots * sizeof(*index), YAFFS_MEM_DIR_INDEX);
+	if (!index)
+		return YAFFS_FAIL;
+	memset(index, 0, n_slots * sizeof(*index));
+
+	for (i = 0; dv->index && i <= dv->index_mask; i++) {
+		obj = dv->index[i];
+		if (!obj)
+			continue;
+		for (j = obj->sum & mask; index[j]; j = (j + 1) & mask)
+			;
+		index[j] = obj;
+	}
+
+	kfree(dv->index);
+	dv->index = index;
+	dv->index_mask = mask;
+	return YAFFS_OK;
+}
+
+static void yaffs_dir_index_free(struct yaffs_obj *dir)
+{
+	struct yaffs_dir_var *dv = &dir->variant.dir_variant;
+	struct list_head *i;
+
+	if (!dv->index)
+		return;
 
-		/* 0x1f mask is case insensitive */
-		sum += ((*name) & 0x1f) * i;
-		i++;
-		name++;
+	list_for_each(i, &dv->children)
+		list_entry(i, struct yaffs_obj, siblings)->in_dir_index = 0;
+
+	kfree(dv->index);
+	dv->index = NULL;
+	dv->index_mask = 0;
+	dv->n_indexed = 0;
+	dv->n_unindexed = 0;
+}
+
+static void yaffs_dir_index_add(struct yaffs_obj *dir, struct yaffs_obj *obj)
+{
+	struct yaffs_dir_var *dv = &dir->variant.dir_variant;
+	u32 i;
+
+	/* Lookups check for lost+found by name */
+	if (dir->variant_type != YAFFS_OBJECT_TYPE_DIRECTORY || !dv->index ||
+	    obj == obj->my_dev->lost_n_found)
+		return;
+
+	if (!obj->sum) {
+		dv->n_unindexed++;
+		return;
 	}
-	return sum;
+
+	if ((dv->n_indexed + 1) * 2 > dv->index_mask + 1 &&
+	    !yaffs_dir_index_resize(dir, (dv->index_mask + 1) * 2)) {
+		yaffs_dir_index_free(dir);
+		return;
+	}
+
+	for (i = obj->sum & dv->index_mask; dv->index[i];
+	     i = (i + 1) & dv->index_mask)
+		;
+	dv->index[i] = obj;
+	dv->n_indexed++;
+	obj->in_dir_index = 1;
+}
+
+static void yaffs_dir_index_del(struct yaffs_obj *dir, struct yaffs_obj *obj)
+{
+	struct yaffs_dir_var *dv = &dir->variant.dir_variant;
+	u32 mask = dv->index_mask;
+	u32 hole;
+	u32 home;
+	u32 i;
+
+	if (dir->variant_type != YAFFS_OBJECT_TYPE_DIRECTORY || !dv->index)
+		return;
+
+	if (!obj->in_dir_index) {
+		if (!obj->sum && obj != obj->my_dev->lost_n_found &&
+		    dv->n_unindexed)
+			dv->n_unindexed--;
+		return;
+	}
+
+	for (hole = obj->sum & mask; dv->index[hole] != obj;
+	     hole = (hole + 1) & mask)
+		;
+
+	/* Pull back the entries after it that probed past it */
+	for (i = (hole + 1) & mask; dv->index[i]; i = (i + 1) & mask) {
+		home = dv->index[i]->sum & mask;
+		if (hole <= i ? (home > hole && home <= i) :
+				(home > hole || home <= i))
+			continue;
+		dv->index[hole] = dv->index[i];
+		hole = i;
+	}
+	dv->index[hole] = NULL;
+	dv->n_indexed--;
+	obj->in_dir_index = 0;
 }
 
+/* Drop the index once the directory is down to half the size that builds
+ * one, else halve it when it gets too sparse.
+ */
+static void yaffs_dir_index_trim(struct yaffs_obj *dir)
+{
+	struct yaffs_dir_var *dv = &dir->variant.dir_variant;
+
+	if (dir->variant_type != YAFFS_OBJECT_TYPE_DIRECTORY || !dv->index)
+		return;
+
+	if (dv->n_indexed + dv->n_unindexed <
+	    dir->my_dev->param.dir_index_min / 2)
+		yaffs_dir_index_free(dir);
+	else if (dv->n_indexed * 8 < dv->index_mask + 1 &&
+		 dv->index_mask + 1 > YAFFS_DIR_INDEX_MIN_SLOTS)
+		yaffs_dir_index_resize(dir, (dv->index_mask + 1) / 2);
+}
 
 void yaffs_set_obj_name(struct yaffs_obj *obj, const YCHAR * name)
 {
+	struct yaffs_obj *parent = obj->parent;
+
+	if (parent)
+		yaffs_dir_index_del(parent, obj);
+
 	memset(obj->short_name, 0, sizeof(obj->short_name));
 
 	if (name && !name[0]) {
@@ -738,6 +922,9 @@ void yaffs_set_obj_name(struct yaffs_obj *obj, const YCHAR * name)
 	}
 
 	obj->sum = yaffs_calc_name_sum(name);
+
+	if (parent)
+		yaffs_dir_index_add(parent, obj);
 }
 
 void yaffs_set_obj_name_from_oh(struct yaffs_obj *obj,
@@ -786,13 +973,29 @@ struct yaffs_tnode *yaffs_get_tnode(struct yaffs_dev *dev)
 /* FreeTnode frees up a tnode and puts it back on the free list */
 static void yaffs_free_tnode(struct yaffs_dev *dev, struct yaffs_tnode *tn)
 {
+	if (!tn)
+		return;
 	yaffs_free_raw_tnode(dev, tn);
 	dev->n_tnodes--;
+	dev->tnode_gen++;	/* Drop all lookup cursors */
 	dev->checkpoint_blocks_required = 0;	/* force recalculation */
 }
 
 static void yaffs_deinit_tnodes_and_objs(struct yaffs_dev *dev)
 {
+	struct list_head *i;
+	struct yaffs_obj *obj;
+	int b;
+
+	/* The objects go in bulk, so give back the directory indexes first */
+	for (b = 0; b < YAFFS_NOBJECT_BUCKETS; b++) {
+		list_for_each(i, &dev->obj_bucket[b].list) {
+			obj = list_entry(i, struct yaffs_obj, hash_link);
+			if (obj->variant_type == YAFFS_OBJECT_TYPE_DIRECTORY)
+				yaffs_dir_index_free(obj);
+		}
+	}
+
 	yaffs_deinit_raw_tnodes_and_objs(dev);
 	dev->n_obj = 0;
 	dev->n_tnodes = 0;
@@ -865,17 +1068,47 @@ u32 yaffs_get_group_base(struct yaffs_dev *dev, struct yaffs_tnode *tn,
  * in the tree. 0 means only the level 0 tnode is in the tree.
  */
 
+/*
+ * Each file remembers the level 0 tnode it last looked up, so that the
+ * lookups of consecutive chunks in sequential reads and writes skip the
+ * walk down the tree. Freeing any tnode drops every cursor: level 0
+ * tnodes stay put as the tree grows, and are only ever freed.
+ */
+static inline struct yaffs_tnode *yaffs_cursor_tnode_0(struct yaffs_dev *dev,
+					struct yaffs_file_var *file_struct,
+					u32 chunk_id)
+{
+	if (file_struct->cursor &&
+	    file_struct->cursor_gen == dev->tnode_gen &&
+	    file_struct->cursor_base ==
+	    (chunk_id & ~YAFFS_TNODES_LEVEL0_MASK))
+		return file_struct->cursor;
+	return NULL;
+}
+
+static inline void yaffs_set_cursor(struct yaffs_dev *dev,
+				    struct yaffs_file_var *file_struct,
+				    u32 chunk_id, struct yaffs_tnode *tn)
+{
+	file_struct->cursor = tn;
+	file_struct->cursor_base = chunk_id & ~YAFFS_TNODES_LEVEL0_MASK;
+	file_struct->cursor_gen = dev->tnode_gen;
+}
+
 /* FindLevel0Tnode finds the level 0 tnode, if one exists. */
 struct yaffs_tnode *yaffs_find_tnode_0(struct yaffs_dev *dev,
 				       struct yaffs_file_var *file_struct,
 				       u32 chunk_id)
 {
-	struct yaffs_tnode *tn = file_struct->top;
+	struct yaffs_tnode *tn;
 	u32 i;
 	int required_depth;
 	int level = file_struct->top_level;
 
-	(void) dev;
+	tn = yaffs_cursor_tnode_0(dev, file_struct, chunk_id);
+	if (tn)
+		return tn;
+	tn = file_struct->top;
 
 	/* Check sane level and chunk Id */
 	if (level < 0 || level > YAFFS_TNODES_MAX_LEVEL)
@@ -906,6 +1139,8 @@ struct yaffs_tnode *yaffs_find_tnode_0(struct yaffs_dev *dev,
 		level--;
 	}
 
+	if (tn)
+		yaffs_set_cursor(dev, file_struct, chunk_id, tn);
 	return tn;
 }
 
@@ -932,6 +1167,12 @@ struct yaffs_tnode *yaffs_add_find_tnode_0(struct yaffs_dev *dev,
 	struct yaffs_tnode *tn;
 	u32 x;
 
+	if (!passed_tn) {
+		tn = yaffs_cursor_tnode_0(dev, file_struct, chunk_id);
+		if (tn)
+			return tn;
+	}
+
 	/* Check sane level and page Id */
 	if (file_struct->top_level < 0 ||
 	    file_struct->top_level > YAFFS_TNODES_MAX_LEVEL)
@@ -1013,9 +1254,393 @@ struct yaffs_tnode *yaffs_add_find_tnode_0(struct yaffs_dev *dev,
 		}
 	}
 
+	if (tn)
+		yaffs_set_cursor(dev, file_struct, chunk_id, tn);
 	return tn;
 }
 
+static void yaffs_free_tree(struct yaffs_dev *dev, struct yaffs_tnode *tn,
+			    u32 level)
+{
+	int i;
+
+	if (!tn)
+		return;
+
+	if (level > 0) {
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++)
+			yaffs_free_tree(dev, tn->internal[i], level - 1);
+	}
+	yaffs_free_tnode(dev, tn);
+}
+
+/* ---------- Functions to manipulate the extent map of a file ------------
+ * While n_extents is not negative, top points at the file's extents (or is
+ * NULL if it has never had any) instead of a tree. See struct yaffs_extent.
+ *
+ * An extent runs over the chunks in each block that can hold data, so a
+ * file written straight on from one block into the next is still a single
+ * extent although the block summary is in between.
+ */
+
+/* The next block of a file's chain of extents is in the last word. */
+static inline struct yaffs_tnode **yaffs_extent_link(struct yaffs_dev *dev,
+						     struct yaffs_tnode *tn)
+{
+	return (struct yaffs_tnode **)((u8 *)tn + dev->tnode_size -
+				       sizeof(struct yaffs_tnode *));
+}
+
+struct yaffs_extent *yaffs_file_extent(struct yaffs_dev *dev,
+				       struct yaffs_tnode *ext, int i)
+{
+	int per_tnode = YAFFS_TNODE_EXTENTS(dev);
+
+	while (i >= per_tnode) {
+		ext = *yaffs_extent_link(dev, ext);
+		i -= per_tnode;
+	}
+	return (struct yaffs_extent *)ext + i;
+}
+
+static void yaffs_free_extents(struct yaffs_dev *dev, struct yaffs_tnode *ext)
+{
+	struct yaffs_tnode *next;
+
+	while (ext) {
+		next = *yaffs_extent_link(dev, ext);
+		yaffs_free_tnode(dev, ext);
+		ext = next;
+	}
+}
+
+/* Make sure the chain has n_tnodes blocks. 0 means the file can't have the
+ * extents it would take.
+ */
+int yaffs_grow_extents(struct yaffs_dev *dev,
+		       struct yaffs_file_var *file_struct, int n_tnodes)
+{
+	struct yaffs_tnode **link = &file_struct->top;
+
+	if (n_tnodes < 1)
+		return YAFFS_FAIL;
+
+	for (; n_tnodes > 0; n_tnodes--) {
+		if (!*link) {
+			*link = yaffs_get_tnode(dev);
+			if (!*link)
+				return YAFFS_FAIL;
+		}
+		link = yaffs_extent_link(dev, *link);
+	}
+	return YAFFS_OK;
+}
+
+static u32 yaffs_extent_nand(struct yaffs_dev *dev, u32 nand, u32 offs)
+{
+	u32 per_block = dev->param.chunks_per_block;
+	u32 n_data = dev->chunks_per_summary ?
+			(u32)dev->chunks_per_summary : per_block;
+	u32 in_block;
+
+	if (!offs)
+		return nand;
+	in_block = nand % per_block + offs;
+	if (in_block < n_data)
+		return nand + offs;
+	return (nand / per_block + in_block / n_data) * per_block +
+		in_block % n_data;
+}
+
+static u32 yaffs_find_extent(struct yaffs_dev *dev,
+			     struct yaffs_file_var *file_struct,
+			     u32 chunk_id)
+{
+	struct yaffs_tnode *ext = file_struct->top;
+	struct yaffs_extent *e;
+	int per_tnode = YAFFS_TNODE_EXTENTS(dev);
+	int i;
+
+	for (i = 0; i < file_struct->n_extents; i++) {
+		if (i && !(i % per_tnode))
+			ext = *yaffs_extent_link(dev, ext);
+		e = (struct yaffs_extent *)ext + i % per_tnode;
+		if (chunk_id - e->chunk < e->len)
+			return yaffs_extent_nand(dev, e->nand,
+						 chunk_id - e->chunk);
+	}
+	return 0;
+}
+
+/* One past the last chunk_id the extents map. */
+static u32 yaffs_extents_end(struct yaffs_dev *dev,
+			     struct yaffs_file_var *file_struct)
+{
+	struct yaffs_extent *e;
+	u32 end = 0;
+	int i;
+
+	for (i = 0; i < file_struct->n_extents; i++) {
+		e = yaffs_file_extent(dev, file_struct->top, i);
+		if (e->chunk + e->len > end)
+			end = e->chunk + e->len;
+	}
+	return end;
+}
+
+/* Blocks of extents for n extents reaching up to chunk_id end, or 0 if the
+ * file should have a tree instead: past YAFFS_EXTENT_TNODES, or once the
+ * chain would be longer than the level 0 tnodes of a tree of the file.
+ */
+static int yaffs_extent_tnodes(struct yaffs_dev *dev, int n, u32 end)
+{
+	int per_tnode = YAFFS_TNODE_EXTENTS(dev);
+	int n_tnodes = (n + per_tnode - 1) / per_tnode;
+
+	if (n_tnodes <= 1)
+		return 1;
+	if (n_tnodes > YAFFS_EXTENT_TNODES ||
+	    (u32)n_tnodes > ((end - 1) >> YAFFS_TNODES_LEVEL0_BITS) + 1)
+		return 0;
+	return n_tnodes;
+}
+
+/* The blocks of extents needed to map chunk_id to any NAND chunk at all,
+ * even one that does not run on from a neighbour, or 0 if there is no room.
+ * Replacing a chunk in the middle of an extent splits it, so that takes two
+ * more extents.
+ */
+static int yaffs_extent_room(struct yaffs_dev *dev,
+			     struct yaffs_file_var *file_struct,
+			     u32 chunk_id)
+{
+	struct yaffs_tnode *ext = file_struct->top;
+	struct yaffs_extent *e;
+	int per_tnode = YAFFS_TNODE_EXTENTS(dev);
+	int n = file_struct->n_extents + 1;
+	u32 end = chunk_id + 1;
+	int split = 0;
+	int i;
+	u32 offs;
+
+	for (i = 0; i < file_struct->n_extents; i++) {
+		if (i && !(i % per_tnode))
+			ext = *yaffs_extent_link(dev, ext);
+		e = (struct yaffs_extent *)ext + i % per_tnode;
+		if (e->chunk + e->len > end)
+			end = e->chunk + e->len;
+		offs = chunk_id - e->chunk;
+		if (offs >= e->len)
+			continue;
+		if (e->len == 1)
+			split = -1;
+		else if (offs > 0 && offs < e->len - 1)
+			split = 1;
+	}
+	return yaffs_extent_tnodes(dev, n + split, end);
+}
+
+/* Map chunk_id to nand_chunk, or unmap it if nand_chunk is 0, adding blocks
+ * to the chain as needed. Fails, leaving the map as it was, if there is no
+ * room or no memory for the extents.
+ */
+static int yaffs_set_extent(struct yaffs_dev *dev,
+			    struct yaffs_file_var *file_struct,
+			    u32 chunk_id, u32 nand_chunk)
+{
+	struct yaffs_tnode *ext;
+	struct yaffs_extent *e;
+	struct yaffs_extent *f;
+	int n = file_struct->n_extents;
+	int i;
+	int j;
+	u32 offs;
+
+	if (nand_chunk &&
+	    yaffs_grow_extents(dev, file_struct,
+			       yaffs_extent_room(dev, file_struct, chunk_id)) !=
+	    YAFFS_OK)
+		return YAFFS_FAIL;
+	ext = file_struct->top;
+
+	/* Take the chunk out of the extent it is in, if any */
+	for (i = 0; i < n; i++) {
+		e = yaffs_file_extent(dev, ext, i);
+		offs = chunk_id - e->chunk;
+		if (offs >= e->len)
+			continue;
+		if (offs == 0) {
+			e->chunk++;
+			e->nand = yaffs_extent_nand(dev, e->nand, 1);
+			e->len--;
+		} else if (offs == e->len - 1) {
+			e->len--;
+		} else {
+			/* A new mapping made sure of the room already */
+			if (!nand_chunk &&
+			    yaffs_grow_extents(dev, file_struct,
+					yaffs_extent_tnodes(dev, n + 1,
+						yaffs_extents_end(dev,
+							file_struct))) !=
+			    YAFFS_OK)
+				return YAFFS_FAIL;
+			f = yaffs_file_extent(dev, ext, n);
+			f->chunk = chunk_id + 1;
+			f->nand = yaffs_extent_nand(dev, e->nand, offs + 1);
+			f->len = e->len - offs - 1;
+			e->len = offs;
+			n++;
+		}
+		if (!e->len)
+			*e = *yaffs_file_extent(dev, ext, --n);
+		break;
+	}
+
+	if (nand_chunk) {
+		/* Run on from an extent, or into one, else start a new one */
+		for (i = 0; i < n; i++) {
+			e = yaffs_file_extent(dev, ext, i);
+			if (e->chunk + e->len == chunk_id &&
+			    yaffs_extent_nand(dev, e->nand, e->len) ==
+			    nand_chunk) {
+				e->len++;
+				break;
+			}
+			if (e->chunk == chunk_id + 1 &&
+			    yaffs_extent_nand(dev, nand_chunk, 1) == e->nand) {
+				e->chunk--;
+				e->nand = nand_chunk;
+				e->len++;
+				break;
+			}
+		}
+		if (i < n) {
+			/* The chunk may have closed the gap to another one */
+			for (j = 0; j < n; j++) {
+				if (j == i)
+					continue;
+				f = yaffs_file_extent(dev, ext, j);
+				if (e->chunk + e->len == f->chunk &&
+				    yaffs_extent_nand(dev, e->nand, e->len) ==
+				    f->nand) {
+					e->len += f->len;
+					*f = *yaffs_file_extent(dev, ext, --n);
+					break;
+				}
+				if (f->chunk + f->len == e->chunk &&
+				    yaffs_extent_nand(dev, f->nand, f->len) ==
+				    e->nand) {
+					f->len += e->len;
+					*e = *yaffs_file_extent(dev, ext, --n);
+					break;
+				}
+			}
+		} else {
+			f = yaffs_file_extent(dev, ext, n);
+			f->chunk = chunk_id;
+			f->nand = nand_chunk;
+			f->len = 1;
+			n++;
+		}
+	}
+
+	file_struct->n_extents = n;
+	return YAFFS_OK;
+}
+
+/* Move a file from its extents over to a tnode tree. */
+int yaffs_extents_to_tnodes(struct yaffs_dev *dev,
+			    struct yaffs_file_var *file_struct)
+{
+	struct yaffs_tnode *ext = file_struct->top;
+	struct yaffs_extent *e;
+	int n = file_struct->n_extents;
+	struct yaffs_tnode *tn;
+	int i;
+	u32 j;
+
+	if (n < 0)
+		return YAFFS_OK;
+
+	file_struct->top = yaffs_get_tnode(dev);
+	if (!file_struct->top) {
+		file_struct->top = ext;
+		return YAFFS_FAIL;
+	}
+	file_struct->top_level = 0;
+	file_struct->n_extents = -1;
+
+	for (i = 0; i < n; i++) {
+		e = yaffs_file_extent(dev, ext, i);
+		for (j = 0; j < e->len; j++) {
+			tn = yaffs_add_find_tnode_0(dev, file_struct,
+						    e->chunk + j, NULL);
+			if (!tn) {
+				/* Put the extents back */
+				yaffs_free_tree(dev, file_struct->top,
+						file_struct->top_level);
+				file_struct->top = ext;
+				file_struct->top_level = 0;
+				file_struct->n_extents = n;
+				return YAFFS_FAIL;
+			}
+			yaffs_load_tnode_0(dev, tn, e->chunk + j,
+					   yaffs_extent_nand(dev, e->nand, j));
+		}
+	}
+	yaffs_free_extents(dev, ext);
+
+	yaffs_trace(YAFFS_TRACE_TRACING,
+		"yaffs: file map of %d extents moved to tnodes", n);
+	return YAFFS_OK;
+}
+
+/* Make sure chunk_id can be mapped without any more memory. */
+static int yaffs_reserve_file_map(struct yaffs_dev *dev,
+				  struct yaffs_file_var *file_struct,
+				  u32 chunk_id)
+{
+	if (file_struct->n_extents < 0)
+		return yaffs_add_find_tnode_0(dev, file_struct, chunk_id,
+					      NULL) ? YAFFS_OK : YAFFS_FAIL;
+
+	if (yaffs_grow_extents(dev, file_struct,
+			       yaffs_extent_room(dev, file_struct, chunk_id)) ==
+	    YAFFS_OK)
+		return YAFFS_OK;
+
+	if (yaffs_extents_to_tnodes(dev, file_struct) != YAFFS_OK)
+		return YAFFS_FAIL;
+	return yaffs_add_find_tnode_0(dev, file_struct, chunk_id, NULL) ?
+		YAFFS_OK : YAFFS_FAIL;
+}
+
+/* Free what maps a file's chunks, once it has none left. */
+static void yaffs_free_file_map(struct yaffs_dev *dev,
+				struct yaffs_file_var *file_struct)
+{
+	if (file_struct->n_extents >= 0)
+		yaffs_free_extents(dev, file_struct->top);
+	else
+		yaffs_free_tnode(dev, file_struct->top);
+	file_struct->top = NULL;
+}
+
+/* The NAND chunk (or the base of its chunk group) that chunk_id is mapped
+ * to, or 0 if it is not mapped.
+ */
+u32 yaffs_get_file_map(struct yaffs_dev *dev,
+		       struct yaffs_file_var *file_struct, u32 chunk_id)
+{
+	struct yaffs_tnode *tn;
+
+	if (file_struct->n_extents >= 0)
+		return yaffs_find_extent(dev, file_struct, chunk_id);
+
+	tn = yaffs_find_tnode_0(dev, file_struct, chunk_id);
+	return tn ? yaffs_get_group_base(dev, tn, chunk_id) : 0;
+}
+
 static int yaffs_tags_match(const struct yaffs_ext_tags *tags, int obj_id,
 			    int chunk_obj)
 {
@@ -1056,9 +1681,8 @@ static int yaffs_find_chunk_in_group(struct yaffs_dev *dev, int the_chunk,
 int yaffs_find_chunk_in_file(struct yaffs_obj *in, int inode_chunk,
 				    struct yaffs_ext_tags *tags)
 {
-	/*Get the Tnode, then get the level 0 offset chunk offset */
-	struct yaffs_tnode *tn;
-	int the_chunk = -1;
+	/* Get the chunk (group) it is mapped to, then look in the group */
+	int the_chunk;
 	struct yaffs_ext_tags local_tags;
 	int ret_val = -1;
 	struct yaffs_dev *dev = in->my_dev;
@@ -1068,13 +1692,11 @@ int yaffs_find_chunk_in_file(struct yaffs_obj *in, int inode_chunk,
 		tags = &local_tags;
 	}
 
-	tn = yaffs_find_tnode_0(dev, &in->variant.file_variant, inode_chunk);
-
-	if (!tn)
+	the_chunk = yaffs_get_file_map(dev, &in->variant.file_variant,
+				       inode_chunk);
+	if (!the_chunk)
 		return ret_val;
 
-	the_chunk = yaffs_get_group_base(dev, tn, inode_chunk);
-
 	ret_val = yaffs_find_chunk_in_group(dev, the_chunk, tags, in->obj_id,
 					      inode_chunk);
 	return ret_val;
@@ -1088,6 +1710,7 @@ static int yaffs_find_del_file_chunk(struct yaffs_obj *in, int inode_chunk,
 	int the_chunk = -1;
 	struct yaffs_ext_tags local_tags;
 	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_file_var *file_struct = &in->variant.file_variant;
 	int ret_val = -1;
 
 	if (!tags) {
@@ -1095,7 +1718,28 @@ static int yaffs_find_del_file_chunk(struct yaffs_obj *in, int inode_chunk,
 		tags = &local_tags;
 	}
 
-	tn = yaffs_find_tnode_0(dev, &in->variant.file_variant, inode_chunk);
+	if (file_struct->n_extents >= 0) {
+		the_chunk = yaffs_find_extent(dev, file_struct, inode_chunk);
+		if (!the_chunk)
+			return ret_val;
+
+		ret_val = yaffs_find_chunk_in_group(dev, the_chunk, tags,
+						    in->obj_id, inode_chunk);
+		if (ret_val == -1 ||
+		    yaffs_set_extent(dev, file_struct, inode_chunk, 0) ==
+		    YAFFS_OK)
+			return ret_val;
+
+		/* Splitting the extent would take one too many */
+		if (yaffs_extents_to_tnodes(dev, file_struct) != YAFFS_OK) {
+			yaffs_trace(YAFFS_TRACE_ERROR,
+				"yaffs: no tnodes to delete chunk %d of %d",
+				inode_chunk, in->obj_id);
+			return -1;
+		}
+	}
+
+	tn = yaffs_find_tnode_0(dev, file_struct, inode_chunk);
 
 	if (!tn)
 		return ret_val;
@@ -1122,8 +1766,9 @@ int yaffs_put_chunk_in_file(struct yaffs_obj *in, int inode_chunk,
 	 * nand_chunk = 0 is a dummy insert to make sure the tnodes are there.
 	 */
 
-	struct yaffs_tnode *tn;
+	struct yaffs_tnode *tn = NULL;
 	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_file_var *file_struct = &in->variant.file_variant;
 	int existing_cunk;
 	struct yaffs_ext_tags existing_tags;
 	struct yaffs_ext_tags new_tags;
@@ -1145,17 +1790,23 @@ int yaffs_put_chunk_in_file(struct yaffs_obj *in, int inode_chunk,
 		return YAFFS_OK;
 	}
 
-	tn = yaffs_add_find_tnode_0(dev,
-				    &in->variant.file_variant,
-				    inode_chunk, NULL);
-	if (!tn)
+	/* A file that would need more extents than fit moves over to
+	 * tnodes here, so the insert that follows a dummy insert can't fail.
+	 */
+	if (yaffs_reserve_file_map(dev, file_struct, inode_chunk) != YAFFS_OK)
 		return YAFFS_FAIL;
 
 	if (!nand_chunk)
 		/* Dummy insert, bail now */
 		return YAFFS_OK;
 
-	existing_cunk = yaffs_get_group_base(dev, tn, inode_chunk);
+	if (file_struct->n_extents < 0) {
+		tn = yaffs_find_tnode_0(dev, file_struct, inode_chunk);
+		existing_cunk = yaffs_get_group_base(dev, tn, inode_chunk);
+	} else {
+		existing_cunk = yaffs_find_extent(dev, file_struct,
+						  inode_chunk);
+	}
 
 	if (in_scan != 0) {
 		/* If we're scanning then we need to test for duplicates
@@ -1237,10 +1888,24 @@ int yaffs_put_chunk_in_file(struct yaffs_obj *in, int inode_chunk,
 
 	}
 
+	if (!tn &&
+	    yaffs_set_extent(dev, file_struct, inode_chunk, nand_chunk) !=
+	    YAFFS_OK) {
+		/* The gc moved chunks of the file since the dummy insert and
+		 * took the room it had made sure of.
+		 */
+		if (yaffs_extents_to_tnodes(dev, file_struct) == YAFFS_OK)
+			tn = yaffs_add_find_tnode_0(dev, file_struct,
+						    inode_chunk, NULL);
+		if (!tn)
+			return YAFFS_FAIL;
+	}
+
 	if (existing_cunk == 0)
 		in->n_data_chunks++;
 
-	yaffs_load_tnode_0(dev, tn, inode_chunk, nand_chunk);
+	if (tn)
+		yaffs_load_tnode_0(dev, tn, inode_chunk, nand_chunk);
 
 	return YAFFS_OK;
 }
@@ -1315,6 +1980,22 @@ static int yaffs_soft_del_worker(struct yaffs_obj *in, struct yaffs_tnode *tn,
 	return 1;
 }
 
+static void yaffs_soft_del_extents(struct yaffs_obj *in)
+{
+	struct yaffs_file_var *file_struct = &in->variant.file_variant;
+	struct yaffs_extent *e;
+	int i;
+	u32 j;
+
+	for (i = 0; i < file_struct->n_extents; i++) {
+		e = yaffs_file_extent(in->my_dev, file_struct->top, i);
+		for (j = 0; j < e->len; j++)
+			yaffs_soft_del_chunk(in->my_dev,
+				yaffs_extent_nand(in->my_dev, e->nand, j));
+	}
+	file_struct->n_extents = 0;
+}
+
 static void yaffs_remove_obj_from_dir(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
@@ -1328,9 +2009,15 @@ static void yaffs_remove_obj_from_dir(struct yaffs_obj *obj)
 	if (dev && dev->param.remove_obj_fn)
 		dev->param.remove_obj_fn(obj);
 
+	if (parent)
+		yaffs_dir_index_del(parent, obj);
+
 	list_del_init(&obj->siblings);
 	obj->parent = NULL;
 
+	if (parent)
+		yaffs_dir_index_trim(parent);
+
 	yaffs_verify_dir(parent);
 }
 
@@ -1362,6 +2049,7 @@ void yaffs_add_obj_to_dir(struct yaffs_obj *directory, struct yaffs_obj *obj)
 	/* Now add it */
 	list_add(&obj->siblings, &directory->variant.dir_variant.children);
 	obj->parent = directory;
+	yaffs_dir_index_add(directory, obj);
 
 	if (directory == obj->my_dev->unlinked_dir
 	    || directory == obj->my_dev->del_dir) {
@@ -1451,6 +2139,8 @@ static void yaffs_free_obj(struct yaffs_obj *obj)
 		BUG();
 	if (!list_empty(&obj->siblings))
 		BUG();
+	if (obj->variant_type == YAFFS_OBJECT_TYPE_DIRECTORY)
+		yaffs_dir_index_free(obj);
 
 	if (obj->my_inode) {
 		/* We're still hooked up to a cached inode.
@@ -1503,17 +2193,19 @@ static void yaffs_soft_del_file(struct yaffs_obj *obj)
 	if (obj->n_data_chunks <= 0) {
 		/* Empty file with no duplicate object headers,
 		 * just delete it immediately */
-		yaffs_free_tnode(obj->my_dev, obj->variant.file_variant.top);
-		obj->variant.file_variant.top = NULL;
+		yaffs_free_file_map(obj->my_dev, &obj->variant.file_variant);
 		yaffs_trace(YAFFS_TRACE_TRACING,
 			"yaffs: Deleting empty file %d",
 			obj->obj_id);
 		yaffs_generic_obj_del(obj);
 	} else {
-		yaffs_soft_del_worker(obj,
-				      obj->variant.file_variant.top,
-				      obj->variant.
-				      file_variant.top_level, 0);
+		if (obj->variant.file_variant.n_extents < 0)
+			yaffs_soft_del_worker(obj,
+					      obj->variant.file_variant.top,
+					      obj->variant.
+					      file_variant.top_level, 0);
+		else
+			yaffs_soft_del_extents(obj);
 		obj->soft_del = 1;
 	}
 }
@@ -1584,7 +2276,7 @@ static int yaffs_prune_tree(struct yaffs_dev *dev,
 	int done = 0;
 	struct yaffs_tnode *tn;
 
-	if (file_struct->top_level < 1)
+	if (file_struct->n_extents >= 0 || file_struct->top_level < 1)
 		return YAFFS_OK;
 
 	file_struct->top =
@@ -1641,12 +2333,14 @@ static struct yaffs_obj *yaffs_alloc_empty_obj(struct yaffs_dev *dev)
 	INIT_LIST_HEAD(&(obj->hard_links));
 	INIT_LIST_HEAD(&(obj->hash_link));
 	INIT_LIST_HEAD(&obj->siblings);
+	INIT_LIST_HEAD(&obj->cache_list);
 
 	/* Now make the directory sane */
 	if (dev->root_dir) {
 		obj->parent = dev->root_dir;
 		list_add(&(obj->siblings),
 			 &dev->root_dir->variant.dir_variant.children);
+		yaffs_dir_index_add(dev->root_dir, obj);
 	}
 
 	/* Add it to the lost and found directory.
@@ -1742,23 +2436,13 @@ static struct yaffs_obj *yaffs_new_obj(struct yaffs_dev *dev, int number,
 				enum yaffs_obj_type type)
 {
 	struct yaffs_obj *the_obj = NULL;
-	struct yaffs_tnode *tn = NULL;
 
 	if (number < 0)
 		number = yaffs_new_obj_id(dev);
 
-	if (type == YAFFS_OBJECT_TYPE_FILE) {
-		tn = yaffs_get_tnode(dev);
-		if (!tn)
-			return NULL;
-	}
-
 	the_obj = yaffs_alloc_empty_obj(dev);
-	if (!the_obj) {
-		if (tn)
-			yaffs_free_tnode(dev, tn);
+	if (!the_obj)
 		return NULL;
-	}
 
 	the_obj->fake = 0;
 	the_obj->rename_allowed = 1;
@@ -1774,8 +2458,10 @@ static struct yaffs_obj *yaffs_new_obj(struct yaffs_dev *dev, int number,
 		the_obj->variant.file_variant.stored_size = 0;
 		the_obj->variant.file_variant.shrink_size =
 						yaffs_max_file_size(dev);
+		/* Files start out mapped by extents */
 		the_obj->variant.file_variant.top_level = 0;
-		the_obj->variant.file_variant.top = tn;
+		the_obj->variant.file_variant.top = NULL;
+		the_obj->variant.file_variant.n_extents = 0;
 		break;
 	case YAFFS_OBJECT_TYPE_DIRECTORY:
 		INIT_LIST_HEAD(&the_obj->variant.dir_variant.children);
@@ -2092,7 +2778,8 @@ static int yaffs_init_blocks(struct yaffs_dev *dev)
 
 	/* If the first allocation strategy fails, thry the alternate one */
 	dev->block_info =
-		kmalloc(n_blocks * sizeof(struct yaffs_block_info), GFP_NOFS);
+		kmalloc_class(n_blocks * sizeof(struct yaffs_block_info),
+			      YAFFS_MEM_MOUNT);
 	if (!dev->block_info) {
 		dev->block_info =
 		    vmalloc(n_blocks * sizeof(struct yaffs_block_info));
@@ -2107,7 +2794,7 @@ static int yaffs_init_blocks(struct yaffs_dev *dev)
 	/* Set up dynamic blockinfo stuff. Round up bytes. */
 	dev->chunk_bit_stride = (dev->param.chunks_per_block + 7) / 8;
 	dev->chunk_bits =
-		kmalloc(dev->chunk_bit_stride * n_blocks, GFP_NOFS);
+		kmalloc_class(dev->chunk_bit_stride * n_blocks, YAFFS_MEM_MOUNT);
 	if (!dev->chunk_bits) {
 		dev->chunk_bits =
 		    vmalloc(dev->chunk_bit_stride * n_blocks);
@@ -2124,40 +2811,20 @@ static int yaffs_init_blocks(struct yaffs_dev *dev)
 	return YAFFS_OK;
 
 alloc_error:
-	yaffs_deinit_blocks(dev);
-	return YAFFS_FAIL;
-}
-
-
-void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
-{
-	struct yaffs_block_info *bi = yaffs_get_block_info(dev, block_no);
-	int erased_ok = 0;
-	u32 i;
-
-	/* If the block is still healthy erase it and mark as clean.
-	 * If the block has had a data failure, then retire it.
-	 */
-
-	yaffs_trace(YAFFS_TRACE_GC | YAFFS_TRACE_ERASE,
-		"yaffs_block_became_dirty block %d state %d %s",
-		block_no, bi->block_state,
-		(bi->needs_retiring) ? "needs retiring" : "");
-
-	yaffs2_clear_oldest_dirty_seq(dev, bi);
-
-	bi->block_state = YAFFS_BLOCK_STATE_DIRTY;
+	yaffs_deinit_blocks(dev);
+	return YAFFS_FAIL;
+}
 
-	/* If this is the block being garbage collected then stop gc'ing */
-	if (block_no == (int)dev->gc_block)
-		dev->gc_block = 0;
 
-	/* If this block is currently the best candidate for gc
-	 * then drop as a candidate */
-	if (block_no == (int)dev->gc_dirtiest) {
-		dev->gc_dirtiest = 0;
-		dev->gc_pages_in_use = 0;
-	}
+/*
+ * Erase a dirty block and make it available for allocation, or retire it if
+ * it has had a data failure or the erase fails.
+ */
+static void yaffs_erase_dirty_block(struct yaffs_dev *dev, int block_no)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, block_no);
+	int erased_ok = 0;
+	u32 i;
 
 	if (!bi->needs_retiring) {
 		yaffs2_checkpt_invalidate(dev);
@@ -2202,12 +2869,83 @@ void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
 	bi->skip_erased_check = 1;	/* Clean, so no need to check */
 	bi->gc_prioritise = 0;
 	bi->has_summary = 0;
+	yaffs_health_erased(dev, block_no);
 
 	yaffs_clear_chunk_bits(dev, block_no);
 
 	yaffs_trace(YAFFS_TRACE_ERASE, "Erased block %d", block_no);
 }
 
+/*
+ * Erase up to max_blocks of the blocks left dirty by
+ * yaffs_block_became_dirty(), or all of them if max_blocks is negative.
+ * Returns the number of blocks erased.
+ */
+int yaffs_erase_pending_blocks(struct yaffs_dev *dev, int max_blocks)
+{
+	u32 i;
+	int n = 0;
+	struct yaffs_block_info *bi;
+
+	for (i = dev->internal_start_block;
+	     i <= dev->internal_end_block && dev->n_pending_erases > 0 &&
+	     (max_blocks < 0 || n < max_blocks); i++) {
+		bi = yaffs_get_block_info(dev, i);
+		if (bi->block_state != YAFFS_BLOCK_STATE_DIRTY)
+			continue;
+
+		dev->n_pending_erases--;
+		yaffs_erase_dirty_block(dev, i);
+		n++;
+	}
+
+	return n;
+}
+
+void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
+{
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, block_no);
+
+	/* If the block is still healthy it is left dirty, to be erased
+	 * later by yaffs_erase_pending_blocks(), so that the erase time
+	 * is not added to the write that freed the block.
+	 * If the block has had a data failure, then retire it.
+	 *
+	 * A dirty block's chunks are already counted as free. Nothing is
+	 * written to flash until it is erased, so after a power loss the
+	 * scan finds its chunks obsolete and the block dirty again.
+	 */
+
+	yaffs_trace(YAFFS_TRACE_GC | YAFFS_TRACE_ERASE,
+		"yaffs_block_became_dirty block %d state %d %s",
+		block_no, bi->block_state,
+		(bi->needs_retiring) ? "needs retiring" : "");
+
+	yaffs2_clear_oldest_dirty_seq(dev, bi);
+
+	bi->block_state = YAFFS_BLOCK_STATE_DIRTY;
+
+	/* If this is the block being garbage collected then stop gc'ing */
+	if (block_no == (int)dev->gc_block)
+		dev->gc_block = 0;
+
+	/* If this block is currently the best candidate for gc
+	 * then drop as a candidate */
+	if (block_no == (int)dev->gc_dirtiest) {
+		dev->gc_dirtiest = 0;
+		dev->gc_pages_in_use = 0;
+	}
+
+	if (!bi->needs_retiring && !dev->param.disable_deferred_erase) {
+		yaffs2_checkpt_invalidate(dev);
+		dev->n_pending_erases++;
+		dev->n_deferred_erases++;
+		return;
+	}
+
+	yaffs_erase_dirty_block(dev, block_no);
+}
+
 static inline int yaffs_gc_process_chunk(struct yaffs_dev *dev,
 					struct yaffs_block_info *bi,
 					int old_chunk, u8 *buffer)
@@ -2218,10 +2956,27 @@ static inline int yaffs_gc_process_chunk(struct yaffs_dev *dev,
 	struct yaffs_obj *object;
 	int matching_chunk;
 	int ret_val = YAFFS_OK;
+	int copy_back = 0;
 
 	memset(&tags, 0, sizeof(tags));
-	yaffs_rd_chunk_tags_nand(dev, old_chunk,
-				 buffer, &tags);
+
+	/* If the device can copy a chunk internally, data chunks are moved
+	 * without bringing the data over. Headers get patched so they are
+	 * always read, as are chunks whose data is suspect.
+	 */
+	if (dev->tagger.copy_chunk_tags_fn) {
+		yaffs_rd_chunk_tags_nand(dev, old_chunk, NULL, &tags);
+		copy_back = tags.chunk_id != 0 &&
+			    tags.ecc_result != YAFFS_ECC_RESULT_UNFIXED;
+		if (!copy_back) {
+			memset(&tags, 0, sizeof(tags));
+			yaffs_rd_chunk_tags_nand(dev, old_chunk,
+						 buffer, &tags);
+		}
+	} else {
+		yaffs_rd_chunk_tags_nand(dev, old_chunk,
+					 buffer, &tags);
+	}
 	object = yaffs_find_by_number(dev, tags.obj_id);
 
 	yaffs_trace(YAFFS_TRACE_GC_DETAIL,
@@ -2327,6 +3082,10 @@ static inline int yaffs_gc_process_chunk(struct yaffs_dev *dev,
 			yaffs_verify_oh(object, oh, &tags, 1);
 			new_chunk =
 			    yaffs_write_new_chunk(dev, (u8 *) oh, &tags, 1);
+		} else if (copy_back) {
+			dev->n_gc_copy_backs++;
+			new_chunk =
+			    yaffs_copy_new_chunk(dev, old_chunk, &tags, 1);
 		} else {
 			new_chunk =
 			    yaffs_write_new_chunk(dev, buffer, &tags, 1);
@@ -2429,9 +3188,8 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 			struct yaffs_obj *object =
 			    yaffs_find_by_number(dev, dev->gc_cleanup_list[i]);
 			if (object) {
-				yaffs_free_tnode(dev,
-					  object->variant.file_variant.top);
-				object->variant.file_variant.top = NULL;
+				yaffs_free_file_map(dev,
+					  &object->variant.file_variant);
 				yaffs_trace(YAFFS_TRACE_GC,
 					"yaffs: About to finally delete object %d",
 					object->obj_id);
@@ -2654,8 +3412,18 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 
 		min_erased =
 		    dev->param.n_reserved_blocks + checkpt_block_adjust + 1;
+
+		/* Pending erases are cheaper than gc, so use them first. */
+		if (background)
+			yaffs_erase_pending_blocks(dev, -1);
+		else if (dev->n_erased_blocks < min_erased)
+			yaffs_erase_pending_blocks(dev,
+					min_erased - dev->n_erased_blocks);
+
+		/* Dirty blocks are free space that gc does not need to make */
 		erased_chunks =
-		    dev->n_erased_blocks * dev->param.chunks_per_block;
+		    (dev->n_erased_blocks + dev->n_pending_erases) *
+		    dev->param.chunks_per_block;
 
 		/* If we need a block soon then do aggressive gc. */
 		if (dev->n_erased_blocks < min_erased)
@@ -2736,6 +3504,29 @@ int yaffs_bg_gc(struct yaffs_dev *dev, unsigned urgency)
 
 /*-------------------- Data file manipulation -----------------*/
 
+/*
+ * Read n_bytes of a data chunk starting at offset, without going through
+ * the cache.
+ */
+static int yaffs_rd_data_obj_part(struct yaffs_obj *in, int inode_chunk,
+				  int offset, u8 *buffer, int n_bytes)
+{
+	int nand_chunk = yaffs_find_chunk_in_file(in, inode_chunk, NULL);
+
+	if (nand_chunk >= 0)
+		return yaffs_rd_chunk_part_nand(in->my_dev, nand_chunk,
+						offset, buffer, n_bytes, NULL);
+
+	/* get sane (zero) data if you read a hole */
+	memset(buffer, 0, n_bytes);
+	return 0;
+}
+
+/*
+ * Read a whole data chunk. Returns YAFFS_OK if buffer holds good data, a
+ * hole reading as zeros, or YAFFS_FAIL if the chunk could not be read or
+ * had an uncorrectable ECC error.
+ */
 static int yaffs_rd_data_obj(struct yaffs_obj *in, int inode_chunk, u8 * buffer)
 {
 	int nand_chunk = yaffs_find_chunk_in_file(in, inode_chunk, NULL);
@@ -2749,7 +3540,7 @@ static int yaffs_rd_data_obj(struct yaffs_obj *in, int inode_chunk, u8 * buffer)
 			nand_chunk);
 		/* get sane (zero) data if you read a hole */
 		memset(buffer, 0, in->my_dev->data_bytes_per_chunk);
-		return 0;
+		return YAFFS_OK;
 	}
 
 }
@@ -2813,8 +3604,9 @@ void yaffs_chunk_del(struct yaffs_dev *dev, int chunk_id, int mark_flash,
 	}
 }
 
-int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
-			const u8 *buffer, int n_bytes, int use_reserve)
+static int yaffs_wr_data_obj_no_gc(struct yaffs_obj *in, int inode_chunk,
+				   const u8 *buffer, int n_bytes,
+				   int use_reserve)
 {
 	/* Find old chunk Need to do this to get serial number
 	 * Write new one and patch into tree.
@@ -2828,8 +3620,6 @@ int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 	struct yaffs_dev *dev = in->my_dev;
 	Y_LOFF_T endpos;
 
-	yaffs_check_gc(dev, 0);
-
 	/* Get the previous chunk at this location in the file if it exists.
 	 * If it does not exist then put a zero into the tree. This creates
 	 * the tnode now, rather than later when it is harder to clean up.
@@ -2880,6 +3670,104 @@ int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 	return new_chunk_id;
 }
 
+int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
+			const u8 *buffer, int n_bytes, int use_reserve)
+{
+	yaffs_check_gc(in->my_dev, 0);
+
+	return yaffs_wr_data_obj_no_gc(in, inode_chunk, buffer, n_bytes,
+				       use_reserve);
+}
+
+/*
+ * End the write run of the cache entries run[0..n-1], which went to
+ * chunks[0..n-1]. A chunk whose program failed is dropped as any failed
+ * write is, and its entry written again from the cache. It stays dirty if
+ * that fails too. A failed chunk that is not one of the run's was either
+ * dealt with when the write was verified, or is a summary written on the
+ * way, which just gets its block a strike.
+ */
+static void yaffs_end_wr_run(struct yaffs_dev *dev, struct yaffs_cache **run,
+			     const int *chunks, int n)
+{
+	int failed[YAFFS_MAX_WR_RUN];
+	int n_failed;
+	int block;
+	int i;
+	int j;
+
+	n_failed = yaffs_wr_chunk_run_end_nand(dev, failed, YAFFS_MAX_WR_RUN);
+
+	for (i = 0; i < n_failed; i++) {
+		for (j = 0; j < n && chunks[j] != failed[i]; j++)
+			;
+
+		if (j < n) {
+			yaffs_handle_chunk_wr_error(dev, failed[i], 0);
+			run[j]->dirty = 1;
+			continue;
+		}
+
+		block = failed[i] / dev->param.chunks_per_block;
+		if (yaffs_check_chunk_bit(dev, block,
+				failed[i] % dev->param.chunks_per_block))
+			yaffs_handle_chunk_error(dev,
+				yaffs_get_block_info(dev, block));
+	}
+
+	for (j = 0; j < n; j++) {
+		if (run[j]->dirty &&
+		    yaffs_wr_data_obj(run[j]->object, run[j]->chunk_id,
+				      run[j]->data, run[j]->n_bytes, 1) > 0)
+			run[j]->dirty = 0;
+	}
+}
+
+/*
+ * Write back a batch of dirty cache chunks, which the cache has sorted by
+ * object and chunk. Gc is checked once for the batch and again only when
+ * it needs a fresh allocation block, so in between the chunks go to
+ * consecutive pages of the one block.
+ * If the driver has write runs the chunks go out in runs, so that it can
+ * overlap their programs, and the results are checked at the end of each
+ * run. A run ends before gc, which must not see chunks whose program may
+ * yet fail.
+ */
+void yaffs_wr_cache_batch(struct yaffs_dev *dev, struct yaffs_cache **batch,
+			  int n)
+{
+	struct yaffs_cache *cache;
+	int chunks[YAFFS_MAX_WR_RUN];
+	int chunk;
+	int first = 0;
+	int in_run = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		cache = batch[i];
+		if (in_run && (i - first == YAFFS_MAX_WR_RUN ||
+			       dev->alloc_block < 0)) {
+			yaffs_end_wr_run(dev, &batch[first], chunks, i - first);
+			in_run = 0;
+		}
+		if (i == 0 || dev->alloc_block < 0)
+			yaffs_check_gc(dev, 0);
+		if (!in_run && yaffs_wr_chunk_run_nand(dev) == YAFFS_OK) {
+			in_run = 1;
+			first = i;
+		}
+
+		chunk = yaffs_wr_data_obj_no_gc(cache->object, cache->chunk_id,
+						cache->data, cache->n_bytes, 1);
+		if (in_run)
+			chunks[i - first] = chunk;
+		cache->dirty = 0;
+	}
+
+	if (in_run)
+		yaffs_end_wr_run(dev, &batch[first], chunks, n - first);
+}
+
 
 
 static int yaffs_do_xattrib_mod(struct yaffs_obj *obj, int set,
@@ -3006,7 +3894,6 @@ static void yaffs_check_obj_details_loaded(struct yaffs_obj *in)
 	u8 *buf;
 	struct yaffs_obj_hdr *oh;
 	struct yaffs_dev *dev;
-	struct yaffs_ext_tags tags;
 	int result;
 
 	if (!in || !in->lazy_loaded || in->hdr_chunk < 1)
@@ -3015,7 +3902,9 @@ static void yaffs_check_obj_details_loaded(struct yaffs_obj *in)
 	dev = in->my_dev;
 	buf = yaffs_get_temp_buffer(dev);
 
-	result = yaffs_rd_chunk_tags_nand(dev, in->hdr_chunk, buf, &tags);
+	/* Only the header is needed, not the xattribs after it. */
+	result = yaffs_rd_chunk_part_nand(dev, in->hdr_chunk, 0, buf,
+					  sizeof(struct yaffs_obj_hdr), NULL);
 
 	if (result == YAFFS_FAIL)
 		return;
@@ -3215,6 +4104,67 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR *name, int force,
  * Curve-balls: the first chunk might also be the last chunk.
  */
 
+/*
+ * yaffs_start_rd_run() works out how many of the next n_chunks file chunks
+ * are stored in consecutive NAND chunks and hands that run to the driver so
+ * it can overlap the array reads with the data transfers.
+ * Returns the length of the run, which is at least 1.
+ */
+static int yaffs_start_rd_run(struct yaffs_obj *in, int inode_chunk,
+			      int n_chunks)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	int first;
+	int n;
+
+	if (n_chunks > YAFFS_MAX_RD_RUN)
+		n_chunks = YAFFS_MAX_RD_RUN;
+
+	/* With chunk groups the lookups would read tags and break the run. */
+	if (n_chunks < 2 || !dev->drv.drv_read_run_fn ||
+	    dev->chunk_grp_size > 1)
+		return 1;
+
+	first = yaffs_find_chunk_in_file(in, inode_chunk, NULL);
+	if (first < 1)
+		return 1;
+
+	for (n = 1; n < n_chunks; n++) {
+		if (yaffs_find_chunk_in_file(in, inode_chunk + n, NULL) !=
+		    first + n)
+			break;
+	}
+
+	yaffs_rd_chunk_run_nand(dev, first, n, 1);
+
+	return n;
+}
+
+/*
+ * Should a short read of a chunk that is not in the cache bypass it and
+ * read just the bytes wanted?
+ * Only the first short read of a chunk does, if the same chunk is read
+ * again then it is loaded into the cache as usual.
+ */
+static int yaffs_rd_short_direct(struct yaffs_obj *in, int chunk)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_cache_manager *mgr = &dev->cache_mgr;
+
+	if (!dev->tagger.read_chunk_part_fn ||
+	    dev->param.disable_partial_read ||
+	    dev->param.inband_tags)
+		return 0;
+
+	if (mgr->part_rd_obj_id == (int)in->obj_id &&
+	    mgr->part_rd_chunk == chunk && dev->param.n_caches > 0)
+		return 0;
+
+	mgr->part_rd_obj_id = in->obj_id;
+	mgr->part_rd_chunk = chunk;
+	return 1;
+}
+
 int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, Y_LOFF_T offset, int n_bytes)
 {
 	int chunk;
@@ -3222,6 +4172,7 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, Y_LOFF_T offset, int n_byte
 	int n_copy;
 	int n = n_bytes;
 	int n_done = 0;
+	int run_left = 0;
 	struct yaffs_cache *cache;
 	struct yaffs_dev *dev;
 
@@ -3243,48 +4194,75 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, Y_LOFF_T offset, int n_byte
 
 		/* If the chunk is already in the cache or it is less than
 		 * a whole chunk or we're using inband tags then use the cache
-		 * (if there is caching) else bypass the cache.
+		 * (if there is caching) else bypass the cache, keeping a copy
+		 * in it if page caching is on.
 		 */
 		if (cache || n_copy != (int)dev->data_bytes_per_chunk ||
 		    dev->param.inband_tags) {
-			if (dev->param.n_caches > 0) {
+			run_left = 0;
+			if (!cache && yaffs_rd_short_direct(in, chunk)) {
+				/* A short read of a chunk we are not
+				 * otherwise using. Just fetch the bytes
+				 * wanted.
+				 */
+				yaffs_rd_data_obj_part(in, chunk, start,
+						       buffer, n_copy);
+			} else {
 
 				/* If we can't find the data in the cache,
-				 * then load it up. */
+				 * then load it up. Readers sharing the
+				 * device may have every entry pinned, then
+				 * go without.
+				 */
 
-				if (!cache) {
+				if (!cache && dev->param.n_caches > 0) {
 					cache =
 					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_rd_data_obj(in, chunk,
-							  cache->data);
-					cache->n_bytes = 0;
+					if (cache) {
+						yaffs_cache_attach(cache, in,
+								   chunk);
+						yaffs_rd_data_obj(in, chunk,
+								  cache->data);
+						cache->n_bytes = 0;
+					}
 				}
 
-				yaffs_use_cache(dev, cache, 0);
-
-				cache->locked = 1;
+				if (cache) {
+					yaffs_use_cache(dev, cache, 0);
 
-				memcpy(buffer, &cache->data[start], n_copy);
+					cache->locked++;
 
-				cache->locked = 0;
-			} else {
-				/* Read into the local buffer then copy.. */
+					memcpy(buffer, &cache->data[start],
+					       n_copy);
 
-				u8 *local_buffer =
-				    yaffs_get_temp_buffer(dev);
-				yaffs_rd_data_obj(in, chunk, local_buffer);
+					cache->locked--;
+				} else {
+					/* Read into the local buffer then
+					 * copy..
+					 */
+					u8 *local_buffer =
+					    yaffs_get_temp_buffer(dev);
+					yaffs_rd_data_obj(in, chunk,
+							  local_buffer);
 
-				memcpy(buffer, &local_buffer[start], n_copy);
+					memcpy(buffer, &local_buffer[start],
+					       n_copy);
 
-				yaffs_release_temp_buffer(dev, local_buffer);
+					yaffs_release_temp_buffer(dev,
+								  local_buffer);
+				}
 			}
 		} else {
-			/* A full chunk. Read directly into the buffer. */
-			yaffs_rd_data_obj(in, chunk, buffer);
+			/* A full chunk. Read directly into the buffer.
+			 * If more full chunks follow, start a read run.
+			 */
+			if (run_left < 1)
+				run_left = yaffs_start_rd_run(in, chunk,
+					n / dev->data_bytes_per_chunk);
+			run_left--;
+			/* Only keep good data, a bad read must be retried. */
+			if (yaffs_rd_data_obj(in, chunk, buffer) == YAFFS_OK)
+				yaffs_cache_keep_page(in, chunk, buffer);
 		}
 		n -= n_copy;
 		offset += n_copy;
@@ -3294,6 +4272,114 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, Y_LOFF_T offset, int n_byte
 	return n_done;
 }
 
+/*
+ * For readers that share the device, see yaffsfs.c: if the chunk holding
+ * offset is cached, count the hit, pin the entry so that nothing pushes
+ * it out while the caller copies from it without the device's state
+ * lock, and return it with the offset of the data in it in *start.
+ * *n_bytes is cut down to the end of the chunk.
+ * Otherwise return NULL with *n_bytes cut down to the chunks up to the
+ * next cached one, for yaffs_file_rd().
+ */
+struct yaffs_cache *yaffs_file_rd_pin(struct yaffs_obj *in, Y_LOFF_T offset,
+				      int *n_bytes, u32 *start)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_cache *cache;
+	int chunk;
+	int n;
+
+	yaffs_addr_to_chunk(dev, offset, &chunk, start);
+	chunk++;
+	n = dev->data_bytes_per_chunk - *start;
+
+	if (yaffs_peek_chunk_cache(in, chunk)) {
+		cache = yaffs_find_chunk_cache(in, chunk);
+		yaffs_use_cache(dev, cache, 0);
+		cache->locked++;
+		if (*n_bytes > n)
+			*n_bytes = n;
+		return cache;
+	}
+
+	while (n < *n_bytes && !yaffs_peek_chunk_cache(in, ++chunk))
+		n += dev->data_bytes_per_chunk;
+	if (*n_bytes > n)
+		*n_bytes = n;
+	return NULL;
+}
+
+void yaffs_file_rd_unpin(struct yaffs_cache *cache)
+{
+	cache->locked--;
+}
+
+/*
+ * Read ahead for a sequential reader: load the n_chunks file chunks from
+ * inode_chunk on into the cache, as read runs so that the driver overlaps
+ * their array reads, and mark those already cached as recently used so
+ * that the loading does not push them out.
+ * Only spare cache entries are used, the read ahead stops rather than
+ * write back a dirty one. Stops at the end of the file.
+ * Returns the number of chunks loaded.
+ */
+int yaffs_file_rd_ahead(struct yaffs_obj *in, int inode_chunk, int n_chunks)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_cache *cache;
+	Y_LOFF_T file_size;
+	int last_chunk;
+	u32 start;
+	int run;
+	int n_done = 0;
+
+	if (dev->param.n_caches < 1 || in->variant_type != YAFFS_OBJECT_TYPE_FILE)
+		return 0;
+
+	file_size = in->variant.file_variant.file_size;
+	if (file_size < 1)
+		return 0;
+
+	yaffs_addr_to_chunk(dev, file_size - 1, &last_chunk, &start);
+	last_chunk++;
+	if (inode_chunk + n_chunks - 1 > last_chunk)
+		n_chunks = last_chunk - inode_chunk + 1;
+
+	while (n_chunks > 0) {
+		cache = yaffs_peek_chunk_cache(in, inode_chunk);
+		if (cache) {
+			yaffs_use_cache(dev, cache, 0);
+			inode_chunk++;
+			n_chunks--;
+			continue;
+		}
+
+		for (run = 1; run < n_chunks; run++) {
+			if (yaffs_peek_chunk_cache(in, inode_chunk + run))
+				break;
+		}
+		run = yaffs_start_rd_run(in, inode_chunk, run);
+
+		while (run-- > 0) {
+			cache = yaffs_grab_spare_chunk_cache(dev);
+			if (!cache)
+				return n_done;
+			yaffs_cache_attach(cache, in, inode_chunk);
+			if (yaffs_rd_data_obj(in, inode_chunk, cache->data) !=
+			    YAFFS_OK) {
+				/* Leave a bad chunk for the reader to retry */
+				yaffs_invalidate_chunk_cache(in, inode_chunk);
+				return n_done;
+			}
+			cache->n_bytes = 0;
+			inode_chunk++;
+			n_chunks--;
+			n_done++;
+		}
+	}
+	return n_done;
+}
+
 int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, Y_LOFF_T offset,
 		     int n_bytes, int write_through)
 {
@@ -3381,10 +4467,7 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, Y_LOFF_T offset,
 				if (!cache &&
 				    yaffs_check_alloc_available(dev, 1)) {
 					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_cache_attach(cache, in, chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
 				} else if (cache &&
@@ -3400,12 +4483,12 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, Y_LOFF_T offset,
 
 				if (cache) {
 					yaffs_use_cache(dev, cache, 1);
-					cache->locked = 1;
+					cache->locked++;
 
 					memcpy(&cache->data[start], buffer,
 					       n_copy);
 
-					cache->locked = 0;
+					cache->locked--;
 					cache->n_bytes = n_writeback;
 
 					if (write_through) {
@@ -3446,8 +4529,10 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, Y_LOFF_T offset,
 					      dev->data_bytes_per_chunk, 0);
 
 			/* Since we've overwritten the cached data,
-			 * we better invalidate it. */
-			yaffs_invalidate_chunk_cache(in, chunk);
+			 * we better update or invalidate it. */
+			if (chunk_written < 0 ||
+			    !yaffs_cache_keep_page(in, chunk, buffer))
+				yaffs_invalidate_chunk_cache(in, chunk);
 		}
 
 		if (chunk_written >= 0) {
@@ -3554,7 +4639,17 @@ void yaffs_resize_file_down(struct yaffs_obj *obj, Y_LOFF_T new_size)
 	obj->variant.file_variant.file_size = new_size;
 	obj->variant.file_variant.stored_size = new_size;
 
-	yaffs_prune_tree(dev, &obj->variant.file_variant);
+	if (new_size == 0 && obj->n_data_chunks == 0 &&
+	    obj->variant.file_variant.n_extents < 0) {
+		/* Nothing left in the tree, go back to extents */
+		yaffs_free_tree(dev, obj->variant.file_variant.top,
+				obj->variant.file_variant.top_level);
+		obj->variant.file_variant.top = NULL;
+		obj->variant.file_variant.top_level = 0;
+		obj->variant.file_variant.n_extents = 0;
+	} else {
+		yaffs_prune_tree(dev, &obj->variant.file_variant);
+	}
 }
 
 int yaffs_resize_file(struct yaffs_obj *in, Y_LOFF_T new_size)
@@ -3676,8 +4771,7 @@ static int yaffs_del_file(struct yaffs_obj *in)
 		return deleted ? YAFFS_OK : YAFFS_FAIL;
 	} else {
 		/* The file has no data chunks so we toss it immediately */
-		yaffs_free_tnode(in->my_dev, in->variant.file_variant.top);
-		in->variant.file_variant.top = NULL;
+		yaffs_free_file_map(in->my_dev, &in->variant.file_variant);
 		yaffs_generic_obj_del(in);
 
 		return YAFFS_OK;
@@ -3772,12 +4866,12 @@ struct yaffs_obj *yaffs_retype_obj(struct yaffs_obj *obj,
 	case YAFFS_OBJECT_TYPE_FILE:
 		/* Nuke file data */
 		yaffs_resize_file(obj, 0);
-		yaffs_free_tnode(obj->my_dev, obj->variant.file_variant.top);
-		obj->variant.file_variant.top = NULL;
+		yaffs_free_file_map(obj->my_dev, &obj->variant.file_variant);
 		break;
 	case YAFFS_OBJECT_TYPE_DIRECTORY:
 		/* Put the children in lost and found. */
 		yaffs_empty_dir_to_dir(obj, obj->my_dev->lost_n_found);
+		yaffs_dir_index_free(obj);
 		if (!list_empty(&obj->variant.dir_variant.dirty))
 			list_del_init(&obj->variant.dir_variant.dirty);
 		break;
@@ -4182,13 +5276,49 @@ static void yaffs_empty_l_n_f(struct yaffs_dev *dev)
 }
 
 
+/* Build the name index of a directory that has grown big enough. Lazy
+ * loaded children are loaded first, as the list walk would.
+ */
+static void yaffs_dir_index_build(struct yaffs_obj *directory)
+{
+	struct yaffs_dev *dev = directory->my_dev;
+	struct yaffs_dir_var *dv = &directory->variant.dir_variant;
+	struct list_head *i;
+	u32 n_slots = YAFFS_DIR_INDEX_MIN_SLOTS;
+	u32 n = 0;
+
+	if (!dev->param.dir_index_min || dv->index ||
+	    directory == dev->unlinked_dir || directory == dev->del_dir)
+		return;
+
+	list_for_each(i, &dv->children)
+		n++;
+	if (n < dev->param.dir_index_min)
+		return;
+
+	list_for_each(i, &dv->children)
+		yaffs_check_obj_details_loaded(list_entry(i, struct yaffs_obj,
+							  siblings));
+
+	while (n_slots < n * 4)
+		n_slots <<= 1;
+	if (!yaffs_dir_index_resize(directory, n_slots))
+		return;
+
+	list_for_each(i, &dv->children)
+		yaffs_dir_index_add(directory,
+				list_entry(i, struct yaffs_obj, siblings));
+}
+
 struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 				     const YCHAR *name)
 {
-	int sum;
+	u32 sum;
 	struct list_head *i;
 	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
 	struct yaffs_obj *l;
+	struct yaffs_dir_var *dv;
+	u32 j;
 
 	if (!name)
 		return NULL;
@@ -4209,6 +5339,31 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 
 	sum = yaffs_calc_name_sum(name);
 
+	dv = &directory->variant.dir_variant;
+	yaffs_dir_index_build(directory);
+
+	if (dv->index) {
+		l = directory->my_dev->lost_n_found;
+		if (l && l->parent == directory && !list_empty(&l->siblings) &&
+		    !yaffs_strcmp(name, YAFFS_LOSTNFOUND_NAME))
+			return l;
+
+		for (j = sum & dv->index_mask; dv->index[j];
+		     j = (j + 1) & dv->index_mask) {
+			l = dv->index[j];
+			if (l->sum != sum)
+				continue;
+			yaffs_get_obj_name(l, buffer,
+				YAFFS_MAX_NAME_LENGTH + 1);
+			if (!yaffs_strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH))
+				return l;
+		}
+
+		/* Only the children without a sum can still match */
+		if (!dv->n_unindexed)
+			return NULL;
+	}
+
 	list_for_each(i, &directory->variant.dir_variant.children) {
 		l = list_entry(i, struct yaffs_obj, siblings);
 
@@ -4589,6 +5744,7 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	int init_failed = 0;
 	u32 x;
 	u32 bits;
+	u32 i;
 
 	if(yaffs_guts_ll_init(dev) != YAFFS_OK)
 		return YAFFS_FAIL;
@@ -4683,6 +5839,7 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->n_tags_ecc_unfixed = 0;
 	dev->n_erase_failures = 0;
 	dev->n_erased_blocks = 0;
+	dev->n_pending_erases = 0;
 	dev->gc_disable = 0;
 	dev->has_pending_prioritised_gc = 1; /* Assume the worst for now,
 					      * will get fixed on first GC */
@@ -4705,8 +5862,8 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 
 	if (!init_failed) {
 		dev->gc_cleanup_list =
-		    kmalloc(dev->param.chunks_per_block * sizeof(u32),
-					GFP_NOFS);
+		    kmalloc_class(dev->param.chunks_per_block * sizeof(u32),
+					YAFFS_MEM_MOUNT);
 		if (!dev->gc_cleanup_list)
 			init_failed = 1;
 	}
@@ -4727,6 +5884,9 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		!yaffs_summary_init(dev))
 		init_failed = 1;
 
+	if (!init_failed && !yaffs_health_init(dev))
+		init_failed = 1;
+
 	if (!init_failed) {
 		/* Now scan the flash. */
 		if (dev->param.is_yaffs2) {
@@ -4781,14 +5941,29 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		return YAFFS_FAIL;
 	}
 
+	/* Dirty blocks found by the scan or restored from the checkpoint
+	 * are still waiting to be erased.
+	 */
+	dev->n_pending_erases = 0;
+	for (i = dev->internal_start_block; i <= dev->internal_end_block; i++)
+		if (yaffs_get_block_info(dev, i)->block_state ==
+		    YAFFS_BLOCK_STATE_DIRTY)
+			dev->n_pending_erases++;
+
 	/* Zero out stats */
 	dev->n_page_reads = 0;
+	dev->n_partial_reads = 0;
 	dev->n_page_writes = 0;
 	dev->n_erasures = 0;
 	dev->n_gc_copies = 0;
+	dev->n_gc_copy_backs = 0;
+	dev->n_deferred_erases = 0;
+	dev->n_forced_erases = 0;
 	dev->n_retried_writes = 0;
 
 	dev->n_retired_blocks = 0;
+	memset(dev->n_health_flips, 0, sizeof(dev->n_health_flips));
+	dev->n_health_refreshes = 0;
 
 	yaffs_verify_free_chunks(dev);
 	yaffs_verify_blocks(dev);
@@ -4810,6 +5985,7 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 		yaffs_deinit_blocks(dev);
 		yaffs_deinit_tnodes_and_objs(dev);
 		yaffs_summary_deinit(dev);
+		yaffs_health_deinit(dev);
 		yaffs_cache_deinit(dev);
 
 		kfree(dev->gc_cleanup_list);
@@ -4847,6 +6023,10 @@ int yaffs_count_free_chunks(struct yaffs_dev *dev)
 			    (dev->param.chunks_per_block - blk->pages_in_use +
 			     blk->soft_del_pages);
 			break;
+		case YAFFS_BLOCK_STATE_DIRTY:
+			/* Waiting to be erased */
+			n_free += dev->param.chunks_per_block;
+			break;
 		default:
 			break;
 		}
@@ -102,7 +102,7 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA	0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	4096
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -129,18 +129,69 @@
 struct yaffs_cache {
 	struct yaffs_obj *object;
 	int chunk_id;
-	int last_use;
 	int dirty;
 	int n_bytes;		/* Only valid if the cache is dirty */
-	int locked;		/* Can't push out or flush while locked. */
+	int locked;		/* Pins: can't push out or flush while locked. */
+	int page;		/* A clean copy of a whole chunk read or write */
+	int queue;		/* The replacement queue it is on */
 	u8 *data;
+	struct list_head hash_link;	/* Entries in the same hash bucket */
+	struct list_head obj_link;	/* Entries of the same object */
+	struct list_head queue_link;	/* On a replacement queue, or free */
 };
 
+/* A chunk recently pushed out of the cache, remembered by the ARC policy. */
+struct yaffs_cache_ghost {
+	u32 obj_id;
+	int chunk_id;
+	int queue;		/* The queue it was pushed out of, -1 if unused */
+	struct list_head hash_link;
+};
+
+/* Short op cache replacement policies, see yaffs_cache.c. */
+enum yaffs_cache_policy_id {
+	YAFFS_CACHE_POLICY_LRU,
+	YAFFS_CACHE_POLICY_ARC,
+	YAFFS_CACHE_N_POLICIES
+};
+
+#define YAFFS_CACHE_N_QUEUES	2
+
+struct yaffs_cache_stats {
+	u32 hits;
+	u32 misses;
+	u32 evictions;
+	u32 dirty_evictions;	/* Evictions that had to write back */
+	u32 promotions;		/* Reloads the policy took as re-references */
+	u32 page_fills;		/* Whole chunk reads and writes kept */
+};
+
+struct yaffs_cache_policy;
+
 struct yaffs_cache_manager {
 	struct yaffs_cache *cache;
 	int n_caches;
-	int cache_last_use;
+	struct list_head *hash;	/* Entries in use by (object, chunk) */
+	u32 hash_mask;		/* Number of hash buckets - 1 */
+	const struct yaffs_cache_policy *policy;
+	/* Entries in use, oldest first on each queue */
+	struct list_head queue[YAFFS_CACHE_N_QUEUES];
+	int queue_len[YAFFS_CACHE_N_QUEUES];
+	struct list_head free;	/* Entries not in use */
+	int n_pages;		/* Entries with page set */
+	struct yaffs_cache **wb; /* Dirty entries gathered for write back */
+	int target;		/* Entries the policy aims to keep on queue 0 */
+	struct yaffs_cache_ghost *ghost; /* Ring of ghosts, for ARC */
+	struct list_head *ghost_hash;
+	u32 ghost_mask;
+	int n_ghosts;
+	int ghost_next;
+	int ghost_len[YAFFS_CACHE_N_QUEUES]; /* Ghosts from each queue */
+	struct yaffs_cache_stats stats;
 	int n_temp_buffers;
+	/* Last chunk read without going through the cache */
+	int part_rd_obj_id;
+	int part_rd_chunk;
 };
 
 /* yaffs1 tags structures in RAM
@@ -395,17 +446,62 @@ struct yaffs_tnode {
  * change when the data is actually stored.
  *
  */
+/* A file that has not fragmented is mapped by runs of consecutive chunks in
+ * the file that are in consecutive NAND chunks (stepping over the block
+ * summaries), kept instead of a tree in a chain of tnode sized blocks, each
+ * with the next one in its last word. Once a write needs more runs than the
+ * chain may have (YAFFS_EXTENT_TNODES blocks, and never more blocks than a
+ * tree would need at level 0), the file moves over to a tnode tree for
+ * good, or until it is truncated to nothing.
+ *
+ * 2 extents fit a 32 byte tnode, so a chain of 8 takes a file through 15
+ * interruptions: writes to other files in between, or gc moving parts of
+ * it.
+ */
+struct yaffs_extent {
+	u32 chunk;		/* First chunk_id in the file */
+	u32 nand;		/* NAND chunk it is in */
+	u32 len;		/* Number of chunks */
+};
+
+#define YAFFS_EXTENT_TNODES	8
+
+#define YAFFS_TNODE_EXTENTS(dev) \
+	((int)(((dev)->tnode_size - sizeof(struct yaffs_tnode *)) / \
+	       sizeof(struct yaffs_extent)))
+#define YAFFS_FILE_EXTENTS(dev) \
+	(YAFFS_TNODE_EXTENTS(dev) * YAFFS_EXTENT_TNODES)
+
 struct yaffs_file_var {
 	Y_LOFF_T file_size;
 	Y_LOFF_T stored_size;
 	Y_LOFF_T shrink_size;
 	int top_level;
 	struct yaffs_tnode *top;
+	/* The level 0 tnode last looked up, for chunk_ids from cursor_base
+	 * on. Valid while dev->tnode_gen is still cursor_gen.
+	 */
+	struct yaffs_tnode *cursor;
+	u32 cursor_base;
+	u32 cursor_gen;
+	/* Extents in the chain at top (which is NULL until there are
+	 * any), or -1 once top is a tnode tree.
+	 */
+	int n_extents;
 };
 
+/* A directory with dir_index_min or more children gets a hash table of
+ * them, keyed on the name sums, the first time a name is looked up in it.
+ * Children without a name sum yet are counted in n_unindexed instead, and
+ * while there are any, lookups that miss the table still walk the list.
+ */
 struct yaffs_dir_var {
 	struct list_head children;	/* list of child links */
 	struct list_head dirty;	/* Entry for list of dirty directories */
+	struct yaffs_obj **index;	/* Open addressed, NULL if none */
+	u32 index_mask;		/* Slots - 1 */
+	u32 n_indexed;
+	u32 n_unindexed;
 };
 
 struct yaffs_symlink_var {
@@ -455,9 +551,11 @@ struct yaffs_obj {
 				 * or not. */
 	u8 has_xattr:1;		/* This object has xattribs.
 				 * Only valid if xattr_known. */
+	u8 in_dir_index:1;	/* In its parent's directory index */
 
 	u8 serial;		/* serial number of chunk in NAND.*/
-	u16 sum;		/* sum of the name to speed searching */
+	u32 sum;		/* hash of the name to speed searching,
+				 * 0 until the name is known */
 
 	struct yaffs_dev *my_dev;	/* The device I'm on */
 
@@ -465,6 +563,8 @@ struct yaffs_obj {
 
 	struct list_head hard_links;	/* hard linked object chain*/
 
+	struct list_head cache_list;	/* short op cache entries of a file */
+
 	/* directory structure stuff */
 	/* also used for linking up the free list */
 	struct yaffs_obj *parent;
@@ -546,6 +646,19 @@ struct yaffs_param {
 	int cache_bypass_aligned; /* If non-zero then bypass the cache for
 				   * aligned writes.
 				   */
+	u32 cache_policy;	/* enum yaffs_cache_policy_id */
+	u32 read_ahead_chunks;	/* Most chunks a sequential reader may have
+				 * read ahead into the cache, 0 for none.
+				 * Capped at half the short op caches.
+				 */
+	u32 page_cache_chunks;	/* Most short op caches that may hold
+				 * copies of whole chunks read or written
+				 * past the cache, 0 for none.
+				 */
+	u32 dir_index_min;	/* Children a directory needs before name
+				 * lookups in it build a hash index of
+				 * them, 0 for no indexes.
+				 */
 
 	int use_nand_ecc;	/* Flag to decide whether or not to use
 				 * NAND driver ECC on data (yaffs1) */
@@ -558,6 +671,8 @@ struct yaffs_param {
 	int empty_lost_n_found;	/* Auto-empty lost+found directory on mount */
 
 	int refresh_period;	/* How often to check for a block refresh */
+	int health_refresh_threshold;	/* Read health score at which a block
+					 * is refreshed, 0 for the default */
 
 	/* Checkpoint control. Can be set before or after initialisation */
 	u8 skip_checkpt_rd;
@@ -604,6 +719,8 @@ struct yaffs_param {
 
 	int disable_summary;
 	int disable_bad_block_marking;
+	int disable_partial_read;	/* Always read whole chunks */
+	int disable_deferred_erase;	/* Erase blocks as soon as they are dirty */
 
 };
 
@@ -616,10 +733,42 @@ struct yaffs_driver {
 				   u8 *oob, int oob_len,
 				   enum yaffs_ecc_result *ecc_result);
 	int (*drv_erase_fn) (struct yaffs_dev *dev, int block_no);
+	/* Optional: Read data_len bytes of data starting at offset in the
+	 * chunk, plus the oob if oob is not NULL.
+	 */
+	int (*drv_read_partial_fn) (struct yaffs_dev *dev, int nand_chunk,
+				    int offset, u8 *data, int data_len,
+				    u8 *oob, int oob_len,
+				    enum yaffs_ecc_result *ecc_result);
+	/* Optional: Hint that the next n_chunks reads will be of nand_chunk,
+	 * nand_chunk + stride, ... so the driver can pipeline them.
+	 */
+	int (*drv_read_run_fn) (struct yaffs_dev *dev, int nand_chunk,
+				int n_chunks, int stride);
+	/* Optional: Start a write run. Until drv_write_run_end_fn a chunk
+	 * write may return once its program has started, so that programs
+	 * overlap. A write whose failure the driver could not report later
+	 * must still wait and fail by itself.
+	 */
+	int (*drv_write_run_fn) (struct yaffs_dev *dev);
+	/* Wait for the programs of the write run. Returns how many failed and
+	 * puts up to max of those chunks in failed.
+	 */
+	int (*drv_write_run_end_fn) (struct yaffs_dev *dev, int *failed,
+				     int max);
 	int (*drv_mark_bad_fn) (struct yaffs_dev *dev, int block_no);
 	int (*drv_check_bad_fn) (struct yaffs_dev *dev, int block_no);
 	int (*drv_initialise_fn) (struct yaffs_dev *dev);
 	int (*drv_deinitialise_fn) (struct yaffs_dev *dev);
+	/* Optional: Called at the end of a sync so the driver can put the
+	 * device into a safe state.
+	 */
+	int (*drv_sync_fn) (struct yaffs_dev *dev);
+	/* Optional: Copy the data of src_chunk to dst_chunk inside the device,
+	 * writing the new oob with it.
+	 */
+	int (*drv_copy_chunk_fn) (struct yaffs_dev *dev, int src_chunk,
+				  int dst_chunk, const u8 *oob, int oob_len);
 };
 
 struct yaffs_tags_handler {
@@ -634,6 +783,16 @@ struct yaffs_tags_handler {
 			       enum yaffs_block_state *state,
 			       u32 *seq_number);
 	int (*mark_bad_fn) (struct yaffs_dev *dev, int block_no);
+	/* Optional: Read part of the data, and the tags if tags is not NULL. */
+	int (*read_chunk_part_fn) (struct yaffs_dev *dev,
+				   int nand_chunk, int offset,
+				   u8 *data, int n_bytes,
+				   struct yaffs_ext_tags *tags,
+				   enum yaffs_ecc_result *ecc_result);
+	/* Optional: Copy the data of src_chunk to dst_chunk with new tags. */
+	int (*copy_chunk_tags_fn) (struct yaffs_dev *dev,
+				   int src_chunk, int dst_chunk,
+				   const struct yaffs_ext_tags *tags);
 };
 
 struct yaffs_dev {
@@ -709,6 +868,7 @@ struct yaffs_dev {
 				 */
 
 	int n_erased_blocks;
+	int n_pending_erases;	/* Dirty blocks waiting to be erased */
 	int alloc_block;	/* Current block being allocated off */
 	u32 alloc_page;
 	int alloc_block_finder;	/* Used to search for next allocation block */
@@ -717,6 +877,7 @@ struct yaffs_dev {
 	void *allocator;
 	int n_obj;
 	int n_tnodes;
+	u32 tnode_gen;		/* Bumped each time a tnode is freed */
 
 	int n_hardlinks;
 
@@ -778,6 +939,11 @@ struct yaffs_dev {
 	int refresh_skip;	/* A skip down counter.
 				 * Refresh happens when this gets to zero. */
 
+	/* Read health, see yaffs_health.c */
+	u8 *block_health;
+	u32 health_reads;
+	u32 health_idle_refreshes;
+
 	/* Dirty directory handling */
 	struct list_head dirty_dirs;	/* List of dirty directories */
 
@@ -788,11 +954,15 @@ struct yaffs_dev {
 	/* Statistics */
 	u32 n_page_writes;
 	u32 n_page_reads;
+	u32 n_partial_reads;
 	u32 n_erasures;
 	u32 n_bad_queries;
 	u32 n_bad_markings;
 	u32 n_erase_failures;
+	u32 n_deferred_erases;
+	u32 n_forced_erases;	/* Pending erases done to feed the allocator */
 	u32 n_gc_copies;
+	u32 n_gc_copy_backs;
 	u32 all_gcs;
 	u32 passive_gc_count;
 	u32 oldest_dirty_gc_count;
@@ -807,6 +977,8 @@ struct yaffs_dev {
 	u32 n_deletions;
 	u32 n_unmarked_deletions;
 	u32 refresh_count;
+	u32 n_health_flips[4];	/* Reads at each yaffs_health_level */
+	u32 n_health_refreshes;
 	u32 cache_hits;
 	u32 tags_used;
 	u32 summary_used;
@@ -817,7 +989,7 @@ struct yaffs_dev {
  * Checkpointing definitions.
  */
 
-#define YAFFS_CHECKPOINT_VERSION	8
+#define YAFFS_CHECKPOINT_VERSION	9
 
 /* yaffs_checkpt_obj holds the definition of an object as dumped
  * by checkpointing.
@@ -915,6 +1087,10 @@ int yaffs_get_obj_link_count(struct yaffs_obj *obj);
 /* File operations */
 int yaffs_file_rd(struct yaffs_obj *obj, u8 * buffer, Y_LOFF_T offset,
 		  int n_bytes);
+int yaffs_file_rd_ahead(struct yaffs_obj *in, int inode_chunk, int n_chunks);
+struct yaffs_cache *yaffs_file_rd_pin(struct yaffs_obj *in, Y_LOFF_T offset,
+				      int *n_bytes, u32 *start);
+void yaffs_file_rd_unpin(struct yaffs_cache *cache);
 int yaffs_wr_file(struct yaffs_obj *obj, const u8 * buffer, Y_LOFF_T offset,
 		  int n_bytes, int write_trhrough);
 int yaffs_resize_file(struct yaffs_obj *obj, Y_LOFF_T new_size);
@@ -1004,6 +1180,7 @@ void yaffs_add_obj_to_dir(struct yaffs_obj *directory, struct yaffs_obj *obj);
 YCHAR *yaffs_clone_str(const YCHAR *str);
 void yaffs_link_fixup(struct yaffs_dev *dev, struct list_head *hard_list);
 void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no);
+int yaffs_erase_pending_blocks(struct yaffs_dev *dev, int max_blocks);
 int yaffs_update_oh(struct yaffs_obj *in, const YCHAR *name,
 		    int force, int is_shrink, int shadows,
 		    struct yaffs_xattr_mod *xop);
@@ -1029,6 +1206,14 @@ struct yaffs_tnode *yaffs_find_tnode_0(struct yaffs_dev *dev,
 
 u32 yaffs_get_group_base(struct yaffs_dev *dev, struct yaffs_tnode *tn,
 			 unsigned pos);
+u32 yaffs_get_file_map(struct yaffs_dev *dev,
+		       struct yaffs_file_var *file_struct, u32 chunk_id);
+int yaffs_extents_to_tnodes(struct yaffs_dev *dev,
+			    struct yaffs_file_var *file_struct);
+struct yaffs_extent *yaffs_file_extent(struct yaffs_dev *dev,
+				       struct yaffs_tnode *ext, int i);
+int yaffs_grow_extents(struct yaffs_dev *dev,
+		       struct yaffs_file_var *file_struct, int n_tnodes);
 
 int yaffs_is_non_empty_dir(struct yaffs_obj *obj);
 
@@ -1050,6 +1235,8 @@ Y_LOFF_T yaffs_max_file_size(struct yaffs_dev *dev);
 /* yaffs_wr_data_obj needs to be exposed to allow the cache to access it. */
 int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 			     const u8 *buffer, int n_bytes, int use_reserve);
+void yaffs_wr_cache_batch(struct yaffs_dev *dev, struct yaffs_cache **batch,
+			  int n);
 
 /*
  * Debug function to count number of blocks in each state
@@ -0,0 +1,177 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2018 Aleph One Ltd.
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* Read health tracks how many bit flips the device ECC has been correcting
+ * in each block.
+ *
+ * Each read adds a weight for its corrected bit level to the block's score,
+ * and every YAFFS_HEALTH_DECAY_READS reads all the scores decay by a
+ * quarter, rounded up so that they get down to 0, and old flips are
+ * forgotten. A full block whose score reaches
+ * the refresh threshold is prioritised for gc, which rewrites its data
+ * before the flips reach the point the ECC can no longer fix them.
+ *
+ * Unlike an ECC failure this does not count as a strike against the block,
+ * the block is fine once erased.
+ */
+
+#include "yaffs_health.h"
+#include "yaffs_getblockinfo.h"
+#include "yaffs_trace.h"
+
+#define YAFFS_HEALTH_DECAY_READS	1024
+#define YAFFS_HEALTH_MAX		255
+#define YAFFS_HEALTH_DEFAULT_THRESHOLD	64
+
+static const u8 yaffs_health_weight[YAFFS_HEALTH_N_LEVELS] = {
+	[YAFFS_HEALTH_CLEAN] = 0,
+	[YAFFS_HEALTH_LOW] = 8,
+	[YAFFS_HEALTH_MID] = 32,
+	[YAFFS_HEALTH_HIGH] = 96,
+};
+
+static int yaffs_health_n_blocks(struct yaffs_dev *dev)
+{
+	return dev->internal_end_block - dev->internal_start_block + 1;
+}
+
+static int yaffs_health_threshold(struct yaffs_dev *dev)
+{
+	if (dev->param.health_refresh_threshold > 0)
+		return dev->param.health_refresh_threshold;
+	return YAFFS_HEALTH_DEFAULT_THRESHOLD;
+}
+
+int yaffs_health_init(struct yaffs_dev *dev)
+{
+	int n_blocks = yaffs_health_n_blocks(dev);
+
+	dev->block_health = kmalloc_class(n_blocks, YAFFS_MEM_MOUNT);
+	if (!dev->block_health)
+		return YAFFS_FAIL;
+
+	memset(dev->block_health, 0, n_blocks);
+	dev->health_reads = 0;
+	dev->health_idle_refreshes = 0;
+	return YAFFS_OK;
+}
+
+void yaffs_health_deinit(struct yaffs_dev *dev)
+{
+	kfree(dev->block_health);
+	dev->block_health = NULL;
+}
+
+static void yaffs_health_decay(struct yaffs_dev *dev)
+{
+	int n_blocks = yaffs_health_n_blocks(dev);
+	int i;
+
+	for (i = 0; i < n_blocks; i++)
+		dev->block_health[i] -= (dev->block_health[i] + 3) >> 2;
+}
+
+void yaffs_health_record(struct yaffs_dev *dev, int flash_chunk,
+			 enum yaffs_health_level level)
+{
+	int blk;
+	int score;
+	struct yaffs_block_info *bi;
+
+	if (!dev->block_health || level >= YAFFS_HEALTH_N_LEVELS)
+		return;
+
+	blk = (flash_chunk + dev->chunk_offset) / dev->param.chunks_per_block;
+	if (blk < (int)dev->internal_start_block ||
+	    blk > (int)dev->internal_end_block)
+		return;
+
+	dev->health_reads++;
+	if (dev->health_reads >= YAFFS_HEALTH_DECAY_READS) {
+		dev->health_reads = 0;
+		yaffs_health_decay(dev);
+	}
+
+	if (level == YAFFS_HEALTH_CLEAN)
+		return;
+
+	dev->n_health_flips[level]++;
+
+	score = dev->block_health[blk - dev->internal_start_block] +
+		yaffs_health_weight[level];
+	if (score > YAFFS_HEALTH_MAX)
+		score = YAFFS_HEALTH_MAX;
+	dev->block_health[blk - dev->internal_start_block] = score;
+
+	bi = yaffs_get_block_info(dev, blk);
+	if (score >= yaffs_health_threshold(dev) &&
+	    bi->block_state == YAFFS_BLOCK_STATE_FULL &&
+	    !bi->gc_prioritise) {
+		yaffs_trace(YAFFS_TRACE_GC,
+			"yaffs: block %d health %d, prioritising refresh",
+			blk, score);
+		bi->gc_prioritise = 1;
+		dev->has_pending_prioritised_gc = 1;
+		dev->n_health_refreshes++;
+	}
+}
+
+void yaffs_health_erased(struct yaffs_dev *dev, int blk)
+{
+	if (dev->block_health)
+		dev->block_health[blk - dev->internal_start_block] = 0;
+}
+
+/*
+ * Pick the full block with the highest score, if that is at least
+ * YAFFS_HEALTH_MIN_REFRESH. If no block has seen that many flips of late,
+ * fall back to the oldest block only every YAFFS_HEALTH_IDLE_REFRESH_FACTOR
+ * times, to cover data that is never read.
+ */
+#define YAFFS_HEALTH_IDLE_REFRESH_FACTOR	8
+#define YAFFS_HEALTH_MIN_REFRESH	16	/* Two recent low level flips */
+
+u32 yaffs_health_find_refresh_block(struct yaffs_dev *dev)
+{
+	u32 b;
+	u32 worst = 0;
+	int worst_score = YAFFS_HEALTH_MIN_REFRESH - 1;
+	u32 oldest = 0;
+	u32 oldest_seq = 0;
+	struct yaffs_block_info *bi = dev->block_info;
+	u8 *health = dev->block_health;
+
+	for (b = dev->internal_start_block; b <= dev->internal_end_block; b++) {
+		if (bi->block_state == YAFFS_BLOCK_STATE_FULL) {
+			if (*health > worst_score) {
+				worst = b;
+				worst_score = *health;
+			}
+			if (oldest < 1 || bi->seq_number < oldest_seq) {
+				oldest = b;
+				oldest_seq = bi->seq_number;
+			}
+		}
+		bi++;
+		health++;
+	}
+
+	if (worst > 0)
+		return worst;
+
+	dev->health_idle_refreshes++;
+	if (dev->health_idle_refreshes < YAFFS_HEALTH_IDLE_REFRESH_FACTOR)
+		return 0;
+
+	dev->health_idle_refreshes = 0;
+	return oldest;
+}
@@ -0,0 +1,41 @@
+/*
+ * YAFFS: Yet another Flash File System . A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2018 Aleph One Ltd.
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1 as
+ * published by the Free Software Foundation.
+ *
+ * Note: Only YAFFS headers are LGPL, YAFFS C code is covered by GPL.
+ */
+
+#ifndef __YAFFS_HEALTH_H__
+#define __YAFFS_HEALTH_H__
+
+#include "yaffs_guts.h"
+
+/* How many bits the device ECC had to correct on a read. */
+enum yaffs_health_level {
+	YAFFS_HEALTH_CLEAN,	/* No bit flips */
+	YAFFS_HEALTH_LOW,	/* A few, well within the ECC strength */
+	YAFFS_HEALTH_MID,	/* Getting on for the ECC strength */
+	YAFFS_HEALTH_HIGH,	/* At the ECC strength, refresh now */
+	YAFFS_HEALTH_N_LEVELS
+};
+
+int yaffs_health_init(struct yaffs_dev *dev);
+void yaffs_health_deinit(struct yaffs_dev *dev);
+
+/* Called by the driver after each read, with the chunk it was given. */
+void yaffs_health_record(struct yaffs_dev *dev, int flash_chunk,
+			 enum yaffs_health_level level);
+
+void yaffs_health_erased(struct yaffs_dev *dev, int blk);
+
+/* The full block most in need of a refresh, or 0 if none. */
+u32 yaffs_health_find_refresh_block(struct yaffs_dev *dev);
+
+#endif
@@ -46,6 +46,92 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 	return result;
 }
 
+/*
+ * Read n_bytes of the chunk's data starting at offset, and the tags if
+ * tags is not NULL. Only the bytes asked for are transferred if the
+ * tagger can do that, otherwise the whole chunk is read and the range
+ * copied out.
+ */
+int yaffs_rd_chunk_part_nand(struct yaffs_dev *dev, int nand_chunk,
+			     int offset, u8 *buffer, int n_bytes,
+			     struct yaffs_ext_tags *tags)
+{
+	int result;
+	u8 *local_buffer;
+	enum yaffs_ecc_result ecc_result = YAFFS_ECC_RESULT_NO_ERROR;
+	int flash_chunk = apply_chunk_offset(dev, nand_chunk);
+
+	if (!dev->tagger.read_chunk_part_fn ||
+	    dev->param.disable_partial_read) {
+		local_buffer = yaffs_get_temp_buffer(dev);
+		result = yaffs_rd_chunk_tags_nand(dev, nand_chunk,
+						  local_buffer, tags);
+		memcpy(buffer, &local_buffer[offset], n_bytes);
+		yaffs_release_temp_buffer(dev, local_buffer);
+		return result;
+	}
+
+	dev->n_page_reads++;
+	dev->n_partial_reads++;
+
+	result = dev->tagger.read_chunk_part_fn(dev, flash_chunk, offset,
+						buffer, n_bytes, tags,
+						&ecc_result);
+	if (ecc_result > YAFFS_ECC_RESULT_NO_ERROR) {
+
+		struct yaffs_block_info *bi;
+		bi = yaffs_get_block_info(dev,
+					  nand_chunk /
+					  dev->param.chunks_per_block);
+		yaffs_handle_chunk_error(dev, bi);
+	}
+	return result;
+}
+
+/*
+ * Tell the driver that a run of chunk reads is coming.
+ * This is only a hint. Reads that don't follow the run still work.
+ */
+void yaffs_rd_chunk_run_nand(struct yaffs_dev *dev, int nand_chunk,
+			     int n_chunks, int stride)
+{
+	if (!dev->drv.drv_read_run_fn || n_chunks < 2)
+		return;
+
+	dev->drv.drv_read_run_fn(dev, apply_chunk_offset(dev, nand_chunk),
+				 n_chunks, stride);
+}
+
+/*
+ * Start a write run, see yaffs_wr_cache_batch(). Returns YAFFS_FAIL if the
+ * driver has no write runs, then every write reports its own result.
+ */
+int yaffs_wr_chunk_run_nand(struct yaffs_dev *dev)
+{
+	if (!dev->drv.drv_write_run_fn || !dev->drv.drv_write_run_end_fn)
+		return YAFFS_FAIL;
+
+	return dev->drv.drv_write_run_fn(dev);
+}
+
+/*
+ * End the write run. Returns how many of its chunks failed to program,
+ * up to max of them in failed.
+ */
+int yaffs_wr_chunk_run_end_nand(struct yaffs_dev *dev, int *failed, int max)
+{
+	int n_failed;
+	int i;
+
+	n_failed = dev->drv.drv_write_run_end_fn(dev, failed, max);
+	if (n_failed > max)
+		n_failed = max;
+	for (i = 0; i < n_failed; i++)
+		failed[i] += dev->chunk_offset;
+
+	return n_failed;
+}
+
 int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 				int nand_chunk,
 				const u8 *buffer, struct yaffs_ext_tags *tags)
@@ -75,6 +161,30 @@ int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 	return result;
 }
 
+int yaffs_copy_chunk_tags_nand(struct yaffs_dev *dev,
+				int src_chunk, int dst_chunk,
+				struct yaffs_ext_tags *tags)
+{
+	int result;
+	int flash_src = apply_chunk_offset(dev, src_chunk);
+	int flash_dst = apply_chunk_offset(dev, dst_chunk);
+
+	dev->n_page_writes++;
+
+	tags->seq_number = dev->seq_number;
+	tags->chunk_used = 1;
+	yaffs_trace(YAFFS_TRACE_WRITE,
+		"Copying chunk %d to %d tags %d %d",
+		src_chunk, dst_chunk, tags->obj_id, tags->chunk_id);
+
+	result = dev->tagger.copy_chunk_tags_fn(dev, flash_src, flash_dst,
+						tags);
+
+	yaffs_summary_add(dev, tags, dst_chunk);
+
+	return result;
+}
+
 int yaffs_mark_bad(struct yaffs_dev *dev, int block_no)
 {
 	block_no -= dev->block_offset;
@@ -119,3 +229,10 @@ int yaffs_deinit_nand(struct yaffs_dev *dev)
 		return dev->drv.drv_deinitialise_fn(dev);
 	return YAFFS_OK;
 }
+
+int yaffs_sync_nand(struct yaffs_dev *dev)
+{
+	if (dev->drv.drv_sync_fn)
+		return dev->drv.drv_sync_fn(dev);
+	return YAFFS_OK;
+}
@@ -19,6 +19,17 @@
 int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 			     u8 *buffer, struct yaffs_ext_tags *tags);
 
+int yaffs_rd_chunk_part_nand(struct yaffs_dev *dev, int nand_chunk,
+			     int offset, u8 *buffer, int n_bytes,
+			     struct yaffs_ext_tags *tags);
+
+void yaffs_rd_chunk_run_nand(struct yaffs_dev *dev, int nand_chunk,
+			     int n_chunks, int stride);
+
+int yaffs_wr_chunk_run_nand(struct yaffs_dev *dev);
+
+int yaffs_wr_chunk_run_end_nand(struct yaffs_dev *dev, int *failed, int max);
+
 int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 			     int nand_chunk,
 			     const u8 *buffer, struct yaffs_ext_tags *tags);
@@ -34,5 +45,10 @@ int yaffs_erase_block(struct yaffs_dev *dev, int flash_block);
 
 int yaffs_init_nand(struct yaffs_dev *dev);
 int yaffs_deinit_nand(struct yaffs_dev *dev);
+int yaffs_copy_chunk_tags_nand(struct yaffs_dev *dev,
+				int src_chunk, int dst_chunk,
+				struct yaffs_ext_tags *tags);
+
+int yaffs_sync_nand(struct yaffs_dev *dev);
 
 #endif
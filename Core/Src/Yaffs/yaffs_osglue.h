@@ -24,14 +24,61 @@
 
 #include "yportenv.h"
 
+struct yaffs_dev;
+
+/*
+ * Locking.
+ *
+ * yaffsfs_Lock() takes the file system lock exclusively. It is held for
+ * everything that changes the handle tables, the name space or the
+ * mounted devices.
+ *
+ * Reads and writes on open handles instead take the file system lock
+ * shared, and then the handle's device lock, a reader/writer lock too.
+ * Writes take it exclusively and take turns a piece at a time. Reads take
+ * it shared, and then the device's state lock, a plain mutex, around all
+ * they do to yaffs and the NAND; they drop that only to copy out of a
+ * pinned cache entry. Transfers on different devices run in parallel, and
+ * so do reads of the same device as far as the cache serves them.
+ *
+ * The order is always file system, device, state.
+ * A port without threads can leave all of these empty.
+ */
 void yaffsfs_Lock(void);
 void yaffsfs_Unlock(void);
+void yaffsfs_LockShared(void);
+void yaffsfs_UnlockShared(void);
+void yaffsfs_LockDev(struct yaffs_dev *dev);
+void yaffsfs_UnlockDev(struct yaffs_dev *dev);
+void yaffsfs_LockDevShared(struct yaffs_dev *dev);
+void yaffsfs_UnlockDevShared(struct yaffs_dev *dev);
+void yaffsfs_LockDevState(struct yaffs_dev *dev);
+void yaffsfs_UnlockDevState(struct yaffs_dev *dev);
+
+/* Around the port's allocator, which all the devices share. */
+void yaffsfs_LockMem(void);
+void yaffsfs_UnlockMem(void);
 
 u32 yaffsfs_CurrentTime(void);
 
 void yaffsfs_SetError(int err);
 
+/*
+ * What an allocation is for, so that the port can keep like with like.
+ * yaffsfs_malloc() allocates YAFFS_MEM_GENERAL; yaffsfs_free() frees any.
+ */
+enum yaffs_mem_class {
+	YAFFS_MEM_GENERAL,	/* Names, paths and other short lived memory */
+	YAFFS_MEM_TNODES,	/* Batches of tnodes */
+	YAFFS_MEM_OBJECTS,	/* Batches of objects */
+	YAFFS_MEM_CHUNK,	/* Chunk sized cache and temporary buffers */
+	YAFFS_MEM_MOUNT,	/* Tables kept from mount to unmount */
+	YAFFS_MEM_DIR_INDEX,	/* Directory name index tables */
+	YAFFS_MEM_N_CLASSES
+};
+
 void *yaffsfs_malloc(size_t size);
+void *yaffsfs_malloc_class(size_t size, enum yaffs_mem_class mem_class);
 void yaffsfs_free(void *ptr);
 
 void yaffsfs_get_malloc_values(unsigned *current, unsigned *high_water);
@@ -85,8 +85,8 @@ int yaffs_summary_init(struct yaffs_dev *dev)
 	dev->chunks_per_summary = dev->param.chunks_per_block - chunks_used;
 	sum_tags_bytes = sizeof(struct yaffs_summary_tags) *
 				dev->chunks_per_summary;
-	dev->sum_tags = kmalloc(sum_tags_bytes, GFP_NOFS);
-	dev->gc_sum_tags = kmalloc(sum_tags_bytes, GFP_NOFS);
+	dev->sum_tags = kmalloc_class(sum_tags_bytes, YAFFS_MEM_MOUNT);
+	dev->gc_sum_tags = kmalloc_class(sum_tags_bytes, YAFFS_MEM_MOUNT);
 	if (!dev->sum_tags || !dev->gc_sum_tags) {
 		yaffs_summary_deinit(dev);
 		return YAFFS_FAIL;
@@ -59,6 +59,30 @@ static int yaffs_tags_marshall_write(struct yaffs_dev *dev,
 	return retval;
 }
 
+static int yaffs_tags_marshall_copy(struct yaffs_dev *dev,
+				    int src_chunk, int dst_chunk,
+				    const struct yaffs_ext_tags *tags)
+{
+	struct yaffs_packed_tags2 pt;
+
+	int packed_tags_size =
+	    dev->param.no_tags_ecc ? sizeof(pt.t) : sizeof(pt);
+	void *packed_tags_ptr =
+	    dev->param.no_tags_ecc ? (void *)&pt.t : (void *)&pt;
+
+	yaffs_trace(YAFFS_TRACE_MTD,
+		"yaffs_tags_marshall_copy chunk %d to %d tags %p",
+		src_chunk, dst_chunk, tags);
+
+	if (!tags)
+		BUG();
+
+	yaffs_pack_tags2(dev, &pt, tags, !dev->param.no_tags_ecc);
+
+	return dev->drv.drv_copy_chunk_fn(dev, src_chunk, dst_chunk,
+			packed_tags_ptr, packed_tags_size);
+}
+
 static int yaffs_tags_marshall_read(struct yaffs_dev *dev,
 				   int nand_chunk, u8 *data,
 				   struct yaffs_ext_tags *tags)
@@ -136,6 +160,58 @@ static int yaffs_tags_marshall_read(struct yaffs_dev *dev,
 		return YAFFS_FAIL;
 }
 
+static int yaffs_tags_marshall_read_part(struct yaffs_dev *dev,
+				   int nand_chunk, int offset,
+				   u8 *data, int n_bytes,
+				   struct yaffs_ext_tags *tags,
+				   enum yaffs_ecc_result *ecc_result)
+{
+	int retval;
+	u8 spare_buffer[100];
+
+	struct yaffs_packed_tags2 pt;
+
+	int packed_tags_size =
+	    dev->param.no_tags_ecc ? sizeof(pt.t) : sizeof(pt);
+	void *packed_tags_ptr =
+	    dev->param.no_tags_ecc ? (void *)&pt.t : (void *)&pt;
+
+	yaffs_trace(YAFFS_TRACE_MTD,
+		"yaffs_tags_marshall_read_part chunk %d offset %d bytes %d tags %p",
+		nand_chunk, offset, n_bytes, tags);
+
+	retval = dev->drv.drv_read_partial_fn(dev, nand_chunk,
+				offset, data, n_bytes,
+				tags ? spare_buffer : NULL,
+				tags ? packed_tags_size : 0,
+				ecc_result);
+
+	if (retval == YAFFS_FAIL)
+		return YAFFS_FAIL;
+
+	if (tags) {
+		memcpy(packed_tags_ptr, spare_buffer, packed_tags_size);
+		yaffs_unpack_tags2(dev, tags, &pt, !dev->param.no_tags_ecc);
+	}
+
+	if (*ecc_result == YAFFS_ECC_RESULT_UNFIXED) {
+		if (tags)
+			tags->ecc_result = YAFFS_ECC_RESULT_UNFIXED;
+		dev->n_ecc_unfixed++;
+	}
+
+	if (*ecc_result == YAFFS_ECC_RESULT_FIXED) {
+		if (tags && tags->ecc_result <= YAFFS_ECC_RESULT_NO_ERROR)
+			tags->ecc_result = YAFFS_ECC_RESULT_FIXED;
+		dev->n_ecc_fixed++;
+	}
+
+	if (*ecc_result < YAFFS_ECC_RESULT_UNFIXED)
+		return YAFFS_OK;
+	else
+		return YAFFS_FAIL;
+}
+
 static int yaffs_tags_marshall_query_block(struct yaffs_dev *dev, int block_no,
 			       enum yaffs_block_state *state,
 			       u32 *seq_number)
@@ -199,4 +275,15 @@ void yaffs_tags_marshall_install(struct yaffs_dev *dev)
 	if (!dev->tagger.mark_bad_fn)
 		dev->tagger.mark_bad_fn = yaffs_tags_marshall_mark_bad;
 
+	/* Inband tags live in the data area, so they can't be swapped
+	 * in by a copy or read separately.
+	 */
+	if (!dev->tagger.read_chunk_part_fn &&
+	    dev->drv.drv_read_partial_fn && !dev->param.inband_tags)
+		dev->tagger.read_chunk_part_fn = yaffs_tags_marshall_read_part;
+
+	if (!dev->tagger.copy_chunk_tags_fn &&
+	    dev->drv.drv_copy_chunk_fn && !dev->param.inband_tags)
+		dev->tagger.copy_chunk_tags_fn = yaffs_tags_marshall_copy;
+
 }
@@ -232,7 +232,6 @@ void yaffs_verify_file(struct yaffs_obj *obj)
 	int i;
 	struct yaffs_dev *dev;
 	struct yaffs_ext_tags tags;
-	struct yaffs_tnode *tn;
 	u32 obj_id;
 
 	if (!obj)
@@ -256,8 +255,8 @@ void yaffs_verify_file(struct yaffs_obj *obj)
 		required_depth++;
 	}
 
-	/* Check that the chunks in the tnode tree are all correct.
-	 * We do this by scanning through the tnode tree and
+	/* Check that the chunks in the file map are all correct.
+	 * We do this by going through the tnode tree or extents and
 	 * checking the tags for every chunk match.
 	 */
 
@@ -265,12 +264,8 @@ void yaffs_verify_file(struct yaffs_obj *obj)
 		return;
 
 	for (i = 1; i <= last_chunk; i++) {
-		tn = yaffs_find_tnode_0(dev, &obj->variant.file_variant, i);
-
-		if (!tn)
-			continue;
-
-		the_chunk = yaffs_get_group_base(dev, tn, i);
+		the_chunk = yaffs_get_file_map(dev,
+					       &obj->variant.file_variant, i);
 		if (the_chunk > 0) {
 			yaffs_rd_chunk_tags_nand(dev, the_chunk, NULL,
 						 &tags);
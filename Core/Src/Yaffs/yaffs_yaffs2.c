@@ -20,6 +20,7 @@
 #include "yaffs_verify.h"
 #include "yaffs_attribs.h"
 #include "yaffs_summary.h"
+#include "yaffs_health.h"
 #include "yaffs_endian.h"
 
 /*
@@ -170,6 +171,17 @@ u32 yaffs2_find_refresh_block(struct yaffs_dev *dev)
 	 */
 	dev->refresh_skip = dev->param.refresh_period;
 	dev->refresh_count++;
+
+	/* With read health, only refresh the blocks that need it. */
+	if (dev->block_health) {
+		oldest = yaffs_health_find_refresh_block(dev);
+		if (oldest > 0)
+			yaffs_trace(YAFFS_TRACE_GC,
+				"GC refresh count %d selected block %d by health",
+				dev->refresh_count, oldest);
+		return oldest;
+	}
+
 	bi = dev->block_info;
 	for (b = dev->internal_start_block; b <= dev->internal_end_block; b++) {
 
@@ -226,6 +238,8 @@ int yaffs_calc_checkpt_blocks_required(struct yaffs_dev *dev)
 		    (sizeof(struct yaffs_checkpt_obj) + sizeof(u32)) *
 		    dev->n_obj;
 		n_bytes += (dev->tnode_size + sizeof(u32)) * dev->n_tnodes;
+		/* A file's extents take up tnodes and a longer record */
+		n_bytes += 2 * sizeof(u32) * dev->n_obj;
 		n_bytes += sizeof(struct yaffs_checkpt_validity);
 		n_bytes += sizeof(u32);	/* checksum */
 
@@ -612,6 +626,93 @@ static int yaffs2_checkpt_tnode_worker(struct yaffs_obj *in,
 	return ok;
 }
 
+/*
+ * A file mapped by extents is written as a record of its own in among the
+ * level 0 tnode records: a base chunk of YAFFS_CHECKPT_EXTENTS, which no
+ * tnode can have, the number of chunks in a block that hold data (which
+ * the extents run over), the number of extents and the extents.
+ */
+#define YAFFS_CHECKPT_EXTENTS	(~1U)
+
+static u32 yaffs2_extent_data_chunks(struct yaffs_dev *dev)
+{
+	return dev->chunks_per_summary ?
+		(u32)dev->chunks_per_summary : dev->param.chunks_per_block;
+}
+
+static int yaffs2_wr_checkpt_extents(struct yaffs_obj *obj)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_file_var *file_struct = &obj->variant.file_variant;
+	struct yaffs_extent *e;
+	u32 rec[3];
+	int ok;
+	int i;
+	int j;
+
+	if (!file_struct->n_extents)
+		return 1;
+
+	rec[0] = YAFFS_CHECKPT_EXTENTS;
+	rec[1] = yaffs2_extent_data_chunks(dev);
+	rec[2] = file_struct->n_extents;
+	for (i = 0; i < 3; i++)
+		yaffs_do_endian_u32(dev, &rec[i]);
+	ok = (yaffs2_checkpt_wr(dev, rec, sizeof(rec)) == sizeof(rec));
+
+	for (i = 0; ok && i < file_struct->n_extents; i++) {
+		e = yaffs_file_extent(dev, file_struct->top, i);
+		rec[0] = e->chunk;
+		rec[1] = e->nand;
+		rec[2] = e->len;
+		for (j = 0; j < 3; j++)
+			yaffs_do_endian_u32(dev, &rec[j]);
+		ok = (yaffs2_checkpt_wr(dev, rec, sizeof(rec)) == sizeof(rec));
+	}
+	return ok;
+}
+
+static int yaffs2_rd_checkpt_extents(struct yaffs_obj *obj)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_file_var *file_struct = &obj->variant.file_variant;
+	struct yaffs_extent *e;
+	u32 rec[3];
+	int n;
+	int i;
+	int j;
+
+	if (yaffs2_checkpt_rd(dev, rec, 2 * sizeof(u32)) != 2 * sizeof(u32))
+		return 0;
+	yaffs_do_endian_u32(dev, &rec[0]);
+	yaffs_do_endian_u32(dev, &rec[1]);
+	n = rec[1];
+
+	/* Extents written with the summaries on can't be read with them off */
+	if (rec[0] != yaffs2_extent_data_chunks(dev) ||
+	    file_struct->n_extents != 0 ||
+	    n < 1 || n > YAFFS_FILE_EXTENTS(dev))
+		return 0;
+
+	if (yaffs_grow_extents(dev, file_struct,
+			       (n + YAFFS_TNODE_EXTENTS(dev) - 1) /
+			       YAFFS_TNODE_EXTENTS(dev)) != YAFFS_OK)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		if (yaffs2_checkpt_rd(dev, rec, sizeof(rec)) != sizeof(rec))
+			return 0;
+		for (j = 0; j < 3; j++)
+			yaffs_do_endian_u32(dev, &rec[j]);
+		e = yaffs_file_extent(dev, file_struct->top, i);
+		e->chunk = rec[0];
+		e->nand = rec[1];
+		e->len = rec[2];
+	}
+	file_struct->n_extents = n;
+	return 1;
+}
+
 static int yaffs2_wr_checkpt_tnodes(struct yaffs_obj *obj)
 {
 	u32 end_marker = ~0;
@@ -620,7 +721,10 @@ static int yaffs2_wr_checkpt_tnodes(struct yaffs_obj *obj)
 	if (obj->variant_type != YAFFS_OBJECT_TYPE_FILE)
 		return ok;
 
-	ok = yaffs2_checkpt_tnode_worker(obj,
+	if (obj->variant.file_variant.n_extents >= 0)
+		ok = yaffs2_wr_checkpt_extents(obj);
+	else
+		ok = yaffs2_checkpt_tnode_worker(obj,
 					 obj->variant.file_variant.top,
 					 obj->variant.file_variant.
 					 top_level, 0);
@@ -647,7 +751,24 @@ static int yaffs2_rd_checkpt_tnodes(struct yaffs_obj *obj)
 
 	while (ok && (~base_chunk)) {
 		nread++;
-		/* Read level 0 tnode */
+
+		if (base_chunk == YAFFS_CHECKPT_EXTENTS) {
+			ok = yaffs2_rd_checkpt_extents(obj);
+			if (ok) {
+				ok = (yaffs2_checkpt_rd
+				      (dev, &base_chunk,
+				       sizeof(base_chunk)) ==
+				      sizeof(base_chunk));
+				yaffs_do_endian_u32(dev, &base_chunk);
+			}
+			continue;
+		}
+
+		/* Read level 0 tnode, into a tree if there is none yet */
+		if (yaffs_extents_to_tnodes(dev, file_stuct_ptr) != YAFFS_OK) {
+			ok = 0;
+			break;
+		}
 
 		tn = yaffs_get_tnode(dev);
 		if (tn) {
@@ -959,6 +1080,11 @@ int yaffs_checkpoint_save(struct yaffs_dev *dev)
 		"save entry: is_checkpointed %d",
 		dev->is_checkpointed);
 
+	/* Erase pending blocks now, so the checkpoint has room and is not
+	 * invalidated by the next erase.
+	 */
+	yaffs_erase_pending_blocks(dev, -1);
+
 	yaffs_verify_objects(dev);
 	yaffs_verify_blocks(dev);
 	yaffs_verify_free_chunks(dev);
@@ -1550,7 +1676,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	dev->seq_number = YAFFS_LOWEST_SEQUENCE_NUMBER;
 
 	block_index =
-		kmalloc(n_blocks * sizeof(struct yaffs_block_index), GFP_NOFS);
+		kmalloc_class(n_blocks * sizeof(struct yaffs_block_index),
+			      YAFFS_MEM_MOUNT);
 
 	if (!block_index) {
 		block_index =
@@ -1654,10 +1781,15 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 		/* For each chunk in each block that needs scanning.... */
 		found_chunks = 0;
-		if (summary_available)
+		if (summary_available) {
 			c = dev->chunks_per_summary - 1;
-		else
+		} else {
 			c = dev->param.chunks_per_block - 1;
+			/* Every chunk's tags get read, last chunk first. */
+			yaffs_rd_chunk_run_nand(dev,
+				blk * dev->param.chunks_per_block + c,
+				c + 1, -1);
+		}
 
 		for (/* c is already initialised */;
 		     !alloc_failed && c >= 0 &&
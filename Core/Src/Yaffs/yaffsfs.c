@@ -12,6 +12,7 @@
 
 #include "yaffsfs.h"
 #include "yaffs_guts.h"
+#include "yaffs_nand.h"
 #include "yaffscfg.h"
 #include "yportenv.h"
 #include "yaffs_trace.h"
@@ -95,6 +96,9 @@ struct yaffsfs_FileDes {
 		Y_LOFF_T position;	/* current position in file */
 		yaffs_DIR *dir;
 	} v;
+	Y_LOFF_T raNext;	/* Where a sequential read would start */
+	int raChunk;		/* First chunk not yet read ahead */
+	int raWindow;		/* Chunks to read ahead, 0 if not sequential */
 };
 
 struct yaffsfs_Handle {
@@ -1158,11 +1162,177 @@ int yaffs_close(int handle)
 	return retVal;
 }
 
+/*
+ * Data transfers on open handles run under the shared file system lock
+ * and the lock of the handle's device, see yaffs_osglue.h. The handle
+ * table entries a transfer touches belong to that device, and new
+ * handles are only set up under the exclusive lock.
+ *
+ * Writes hold the device exclusively. Reads hold it shared and take its
+ * state lock for everything that looks at or changes yaffs state: the
+ * handle, the cache, the NAND. Only the copy out of a pinned cache entry
+ * runs without it, so readers of the same device copy cached data in
+ * parallel and with another reader's NAND read.
+ */
+
+/*
+ * Find the device of a handle with neither its device nor its state
+ * locked. Transfers on the device change the use counts as they go, so
+ * this follows the indices alone. Those are only set under the exclusive
+ * lock, and only cleared once the handle has been closed.
+ */
+static struct yaffs_dev *yaffsfs_HandleToDev(int handle)
+{
+	struct yaffsfs_Handle *h = yaffsfs_HandleToPointer(handle);
+	struct yaffsfs_FileDes *fd;
+	struct yaffs_obj *obj;
+
+	if (!h || h->fdId < 0 || h->fdId >= YAFFSFS_N_HANDLES)
+		return NULL;
+	fd = &yaffsfs_fd[h->fdId];
+	if (fd->inodeId < 0 || fd->inodeId >= YAFFSFS_N_HANDLES)
+		return NULL;
+	obj = yaffsfs_inode[fd->inodeId].iObj;
+
+	return obj ? obj->my_dev : NULL;
+}
+
+/*
+ * yaffsfs_LockHandleDev() locks the device of the handle's object and
+ * returns it, or returns NULL if the handle is bad. Objects are never
+ * given back to another device, so my_dev can be read before the device
+ * is locked; the caller looks the handle up again once it is.
+ */
+static struct yaffs_dev *yaffsfs_LockHandleDev(int handle, int shared)
+{
+	struct yaffs_dev *dev = yaffsfs_HandleToDev(handle);
+
+	if (!dev)
+		return NULL;
+
+	if (shared)
+		yaffsfs_LockDevShared(dev);
+	else
+		yaffsfs_LockDev(dev);
+	return dev;
+}
+
+static void yaffsfs_UnlockHandleDev(struct yaffs_dev *dev, int shared)
+{
+	if (!dev)
+		return;
+	if (shared)
+		yaffsfs_UnlockDevShared(dev);
+	else
+		yaffsfs_UnlockDev(dev);
+}
+
+/* Look the handle's object up again, it must still be on dev. */
+static struct yaffs_obj *yaffsfs_HandleToDevObject(int handle,
+						   struct yaffs_dev *dev)
+{
+	struct yaffs_obj *obj = yaffsfs_HandleToObject(handle);
+
+	if (obj && obj->my_dev != dev)
+		obj = NULL;
+	return obj;
+}
+
+/* Let others in between the pieces of a transfer. */
+static void yaffsfs_YieldDev(struct yaffs_dev *dev, int shared)
+{
+	yaffsfs_UnlockHandleDev(dev, shared);
+	yaffsfs_UnlockShared();
+	yaffsfs_LockShared();
+	if (shared)
+		yaffsfs_LockDevShared(dev);
+	else
+		yaffsfs_LockDev(dev);
+}
+
+/*
+ * Read up to *n bytes at pos with the device shared and its state lock
+ * held. A cached chunk is pinned and copied with the state lock dropped,
+ * anything else goes to yaffs_file_rd(). *n is cut down to what was
+ * tried, see yaffs_file_rd_pin().
+ */
+static int yaffsfs_ReadPiece(struct yaffs_dev *dev, struct yaffs_obj *obj,
+			u8 *buf, Y_LOFF_T pos, int *n)
+{
+	struct yaffs_cache *cache;
+	u32 start;
+
+	cache = yaffs_file_rd_pin(obj, pos, n, &start);
+	if (!cache)
+		return yaffs_file_rd(obj, buf, pos, *n);
+
+	yaffsfs_UnlockDevState(dev);
+	memcpy(buf, &cache->data[start], *n);
+	yaffsfs_LockDevState(dev);
+	yaffs_file_rd_unpin(cache);
+
+	return *n;
+}
+
+/*
+ * Read ahead for short sequential reads.
+ * A read that starts where the last one on the file descriptor ended is
+ * sequential, and each one doubles the read ahead window up to the
+ * device's read_ahead_chunks. Once the reader gets within half a window
+ * of what has been read ahead, the chunks of the read and up to a window
+ * past it are loaded into the cache in one go, so later short reads find
+ * them there rather than each stall on a NAND read. Reads of one chunk
+ * count as short, they would otherwise go to NAND one at a time.
+ * Longer reads are left to the read runs of yaffs_file_rd().
+ */
+static void yaffsfs_ReadAhead(struct yaffsfs_FileDes *fd, struct yaffs_obj *obj,
+			Y_LOFF_T pos, unsigned int nbyte)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	int maxWindow = dev->param.read_ahead_chunks;
+	int firstChunk;
+	int endChunk;
+	u32 start;
+
+	if (maxWindow > (int)dev->param.n_caches / 2)
+		maxWindow = dev->param.n_caches / 2;
+
+	if (pos != fd->raNext || maxWindow < 1) {
+		fd->raWindow = 0;
+		fd->raChunk = 0;
+		return;
+	}
+
+	if (nbyte < 1 || nbyte > dev->data_bytes_per_chunk)
+		return;
+
+	fd->raWindow = fd->raWindow ? fd->raWindow * 2 : 2;
+	if (fd->raWindow > maxWindow)
+		fd->raWindow = maxWindow;
+
+	/* The chunks holding the first byte and the byte after the read. */
+	yaffs_addr_to_chunk(dev, pos, &firstChunk, &start);
+	yaffs_addr_to_chunk(dev, pos + nbyte, &endChunk, &start);
+	firstChunk++;
+	endChunk++;
+
+	if (fd->raChunk < firstChunk)
+		fd->raChunk = firstChunk;
+	if (fd->raChunk > endChunk + fd->raWindow / 2)
+		return;
+
+	/* From the chunks of this read on, so that they are not pushed out. */
+	yaffs_file_rd_ahead(obj, firstChunk,
+			    endChunk + fd->raWindow + 1 - firstChunk);
+	fd->raChunk = endChunk + fd->raWindow + 1;
+}
+
 static int yaffsfs_do_read(int handle, void *vbuf, unsigned int nbyte,
 		    int isPread, Y_LOFF_T offset)
 {
 	struct yaffsfs_FileDes *fd = NULL;
 	struct yaffs_obj *obj = NULL;
+	struct yaffs_dev *dev;
 	Y_LOFF_T pos = 0;
 	Y_LOFF_T startPos = 0;
 	Y_LOFF_T endPos = 0;
@@ -1177,9 +1347,12 @@ static int yaffsfs_do_read(int handle, void *vbuf, unsigned int nbyte,
 		return -1;
 	}
 
-	yaffsfs_Lock();
+	yaffsfs_LockShared();
+	dev = yaffsfs_LockHandleDev(handle, 1);
+	if (dev)
+		yaffsfs_LockDevState(dev);
 	fd = yaffsfs_HandleToFileDes(handle);
-	obj = yaffsfs_HandleToObject(handle);
+	obj = yaffsfs_HandleToDevObject(handle, dev);
 
 	if (!fd || !obj) {
 		/* bad handle */
@@ -1219,6 +1392,8 @@ static int yaffsfs_do_read(int handle, void *vbuf, unsigned int nbyte,
 			nbyte = 0;
 		}
 
+		yaffsfs_ReadAhead(fd, obj, pos, nbyte);
+
 		while (nbyte > 0) {
 			nToRead = YAFFSFS_RW_SIZE -
 			    (pos & (YAFFSFS_RW_SIZE - 1));
@@ -1229,11 +1404,12 @@ static int yaffsfs_do_read(int handle, void *vbuf, unsigned int nbyte,
 			 * Need to reverify object in case the device was
 			 * unmounted in another thread.
 			 */
-			obj = yaffsfs_HandleToObject(handle);
+			obj = yaffsfs_HandleToDevObject(handle, dev);
 			if (!obj)
 				nRead = 0;
 			else
-				nRead = yaffs_file_rd(obj, buf, pos, nToRead);
+				nRead = yaffsfs_ReadPiece(dev, obj, buf, pos,
+							  &nToRead);
 
 			if (nRead > 0) {
 				totalRead += nRead;
@@ -1247,14 +1423,18 @@ static int yaffsfs_do_read(int handle, void *vbuf, unsigned int nbyte,
 				nbyte = 0;	/* no more to read */
 
 			if (nbyte > 0) {
-				yaffsfs_Unlock();
-				yaffsfs_Lock();
+				yaffsfs_UnlockDevState(dev);
+				yaffsfs_YieldDev(dev, 1);
+				yaffsfs_LockDevState(dev);
 			}
 
 		}
 
 		yaffsfs_PutHandle(handle);
 
+		if (totalRead >= 0)
+			fd->raNext = startPos + totalRead;
+
 		if (!isPread) {
 			if (totalRead >= 0)
 				fd->v.position = startPos + totalRead;
@@ -1264,7 +1444,10 @@ static int yaffsfs_do_read(int handle, void *vbuf, unsigned int nbyte,
 
 	}
 
-	yaffsfs_Unlock();
+	if (dev)
+		yaffsfs_UnlockDevState(dev);
+	yaffsfs_UnlockHandleDev(dev, 1);
+	yaffsfs_UnlockShared();
 
 	return (totalRead >= 0) ? totalRead : -1;
 
@@ -1285,6 +1468,7 @@ static int yaffsfs_do_write(int handle, const void *vbuf, unsigned int nbyte,
 {
 	struct yaffsfs_FileDes *fd = NULL;
 	struct yaffs_obj *obj = NULL;
+	struct yaffs_dev *dev;
 	Y_LOFF_T pos = 0;
 	Y_LOFF_T startPos = 0;
 	Y_LOFF_T endPos;
@@ -1299,9 +1483,10 @@ static int yaffsfs_do_write(int handle, const void *vbuf, unsigned int nbyte,
 		return -1;
 	}
 
-	yaffsfs_Lock();
+	yaffsfs_LockShared();
+	dev = yaffsfs_LockHandleDev(handle, 0);
 	fd = yaffsfs_HandleToFileDes(handle);
-	obj = yaffsfs_HandleToObject(handle);
+	obj = yaffsfs_HandleToDevObject(handle, dev);
 
 	if (!fd || !obj) {
 		/* bad handle */
@@ -1343,7 +1528,7 @@ static int yaffsfs_do_write(int handle, const void *vbuf, unsigned int nbyte,
 			 * Need to reverify object in case the device was
 			 * remounted or unmounted in another thread.
 			 */
-			obj = yaffsfs_HandleToObject(handle);
+			obj = yaffsfs_HandleToDevObject(handle, dev);
 			if (!obj || obj->my_dev->read_only)
 				nWritten = 0;
 			else
@@ -1366,10 +1551,8 @@ static int yaffsfs_do_write(int handle, const void *vbuf, unsigned int nbyte,
 				totalWritten = -1;
 			}
 
-			if (nbyte > 0) {
-				yaffsfs_Unlock();
-				yaffsfs_Lock();
-			}
+			if (nbyte > 0)
+				yaffsfs_YieldDev(dev, 0);
 		}
 
 		yaffsfs_PutHandle(handle);
@@ -1382,7 +1565,8 @@ static int yaffsfs_do_write(int handle, const void *vbuf, unsigned int nbyte,
 		}
 	}
 
-	yaffsfs_Unlock();
+	yaffsfs_UnlockHandleDev(dev, 0);
+	yaffsfs_UnlockShared();
 
 	return (totalWritten >= 0) ? totalWritten : -1;
 }
@@ -2952,6 +3136,7 @@ static int yaffs_sync_common(struct yaffs_dev *dev,
 			yaffs_flush_whole_cache(dev, 0);
 			if (do_checkpt)
 				yaffs_checkpoint_save(dev);
+			yaffs_sync_nand(dev);
 			retVal = 0;
 
 		}
@@ -3945,15 +4130,29 @@ int yaffs_dump_dev_reldir(struct yaffs_obj *reldir, const YCHAR *path)
 		printf("\n"
 		       "n_page_writes.......... %d\n"
 		       "n_page_reads........... %d\n"
+		       "n_partial_reads........ %d\n"
 		       "n_erasures....... %d\n"
+		       "n_deferred_erases...... %d\n"
+		       "n_forced_erases........ %d\n"
 		       "n_gc_copies............ %d\n"
+		       "n_gc_copy_backs........ %d\n"
+		       "n_health_flips......... %d %d %d\n"
+		       "n_health_refreshes..... %d\n"
 		       "garbageCollections... %d\n"
 		       "passiveGarbageColl'ns %d\n"
 		       "\n",
 		       dev->n_page_writes,
 		       dev->n_page_reads,
+		       dev->n_partial_reads,
 		       dev->n_erasures,
+		       dev->n_deferred_erases,
+		       dev->n_forced_erases,
 		       dev->n_gc_copies,
+		       dev->n_gc_copy_backs,
+		       dev->n_health_flips[1],
+		       dev->n_health_flips[2],
+		       dev->n_health_flips[3],
+		       dev->n_health_refreshes,
 		       dev->garbageCollections, dev->passiveGarbageCollections);
 
 	}
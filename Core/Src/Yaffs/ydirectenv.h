@@ -67,6 +67,7 @@ size_t strnlen(const char *s, size_t maxlen);
 #endif
 
 #define kmalloc(x, flags) yaffsfs_malloc(x)
+#define kmalloc_class(x, mem_class) yaffsfs_malloc_class(x, mem_class)
 #define kfree(x)   yaffsfs_free(x)
 #define vmalloc(x) yaffsfs_malloc(x)
 #define vfree(x) yaffsfs_free(x)
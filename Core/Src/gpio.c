@@ -103,10 +103,14 @@ void gpio_LED1(uint32_t enable)
 
 void gpio_NAND_CS(uint32_t ncs)
 {
-	//HAL_GPIO_WritePin(GPIOA, GPIO_PIN_15, ncs);
 	HAL_GPIO_WritePin(GPIOB, GPIO_PIN_6, ncs);
 }
 
+void gpio_NAND1_CS(uint32_t ncs)
+{
+	HAL_GPIO_WritePin(GPIOA, GPIO_PIN_15, ncs);
+}
+
 void gpio_debug0(uint32_t val)
 {
 	HAL_GPIO_WritePin(GPIOB, GPIO_PIN_11, val);
@@ -0,0 +1,66 @@
+#ifdef SPI_NAND_HOST_SIM
+
+/*
+ * main() for host builds: runs the yaffs test and benchmarks of yaffs_pr.c
+ * on simulated chips, see spi_nand_sim.h.
+ *
+ *   sim [-stress | -pfail] [image_path [spi_hz]]
+ *
+ * Without an image path the arrays start erased each run.
+ * With -stress first it runs the thread stress test of yaffs_stress.c
+ * instead, which needs a build with YAFFS_PTHREAD_LOCKS, and with -pfail
+ * the program failure test of yaffs_pfail.c.
+ */
+#include "spi_nand_sim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void yaffs_test(void);
+int yaffs_stress_test(void);
+int yaffs_pfail_test(void);
+
+int main(int argc, char *argv[])
+{
+	struct spi_nand_sim_config cfg;
+	uint32_t die;
+	int stress = 0;
+	int pfail = 0;
+	int ret = 0;
+
+	if (argc > 1 && strcmp(argv[1], "-stress") == 0) {
+		stress = 1;
+		argc--;
+		argv++;
+	} else if (argc > 1 && strcmp(argv[1], "-pfail") == 0) {
+		pfail = 1;
+		argc--;
+		argv++;
+	}
+
+	for (die = 0; die < SPI_NAND_N_CHIPS; die++) {
+		spi_nand_sim_default_config(die, &cfg);
+		if (argc > 1)
+			cfg.image_path = argv[1];
+		if (argc > 2)
+			cfg.spi_hz = strtoul(argv[2], NULL, 0);
+		if (spi_nand_sim_setup(die, &cfg) < 0)
+			return 1;
+	}
+
+	printf("\n\nStarting simulation\n");
+	if (stress)
+		ret = yaffs_stress_test();
+	else if (pfail)
+		ret = yaffs_pfail_test();
+	else
+		yaffs_test();
+	spi_nand_sim_print_stats();
+
+	for (die = 0; die < SPI_NAND_N_CHIPS; die++)
+		spi_nand_sim_close(die);
+
+	return ret;
+}
+
+#endif /* SPI_NAND_HOST_SIM */
@@ -1,21 +1,23 @@
 #include "spi_nand.h"
+#include "spi_nand_engine.h"
+#include "spi_nand_timing.h"
+#ifdef SPI_NAND_HOST_SIM
+#include "spi_nand_sim.h"
+#else
 #include "gpio.h"
 #include "spi.h"
+#endif
 #include <stdlib.h>
 #include <string.h>
 
-#define ID_MANUFACTURER_MICRON 	0x2c
-#define ID_MICRON_1Gbit_3V3		0x14
-
-#define MAX_ADDRESS_BYTES 	3
-#define MAX_DUMMY_BYTES		2
-
 #define STATUS_OIP				0x01
+#define STATUS_WEL				0x02
+#define STATUS_CRBSY			0x80
 
-#define nand_spi hspi1
+#define CONFIG_OTP_ENABLE		0x40
+#define CONFIG_ECC_ENABLE		0x10
 
-#define PAGES_PER_BLOCK					64
-#define BAD_BLOCK_MARKER_OFFSET			0x800
+/* The bad block marker is at the start of the spare area. */
 #define BAD_BLOCK_MARKER_SIZE			4
 /*
  * Note that all functions of the form spi_nand_cmd_xxx
@@ -43,6 +45,9 @@ const struct nand_command_def cmd_def_get_features = 			{ 0x0f, 1, 0, 0, 0, 0};
 const struct nand_command_def cmd_def_set_features = 			{ 0x1f, 1, 0, 1, 0, 0};
 const struct nand_command_def cmd_def_read_id = 				{ 0x9f, 0, 1, 0, 0, 0};
 const struct nand_command_def cmd_def_page_read = 		 		{ 0x13, 3, 0, 0, 0, 0};
+const struct nand_command_def cmd_def_page_read_cache_random =	{ 0x30, 3, 0, 0, 0, 0};
+const struct nand_command_def cmd_def_page_read_cache_seq =		{ 0x31, 0, 0, 0, 0, 0};
+const struct nand_command_def cmd_def_page_read_cache_last =	{ 0x3f, 0, 0, 0, 0, 0};
 const struct nand_command_def cmd_def_read_from_cache_1 = 		{ 0x03, 2, 1, 0, 0, 0};
 const struct nand_command_def cmd_def_read_from_cache_4 = 		{ 0x6B, 2, 1, 0, 1, 0};
 const struct nand_command_def cmd_def_read_from_cache_quad = 	{ 0x6B, 2, 1, 0, 1, 1};
@@ -63,213 +68,521 @@ void print_buffer(const uint8_t *buffer, uint32_t buffer_size)
 		printf(" %02x%s", buffer[i], (i+1) & 0xf ? "" : "\n");
 }
 
+#ifndef SPI_NAND_HOST_SIM
 
-#if 1
+/*
+ * STM32 bus for the transaction engine.
+ * Short transfers use interrupt mode, longer ones DMA. Either way the HAL
+ * completion callbacks step the engine.
+ */
+static void spi_nand_bus_select(void *bus_ctx, int selected)
+{
+	struct spi_nand *nand = bus_ctx;
+
+	if (selected) {
+		/*
+		 * Call the CS function twice to ensure it has settled
+		 * before the SPI transaction starts.
+		 */
+		nand->cs(0);
+		nand->cs(0);
+	} else {
+		nand->cs(1);
+	}
+}
 
-static volatile uint32_t transmit_complete;
-static volatile uint32_t receive_complete;
+static int spi_nand_bus_transmit(void *bus_ctx, const uint8_t *buffer, uint32_t nbytes)
+{
+	SPI_HandleTypeDef *hspi = ((struct spi_nand *)bus_ctx)->bus;
 
-void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+	if (nbytes < 10)
+		return -HAL_SPI_Transmit_IT(hspi, (uint8_t *)buffer, nbytes);
+
+	return -HAL_SPI_Transmit_DMA(hspi, (uint8_t *)buffer, nbytes);
+}
+
+static int spi_nand_bus_receive(void *bus_ctx, uint8_t *buffer, uint32_t nbytes)
 {
-  (void)hspi;
-  transmit_complete = 1;
+	SPI_HandleTypeDef *hspi = ((struct spi_nand *)bus_ctx)->bus;
+
+	if (nbytes < 10)
+		return -HAL_SPI_Receive_IT(hspi, buffer, nbytes);
+
+	return -HAL_SPI_Receive_DMA(hspi, buffer, nbytes);
 }
 
-void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+static uint32_t spi_nand_bus_lock(void *bus_ctx)
 {
-  (void)hspi;
-  receive_complete = 1;
+	uint32_t flags = __get_PRIMASK();
+
+	(void)bus_ctx;
+	__disable_irq();
+	return flags;
 }
 
-static int spi_nand_transmit_data(const uint8_t *buffer, uint32_t buffer_size)
+static void spi_nand_bus_unlock(void *bus_ctx, uint32_t flags)
 {
-	int ret;
+	(void)bus_ctx;
+	__set_PRIMASK(flags);
+}
 
-	if (buffer_size < 10)
-		return HAL_SPI_Transmit(&nand_spi, (uint8_t *)buffer, buffer_size, 10);
+/*
+ * Each chip has a basic timer, run one shot at 1 MHz, so the engine can
+ * stay off the bus while the part is busy instead of polling back to back.
+ */
+static void spi_nand_bus_start_timer(void *bus_ctx, uint32_t us)
+{
+	TIM_TypeDef *tim = ((struct spi_nand *)bus_ctx)->timer;
+
+	/* The counter is 16 bits, a longer wait just polls early. */
+	if (us > 0xffff)
+		us = 0xffff;
+	tim->ARR = us;
+	tim->CNT = 0;
+	tim->CR1 |= TIM_CR1_CEN;
+}
 
-	transmit_complete = 0;
-	ret = HAL_SPI_Transmit_DMA(&nand_spi, (uint8_t *)buffer, buffer_size);
+static uint32_t spi_nand_bus_clock(void *bus_ctx)
+{
+	(void)bus_ctx;
+	return DWT->CYCCNT;
+}
 
-	if (ret < 0)
-		return ret;
+static const struct spi_nand_bus_ops spi_nand_stm32_bus_ops = {
+	.select = spi_nand_bus_select,
+	.transmit_async = spi_nand_bus_transmit,
+	.receive_async = spi_nand_bus_receive,
+	.lock = spi_nand_bus_lock,
+	.unlock = spi_nand_bus_unlock,
+	.start_timer = spi_nand_bus_start_timer,
+	.clock = spi_nand_bus_clock,
+};
+
+/*
+ * The chips we know about. Each one has its own SPI bus, so transactions
+ * on different chips run in parallel.
+ */
+struct spi_nand spi_nand_chips[SPI_NAND_N_CHIPS] = {
+	{
+		.name = "nand0",
+		.bus = &hspi1,
+		.timer = TIM6,
+		.cs = gpio_NAND_CS,
+		.die = 0,
+	},
+	{
+		.name = "nand1",
+		.bus = &hspi3,
+		.timer = TIM7,
+		.cs = gpio_NAND1_CS,
+		.die = 1,
+	},
+};
+
+static void spi_nand_bus_xfer_done(SPI_HandleTypeDef *hspi)
+{
+	uint32_t i;
 
-	while (!transmit_complete) {
-		/* Spin */
+	for (i = 0; i < SPI_NAND_N_CHIPS; i++) {
+		if (spi_nand_chips[i].bus == hspi)
+			spi_nand_engine_xfer_done(&spi_nand_chips[i].engine);
 	}
+}
 
-	return ret;
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	spi_nand_bus_xfer_done(hspi);
 }
 
-static int spi_nand_receive_data(uint8_t *buffer, uint32_t buffer_size)
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
 {
-	int ret;
+	spi_nand_bus_xfer_done(hspi);
+}
 
-	if (buffer_size < 10)
-		return HAL_SPI_Receive(&nand_spi, buffer, buffer_size, 10);
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+	/* Let the engine carry on, the data will be caught by ECC or checks. */
+	spi_nand_bus_xfer_done(hspi);
+}
 
-	receive_complete = 0;
-	ret = HAL_SPI_Receive_DMA(&nand_spi, buffer, buffer_size);
+static void spi_nand_bus_timer_done(TIM_TypeDef *tim)
+{
+	uint32_t i;
 
-	if (ret < 0)
-		return ret;
+	tim->SR = ~TIM_SR_UIF;
+	for (i = 0; i < SPI_NAND_N_CHIPS; i++) {
+		if (spi_nand_chips[i].timer == tim)
+			spi_nand_engine_timer_done(&spi_nand_chips[i].engine);
+	}
+}
+
+void TIM6_DAC_IRQHandler(void)
+{
+	spi_nand_bus_timer_done(TIM6);
+}
 
-	while (!receive_complete) {
-		/* Spin */
+void TIM7_IRQHandler(void)
+{
+	spi_nand_bus_timer_done(TIM7);
+}
+
+/* The APB1 timers run at twice PCLK1 when it is divided down. */
+static uint32_t spi_nand_timer_clock_hz(void)
+{
+	uint32_t hz = HAL_RCC_GetPCLK1Freq();
+
+	if ((RCC->CFGR & RCC_CFGR_PPRE1) != RCC_CFGR_PPRE1_DIV1)
+		hz *= 2;
+	return hz;
+}
+
+static void spi_nand_bus_init(struct spi_nand *nand)
+{
+	TIM_TypeDef *tim = nand->timer;
+	IRQn_Type irq;
+
+	if (tim == TIM6) {
+		__HAL_RCC_TIM6_CLK_ENABLE();
+		irq = TIM6_DAC_IRQn;
+	} else {
+		__HAL_RCC_TIM7_CLK_ENABLE();
+		irq = TIM7_IRQn;
 	}
 
-	return ret;
+	/* One shot, and only the count running out raises the interrupt. */
+	tim->CR1 = TIM_CR1_OPM | TIM_CR1_URS;
+	tim->PSC = spi_nand_timer_clock_hz() / 1000000 - 1;
+	tim->EGR = TIM_EGR_UG;
+	tim->SR = 0;
+	tim->DIER = TIM_DIER_UIE;
+
+	/* The same priority as SPI and DMA, so the engine is never reentered. */
+	HAL_NVIC_SetPriority(irq, 0, 0);
+	HAL_NVIC_EnableIRQ(irq);
+}
+
+#define SPI_NAND_BUS_OPS	(&spi_nand_stm32_bus_ops)
+
+/* The bus interrupts move things on while we wait. */
+static void spi_nand_spin(void)
+{
 }
 
 #else
 
-static int spi_nand_transmit_data(uint8_t *buffer, uint32_t buffer_size)
+/*
+ * Host build: the simulator is the bus, see spi_nand_sim.h. It moves the
+ * bus on when we wait.
+ */
+struct spi_nand spi_nand_chips[SPI_NAND_N_CHIPS] = {
+	{
+		.name = "nand0",
+		.die = 0,
+	},
+	{
+		.name = "nand1",
+		.die = 1,
+	},
+};
+
+#define SPI_NAND_BUS_OPS	(&spi_nand_sim_bus_ops)
+
+static void spi_nand_spin(void)
 {
-	return HAL_SPI_Transmit(&nand_spi, buffer, buffer_size, 10);
+	spi_nand_sim_step();
 }
 
-static int spi_nand_receive_data(uint8_t *buffer, uint32_t buffer_size)
+static void spi_nand_bus_init(struct spi_nand *nand)
 {
-	return HAL_SPI_Receive(&nand_spi, buffer, buffer_size, 10);
+	(void)nand;
 }
 
-#endif
+static void gpio_debug0(uint32_t val) { (void)val; }
+static void gpio_debug1(uint32_t val) { (void)val; }
+static void gpio_debug2(uint32_t val) { (void)val; }
+static void gpio_debug3(uint32_t val) { (void)val; }
 
+#endif /* SPI_NAND_HOST_SIM */
 
-/* Base transaction handler and
- * three variants of functions to perform transaction.
+/*
+ * Fill in a transaction from a command definition.
  */
-static int spi_nand_do_transaction(const uint8_t *header,
-								 uint32_t header_size,
-								 uint32_t data_is_tx,
-								 uint8_t *data,
-								 uint32_t data_size)
+static void spi_nand_txn_from_def(struct spi_nand_txn *txn,
+								  const struct nand_command_def *cmd,
+								  uint32_t address,
+								  uint8_t *data,
+								  uint32_t data_size)
 {
-	int ret = 0;
+	spi_nand_txn_setup(txn, cmd->opcode, cmd->n_addr, address, cmd->n_dummy);
+	txn->data_is_tx = cmd->data_is_tx;
+	txn->data = data;
+	txn->data_size = data_size;
+}
 
-	/*
-	 * Call the gpio_NAND_CS function twice to ensure it has settled
-	 * before the SPI transaction starts.
-	 */
-	gpio_NAND_CS(0);
-	gpio_NAND_CS(0);
-	/* Send transaction header (opcode, optional address, optional dummy) */
-	if (header && header_size)
-		ret = spi_nand_transmit_data(header, header_size);
+static void spi_nand_sync_done(struct spi_nand_txn *txn, void *ctx)
+{
+	(void)txn;
+	*(volatile uint32_t *)ctx = 1;
+}
 
-	/* Send or receive data if required. */
-	if (data_is_tx && data && data_size)
-		ret = spi_nand_transmit_data(data, data_size);
-	else if (data && data_size)
-		ret = spi_nand_receive_data(data, data_size);
+/*
+ * Run a transaction and wait for it to finish.
+ */
+static int spi_nand_run_txn(struct spi_nand *nand, struct spi_nand_txn *txn)
+{
+	volatile uint32_t done = 0;
 
-	/* Finish off SPI transaction by deselecting. */
-	gpio_NAND_CS(1);
+	txn->done = spi_nand_sync_done;
+	txn->ctx = (void *)&done;
+	spi_nand_engine_submit(&nand->engine, txn);
 
-	return ret;
-}
+	while (!done)
+		spi_nand_spin();
 
+	return txn->result;
+}
 
-static int spi_nand_transaction(const struct nand_command_def *cmd,
+static int spi_nand_transaction(struct spi_nand *nand, const struct nand_command_def *cmd,
 								uint32_t address,
 								uint8_t *data,
 								uint32_t data_size)
 {
-	uint8_t header[1 /* space for opcode */
-				   + MAX_ADDRESS_BYTES
-				   + MAX_DUMMY_BYTES];
-	uint32_t header_size;
-
-	header[0]= cmd->opcode;
-	header_size = 1;
-
-	/* Addresses are MSB first */
-	if (cmd->n_addr == 1) {
-		header[1] = (uint8_t) (address >> 0);
-		header_size = 2;
-	} else if (cmd->n_addr == 2) {
-		header[1] = (uint8_t) (address >> 8);
-		header[2] = (uint8_t) (address >> 0);
-		header_size = 3;
-	} else if (cmd->n_addr == 3) {
-		header[1] = (uint8_t) (address >> 16);
-		header[2] = (uint8_t) (address >> 8);
-		header[3] = (uint8_t) (address >> 0);
-		header_size = 4;
+	struct spi_nand_txn txn;
+
+	spi_nand_txn_from_def(&txn, cmd, address, data, data_size);
+
+	return spi_nand_run_txn(nand, &txn);
+}
+
+/*
+ * Gathered transactions.
+ * Buffer ops that are in column order and close together are sent as one
+ * command, with filler segments covering the gaps between them. Writes pad
+ * with 0xff, which leaves those bytes unprogrammed; reads throw the gap
+ * away. This lets a page's data and OOB go in one CS assertion instead of
+ * two commands.
+ */
+#define MAX_GATHER_GAP		64
+#define MAX_GATHER_SEGS		(2 * SPI_NAND_REQUEST_MAX_OPS)
+
+static uint8_t gather_fill[MAX_GATHER_GAP];
+static uint8_t gather_discard[MAX_GATHER_GAP];
+
+static void spi_nand_gather_init(void)
+{
+	memset(gather_fill, 0xff, sizeof(gather_fill));
+}
+
+/*
+ * Set up txn to cover as many of ops as can go in one command.
+ * column_base holds the plane select bit, see spi_nand_column_base().
+ * Returns the number of ops covered, and the number of segs used in
+ * *n_segs_used.
+ */
+static uint32_t spi_nand_txn_gather(struct spi_nand_txn *txn,
+									const struct nand_command_def *cmd,
+									uint32_t column_base,
+									struct spi_nand_buffer_op *ops,
+									uint32_t n_ops,
+									struct spi_nand_seg *segs,
+									uint32_t max_segs,
+									uint32_t *n_segs_used)
+{
+	uint32_t i;
+	uint32_t n_segs = 0;
+	uint32_t end;
+	uint32_t gap;
+
+	spi_nand_txn_from_def(txn, cmd, column_base | ops[0].offset, NULL, 0);
+
+	segs[n_segs].buffer = ops[0].buffer;
+	segs[n_segs].nbytes = ops[0].nbytes;
+	segs[n_segs].is_tx = cmd->data_is_tx;
+	n_segs++;
+	end = ops[0].offset + ops[0].nbytes;
+
+	for (i = 1; i < n_ops; i++) {
+		if (ops[i].offset < end)
+			break;
+		gap = ops[i].offset - end;
+		if (gap > MAX_GATHER_GAP || n_segs + 2 > max_segs)
+			break;
+
+		if (gap) {
+			segs[n_segs].buffer = cmd->data_is_tx ? gather_fill : gather_discard;
+			segs[n_segs].nbytes = gap;
+			segs[n_segs].is_tx = cmd->data_is_tx;
+			n_segs++;
+		}
+		segs[n_segs].buffer = ops[i].buffer;
+		segs[n_segs].nbytes = ops[i].nbytes;
+		segs[n_segs].is_tx = cmd->data_is_tx;
+		n_segs++;
+		end = ops[i].offset + ops[i].nbytes;
 	}
 
-	header_size += cmd->n_dummy;
+	txn->segs = segs;
+	txn->n_segs = n_segs;
+	if (n_segs_used)
+		*n_segs_used = n_segs;
+
+	return i;
+}
+
+/*
+ * On multi plane parts the column address carries a plane select bit,
+ * which has to match the plane of the block being read or programmed.
+ */
+static uint32_t spi_nand_plane(struct spi_nand *nand, uint32_t page)
+{
+	return (page / nand->geo.pages_per_block) & (nand->geo.n_planes - 1);
+}
+
+static uint32_t spi_nand_column_base(struct spi_nand *nand, uint32_t page)
+{
+	return spi_nand_plane(nand, page) << nand->geo.column_bits;
+}
 
-	return spi_nand_do_transaction(header, header_size,
-						 	    	cmd->data_is_tx,
-									data, data_size);
+int spi_nand_same_plane(struct spi_nand *nand, uint32_t page_a, uint32_t page_b)
+{
+	return spi_nand_plane(nand, page_a) == spi_nand_plane(nand, page_b);
 }
 
+/*
+ * Session state, see struct spi_nand_session.
+ */
+#define LOCK_NONE		0x02			/* Unlock all and disable nWP/nHOLD */
+#define LOCK_ALL		(0x7C | 0x02)	/* Lock all and disable nWP/nHOLD */
+
 /*
  * Commands used.
  */
 
-static int spi_nand_cmd_reset(void)
+static int spi_nand_cmd_reset(struct spi_nand *nand)
 {
-	return spi_nand_transaction(&cmd_def_reset, 0, NULL, 0);
+	return spi_nand_transaction(nand, &cmd_def_reset, 0, NULL, 0);
 }
 
 
-static int spi_nand_cmd_get_features(uint32_t address,
+static int spi_nand_cmd_get_features(struct spi_nand *nand, uint32_t address,
 									uint8_t *data)
 {
-	return spi_nand_transaction(&cmd_def_get_features,
+	return spi_nand_transaction(nand, &cmd_def_get_features,
 								address,
 								data, 1);
 }
 
-static int spi_nand_cmd_set_features(uint32_t address,
+static int spi_nand_cmd_set_features(struct spi_nand *nand, uint32_t address,
 						 	 	 	uint8_t data)
 {
-	return spi_nand_transaction(&cmd_def_set_features,
+	return spi_nand_transaction(nand, &cmd_def_set_features,
 								address,
 								&data, 1);
 }
 
-int spi_nand_cmd_read_id(uint8_t id[2])
+int spi_nand_cmd_read_id(struct spi_nand *nand, uint8_t id[2])
 {
-	return spi_nand_transaction(&cmd_def_read_id, 0, id, 2);
+	return spi_nand_transaction(nand, &cmd_def_read_id, 0, id, 2);
 }
 
-int spi_nand_cmd_read_array_to_cache(uint32_t page)
+int spi_nand_cmd_read_array_to_cache(struct spi_nand *nand, uint32_t page)
 {
-	return spi_nand_transaction(&cmd_def_page_read, page, NULL, 0);
+	return spi_nand_transaction(nand, &cmd_def_page_read, page, NULL, 0);
 }
 
-static int spi_nand_cmd_read_from_cache(uint32_t offset, uint8_t *buffer, uint32_t buffer_size)
+/*
+ * Cache read commands.
+ * These move the data register to the cache register and, except for
+ * read_cache_last, start loading the next page into the data register.
+ */
+static int spi_nand_cmd_read_cache_random(struct spi_nand *nand, uint32_t next_page)
 {
-	return spi_nand_transaction(&cmd_def_read_from_cache_1, offset, buffer, buffer_size);
+	return spi_nand_transaction(nand, &cmd_def_page_read_cache_random, next_page, NULL, 0);
+}
+
+static int spi_nand_cmd_read_cache_seq(struct spi_nand *nand)
+{
+	return spi_nand_transaction(nand, &cmd_def_page_read_cache_seq, 0, NULL, 0);
+}
+
+static int spi_nand_cmd_read_cache_last(struct spi_nand *nand)
+{
+	return spi_nand_transaction(nand, &cmd_def_page_read_cache_last, 0, NULL, 0);
+}
+
+static int spi_nand_cmd_read_from_cache(struct spi_nand *nand, uint32_t page,
+										struct spi_nand_buffer_op *ops, uint32_t n_ops)
+{
+	struct spi_nand_txn txn;
+	struct spi_nand_seg segs[MAX_GATHER_SEGS];
+	uint32_t n;
+	int ret = 0;
+
+	while (n_ops > 0) {
+		n = spi_nand_txn_gather(&txn, &cmd_def_read_from_cache_1,
+								spi_nand_column_base(nand, page), ops, n_ops,
+								segs, MAX_GATHER_SEGS, NULL);
+		ret = spi_nand_run_txn(nand, &txn);
+		ops += n;
+		n_ops -= n;
+	}
+
+	return ret;
 }
 
-int spi_nand_cmd_write_enable(int enable)
+int spi_nand_cmd_write_enable(struct spi_nand *nand, int enable)
 {
-	return spi_nand_transaction(enable ? &cmd_def_write_enable : &cmd_def_write_disable,
-								0, NULL, 0);
+	int ret;
+
+	ret = spi_nand_transaction(nand, enable ? &cmd_def_write_enable : &cmd_def_write_disable,
+							   0, NULL, 0);
+
+	/* If it did not get through the latch could be either way. */
+	nand->session.wel_valid = ret == 0;
+	nand->session.wel = enable;
+	return ret;
 }
 
-int spi_nand_cmd_erase_block(uint32_t block)
+/* Block erase takes a row address, the block's first page. */
+int spi_nand_cmd_erase_block(struct spi_nand *nand, uint32_t block)
 {
-	return spi_nand_transaction(&cmd_def_block_erase, block, NULL, 0);
+	return spi_nand_transaction(nand, &cmd_def_block_erase,
+								block * nand->geo.pages_per_block, NULL, 0);
 }
 
-static int spi_nand_cmd_program_execute(uint32_t page)
+static int spi_nand_cmd_program_execute(struct spi_nand *nand, uint32_t page)
 {
-	return spi_nand_transaction(&cmd_def_program_execute, page, NULL, 0);
+	return spi_nand_transaction(nand, &cmd_def_program_execute, page, NULL, 0);
 }
 
-static int spi_nand_cmd_program_load(uint32_t random_data, uint32_t offset,
-									 const uint8_t *buffer, uint32_t buffer_size)
+/*
+ * Unless random_data is set, the first load resets the cache register to
+ * 0xff. Any after that use random data load to keep what is already there.
+ */
+static int spi_nand_cmd_program_load(struct spi_nand *nand, uint32_t page,
+									 uint32_t random_data,
+									 struct spi_nand_buffer_op *ops, uint32_t n_ops)
 {
-	return spi_nand_transaction(random_data ?
+	struct spi_nand_txn txn;
+	struct spi_nand_seg segs[MAX_GATHER_SEGS];
+	uint32_t n;
+	int ret = 0;
+
+	while (n_ops > 0) {
+		n = spi_nand_txn_gather(&txn,
+								random_data ?
 									&cmd_def_program_load_random_1 :
 									&cmd_def_program_load_1,
-								offset,
-								(uint8_t *)buffer, buffer_size);
+								spi_nand_column_base(nand, page),
+								ops, n_ops,
+								segs, MAX_GATHER_SEGS, NULL);
+		ret = spi_nand_run_txn(nand, &txn);
+		random_data = 1;
+		ops += n;
+		n_ops -= n;
+	}
+
+	return ret;
 }
 
 /*
@@ -278,81 +591,252 @@ static int spi_nand_cmd_program_load(uint32_t random_data, uint32_t offset,
  * Feature 0xB0: Configuration.
  * Feature 0xc0: Status.
  */
-static int spi_nand_get_block_lock(uint8_t *lock)
+static int spi_nand_get_block_lock(struct spi_nand *nand, uint8_t *lock)
+{
+	return spi_nand_cmd_get_features(nand, 0xA0, lock);
+}
+
+static int spi_nand_set_block_lock(struct spi_nand *nand, uint8_t lock)
+{
+	int ret;
+
+	ret = spi_nand_cmd_set_features(nand, 0xA0, lock);
+
+	/* Only remember what the part has taken, a failed write may not have. */
+	nand->session.lock_valid = ret == 0;
+	nand->session.lock = lock;
+	return ret;
+}
+
+static int spi_unlock_all_blocks(struct spi_nand *nand)
+{
+	return spi_nand_set_block_lock(nand, LOCK_NONE);
+}
+
+static int spi_lock_all_blocks(struct spi_nand *nand)
+{
+	return spi_nand_set_block_lock(nand, LOCK_ALL);
+}
+
+/*
+ * Session checks.
+ * These say whether the command is needed and count it as issued or saved.
+ */
+static int spi_nand_session_need_unlock(struct spi_nand *nand, struct spi_nand_op_stats *st)
 {
-	return spi_nand_cmd_get_features(0xA0, lock);
+	if (nand->session.lock_valid && nand->session.lock == LOCK_NONE) {
+		st->n_saved++;
+		return 0;
+	}
+	st->n_issued++;
+	return 1;
 }
 
-static int spi_nand_set_block_lock(uint8_t lock)
+static int spi_nand_session_need_write_enable(struct spi_nand *nand, struct spi_nand_op_stats *st)
 {
-	return spi_nand_cmd_set_features(0xA0, lock);
+	if (nand->session.wel_valid && nand->session.wel) {
+		st->n_saved++;
+		return 0;
+	}
+	st->n_issued++;
+	return 1;
 }
 
-static int spi_unlock_all_blocks(void)
+/*
+ * Program execute and block erase clear the write enable latch when they
+ * complete, so the next one has to set it again.
+ */
+static void spi_nand_session_write_done(struct spi_nand *nand)
 {
-	/* Unlock all and disable nWP/nHOLD */
-	return spi_nand_set_block_lock(0x2);
+	nand->session.wel_valid = 1;
+	nand->session.wel = 0;
 }
 
-static int spi_lock_all_blocks(void)
+static int spi_nand_session_prepare_write(struct spi_nand *nand, struct spi_nand_op_stats *st)
 {
-	/* Lock all and disable nWP/nHOLD */
-	return spi_nand_set_block_lock(0x7C | 0x2);
+	int ret = 0;
+
+	st->n_ops++;
+	if (spi_nand_session_need_unlock(nand, st)) {
+		ret = spi_unlock_all_blocks(nand);
+		if (ret < 0)
+			return ret;
+	}
+	if (spi_nand_session_need_write_enable(nand, st))
+		ret = spi_nand_cmd_write_enable(nand, 1);
+
+	return ret;
 }
 
 /*
  * Configuration functions.
  */
-static int spi_nand_get_configuration(uint8_t *cfg)
+static int spi_nand_get_configuration(struct spi_nand *nand, uint8_t *cfg)
 {
-	return spi_nand_cmd_get_features(0xB0, cfg);
+	return spi_nand_cmd_get_features(nand, 0xB0, cfg);
 }
 
-static int spi_nand_set_configuration(uint8_t cfg)
+static int spi_nand_set_configuration(struct spi_nand *nand, uint8_t cfg)
 {
-	return spi_nand_cmd_set_features(0xB0, cfg);
+	return spi_nand_cmd_set_features(nand, 0xB0, cfg);
 }
 
 /* Status is read only. */
-static int spi_nand_get_status(uint8_t *status)
+static int spi_nand_get_status(struct spi_nand *nand, uint8_t *status)
 {
-	return spi_nand_cmd_get_features(0xc0, status);
+	return spi_nand_cmd_get_features(nand, 0xc0, status);
 }
 
+#ifndef SPI_NAND_HOST_SIM
 /*
- * Wait until status is no longer busy and pass back status.
+ * Microsecond timing from the DWT cycle counter.
  */
-static int spi_nand_wait_not_busy(const char *label, uint8_t *statusptr)
+static void spi_nand_clock_init(void)
 {
-	int n = 0;
-	uint8_t status;
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+static uint32_t spi_nand_cycles(void)
+{
+	return DWT->CYCCNT;
+}
+
+static uint32_t spi_nand_cycles_per_us(void)
+{
+	return SystemCoreClock / 1000000;
+}
+
+static void spi_nand_delay_us(uint32_t us)
+{
+	uint32_t start = DWT->CYCCNT;
+	uint32_t cycles = us * spi_nand_cycles_per_us();
+
+	while (DWT->CYCCNT - start < cycles) {
+		/* Spin, off the bus */
+	}
+}
+#else
+/* Simulated time. */
+static void spi_nand_clock_init(void)
+{
+}
+
+static uint32_t spi_nand_cycles(void)
+{
+	return spi_nand_sim_cycles();
+}
+
+static uint32_t spi_nand_cycles_per_us(void)
+{
+	return SPI_NAND_SIM_CYCLES_PER_US;
+}
+
+static void spi_nand_delay_us(uint32_t us)
+{
+	spi_nand_sim_delay_us(us);
+}
+#endif
+
+uint32_t spi_nand_clock_cycles(void)
+{
+	return spi_nand_cycles();
+}
+
+uint32_t spi_nand_clock_cycles_per_us(void)
+{
+	return spi_nand_cycles_per_us();
+}
+
+/*
+ * Wait until the status bits in mask are clear and pass back status.
+ *
+ * Rather than hammer the bus with status reads, stay off it for most of
+ * the time the operation is expected to take and then poll at an interval
+ * scaled to the operation. The measured busy time feeds back into the
+ * model. It includes up to one poll interval of overshoot, which is what
+ * a caller actually waits anyway.
+ */
+static int spi_nand_wait_status_clear(struct spi_nand *nand, uint8_t mask,
+									  enum spi_nand_timing_op op,
+									  const char *label,
+									  uint8_t *statusptr)
+{
+	uint32_t start = spi_nand_cycles();
+	uint32_t interval;
+	uint32_t n = 0;
+	uint32_t busy_us;
+	uint8_t status = 0;
 	int ret;
 
+	spi_nand_delay_us(spi_nand_timing_first_poll_us(nand->die, op));
+	interval = spi_nand_timing_poll_interval_us(nand->die, op);
+
 	while(1) {
-		ret = spi_nand_get_status(&status);
-		if ((status & STATUS_OIP) == 0)
-			break;
+		ret = spi_nand_get_status(nand, &status);
 		n++;
+		if (ret < 0 || (status & mask) == 0)
+			break;
+		spi_nand_delay_us(interval);
 	}
+
+	busy_us = (spi_nand_cycles() - start) / spi_nand_cycles_per_us();
+	spi_nand_timing_record(nand->die, op, busy_us, n);
+
 	if (label)
-		dprintf("%s took %d status reads while busy\n", label, n);
+		dprintf("%s took %lu us, %lu status reads\n", label, busy_us, n);
 	if (statusptr)
 		*statusptr = status;
 
 	return ret;
 }
 
+/*
+ * Wait until status is no longer busy and pass back status.
+ */
+static int spi_nand_wait_not_busy(struct spi_nand *nand, enum spi_nand_timing_op op,
+								  const char *label, uint8_t *statusptr)
+{
+	return spi_nand_wait_status_clear(nand, STATUS_OIP, op, label, statusptr);
+}
+
+/*
+ * Take the part out of cache read mode.
+ * This must be done before any command other than a cache read.
+ */
+static int spi_nand_cache_read_stop(struct spi_nand *nand)
+{
+	int ret;
+
+	if (!nand->cache_read.active)
+		return 0;
+
+	nand->cache_read.active = 0;
+	ret = spi_nand_cmd_read_cache_last(nand);
+	if (ret < 0)
+		return ret;
+
+	return spi_nand_wait_status_clear(nand, STATUS_OIP | STATUS_CRBSY,
+									  SPI_NAND_OP_READ, NULL, NULL);
+}
+
 /*
  * Higher level commands
  */
-int spi_nand_reset(void)
+int spi_nand_reset(struct spi_nand *nand)
 {
-	int ret = spi_nand_cmd_reset();
-	spi_nand_wait_not_busy(NULL /* "reset" */, NULL);
+	int ret;
+
+	nand->cache_read.active = 0;
+	nand->session.lock_valid = 0;
+	nand->session.wel_valid = 0;
+	ret = spi_nand_cmd_reset(nand);
+	spi_nand_wait_not_busy(nand, SPI_NAND_OP_OTHER, NULL /* "reset" */, NULL);
 	return ret;
 }
 
-int spi_nand_ecc_enable(unsigned enable)
+int spi_nand_ecc_enable(struct spi_nand *nand, unsigned enable)
 {
 	int ret;
 	uint8_t config0;
@@ -360,16 +844,16 @@ int spi_nand_ecc_enable(unsigned enable)
 
 
 	/* If need be, reconfigure the configuration byte to enable ECC. */
-	ret = spi_nand_get_configuration(&config0);
+	ret = spi_nand_get_configuration(nand, &config0);
 
 	if (enable)
-		config1 = config0 | 0x10;
+		config1 = config0 | CONFIG_ECC_ENABLE;
 	else
-		config1 = config0 & ~0x10;
+		config1 = config0 & ~CONFIG_ECC_ENABLE;
 
 	if (config0 != config1) {
-		ret = spi_nand_set_configuration(config1);
-		ret = spi_nand_get_configuration(&config1);
+		ret = spi_nand_set_configuration(nand, config1);
+		ret = spi_nand_get_configuration(nand, &config1);
 	}
 
 	dprintf("%s ECC, configuration changed from %02x to %02x\n",
@@ -379,68 +863,192 @@ int spi_nand_ecc_enable(unsigned enable)
 	return ret;
 }
 
-static int spi_nand_check_id(void)
+/*
+ * Read the parameter page. It is in the OTP area, page SPI_NAND_PARAM_PAGE,
+ * and holds several copies in case one is damaged.
+ * Returns -1 if no copy is valid, -2 if the part cannot be driven.
+ */
+static int spi_nand_read_param_page(struct spi_nand *nand, struct spi_nand_part *part)
 {
-	int ret;
-	uint8_t id[2];
+	uint8_t pp[SPI_NAND_PARAM_PAGE_SIZE];
+	struct spi_nand_buffer_op op;
+	uint8_t config;
+	uint8_t status;
+	uint32_t i;
+	int ret = -1;
 
-	/* Check it is the expected part: */
-	ret = spi_nand_cmd_read_id(id);
-	if (id[0] != ID_MANUFACTURER_MICRON ||
-		id[1] != ID_MICRON_1Gbit_3V3) {
+	spi_nand_get_configuration(nand, &config);
+	spi_nand_set_configuration(nand, config | CONFIG_OTP_ENABLE);
 
-		dprintf("Got wrong id: expected %02X,%02X got %02X,%02X\n",
-				ID_MANUFACTURER_MICRON, ID_MICRON_1Gbit_3V3,
-				id[0], id[1]);
-		return -1;
+	spi_nand_cmd_read_array_to_cache(nand, SPI_NAND_PARAM_PAGE);
+	spi_nand_wait_not_busy(nand, SPI_NAND_OP_READ, NULL, &status);
+
+	for (i = 0; i < SPI_NAND_PARAM_PAGE_COPIES && ret == -1; i++) {
+		op.offset = i * SPI_NAND_PARAM_PAGE_SIZE;
+		op.buffer = pp;
+		op.nbytes = sizeof(pp);
+		spi_nand_cmd_read_from_cache(nand, 0, &op, 1);
+		ret = spi_nand_part_from_param_page(pp, part);
+	}
+
+	if (ret == 0) {
+		/* Model name, space padded. */
+		memcpy(nand->model, &pp[44], 20);
+		nand->model[20] = 0;
+		for (i = 20; i > 0 && nand->model[i - 1] == ' '; i--)
+			nand->model[i - 1] = 0;
 	}
+
+	spi_nand_set_configuration(nand, config);
+
 	return ret;
 }
 
-int spi_nand_init(void)
+int spi_nand_probe(struct spi_nand *nand)
 {
 	int ret;
+	uint8_t id[2];
 	uint8_t status;
+	const struct spi_nand_part *known;
+	struct spi_nand_part part;
+
+	spi_nand_engine_init(&nand->engine, SPI_NAND_BUS_OPS, nand);
+	if (!nand->initialised) {
+		/* Once only, so what the timing model learns outlives a remount. */
+		spi_nand_clock_init();
+		spi_nand_gather_init();
+		spi_nand_bus_init(nand);
+		spi_nand_timing_init(nand->die);
+		nand->initialised = 1;
+	}
 
 	/* Read status a couple of times to clear the bus. */
-	spi_nand_get_status(&status);
-	spi_nand_get_status(&status);
+	spi_nand_get_status(nand, &status);
+	spi_nand_get_status(nand, &status);
 
 	/* Reset to get the right starting state. */
-	ret = spi_nand_reset();
+	ret = spi_nand_reset(nand);
 
-	ret = spi_nand_check_id();
+	ret = spi_nand_cmd_read_id(nand, id);
+	if (ret < 0)
+		return ret;
 
-	ret = spi_nand_cmd_write_enable(0);
-	ret = spi_lock_all_blocks();
-	ret = spi_nand_ecc_enable(1);
+	known = spi_nand_part_lookup(id[0], id[1]);
+	if (known)
+		part = *known;
+	else
+		memset(&part, 0, sizeof(part));
+
+	/* The geometry is needed to read anything, start with one page. */
+	nand->geo.pages_per_block = 1;
+	nand->geo.n_planes = 1;
+
+	ret = spi_nand_read_param_page(nand, &part);
+	if (ret == 0) {
+		if (!known)
+			part.name = nand->model;
+	} else if (ret == -2) {
+		dprintf("%s: part %02X,%02X has more LUNs, planes or page than supported\n",
+				nand->name, id[0], id[1]);
+		return -1;
+	} else if (!known) {
+		dprintf("%s: unknown part %02X,%02X and no parameter page\n",
+				nand->name, id[0], id[1]);
+		return -1;
+	}
 
-	return ret;
-}
+	spi_nand_part_finish_geometry(&part.geo);
+	nand->geo = part.geo;
+	nand->part_name = part.name;
 
+	if (part.t_read_us)
+		spi_nand_timing_seed(nand->die, SPI_NAND_OP_READ, part.t_read_us);
+	if (part.t_prog_us)
+		spi_nand_timing_seed(nand->die, SPI_NAND_OP_PROGRAM, part.t_prog_us);
+	if (part.t_erase_us)
+		spi_nand_timing_seed(nand->die, SPI_NAND_OP_ERASE, part.t_erase_us);
 
-int spi_nand_read_page(uint32_t page,
-					   struct spi_nand_buffer_op *ops,
-					   uint32_t n_ops,
-					   uint8_t *statusptr)
+	dprintf("%s: %s, %lu+%lu byte pages, %lu pages per block, %lu blocks, %lu planes\n",
+			nand->name, nand->part_name,
+			nand->geo.data_bytes_per_page, nand->geo.spare_bytes_per_page,
+			nand->geo.pages_per_block, nand->geo.n_blocks, nand->geo.n_planes);
+
+	return 0;
+}
+
+int spi_nand_init(struct spi_nand *nand)
 {
 	int ret;
+
+	/* The geometry is only set by a probe that worked, don't redo it. */
+	if (!nand->geo.n_blocks) {
+		ret = spi_nand_probe(nand);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = spi_nand_cmd_write_enable(nand, 0);
+	ret = spi_lock_all_blocks(nand);
+	ret = spi_nand_ecc_enable(nand, 1);
+
+	return ret;
+}
+
+int spi_nand_read_page_pipelined(struct spi_nand *nand, uint32_t page,
+								 uint32_t next_page,
+								 struct spi_nand_buffer_op *ops,
+								 uint32_t n_ops,
+								 uint8_t *statusptr)
+{
+	int ret = 0;
 	uint8_t status;
-	uint32_t i;
 
 	gpio_debug0(1);
-	ret = spi_nand_cmd_read_array_to_cache(page);
+	if (!nand->cache_read.active || nand->cache_read.next_page != page) {
+		/* Not already on its way, start a fresh array read. */
+		ret = spi_nand_cache_read_stop(nand);
+		ret = spi_nand_cmd_read_array_to_cache(nand, page);
+
+		if (next_page == SPI_NAND_NO_PAGE) {
+			/* Plain page read, the data lands straight in the cache. */
+			gpio_debug0(0);
+			gpio_debug1(1);
+			ret = spi_nand_wait_not_busy(nand, SPI_NAND_OP_READ,
+										 NULL /* "reading" */, &status);
+			gpio_debug1(0);
+			goto read_cache;
+		}
+
+		ret = spi_nand_wait_not_busy(nand, SPI_NAND_OP_READ, NULL, &status);
+	}
+
+	/*
+	 * page is now in the data register.
+	 * Move it to the cache and, if there is a following page, start
+	 * loading it while we drain this one.
+	 */
+	if (next_page == SPI_NAND_NO_PAGE) {
+		nand->cache_read.active = 0;
+		ret = spi_nand_cmd_read_cache_last(nand);
+	} else {
+		if (next_page == page + 1)
+			ret = spi_nand_cmd_read_cache_seq(nand);
+		else
+			ret = spi_nand_cmd_read_cache_random(nand, next_page);
+		nand->cache_read.active = 1;
+		nand->cache_read.next_page = next_page;
+	}
 	gpio_debug0(0);
 
 	gpio_debug1(1);
-
-	ret = spi_nand_wait_not_busy(NULL /* "reading" */, &status);
+	/* Only wait for the cache to fill, not for the array read (CRBSY). */
+	ret = spi_nand_wait_not_busy(nand, SPI_NAND_OP_CACHE_READ,
+								 NULL /* "reading" */, &status);
 	gpio_debug1(0);
+
+read_cache:
 	gpio_debug2(1);
-	for(i = 0; i < n_ops; i++) {
-		ret = spi_nand_cmd_read_from_cache(ops->offset, ops->buffer, ops->nbytes);
-		ops++;
-	}
+	ret = spi_nand_cmd_read_from_cache(nand, page, ops, n_ops);
 	gpio_debug2(0);
 
 	if (statusptr)
@@ -449,29 +1057,38 @@ int spi_nand_read_page(uint32_t page,
 	return ret;
 }
 
-int spi_nand_write_page(uint32_t page,
+int spi_nand_read_page(struct spi_nand *nand, uint32_t page,
+					   struct spi_nand_buffer_op *ops,
+					   uint32_t n_ops,
+					   uint8_t *statusptr)
+{
+	return spi_nand_read_page_pipelined(nand, page, SPI_NAND_NO_PAGE,
+										ops, n_ops, statusptr);
+}
+
+int spi_nand_write_page(struct spi_nand *nand, uint32_t page,
 		   	   	   	    struct spi_nand_buffer_op *ops,
 						uint32_t n_ops,
 						uint8_t *statusptr)
 {
 	int ret;
 	uint8_t status;
-	uint32_t i;
 
-	ret = spi_nand_cmd_write_enable(1);
-	ret = spi_unlock_all_blocks();
+	ret = spi_nand_cache_read_stop(nand);
+	ret = spi_nand_session_prepare_write(nand, &nand->session.stats.program);
+	if (ret < 0)
+		return ret;
 
 	gpio_debug3(1);
 
-	for(i = 0; i < n_ops; i++) {
-		ret = spi_nand_cmd_program_load(i != 0, ops->offset, ops->buffer, ops->nbytes);
-		ops++;
-	}
+	ret = spi_nand_cmd_program_load(nand, page, 0, ops, n_ops);
 	gpio_debug3(0);
 
-	ret = spi_nand_cmd_program_execute(page);
+	ret = spi_nand_cmd_program_execute(nand, page);
+	spi_nand_session_write_done(nand);
 
-	ret = spi_nand_wait_not_busy(NULL /* "writing" */, &status);
+	ret = spi_nand_wait_not_busy(nand, SPI_NAND_OP_PROGRAM,
+								 NULL /* "writing" */, &status);
 
 	if (statusptr)
 		*statusptr = status;
@@ -479,16 +1096,68 @@ int spi_nand_write_page(uint32_t page,
 	return ret;
 }
 
-int spi_nand_erase_block(uint32_t block, uint8_t *statusptr)
+/*
+ * Internal data move.
+ * The source page is read into the cache register, the bytes described by
+ * ops are patched in with random data load and the result is programmed to
+ * dst_page. Only the patch bytes cross the bus.
+ * The source is read with ECC on, so any correctable errors are fixed
+ * before it is programmed again. If the source has uncorrectable errors
+ * nothing is programmed and -1 is returned.
+ * Source and destination must be on the same plane.
+ */
+int spi_nand_copy_page(struct spi_nand *nand,
+					   uint32_t src_page,
+					   uint32_t dst_page,
+					   struct spi_nand_buffer_op *ops,
+					   uint32_t n_ops,
+					   uint8_t *statusptr)
 {
 	int ret;
 	uint8_t status;
 
-	ret = spi_nand_cmd_write_enable(1);
-	ret = spi_unlock_all_blocks();
-	ret = spi_nand_cmd_erase_block(block);
+	if (!spi_nand_same_plane(nand, src_page, dst_page))
+		return -1;
+
+	ret = spi_nand_cache_read_stop(nand);
+	ret = spi_nand_cmd_read_array_to_cache(nand, src_page);
+	ret = spi_nand_wait_not_busy(nand, SPI_NAND_OP_READ, NULL, &status);
+	if (ret < 0 || ((status >> 4) & 7) == 2)
+		return -1;
+
+	ret = spi_nand_session_prepare_write(nand, &nand->session.stats.copy);
+	if (ret < 0)
+		return ret;
+
+	if (n_ops)
+		ret = spi_nand_cmd_program_load(nand, dst_page, 1, ops, n_ops);
+
+	ret = spi_nand_cmd_program_execute(nand, dst_page);
+	spi_nand_session_write_done(nand);
+
+	ret = spi_nand_wait_not_busy(nand, SPI_NAND_OP_PROGRAM,
+								 NULL /* "copying" */, &status);
+
+	if (statusptr)
+		*statusptr = status;
+
+	return ret;
+}
+
+int spi_nand_erase_block(struct spi_nand *nand, uint32_t block, uint8_t *statusptr)
+{
+	int ret;
+	uint8_t status;
+
+	ret = spi_nand_cache_read_stop(nand);
+	ret = spi_nand_session_prepare_write(nand, &nand->session.stats.erase);
+	if (ret < 0)
+		return ret;
+	ret = spi_nand_cmd_erase_block(nand, block);
+	spi_nand_session_write_done(nand);
 
-	ret = spi_nand_wait_not_busy(NULL /*"erasing" */, &status);
+	ret = spi_nand_wait_not_busy(nand, SPI_NAND_OP_ERASE,
+								 NULL /*"erasing" */, &status);
 
 	if (statusptr)
 		*statusptr = status;
@@ -497,7 +1166,291 @@ int spi_nand_erase_block(uint32_t block, uint8_t *statusptr)
 }
 
 
-int spi_nand_check_block_ok(uint32_t block, uint32_t *is_ok)
+/*
+ * Asynchronous page operations.
+ * These queue all the transactions for the operation and return at once.
+ * The request's done callback is called, from interrupt context, once the
+ * last transaction has finished.
+ * The engine paces the status polls from the timing model, and the busy
+ * time it measures goes back into the model as for the sync waits.
+ */
+static void spi_nand_request_txn_done(struct spi_nand_txn *txn, void *ctx)
+{
+	struct spi_nand_request *req = ctx;
+
+	if (txn->result < 0 && req->result == 0)
+		req->result = txn->result;
+	if (txn->poll_mask) {
+		req->status = txn->status;
+		if (txn->result == 0)
+			spi_nand_timing_record(req->die, req->op,
+								   txn->busy_ticks / spi_nand_cycles_per_us(),
+								   txn->n_polls);
+	}
+
+	req->n_done++;
+	if (req->n_done == req->n_txns) {
+		req->complete = 1;
+		if (req->done)
+			req->done(req, req->ctx);
+	}
+}
+
+/*
+ * Add gathered transactions covering all of ops, using first_cmd for the
+ * first and cmd for the rest.
+ */
+static void spi_nand_request_add_ops(struct spi_nand_request *req,
+									 const struct nand_command_def *first_cmd,
+									 const struct nand_command_def *cmd,
+									 uint32_t column_base,
+									 struct spi_nand_buffer_op *ops,
+									 uint32_t n_ops)
+{
+	struct spi_nand_txn *txn;
+	uint32_t n;
+	uint32_t n_segs;
+
+	while (n_ops > 0) {
+		txn = &req->txn[req->n_txns++];
+		n = spi_nand_txn_gather(txn, first_cmd, column_base, ops, n_ops,
+								&req->seg[req->n_segs],
+								SPI_NAND_REQUEST_MAX_SEGS - req->n_segs,
+								&n_segs);
+		txn->done = spi_nand_request_txn_done;
+		txn->ctx = req;
+		req->n_segs += n_segs;
+		first_cmd = cmd;
+		ops += n;
+		n_ops -= n;
+	}
+}
+
+static struct spi_nand_txn *spi_nand_request_add(struct spi_nand_request *req,
+												 const struct nand_command_def *cmd,
+												 uint32_t address,
+												 uint8_t *data,
+												 uint32_t data_size)
+{
+	struct spi_nand_txn *txn = &req->txn[req->n_txns++];
+
+	spi_nand_txn_from_def(txn, cmd, address, data, data_size);
+	txn->done = spi_nand_request_txn_done;
+	txn->ctx = req;
+
+	return txn;
+}
+
+static void spi_nand_request_init(struct spi_nand *nand,
+								  struct spi_nand_request *req,
+								  enum spi_nand_timing_op op,
+								  spi_nand_request_done_fn done,
+								  void *ctx)
+{
+	req->nand = nand;
+	req->die = nand->die;
+	req->op = op;
+	req->n_txns = 0;
+	req->n_segs = 0;
+	req->n_done = 0;
+	req->status = 0;
+	req->result = 0;
+	req->complete = 0;
+	req->done = done;
+	req->ctx = ctx;
+}
+
+/* Poll txn until the part is ready, paced like the sync waits. */
+static void spi_nand_request_poll(struct spi_nand *nand,
+								  struct spi_nand_txn *txn,
+								  enum spi_nand_timing_op op)
+{
+	txn->poll_mask = STATUS_OIP;
+	txn->poll_delay_us = spi_nand_timing_first_poll_us(nand->die, op);
+	txn->poll_interval_us = spi_nand_timing_poll_interval_us(nand->die, op);
+}
+
+/* Queue the unlock and write enable the write needs, as the sync calls do. */
+static void spi_nand_request_prepare_write(struct spi_nand *nand,
+										   struct spi_nand_request *req,
+										   struct spi_nand_op_stats *st)
+{
+	st->n_ops++;
+	if (spi_nand_session_need_unlock(nand, st)) {
+		req->lock_value = LOCK_NONE;
+		spi_nand_request_add(req, &cmd_def_set_features, 0xA0,
+							 &req->lock_value, 1);
+		nand->session.lock_valid = 1;
+		nand->session.lock = LOCK_NONE;
+	}
+	if (spi_nand_session_need_write_enable(nand, st))
+		spi_nand_request_add(req, &cmd_def_write_enable, 0, NULL, 0);
+}
+
+static void spi_nand_request_submit(struct spi_nand *nand, struct spi_nand_request *req)
+{
+	uint32_t i;
+	uint32_t n_txns = req->n_txns;
+
+	/* n_txns is stable from here on, completions may start at once. */
+	for (i = 0; i < n_txns; i++)
+		spi_nand_engine_submit(&nand->engine, &req->txn[i]);
+}
+
+int spi_nand_read_page_async(struct spi_nand *nand, uint32_t page,
+							 struct spi_nand_buffer_op *ops,
+							 uint32_t n_ops,
+							 struct spi_nand_request *req,
+							 spi_nand_request_done_fn done,
+							 void *ctx)
+{
+	struct spi_nand_txn *txn;
+	int ret;
+
+	if (n_ops > SPI_NAND_REQUEST_MAX_OPS)
+		return -1;
+
+	ret = spi_nand_cache_read_stop(nand);
+	if (ret < 0)
+		return ret;
+
+	spi_nand_request_init(nand, req, SPI_NAND_OP_READ, done, ctx);
+
+	txn = spi_nand_request_add(req, &cmd_def_page_read, page, NULL, 0);
+	spi_nand_request_poll(nand, txn, SPI_NAND_OP_READ);
+
+	spi_nand_request_add_ops(req, &cmd_def_read_from_cache_1,
+							 &cmd_def_read_from_cache_1,
+							 spi_nand_column_base(nand, page), ops, n_ops);
+
+	spi_nand_request_submit(nand, req);
+
+	return 0;
+}
+
+int spi_nand_write_page_async(struct spi_nand *nand, uint32_t page,
+							  struct spi_nand_buffer_op *ops,
+							  uint32_t n_ops,
+							  struct spi_nand_request *req,
+							  spi_nand_request_done_fn done,
+							  void *ctx)
+{
+	struct spi_nand_txn *txn;
+	int ret;
+
+	if (n_ops > SPI_NAND_REQUEST_MAX_OPS)
+		return -1;
+
+	ret = spi_nand_cache_read_stop(nand);
+	if (ret < 0)
+		return ret;
+
+	spi_nand_request_init(nand, req, SPI_NAND_OP_PROGRAM, done, ctx);
+	spi_nand_request_prepare_write(nand, req, &nand->session.stats.program);
+
+	spi_nand_request_add_ops(req, &cmd_def_program_load_1,
+							 &cmd_def_program_load_random_1,
+							 spi_nand_column_base(nand, page), ops, n_ops);
+
+	txn = spi_nand_request_add(req, &cmd_def_program_execute, page, NULL, 0);
+	spi_nand_request_poll(nand, txn, SPI_NAND_OP_PROGRAM);
+	spi_nand_session_write_done(nand);
+
+	spi_nand_request_submit(nand, req);
+
+	return 0;
+}
+
+int spi_nand_erase_block_async(struct spi_nand *nand, uint32_t block,
+							   struct spi_nand_request *req,
+							   spi_nand_request_done_fn done,
+							   void *ctx)
+{
+	struct spi_nand_txn *txn;
+	int ret;
+
+	ret = spi_nand_cache_read_stop(nand);
+	if (ret < 0)
+		return ret;
+
+	spi_nand_request_init(nand, req, SPI_NAND_OP_ERASE, done, ctx);
+	spi_nand_request_prepare_write(nand, req, &nand->session.stats.erase);
+
+	/* Block erase takes a row address, the block's first page. */
+	txn = spi_nand_request_add(req, &cmd_def_block_erase,
+							   block * nand->geo.pages_per_block, NULL, 0);
+	spi_nand_request_poll(nand, txn, SPI_NAND_OP_ERASE);
+	spi_nand_session_write_done(nand);
+
+	spi_nand_request_submit(nand, req);
+
+	return 0;
+}
+
+int spi_nand_request_wait(struct spi_nand_request *req, uint8_t *statusptr)
+{
+	while (!req->complete)
+		spi_nand_spin();
+
+	/*
+	 * The session was moved on when the write was queued. If it failed
+	 * the lock and write enable latch could be either way now.
+	 */
+	if (req->result < 0 && req->op != SPI_NAND_OP_READ) {
+		req->nand->session.lock_valid = 0;
+		req->nand->session.wel_valid = 0;
+	}
+
+	if (statusptr)
+		*statusptr = req->status;
+
+	return req->result;
+}
+
+
+/*
+ * Put the part back into its write protected resting state: all blocks
+ * locked and the write enable latch clear.
+ * Writes and erases unlock again as needed.
+ */
+int spi_nand_lock_down(struct spi_nand *nand)
+{
+	int ret = 0;
+	struct spi_nand_op_stats *st = &nand->session.stats.lock_down;
+
+	ret = spi_nand_cache_read_stop(nand);
+
+	st->n_ops++;
+	if (nand->session.lock_valid && nand->session.lock == LOCK_ALL) {
+		st->n_saved++;
+	} else {
+		st->n_issued++;
+		if (spi_lock_all_blocks(nand) < 0 && ret == 0)
+			ret = -1;
+	}
+
+	if (nand->session.wel_valid && !nand->session.wel) {
+		st->n_saved++;
+	} else {
+		st->n_issued++;
+		if (spi_nand_cmd_write_enable(nand, 0) < 0 && ret == 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+void spi_nand_get_session_stats(struct spi_nand *nand, struct spi_nand_session_stats *stats)
+{
+	*stats = nand->session.stats;
+}
+
+void spi_nand_clear_session_stats(struct spi_nand *nand)
+{
+	memset(&nand->session.stats, 0, sizeof(nand->session.stats));
+}
+
+int spi_nand_check_block_ok(struct spi_nand *nand, uint32_t block, uint32_t *is_ok)
 {
 	int ret;
 	uint8_t buffer[BAD_BLOCK_MARKER_SIZE];
@@ -505,15 +1458,15 @@ int spi_nand_check_block_ok(uint32_t block, uint32_t *is_ok)
 	uint32_t ok;
 	struct spi_nand_buffer_op op;
 
-	op.offset = BAD_BLOCK_MARKER_OFFSET;
+	op.offset = nand->geo.data_bytes_per_page;
 	op.buffer = buffer;
 	op.nbytes = sizeof(buffer);
 
-	ret = spi_nand_read_page(block * PAGES_PER_BLOCK, &op, 1, &status);
+	ret = spi_nand_read_page(nand, block * nand->geo.pages_per_block, &op, 1, &status);
 	ok = (buffer[0] == 0xff && buffer[1] == 0xff);
 
 	if (0 && !ok) {
-		int i;
+		uint32_t i;
 
 		dprintf("block %lu, read bytes returned %d: status %02x, bytes",
 					block, ret, status);
@@ -527,68 +1480,66 @@ int spi_nand_check_block_ok(uint32_t block, uint32_t *is_ok)
 	return ret;
 }
 
-int spi_nand_mark_block_bad(uint32_t block, uint8_t *status)
+int spi_nand_mark_block_bad(struct spi_nand *nand, uint32_t block, uint8_t *status)
 {
 	uint8_t buffer[16] = {0};
 	int ret;
 	uint8_t config;
 	struct spi_nand_buffer_op op;
 
-	op.offset = BAD_BLOCK_MARKER_OFFSET;
+	op.offset = nand->geo.data_bytes_per_page;
 	op.buffer = buffer;
 	op.nbytes = sizeof(buffer);
 
-	ret = spi_nand_get_configuration(&config);
+	ret = spi_nand_cache_read_stop(nand);
+	ret = spi_nand_get_configuration(nand, &config);
 
-	if (config & 0x10) {
+	if (config & CONFIG_ECC_ENABLE) {
 		/* ECC is enabled, disable. */
-		ret = spi_nand_set_configuration(config & ~0x10);
+		ret = spi_nand_set_configuration(nand, config & ~CONFIG_ECC_ENABLE);
 	}
 
 	/* Write 16 bytes of 0x00 to the spare area. */
-	ret = spi_nand_write_page(block * PAGES_PER_BLOCK, &op, 1, status);
+	ret = spi_nand_write_page(nand, block * nand->geo.pages_per_block, &op, 1, status);
 
-	if (config & 0x10) {
+	if (config & CONFIG_ECC_ENABLE) {
 		/* ECC was enabled, re-enable. */
-		ret = spi_nand_set_configuration(config);
+		ret = spi_nand_set_configuration(nand, config);
 	}
 
 	return ret;
 }
 
-void check_bad_blocks_test(void)
+void check_bad_blocks_test(struct spi_nand *nand)
 {
-	int i;
-	uint32_t block_ok;
+	uint32_t i;
 	uint8_t status;
-	int n_bad = 0;
 	int ret;
 
-	for(i = 0; i < 1024; i++) {
-		spi_nand_check_block_ok(i, &block_ok);
-		if (!block_ok) {
-			printf("Block %d ok? %lu\n", i, block_ok);
-			n_bad++;
-		}
+	ret = spi_nand_bbt_load(nand);
+	printf("spi_nand_bbt_load returned %d, version %lu in copy %lu\n",
+			ret, nand->bbt.version, nand->bbt.copy);
+
+	for(i = 0; i < nand->geo.n_blocks; i++) {
+		if (spi_nand_bbt_is_bad(nand, i))
+			printf("Block %lu bad\n", i);
 	}
 
-	printf("Total bad blocks %d\n", n_bad);
+	printf("Total bad blocks %lu\n", spi_nand_bbt_count_bad(nand));
 
 #if 0
-	spi_nand_mark_block_bad(7, &status);
+	spi_nand_bbt_mark_bad(nand, 7);
 
-	for(i = 0; i < 10; i++) {
-		spi_nand_check_block_ok(i, &block_ok);
-		printf("Block %d ok? %lu\n", i, block_ok);
-	}
+	for(i = 0; i < 10; i++)
+		printf("Block %lu bad? %d\n", i, spi_nand_bbt_is_bad(nand, i));
 #endif
-	ret = spi_nand_erase_block(7, &status);
+	ret = spi_nand_erase_block(nand, 7, &status);
 	printf("spi_nand_erase_block returned %d, status %02x\n", ret, status);
 
 }
 
 
-void page_erase_test(void)
+void page_erase_test(struct spi_nand *nand)
 {
 	uint8_t buffer[16];
 	int ret;
@@ -600,18 +1551,18 @@ void page_erase_test(void)
 	op.buffer = buffer;
 	op.nbytes = sizeof(buffer);
 
-	ret = spi_nand_read_page(page,
+	ret = spi_nand_read_page(nand, page,
 							 &op, 1,
 						   	 &status);
 	printf("read page returned %d, status %02x\n",
 			ret, status);
 	print_buffer(buffer, sizeof(buffer));
 
-	ret = spi_nand_erase_block(0, &status);
+	ret = spi_nand_erase_block(nand, 0, &status);
 	printf("block erase returned %d, status %02x\n",
 			ret, status);
 
-	ret = spi_nand_read_page(page,
+	ret = spi_nand_read_page(nand, page,
 							 &op, 1,
 						   	 &status);
 	printf("read page returned %d, status %02x\n",
@@ -619,7 +1570,7 @@ void page_erase_test(void)
 	print_buffer(buffer, sizeof(buffer));
 }
 
-void page_read_write_test(void)
+void page_read_write_test(struct spi_nand *nand)
 {
 	uint8_t buffer[16];
 	int ret;
@@ -631,7 +1582,7 @@ void page_read_write_test(void)
 	op.buffer = buffer;
 	op.nbytes = sizeof(buffer);
 
-	ret = spi_nand_read_page(page, &op, 1, &status);
+	ret = spi_nand_read_page(nand, page, &op, 1, &status);
 	printf("read page returned %d, status %02x\n",
 			ret, status);
 	print_buffer(buffer, sizeof(buffer));
@@ -642,7 +1593,7 @@ void page_read_write_test(void)
 	op.buffer = buffer;
 	op.nbytes = sizeof(buffer);
 
-	ret = spi_nand_write_page(page, &op, 1, &status);
+	ret = spi_nand_write_page(nand, page, &op, 1, &status);
 	printf("write page returned %d, status %02x\n",
 			ret, status);
 
@@ -650,7 +1601,7 @@ void page_read_write_test(void)
 	op.buffer = buffer;
 	op.nbytes = sizeof(buffer);
 
-	ret = spi_nand_read_page(page, &op, 1, &status);
+	ret = spi_nand_read_page(nand, page, &op, 1, &status);
 	printf("read page returned %d, status %02x\n",
 			ret, status);
 	print_buffer(buffer, sizeof(buffer));
@@ -671,6 +1622,7 @@ void malloc_test(uint32_t msize)
 
 void spi_nand_test(void)
 {
+	struct spi_nand *nand = &spi_nand_chips[0];
 	uint8_t status;
 	uint8_t config;
 	uint8_t block_lock;
@@ -679,38 +1631,38 @@ void spi_nand_test(void)
 	printf("\n\nspi_nand_test\n\n");
 
 	printf("spi_nand_init()...\n");
-	ret = spi_nand_init();
+	ret = spi_nand_init(nand);
 	printf("spi_nand_init()... returned %d\n", ret);
 
 
 	printf("Calling spi_nand_get_configuration()...");
-	ret = spi_nand_get_configuration(&config);
+	ret = spi_nand_get_configuration(nand, &config);
 	printf("returned %d, configuration %02x\n", ret, config);
 
 	printf("Calling spi_nand_get_status()...");
-	ret = spi_nand_get_status(&status);
+	ret = spi_nand_get_status(nand, &status);
 	printf("returned %d, status %02x\n", ret, status);
 
-	spi_nand_cmd_write_enable(1);
+	spi_nand_cmd_write_enable(nand, 1);
 
 	printf("Write enabled,  spi_nand_get_status()...");
-	ret = spi_nand_get_status(&status);
+	ret = spi_nand_get_status(nand, &status);
 	printf("returned %d, status %02x\n", ret, status);
 
-	spi_nand_cmd_write_enable(0);
+	spi_nand_cmd_write_enable(nand, 0);
 
 	printf("Write disabled,  spi_nand_get_status()...");
-	ret = spi_nand_get_status(&status);
+	ret = spi_nand_get_status(nand, &status);
 	printf("returned %d, status %02x\n", ret, status);
 
 	printf("spi_nand_get_block_lock()...");
-	ret = spi_nand_get_block_lock(&block_lock);
+	ret = spi_nand_get_block_lock(nand, &block_lock);
 	printf("returned %d, block_lock %02x\n", ret, block_lock);
 
-	check_bad_blocks_test();
+	check_bad_blocks_test(nand);
 
-	page_read_write_test();
-	page_erase_test();
+	page_read_write_test(nand);
+	page_erase_test(nand);
 
 	printf("\n\nEnd of spi_nand_test()\n\n");
 
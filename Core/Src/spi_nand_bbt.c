@@ -0,0 +1,232 @@
+#include "spi_nand_bbt.h"
+#include "spi_nand.h"
+#include <string.h>
+#include <stdio.h>
+
+#define STATUS_E_FAIL	0x04
+#define STATUS_P_FAIL	0x08
+
+#define BBT_MAGIC		0x54424253	/* "SBBT" */
+
+/* On flash the header is followed by the bitmap. */
+struct spi_nand_bbt_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_blocks;
+	uint32_t crc;				/* Over the header with crc 0, and the bitmap */
+};
+
+#define BBT_IMAGE_SIZE	(sizeof(struct spi_nand_bbt_header) + \
+						 SPI_NAND_BBT_MAX_BLOCKS / 8)
+
+static uint32_t spi_nand_bbt_crc32(uint32_t crc, const uint8_t *buffer, uint32_t n)
+{
+	uint32_t i;
+
+	crc = ~crc;
+	while (n--) {
+		crc ^= *buffer++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static uint32_t spi_nand_bbt_map_size(struct spi_nand *nand)
+{
+	return (nand->geo.n_blocks + 7) / 8;
+}
+
+static uint32_t spi_nand_bbt_block(struct spi_nand *nand, uint32_t copy)
+{
+	return nand->geo.n_blocks - SPI_NAND_BBT_N_RESERVED + copy;
+}
+
+static void spi_nand_bbt_set_bad(struct spi_nand *nand, uint32_t block)
+{
+	nand->bbt.bad[block / 8] |= 1 << (block % 8);
+}
+
+static uint32_t spi_nand_bbt_image_crc(struct spi_nand_bbt_header *hdr,
+									   const uint8_t *map, uint32_t map_size)
+{
+	struct spi_nand_bbt_header h = *hdr;
+	uint32_t crc;
+
+	h.crc = 0;
+	crc = spi_nand_bbt_crc32(0, (const uint8_t *)&h, sizeof(h));
+	return spi_nand_bbt_crc32(crc, map, map_size);
+}
+
+/*
+ * Write the table to the other reserved block, or failing that to the one
+ * holding the current table.
+ */
+static int spi_nand_bbt_save(struct spi_nand *nand)
+{
+	uint8_t image[BBT_IMAGE_SIZE];
+	struct spi_nand_bbt_header *hdr = (struct spi_nand_bbt_header *)image;
+	uint32_t map_size = spi_nand_bbt_map_size(nand);
+	struct spi_nand_buffer_op op;
+	uint32_t i;
+	uint32_t copy;
+	uint32_t block;
+	uint8_t status;
+
+	nand->bbt.version++;
+
+	for (i = 0; i < SPI_NAND_BBT_N_RESERVED; i++) {
+		copy = (nand->bbt.copy + 1 + i) % SPI_NAND_BBT_N_RESERVED;
+		block = spi_nand_bbt_block(nand, copy);
+		if (spi_nand_bbt_is_bad(nand, block))
+			continue;
+
+		if (spi_nand_erase_block(nand, block, &status) < 0 ||
+			(status & STATUS_E_FAIL)) {
+			spi_nand_bbt_set_bad(nand, block);
+			continue;
+		}
+
+		hdr->magic = BBT_MAGIC;
+		hdr->version = nand->bbt.version;
+		hdr->n_blocks = nand->geo.n_blocks;
+		memcpy(image + sizeof(*hdr), nand->bbt.bad, map_size);
+		hdr->crc = spi_nand_bbt_image_crc(hdr, nand->bbt.bad, map_size);
+
+		op.offset = 0;
+		op.buffer = image;
+		op.nbytes = sizeof(*hdr) + map_size;
+
+		if (spi_nand_write_page(nand, block * nand->geo.pages_per_block,
+								&op, 1, &status) < 0 ||
+			(status & STATUS_P_FAIL)) {
+			spi_nand_bbt_set_bad(nand, block);
+			continue;
+		}
+
+		nand->bbt.copy = copy;
+		return 0;
+	}
+
+	printf("%s: no good block to save the bad block table\n", nand->name);
+	return -1;
+}
+
+int spi_nand_bbt_scan(struct spi_nand *nand)
+{
+	uint32_t block;
+	uint32_t ok;
+
+	memset(nand->bbt.bad, 0, sizeof(nand->bbt.bad));
+
+	for (block = 0; block < nand->geo.n_blocks; block++) {
+		ok = 0;
+		spi_nand_check_block_ok(nand, block, &ok);
+		if (!ok)
+			spi_nand_bbt_set_bad(nand, block);
+	}
+	nand->bbt.loaded = 1;
+
+	return spi_nand_bbt_save(nand);
+}
+
+int spi_nand_bbt_load(struct spi_nand *nand)
+{
+	uint8_t image[BBT_IMAGE_SIZE];
+	struct spi_nand_bbt_header *hdr = (struct spi_nand_bbt_header *)image;
+	uint32_t map_size = spi_nand_bbt_map_size(nand);
+	struct spi_nand_buffer_op op;
+	uint32_t found = 0;
+	uint32_t copy;
+	uint32_t block;
+	uint8_t status;
+
+	if (nand->geo.n_blocks > SPI_NAND_BBT_MAX_BLOCKS ||
+		nand->geo.n_blocks <= SPI_NAND_BBT_N_RESERVED)
+		return -1;
+
+	memset(&nand->bbt, 0, sizeof(nand->bbt));
+
+	op.offset = 0;
+	op.buffer = image;
+	op.nbytes = sizeof(*hdr) + map_size;
+
+	for (copy = 0; copy < SPI_NAND_BBT_N_RESERVED; copy++) {
+		block = spi_nand_bbt_block(nand, copy);
+		if (spi_nand_read_page(nand, block * nand->geo.pages_per_block,
+							   &op, 1, &status) < 0 ||
+			((status >> 4) & 7) == 2)
+			continue;
+		if (hdr->magic != BBT_MAGIC ||
+			hdr->n_blocks != nand->geo.n_blocks ||
+			hdr->crc != spi_nand_bbt_image_crc(hdr, image + sizeof(*hdr), map_size))
+			continue;
+		if (found && hdr->version <= nand->bbt.version)
+			continue;
+
+		found = 1;
+		nand->bbt.version = hdr->version;
+		nand->bbt.copy = copy;
+		memcpy(nand->bbt.bad, image + sizeof(*hdr), map_size);
+	}
+
+	if (found) {
+		nand->bbt.loaded = 1;
+		return 0;
+	}
+
+	printf("%s: no bad block table, scanning\n", nand->name);
+	return spi_nand_bbt_scan(nand);
+}
+
+uint32_t spi_nand_bbt_usable_blocks(struct spi_nand *nand)
+{
+	return nand->geo.n_blocks - SPI_NAND_BBT_N_RESERVED;
+}
+
+int spi_nand_bbt_is_bad(struct spi_nand *nand, uint32_t block)
+{
+	uint32_t ok = 0;
+
+	if (block >= nand->geo.n_blocks)
+		return 1;
+
+	if (!nand->bbt.loaded) {
+		spi_nand_check_block_ok(nand, block, &ok);
+		return !ok;
+	}
+
+	return (nand->bbt.bad[block / 8] >> (block % 8)) & 1;
+}
+
+int spi_nand_bbt_mark_bad(struct spi_nand *nand, uint32_t block)
+{
+	uint8_t status;
+	int ret = 0;
+
+	if (block >= nand->geo.n_blocks)
+		return -1;
+
+	spi_nand_bbt_set_bad(nand, block);
+
+	/* Also mark it on the block, so a rescan finds it. */
+	if (spi_nand_mark_block_bad(nand, block, &status) < 0)
+		ret = -1;
+
+	if (nand->bbt.loaded && spi_nand_bbt_save(nand) < 0)
+		ret = -1;
+
+	return ret;
+}
+
+uint32_t spi_nand_bbt_count_bad(struct spi_nand *nand)
+{
+	uint32_t block;
+	uint32_t n = 0;
+
+	for (block = 0; block < nand->geo.n_blocks; block++)
+		if (spi_nand_bbt_is_bad(nand, block))
+			n++;
+
+	return n;
+}
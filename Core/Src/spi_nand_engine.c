@@ -0,0 +1,306 @@
+#include "spi_nand_engine.h"
+#include <stddef.h>
+
+#define STATUS_FEATURE_ADDRESS	0xc0
+#define CMD_GET_FEATURES		0x0f
+
+/*
+ * The state machine runs like this for each transaction:
+ *
+ *  HEADER -> DATA -> (deselect) -> POLL_WAIT -> POLL_HEADER -> POLL_DATA -> (deselect)
+ *                                      ^                               |
+ *                                      +------------ busy -------------+
+ *
+ * POLL_WAIT is skipped, and the poll started at once, if the bus has no
+ * timer or the delay is zero.
+ * DATA repeats for each segment if the transaction has a segment list.
+ * DATA is skipped if there is no data phase, the polling states are skipped
+ * if poll_mask is zero and HEADER/DATA are skipped for a poll only
+ * transaction (header_size == 0).
+ */
+
+static void spi_nand_engine_start(struct spi_nand_engine *eng);
+
+void spi_nand_txn_setup(struct spi_nand_txn *txn,
+						uint8_t opcode,
+						uint32_t n_addr, uint32_t address,
+						uint32_t n_dummy)
+{
+	uint32_t i = 0;
+
+	txn->header[i++] = opcode;
+
+	/* Addresses are MSB first */
+	while (n_addr > 0) {
+		n_addr--;
+		txn->header[i++] = (uint8_t)(address >> (n_addr * 8));
+	}
+
+	while (n_dummy > 0 && i < SPI_NAND_TXN_MAX_HEADER) {
+		txn->header[i++] = 0;
+		n_dummy--;
+	}
+
+	txn->header_size = i;
+	txn->data_is_tx = 0;
+	txn->poll_mask = 0;
+	txn->status = 0;
+	txn->data = NULL;
+	txn->data_size = 0;
+	txn->segs = NULL;
+	txn->n_segs = 0;
+	txn->seg_index = 0;
+	txn->n_polls = 0;
+	txn->poll_delay_us = 0;
+	txn->poll_interval_us = 0;
+	txn->poll_start = 0;
+	txn->busy_ticks = 0;
+	txn->result = 0;
+	txn->done = NULL;
+	txn->ctx = NULL;
+	txn->next = NULL;
+}
+
+void spi_nand_engine_init(struct spi_nand_engine *eng,
+						  const struct spi_nand_bus_ops *ops,
+						  void *bus_ctx)
+{
+	eng->ops = ops;
+	eng->bus_ctx = bus_ctx;
+	eng->head = NULL;
+	eng->tail = NULL;
+	eng->state = SPI_NAND_ENGINE_IDLE;
+	eng->poll_cmd[0] = CMD_GET_FEATURES;
+	eng->poll_cmd[1] = STATUS_FEATURE_ADDRESS;
+	eng->n_txns = 0;
+	eng->n_segs = 0;
+	eng->n_polls = 0;
+	eng->n_errors = 0;
+}
+
+int spi_nand_engine_busy(struct spi_nand_engine *eng)
+{
+	return eng->state != SPI_NAND_ENGINE_IDLE;
+}
+
+void spi_nand_engine_submit(struct spi_nand_engine *eng,
+							struct spi_nand_txn *txn)
+{
+	uint32_t flags;
+	int start = 0;
+
+	txn->next = NULL;
+	txn->seg_index = 0;
+	txn->n_polls = 0;
+	txn->busy_ticks = 0;
+	txn->result = 0;
+
+	flags = eng->ops->lock(eng->bus_ctx);
+	if (eng->tail)
+		eng->tail->next = txn;
+	else
+		eng->head = txn;
+	eng->tail = txn;
+
+	if (eng->state == SPI_NAND_ENGINE_IDLE) {
+		/* Claim the engine before letting the interrupt back in. */
+		eng->state = SPI_NAND_ENGINE_HEADER;
+		start = 1;
+	}
+	eng->ops->unlock(eng->bus_ctx, flags);
+
+	if (start)
+		spi_nand_engine_start(eng);
+}
+
+/*
+ * Retire the transaction at the head of the queue, call its completion
+ * callback and start the next one.
+ */
+static void spi_nand_engine_complete(struct spi_nand_engine *eng, int result)
+{
+	struct spi_nand_txn *txn;
+	uint32_t flags;
+	int start = 0;
+
+	flags = eng->ops->lock(eng->bus_ctx);
+	txn = eng->head;
+	eng->head = txn->next;
+	if (!eng->head)
+		eng->tail = NULL;
+	eng->state = SPI_NAND_ENGINE_IDLE;
+	eng->ops->unlock(eng->bus_ctx, flags);
+
+	txn->result = result;
+	if (result < 0)
+		eng->n_errors++;
+	eng->n_txns++;
+
+	if (txn->done)
+		txn->done(txn, txn->ctx);
+
+	/* The callback might have submitted, and so started, another one. */
+	flags = eng->ops->lock(eng->bus_ctx);
+	if (eng->state == SPI_NAND_ENGINE_IDLE && eng->head) {
+		eng->state = SPI_NAND_ENGINE_HEADER;
+		start = 1;
+	}
+	eng->ops->unlock(eng->bus_ctx, flags);
+
+	if (start)
+		spi_nand_engine_start(eng);
+}
+
+static void spi_nand_engine_fail(struct spi_nand_engine *eng, int result)
+{
+	eng->ops->select(eng->bus_ctx, 0);
+	spi_nand_engine_complete(eng, result);
+}
+
+static void spi_nand_engine_poll(struct spi_nand_engine *eng)
+{
+	int ret;
+
+	eng->state = SPI_NAND_ENGINE_POLL_HEADER;
+	eng->ops->select(eng->bus_ctx, 1);
+	ret = eng->ops->transmit_async(eng->bus_ctx, eng->poll_cmd,
+								   sizeof(eng->poll_cmd));
+	if (ret < 0)
+		spi_nand_engine_fail(eng, ret);
+}
+
+/* Poll after us microseconds, off the bus until then. */
+static void spi_nand_engine_poll_after(struct spi_nand_engine *eng, uint32_t us)
+{
+	if (!us || !eng->ops->start_timer) {
+		spi_nand_engine_poll(eng);
+		return;
+	}
+
+	eng->state = SPI_NAND_ENGINE_POLL_WAIT;
+	eng->ops->start_timer(eng->bus_ctx, us);
+}
+
+static uint32_t spi_nand_engine_clock(struct spi_nand_engine *eng)
+{
+	return eng->ops->clock ? eng->ops->clock(eng->bus_ctx) : 0;
+}
+
+/* The command part of the transaction is done. */
+static void spi_nand_engine_end_command(struct spi_nand_engine *eng)
+{
+	struct spi_nand_txn *txn = eng->head;
+
+	eng->ops->select(eng->bus_ctx, 0);
+
+	if (txn->poll_mask) {
+		txn->poll_start = spi_nand_engine_clock(eng);
+		spi_nand_engine_poll_after(eng, txn->poll_delay_us);
+	} else {
+		spi_nand_engine_complete(eng, 0);
+	}
+}
+
+/*
+ * Start the next piece of the data phase.
+ * Returns 0 if there was nothing left to start.
+ */
+static int spi_nand_engine_next_data(struct spi_nand_engine *eng)
+{
+	struct spi_nand_txn *txn = eng->head;
+	uint8_t *buffer;
+	uint32_t nbytes;
+	uint8_t is_tx;
+	int ret;
+
+	if (txn->segs) {
+		if (txn->seg_index >= txn->n_segs)
+			return 0;
+		buffer = txn->segs[txn->seg_index].buffer;
+		nbytes = txn->segs[txn->seg_index].nbytes;
+		is_tx = txn->segs[txn->seg_index].is_tx;
+		txn->seg_index++;
+		eng->n_segs++;
+	} else {
+		if (eng->state == SPI_NAND_ENGINE_DATA ||
+			!txn->data || !txn->data_size)
+			return 0;
+		buffer = txn->data;
+		nbytes = txn->data_size;
+		is_tx = txn->data_is_tx;
+	}
+
+	eng->state = SPI_NAND_ENGINE_DATA;
+	if (is_tx)
+		ret = eng->ops->transmit_async(eng->bus_ctx, buffer, nbytes);
+	else
+		ret = eng->ops->receive_async(eng->bus_ctx, buffer, nbytes);
+	if (ret < 0)
+		spi_nand_engine_fail(eng, ret);
+
+	return 1;
+}
+
+static void spi_nand_engine_start(struct spi_nand_engine *eng)
+{
+	struct spi_nand_txn *txn = eng->head;
+	int ret;
+
+	if (!txn->header_size) {
+		txn->poll_start = spi_nand_engine_clock(eng);
+		spi_nand_engine_poll_after(eng, txn->poll_delay_us);
+		return;
+	}
+
+	eng->state = SPI_NAND_ENGINE_HEADER;
+	eng->ops->select(eng->bus_ctx, 1);
+	ret = eng->ops->transmit_async(eng->bus_ctx, txn->header,
+								   txn->header_size);
+	if (ret < 0)
+		spi_nand_engine_fail(eng, ret);
+}
+
+void spi_nand_engine_xfer_done(struct spi_nand_engine *eng)
+{
+	struct spi_nand_txn *txn = eng->head;
+	int ret = 0;
+
+	if (!txn)
+		return;
+
+	switch (eng->state) {
+	case SPI_NAND_ENGINE_HEADER:
+	case SPI_NAND_ENGINE_DATA:
+		if (!spi_nand_engine_next_data(eng))
+			spi_nand_engine_end_command(eng);
+		break;
+
+	case SPI_NAND_ENGINE_POLL_HEADER:
+		eng->state = SPI_NAND_ENGINE_POLL_DATA;
+		ret = eng->ops->receive_async(eng->bus_ctx, &txn->status, 1);
+		if (ret < 0)
+			spi_nand_engine_fail(eng, ret);
+		break;
+
+	case SPI_NAND_ENGINE_POLL_DATA:
+		eng->ops->select(eng->bus_ctx, 0);
+		txn->n_polls++;
+		eng->n_polls++;
+		if (txn->status & txn->poll_mask) {
+			spi_nand_engine_poll_after(eng, txn->poll_interval_us);
+		} else {
+			txn->busy_ticks = spi_nand_engine_clock(eng) - txn->poll_start;
+			spi_nand_engine_complete(eng, 0);
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+void spi_nand_engine_timer_done(struct spi_nand_engine *eng)
+{
+	if (eng->state == SPI_NAND_ENGINE_POLL_WAIT && eng->head)
+		spi_nand_engine_poll(eng);
+}
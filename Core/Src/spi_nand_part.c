@@ -0,0 +1,185 @@
+#include "spi_nand_part.h"
+#include <string.h>
+
+/* A page size, that fails to build if over SPI_NAND_MAX_PAGE_BYTES. */
+#define PAGE_BYTES(n)	((n) + 0 * sizeof(char[(n) <= SPI_NAND_MAX_PAGE_BYTES ? \
+											   1 : -1]))
+
+/*
+ * Parts we know. The free spare bytes are the ECC protected user bytes
+ * after the bad block marker region.
+ */
+static const struct spi_nand_part parts[] = {
+	{
+		.name = "MT29F1G01ABAFD",
+		.mfr_id = 0x2c,
+		.dev_id = 0x14,
+		.geo = {
+			.data_bytes_per_page = PAGE_BYTES(2048),
+			.spare_bytes_per_page = 64,
+			.pages_per_block = 64,
+			.n_blocks = 1024,
+			.n_planes = 1,
+			.oob_free_offset = 0x20,
+			.oob_free_bytes = 32,
+		},
+		.t_read_us = 50,
+		.t_prog_us = 200,
+		.t_erase_us = 2000,
+	},
+	{
+		.name = "MT29F2G01ABAGD",
+		.mfr_id = 0x2c,
+		.dev_id = 0x24,
+		.geo = {
+			.data_bytes_per_page = PAGE_BYTES(2048),
+			.spare_bytes_per_page = 128,
+			.pages_per_block = 64,
+			.n_blocks = 2048,
+			.n_planes = 2,
+			.oob_free_offset = 0x20,
+			.oob_free_bytes = 32,
+		},
+		.t_read_us = 50,
+		.t_prog_us = 200,
+		.t_erase_us = 2000,
+	},
+#if SPI_NAND_MAX_PAGE_BYTES >= 4096
+	{
+		.name = "MT29F4G01ABAFD",
+		.mfr_id = 0x2c,
+		.dev_id = 0x34,
+		.geo = {
+			.data_bytes_per_page = PAGE_BYTES(4096),
+			.spare_bytes_per_page = 256,
+			.pages_per_block = 64,
+			.n_blocks = 2048,
+			.n_planes = 1,
+			.oob_free_offset = 0x20,
+			.oob_free_bytes = 32,
+		},
+		.t_read_us = 50,
+		.t_prog_us = 220,
+		.t_erase_us = 2000,
+	},
+#endif
+};
+
+#define N_PARTS		(sizeof(parts) / sizeof(parts[0]))
+
+/* Parameter page offsets */
+#define PP_SIGNATURE			0
+#define PP_DATA_BYTES_PER_PAGE	80
+#define PP_SPARE_BYTES_PER_PAGE	84
+#define PP_PAGES_PER_BLOCK		92
+#define PP_BLOCKS_PER_LUN		96
+#define PP_N_LUNS				100
+#define PP_PLANE_ADDR_BITS		110		/* Bits 3:0 */
+#define PP_T_PROG_MAX			133
+#define PP_T_BERS_MAX			135
+#define PP_T_R_MAX				137
+#define PP_CRC					254
+
+#define PP_CRC_INIT				0x4f4e
+#define PP_CRC_POLY				0x8005
+
+const struct spi_nand_part *spi_nand_part_lookup(uint8_t mfr_id, uint8_t dev_id)
+{
+	uint32_t i;
+
+	for (i = 0; i < N_PARTS; i++)
+		if (parts[i].mfr_id == mfr_id && parts[i].dev_id == dev_id)
+			return &parts[i];
+
+	return NULL;
+}
+
+static uint16_t spi_nand_part_crc16(const uint8_t *buffer, uint32_t n)
+{
+	uint16_t crc = PP_CRC_INIT;
+	uint32_t i;
+
+	while (n--) {
+		crc ^= (uint16_t)*buffer++ << 8;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ PP_CRC_POLY : crc << 1;
+	}
+	return crc;
+}
+
+static uint32_t get_le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int spi_nand_part_from_param_page(const uint8_t *pp, struct spi_nand_part *part)
+{
+	struct spi_nand_geometry geo = part->geo;
+
+	if (memcmp(&pp[PP_SIGNATURE], "ONFI", 4) ||
+		spi_nand_part_crc16(pp, PP_CRC) != get_le16(&pp[PP_CRC]))
+		return -1;
+
+	geo.data_bytes_per_page = get_le32(&pp[PP_DATA_BYTES_PER_PAGE]);
+	geo.spare_bytes_per_page = get_le16(&pp[PP_SPARE_BYTES_PER_PAGE]);
+	geo.pages_per_block = get_le32(&pp[PP_PAGES_PER_BLOCK]);
+	geo.n_blocks = get_le32(&pp[PP_BLOCKS_PER_LUN]);
+	geo.n_planes = 1 << (pp[PP_PLANE_ADDR_BITS] & 0x0f);
+
+	if (!geo.data_bytes_per_page || !geo.spare_bytes_per_page ||
+		!geo.pages_per_block || !geo.n_blocks || !pp[PP_N_LUNS])
+		return -1;
+
+	/*
+	 * Only a single plane select bit above the column is supported, and
+	 * no die select: the other LUNs would need the select die command.
+	 * Bigger pages than the table's would not fit the buffers.
+	 */
+	if (pp[PP_N_LUNS] > 1 || geo.n_planes > 2 ||
+		geo.data_bytes_per_page > SPI_NAND_MAX_PAGE_BYTES)
+		return -2;
+
+	/* A different page size makes the table's spare layout meaningless. */
+	if (geo.data_bytes_per_page != part->geo.data_bytes_per_page ||
+		geo.spare_bytes_per_page != part->geo.spare_bytes_per_page) {
+		geo.oob_free_offset = 0;
+		geo.oob_free_bytes = 0;
+	}
+	part->geo = geo;
+
+	/* The parameter page only gives maximum times, start from half. */
+	if (!part->t_read_us)
+		part->t_read_us = get_le16(&pp[PP_T_R_MAX]) / 2;
+	if (!part->t_prog_us)
+		part->t_prog_us = get_le16(&pp[PP_T_PROG_MAX]) / 2;
+	if (!part->t_erase_us)
+		part->t_erase_us = get_le16(&pp[PP_T_BERS_MAX]) / 2;
+
+	return 0;
+}
+
+void spi_nand_part_finish_geometry(struct spi_nand_geometry *geo)
+{
+	uint32_t page_bytes = geo->data_bytes_per_page + geo->spare_bytes_per_page;
+
+	if (!geo->n_planes)
+		geo->n_planes = 1;
+
+	geo->column_bits = 0;
+	while ((1UL << geo->column_bits) < page_bytes)
+		geo->column_bits++;
+
+	/*
+	 * Without a known layout, use the lower half of the spare after the
+	 * bad block marker. The ECC parity is usually in the upper half.
+	 */
+	if (!geo->oob_free_bytes) {
+		geo->oob_free_offset = 4;
+		geo->oob_free_bytes = geo->spare_bytes_per_page / 2 - 4;
+	}
+}
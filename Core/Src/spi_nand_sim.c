@@ -0,0 +1,785 @@
+#ifdef SPI_NAND_HOST_SIM
+
+#include "spi_nand_sim.h"
+#include "spi_nand_part.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define STATUS_OIP				0x01
+#define STATUS_WEL				0x02
+#define STATUS_E_FAIL			0x04
+#define STATUS_P_FAIL			0x08
+#define STATUS_CRBSY			0x80
+#define STATUS_ECC_SHIFT		4
+
+#define CONFIG_OTP_ENABLE		0x40
+#define CONFIG_ECC_ENABLE		0x10
+
+#define LOCK_BP_MASK			0x78	/* Any BP bit set locks it all */
+
+#define FEATURE_LOCK			0xa0
+#define FEATURE_CONFIG			0xb0
+#define FEATURE_STATUS			0xc0
+
+#define SIM_MAX_PAGE			(4096 + 256)
+
+/*
+ * One simulated die and the bus it sits on.
+ * data_reg is what the array last loaded, cache is what the bus reads
+ * from and program loads write to.
+ */
+struct sim_die {
+	int set_up;
+	struct spi_nand_sim_config cfg;
+	const struct spi_nand_part *part;
+	struct spi_nand_geometry geo;
+	uint32_t page_bytes;
+	uint32_t n_pages;
+	uint8_t *array;
+	size_t array_size;
+	int fd;
+	uint8_t *ecc;				/* Injected ECC status per page */
+	uint32_t fail_program;		/* The next program of fail_page fails */
+	uint32_t fail_page;
+
+	uint8_t data_reg[SIM_MAX_PAGE];
+	uint8_t cache[SIM_MAX_PAGE];
+	uint8_t data_ecc;
+	uint8_t cache_ecc;
+
+	uint8_t lock;
+	uint8_t config;
+	uint8_t status;				/* WEL and the fail bits */
+	uint64_t busy_until;		/* OIP */
+	uint64_t array_busy_until;	/* CRBSY */
+	uint32_t cache_mode;
+	uint32_t loading_page;		/* Page in or going into data_reg */
+
+	/* The command being clocked in */
+	uint32_t selected;
+	uint32_t in_header;
+	uint8_t cmd[SPI_NAND_TXN_MAX_HEADER];
+	uint32_t cmd_size;
+	uint32_t column;
+	uint32_t n_busy_errors;
+
+	/* The transfer in flight */
+	struct spi_nand_engine *engine;
+	uint32_t xfer_pending;
+	uint64_t xfer_done_ns;
+
+	/* The engine's poll timer */
+	uint32_t timer_pending;
+	uint64_t timer_done_ns;
+
+	struct spi_nand_sim_stats stats;
+};
+
+static struct sim_die dies[SPI_NAND_N_CHIPS];
+static uint64_t now_ns;
+
+void spi_nand_sim_default_config(uint32_t die, struct spi_nand_sim_config *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->mfr_id = 0x2c;
+	cfg->dev_id = 0x14;
+	/* SPI1 runs from APB2 at 84MHz, SPI3 from APB1 at 42MHz, both /2. */
+	cfg->spi_hz = die == 0 ? 42000000 : 21000000;
+	cfg->xfer_overhead_ns = 1000;
+	cfg->t_read_us = 50;
+	cfg->t_cache_read_us = 3;
+	cfg->t_prog_us = 200;
+	cfg->t_erase_us = 2000;
+	cfg->t_reset_us = 10;
+	cfg->n_factory_bad = 0;
+	cfg->image_path = NULL;
+}
+
+static uint8_t *sim_page(struct sim_die *d, uint32_t page)
+{
+	return d->array + (size_t)page * d->page_bytes;
+}
+
+/* Mark some blocks bad the way the factory does, at random but repeatably. */
+static void sim_mark_factory_bad(struct sim_die *d, uint32_t die)
+{
+	uint32_t seed = 12345 + die;
+	uint32_t i;
+	uint32_t block;
+
+	for (i = 0; i < d->cfg.n_factory_bad; i++) {
+		seed = seed * 1103515245 + 12345;
+		/* Keep clear of block 0 and the bad block table blocks. */
+		block = 1 + (seed >> 8) % (d->geo.n_blocks - 1 - SPI_NAND_BBT_N_RESERVED);
+		sim_page(d, block * d->geo.pages_per_block)[d->geo.data_bytes_per_page] = 0;
+	}
+}
+
+static int sim_map_image(struct sim_die *d, uint32_t die)
+{
+	char path[256];
+	struct stat st;
+	int fresh;
+
+	if (!d->cfg.image_path) {
+		d->fd = -1;
+		d->array = malloc(d->array_size);
+		if (!d->array)
+			return -1;
+		memset(d->array, 0xff, d->array_size);
+		sim_mark_factory_bad(d, die);
+		return 0;
+	}
+
+	snprintf(path, sizeof(path), "%s.%u", d->cfg.image_path, (unsigned)die);
+	d->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (d->fd < 0 || fstat(d->fd, &st) < 0) {
+		printf("spi_nand_sim: cannot open %s\n", path);
+		return -1;
+	}
+
+	fresh = (size_t)st.st_size != d->array_size;
+	if (fresh && ftruncate(d->fd, d->array_size) < 0) {
+		printf("spi_nand_sim: cannot size %s\n", path);
+		return -1;
+	}
+
+	d->array = mmap(NULL, d->array_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+					d->fd, 0);
+	if (d->array == MAP_FAILED) {
+		d->array = NULL;
+		printf("spi_nand_sim: cannot map %s\n", path);
+		return -1;
+	}
+
+	if (fresh) {
+		memset(d->array, 0xff, d->array_size);
+		sim_mark_factory_bad(d, die);
+	}
+
+	return 0;
+}
+
+int spi_nand_sim_setup(uint32_t die, const struct spi_nand_sim_config *cfg)
+{
+	struct sim_die *d;
+
+	if (die >= SPI_NAND_N_CHIPS)
+		return -1;
+
+	d = &dies[die];
+	spi_nand_sim_close(die);
+	memset(d, 0, sizeof(*d));
+	d->cfg = *cfg;
+
+	d->part = spi_nand_part_lookup(cfg->mfr_id, cfg->dev_id);
+	if (!d->part) {
+		printf("spi_nand_sim: no part %02x,%02x\n", cfg->mfr_id, cfg->dev_id);
+		return -1;
+	}
+	d->geo = d->part->geo;
+	spi_nand_part_finish_geometry(&d->geo);
+	d->page_bytes = d->geo.data_bytes_per_page + d->geo.spare_bytes_per_page;
+	if (d->page_bytes > SIM_MAX_PAGE)
+		return -1;
+	d->n_pages = d->geo.n_blocks * d->geo.pages_per_block;
+	d->array_size = (size_t)d->n_pages * d->page_bytes;
+
+	d->ecc = calloc(d->n_pages, 1);
+	if (!d->ecc || sim_map_image(d, die) < 0) {
+		spi_nand_sim_close(die);
+		return -1;
+	}
+
+	/* Power up state: all blocks locked, ECC on. */
+	d->lock = 0x7c;
+	d->config = CONFIG_ECC_ENABLE;
+	d->set_up = 1;
+
+	return 0;
+}
+
+void spi_nand_sim_close(uint32_t die)
+{
+	struct sim_die *d = &dies[die];
+
+	if (d->array) {
+		if (d->fd >= 0) {
+			msync(d->array, d->array_size, MS_SYNC);
+			munmap(d->array, d->array_size);
+		} else {
+			free(d->array);
+		}
+	}
+	if (d->fd > 0)
+		close(d->fd);
+	free(d->ecc);
+
+	d->array = NULL;
+	d->ecc = NULL;
+	d->fd = -1;
+	d->set_up = 0;
+}
+
+static struct sim_die *sim_die_of(void *bus_ctx)
+{
+	struct spi_nand *nand = bus_ctx;
+	struct spi_nand_sim_config cfg;
+	struct sim_die *d = &dies[nand->die];
+
+	if (!d->set_up) {
+		spi_nand_sim_default_config(nand->die, &cfg);
+		if (spi_nand_sim_setup(nand->die, &cfg) < 0) {
+			printf("spi_nand_sim: cannot set up %s\n", nand->name);
+			exit(1);
+		}
+	}
+	d->engine = &nand->engine;
+
+	return d;
+}
+
+/*
+ * The parameter page, three copies of it, as the OTP page
+ * SPI_NAND_PARAM_PAGE reads.
+ */
+static void put_le16(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	put_le16(p, v);
+	put_le16(p + 2, v >> 16);
+}
+
+static uint16_t sim_crc16(const uint8_t *buffer, uint32_t n)
+{
+	uint16_t crc = 0x4f4e;
+	uint32_t i;
+
+	while (n--) {
+		crc ^= (uint16_t)*buffer++ << 8;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1;
+	}
+	return crc;
+}
+
+static void sim_param_page(struct sim_die *d, uint8_t *page)
+{
+	uint8_t *pp = page;
+	uint32_t i;
+
+	memset(pp, 0, SPI_NAND_PARAM_PAGE_SIZE);
+	memcpy(pp, "ONFI", 4);
+	memset(&pp[32], ' ', 32);
+	memcpy(&pp[32], "MICRON", 6);
+	memcpy(&pp[44], d->part->name, strlen(d->part->name));
+	put_le32(&pp[80], d->geo.data_bytes_per_page);
+	put_le16(&pp[84], d->geo.spare_bytes_per_page);
+	put_le32(&pp[92], d->geo.pages_per_block);
+	put_le32(&pp[96], d->geo.n_blocks);
+	pp[100] = 1;
+	pp[110] = d->geo.n_planes > 1 ? 1 : 0;
+	put_le16(&pp[133], 2 * d->cfg.t_prog_us);
+	put_le16(&pp[135], 2 * d->cfg.t_erase_us);
+	put_le16(&pp[137], 2 * d->cfg.t_read_us);
+	put_le16(&pp[254], sim_crc16(pp, 254));
+
+	for (i = 1; i < SPI_NAND_PARAM_PAGE_COPIES; i++)
+		memcpy(page + i * SPI_NAND_PARAM_PAGE_SIZE, pp,
+			   SPI_NAND_PARAM_PAGE_SIZE);
+}
+
+static uint8_t sim_status(struct sim_die *d)
+{
+	uint8_t status = d->status;
+
+	if (d->config & CONFIG_ECC_ENABLE)
+		status |= (d->cache_ecc & 7) << STATUS_ECC_SHIFT;
+	if (now_ns < d->busy_until)
+		status |= STATUS_OIP;
+	if (now_ns < d->array_busy_until)
+		status |= STATUS_CRBSY;
+
+	return status;
+}
+
+static uint32_t sim_row(struct sim_die *d)
+{
+	return (d->cmd[1] << 16) | (d->cmd[2] << 8) | d->cmd[3];
+}
+
+static uint64_t sim_us(uint32_t us)
+{
+	return (uint64_t)us * 1000;
+}
+
+static void sim_busy(struct sim_die *d, uint64_t from, uint32_t us)
+{
+	d->busy_until = from + sim_us(us);
+	d->stats.array_ns += sim_us(us);
+}
+
+/* Load page into the data register. */
+static void sim_load(struct sim_die *d, uint32_t page)
+{
+	d->loading_page = page;
+
+	if (d->config & CONFIG_OTP_ENABLE) {
+		memset(d->data_reg, 0xff, d->page_bytes);
+		if (page == SPI_NAND_PARAM_PAGE)
+			sim_param_page(d, d->data_reg);
+		d->data_ecc = 0;
+		return;
+	}
+
+	if (page >= d->n_pages) {
+		memset(d->data_reg, 0xff, d->page_bytes);
+		d->data_ecc = 2;
+		return;
+	}
+
+	memcpy(d->data_reg, sim_page(d, page), d->page_bytes);
+	d->data_ecc = d->ecc[page];
+}
+
+static void sim_to_cache(struct sim_die *d)
+{
+	memcpy(d->cache, d->data_reg, d->page_bytes);
+	d->cache_ecc = d->data_ecc;
+}
+
+static int sim_can_write(struct sim_die *d)
+{
+	return (d->status & STATUS_WEL) && !(d->lock & LOCK_BP_MASK) &&
+		   !(d->config & CONFIG_OTP_ENABLE);
+}
+
+static void sim_program(struct sim_die *d, uint32_t page)
+{
+	uint8_t *p;
+	uint32_t i;
+
+	d->stats.n_programs++;
+	if (!sim_can_write(d) || page >= d->n_pages) {
+		d->status |= STATUS_P_FAIL;
+		sim_busy(d, now_ns, 1);
+	} else if (d->fail_program && page == d->fail_page) {
+		/* Half programmed, and reads of it will not correct. */
+		d->fail_program = 0;
+		d->status |= STATUS_P_FAIL;
+		p = sim_page(d, page);
+		for (i = 0; i < d->page_bytes / 2; i++)
+			p[i] &= d->cache[i];
+		d->ecc[page] = 2;
+		sim_busy(d, now_ns, d->cfg.t_prog_us);
+	} else {
+		d->status &= ~STATUS_P_FAIL;
+		p = sim_page(d, page);
+		for (i = 0; i < d->page_bytes; i++)
+			p[i] &= d->cache[i];
+		d->ecc[page] = 0;
+		sim_busy(d, now_ns, d->cfg.t_prog_us);
+	}
+	d->status &= ~STATUS_WEL;
+}
+
+static void sim_erase(struct sim_die *d, uint32_t page)
+{
+	uint32_t block = page / d->geo.pages_per_block;
+	uint32_t first = block * d->geo.pages_per_block;
+
+	d->stats.n_erases++;
+	if (!sim_can_write(d) || block >= d->geo.n_blocks) {
+		d->status |= STATUS_E_FAIL;
+		sim_busy(d, now_ns, 1);
+	} else {
+		d->status &= ~STATUS_E_FAIL;
+		memset(sim_page(d, first), 0xff,
+			   (size_t)d->geo.pages_per_block * d->page_bytes);
+		memset(&d->ecc[first], 0, d->geo.pages_per_block);
+		sim_busy(d, now_ns, d->cfg.t_erase_us);
+	}
+	d->status &= ~STATUS_WEL;
+}
+
+/*
+ * Cache read: move the data register to the cache, then if load is set
+ * start loading page into the data register behind it.
+ */
+static void sim_cache_read(struct sim_die *d, int load, uint32_t page)
+{
+	uint64_t from = now_ns;
+
+	/* The cache can only take the data once the array has it. */
+	if (d->array_busy_until > from)
+		from = d->array_busy_until;
+
+	sim_to_cache(d);
+	sim_busy(d, from, d->cfg.t_cache_read_us);
+	d->stats.n_cache_reads++;
+
+	d->cache_mode = load;
+	if (load) {
+		sim_load(d, page);
+		d->array_busy_until = d->busy_until + sim_us(d->cfg.t_read_us);
+		d->stats.array_ns += sim_us(d->cfg.t_read_us);
+		d->stats.n_page_reads++;
+	}
+}
+
+/* Commands that take effect when CS goes high. */
+static void sim_execute(struct sim_die *d)
+{
+	uint8_t opcode = d->cmd[0];
+
+	if (!d->cmd_size)
+		return;
+
+	if (now_ns < d->busy_until && opcode != 0x0f && opcode != 0xff) {
+		/* The part ignores commands while busy. */
+		if (d->n_busy_errors++ == 0)
+			printf("spi_nand_sim: command %02x while busy\n", opcode);
+		return;
+	}
+
+	switch (opcode) {
+	case 0xff:
+		d->status &= ~STATUS_WEL;
+		d->cache_mode = 0;
+		d->array_busy_until = 0;
+		sim_busy(d, now_ns, d->cfg.t_reset_us);
+		break;
+	case 0x06:
+		d->status |= STATUS_WEL;
+		break;
+	case 0x04:
+		d->status &= ~STATUS_WEL;
+		break;
+	case 0x13:
+		d->cache_mode = 0;
+		sim_load(d, sim_row(d));
+		sim_to_cache(d);
+		sim_busy(d, now_ns, d->cfg.t_read_us);
+		d->stats.n_page_reads++;
+		break;
+	case 0x30:
+		sim_cache_read(d, 1, sim_row(d));
+		break;
+	case 0x31:
+		sim_cache_read(d, 1, d->loading_page + 1);
+		break;
+	case 0x3f:
+		sim_cache_read(d, 0, 0);
+		break;
+	case 0x10:
+		sim_program(d, sim_row(d));
+		break;
+	case 0xd8:
+		sim_erase(d, sim_row(d));
+		break;
+	default:
+		break;
+	}
+}
+
+static void sim_select(void *bus_ctx, int selected)
+{
+	struct sim_die *d = sim_die_of(bus_ctx);
+
+	if (selected) {
+		d->selected = 1;
+		d->in_header = 1;
+		d->cmd_size = 0;
+	} else if (d->selected) {
+		sim_execute(d);
+		d->selected = 0;
+	}
+}
+
+static void sim_start_xfer(struct sim_die *d, uint32_t nbytes)
+{
+	uint64_t ns = (uint64_t)nbytes * 8 * 1000000000ULL / d->cfg.spi_hz;
+
+	d->xfer_pending = 1;
+	d->xfer_done_ns = now_ns + d->cfg.xfer_overhead_ns + ns;
+	d->stats.n_xfers++;
+	d->stats.n_bytes += nbytes;
+	d->stats.bus_ns += ns;
+}
+
+/* The header is in, set up for the data phase. */
+static void sim_header(struct sim_die *d)
+{
+	uint32_t column_mask = (1UL << d->geo.column_bits) - 1;
+
+	switch (d->cmd[0]) {
+	case 0x02:
+	case 0x32:
+		/* Program load resets the cache, random program load does not. */
+		memset(d->cache, 0xff, d->page_bytes);
+		/* Fall through */
+	case 0x84:
+	case 0x34:
+	case 0x03:
+	case 0x0b:
+	case 0x3b:
+	case 0x6b:
+		d->column = ((d->cmd[1] << 8) | d->cmd[2]) & column_mask;
+		break;
+	default:
+		d->column = 0;
+		break;
+	}
+}
+
+static int sim_transmit(void *bus_ctx, const uint8_t *buffer, uint32_t nbytes)
+{
+	struct sim_die *d = sim_die_of(bus_ctx);
+	uint32_t i;
+
+	if (d->in_header) {
+		d->in_header = 0;
+		d->cmd_size = nbytes < sizeof(d->cmd) ? nbytes : sizeof(d->cmd);
+		memcpy(d->cmd, buffer, d->cmd_size);
+		sim_header(d);
+	} else {
+		switch (d->cmd[0]) {
+		case 0x02:
+		case 0x32:
+		case 0x84:
+		case 0x34:
+			for (i = 0; i < nbytes; i++, d->column++)
+				if (d->column < d->page_bytes)
+					d->cache[d->column] = buffer[i];
+			break;
+		case 0x1f:
+			if (d->cmd[1] == FEATURE_LOCK)
+				d->lock = buffer[0];
+			else if (d->cmd[1] == FEATURE_CONFIG)
+				d->config = buffer[0];
+			break;
+		default:
+			break;
+		}
+	}
+
+	sim_start_xfer(d, nbytes);
+	return 0;
+}
+
+static int sim_receive(void *bus_ctx, uint8_t *buffer, uint32_t nbytes)
+{
+	struct sim_die *d = sim_die_of(bus_ctx);
+	uint32_t i;
+
+	memset(buffer, 0, nbytes);
+
+	switch (d->cmd[0]) {
+	case 0x03:
+	case 0x0b:
+	case 0x3b:
+	case 0x6b:
+		for (i = 0; i < nbytes; i++, d->column++)
+			buffer[i] = d->cache[d->column % d->page_bytes];
+		break;
+	case 0x0f:
+		if (d->cmd[1] == FEATURE_LOCK)
+			buffer[0] = d->lock;
+		else if (d->cmd[1] == FEATURE_CONFIG)
+			buffer[0] = d->config;
+		else if (d->cmd[1] == FEATURE_STATUS)
+			buffer[0] = sim_status(d);
+		break;
+	case 0x9f:
+		buffer[0] = d->cfg.mfr_id;
+		if (nbytes > 1)
+			buffer[1] = d->cfg.dev_id;
+		break;
+	default:
+		break;
+	}
+
+	sim_start_xfer(d, nbytes);
+	return 0;
+}
+
+/* Only one thread runs the bus, there is nothing to lock. */
+static uint32_t sim_lock(void *bus_ctx)
+{
+	(void)bus_ctx;
+	return 0;
+}
+
+static void sim_unlock(void *bus_ctx, uint32_t flags)
+{
+	(void)bus_ctx;
+	(void)flags;
+}
+
+static void sim_start_timer(void *bus_ctx, uint32_t us)
+{
+	struct sim_die *d = sim_die_of(bus_ctx);
+
+	d->timer_pending = 1;
+	d->timer_done_ns = now_ns + sim_us(us);
+}
+
+static uint32_t sim_clock(void *bus_ctx)
+{
+	(void)bus_ctx;
+	return spi_nand_sim_cycles();
+}
+
+const struct spi_nand_bus_ops spi_nand_sim_bus_ops = {
+	.select = sim_select,
+	.transmit_async = sim_transmit,
+	.receive_async = sim_receive,
+	.lock = sim_lock,
+	.unlock = sim_unlock,
+	.start_timer = sim_start_timer,
+	.clock = sim_clock,
+};
+
+/* When the die's next transfer or timer event is due, or 0 if none is. */
+static uint64_t sim_event_ns(const struct sim_die *d)
+{
+	if (d->xfer_pending &&
+		(!d->timer_pending || d->xfer_done_ns <= d->timer_done_ns))
+		return d->xfer_done_ns;
+	if (d->timer_pending)
+		return d->timer_done_ns;
+	return 0;
+}
+
+static struct sim_die *sim_next_event(void)
+{
+	struct sim_die *next = NULL;
+	uint32_t i;
+
+	for (i = 0; i < SPI_NAND_N_CHIPS; i++)
+		if ((dies[i].xfer_pending || dies[i].timer_pending) &&
+			(!next || sim_event_ns(&dies[i]) < sim_event_ns(next)))
+			next = &dies[i];
+
+	return next;
+}
+
+static void sim_complete(struct sim_die *d)
+{
+	uint64_t at = sim_event_ns(d);
+
+	if (at > now_ns)
+		now_ns = at;
+	if (d->xfer_pending && at == d->xfer_done_ns) {
+		d->xfer_pending = 0;
+		spi_nand_engine_xfer_done(d->engine);
+	} else {
+		d->timer_pending = 0;
+		spi_nand_engine_timer_done(d->engine);
+	}
+}
+
+void spi_nand_sim_step(void)
+{
+	struct sim_die *d = sim_next_event();
+
+	if (!d) {
+		/* On the target this would hang. */
+		printf("spi_nand_sim: waiting with nothing on the bus\n");
+		abort();
+	}
+	sim_complete(d);
+}
+
+void spi_nand_sim_delay_us(uint32_t us)
+{
+	uint64_t until = now_ns + sim_us(us);
+	struct sim_die *d;
+
+	while ((d = sim_next_event()) != NULL && sim_event_ns(d) <= until)
+		sim_complete(d);
+
+	if (until > now_ns)
+		now_ns = until;
+}
+
+uint32_t spi_nand_sim_cycles(void)
+{
+	return (uint32_t)now_ns;
+}
+
+uint64_t spi_nand_sim_now_ns(void)
+{
+	return now_ns;
+}
+
+/* Stands in for the HAL millisecond tick. */
+uint32_t HAL_GetTick(void)
+{
+	return (uint32_t)(now_ns / 1000000);
+}
+
+int spi_nand_sim_set_ecc_status(uint32_t die, uint32_t page, uint8_t ecc_status)
+{
+	if (die >= SPI_NAND_N_CHIPS || !dies[die].set_up ||
+		page >= dies[die].n_pages)
+		return -1;
+
+	dies[die].ecc[page] = ecc_status & 7;
+	return 0;
+}
+
+int spi_nand_sim_set_program_fail(uint32_t die, uint32_t page)
+{
+	if (die >= SPI_NAND_N_CHIPS || !dies[die].set_up ||
+		page >= dies[die].n_pages)
+		return -1;
+
+	dies[die].fail_program = 1;
+	dies[die].fail_page = page;
+	return 0;
+}
+
+void spi_nand_sim_get_stats(uint32_t die, struct spi_nand_sim_stats *stats)
+{
+	*stats = dies[die].stats;
+}
+
+void spi_nand_sim_print_stats(void)
+{
+	struct sim_die *d;
+	uint32_t i;
+
+	printf("Simulated time %lu ms\n", (unsigned long)(now_ns / 1000000));
+	for (i = 0; i < SPI_NAND_N_CHIPS; i++) {
+		d = &dies[i];
+		if (!d->set_up)
+			continue;
+		printf("die %lu %s at %lu Hz: %lu page reads, %lu cache reads, "
+			   "%lu programs, %lu erases\n",
+			   (unsigned long)i, d->part->name, (unsigned long)d->cfg.spi_hz,
+			   (unsigned long)d->stats.n_page_reads,
+			   (unsigned long)d->stats.n_cache_reads,
+			   (unsigned long)d->stats.n_programs,
+			   (unsigned long)d->stats.n_erases);
+		printf("  %lu transfers, %llu bytes, bus busy %llu ms, array busy %llu ms, "
+			   "%lu commands while busy\n",
+			   (unsigned long)d->stats.n_xfers,
+			   (unsigned long long)d->stats.n_bytes,
+			   (unsigned long long)(d->stats.bus_ns / 1000000),
+			   (unsigned long long)(d->stats.array_ns / 1000000),
+			   (unsigned long)d->n_busy_errors);
+	}
+}
+
+#endif /* SPI_NAND_HOST_SIM */
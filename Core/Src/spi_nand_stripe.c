@@ -0,0 +1,339 @@
+#include "spi_nand_stripe.h"
+#include <string.h>
+
+#define STATUS_E_FAIL	0x04
+#define STATUS_P_FAIL	0x08
+
+static struct spi_nand_stripe_chip *spi_nand_stripe_map(struct spi_nand_stripe *s,
+														uint32_t chunk,
+														uint32_t *page)
+{
+	uint32_t block = chunk / s->chunks_per_block;
+	uint32_t offset = chunk % s->chunks_per_block;
+
+	*page = block * s->pages_per_block + offset / s->n_chips;
+	return &s->chip[offset % s->n_chips];
+}
+
+/*
+ * Wait for the async write in flight on sc, if any, and keep its chunk if
+ * the program failed.
+ */
+static void spi_nand_stripe_chip_wait(struct spi_nand_stripe *s,
+									  struct spi_nand_stripe_chip *sc)
+{
+	uint8_t status;
+
+	if (!sc->writing)
+		return;
+
+	sc->writing = 0;
+	if (spi_nand_request_wait(&sc->req, &status) < 0 ||
+		(status & STATUS_P_FAIL))
+		s->failed[s->n_failed++] = sc->chunk;
+}
+
+static void spi_nand_stripe_wait_all(struct spi_nand_stripe *s)
+{
+	uint32_t i;
+
+	for (i = 0; i < s->n_chips; i++)
+		spi_nand_stripe_chip_wait(s, &s->chip[i]);
+}
+
+/* Program ops to page on sc and wait for it. */
+static int spi_nand_stripe_program(struct spi_nand_stripe_chip *sc,
+								   uint32_t page,
+								   struct spi_nand_buffer_op *ops,
+								   uint32_t n_ops)
+{
+	uint8_t status;
+
+	if (spi_nand_write_page(sc->nand, page, ops, n_ops, &status) < 0 ||
+		(status & STATUS_P_FAIL))
+		return -1;
+
+	return 0;
+}
+
+int spi_nand_stripe_setup(struct spi_nand_stripe *s,
+						  struct spi_nand *chips,
+						  uint32_t n_chips)
+{
+	uint32_t i;
+
+	if (n_chips < 1 || n_chips > SPI_NAND_STRIPE_MAX_CHIPS)
+		return -1;
+
+	memset(s, 0, sizeof(*s));
+
+	s->n_chips = n_chips;
+	s->pages_per_block = chips[0].geo.pages_per_block;
+	s->n_blocks = spi_nand_bbt_usable_blocks(&chips[0]);
+
+	for (i = 0; i < n_chips; i++) {
+		if (chips[i].geo.pages_per_block != s->pages_per_block ||
+			chips[i].geo.data_bytes_per_page !=
+			chips[0].geo.data_bytes_per_page ||
+			chips[i].geo.oob_free_offset != chips[0].geo.oob_free_offset ||
+			chips[i].geo.data_bytes_per_page +
+			chips[i].geo.spare_bytes_per_page > SPI_NAND_STRIPE_MAX_PAGE)
+			return -1;
+		if (spi_nand_bbt_usable_blocks(&chips[i]) < s->n_blocks)
+			s->n_blocks = spi_nand_bbt_usable_blocks(&chips[i]);
+		s->chip[i].nand = &chips[i];
+	}
+
+	s->chunks_per_block = s->pages_per_block * n_chips;
+
+	return 0;
+}
+
+int spi_nand_stripe_init(struct spi_nand_stripe *s)
+{
+	uint32_t i;
+	int ret = 0;
+
+	for (i = 0; i < s->n_chips; i++) {
+		if (spi_nand_init(s->chip[i].nand) < 0 ||
+			spi_nand_bbt_load(s->chip[i].nand) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+int spi_nand_stripe_read_chunk(struct spi_nand_stripe *s,
+							   uint32_t chunk,
+							   uint32_t next_chunk,
+							   struct spi_nand_buffer_op *ops,
+							   uint32_t n_ops,
+							   uint8_t *statusptr)
+{
+	struct spi_nand_stripe_chip *sc;
+	uint32_t page;
+	uint32_t next_page = SPI_NAND_NO_PAGE;
+
+	sc = spi_nand_stripe_map(s, chunk, &page);
+	spi_nand_stripe_chip_wait(s, sc);
+
+	if (next_chunk != SPI_NAND_NO_PAGE &&
+		spi_nand_stripe_map(s, next_chunk, &next_page) != sc)
+		next_page = SPI_NAND_NO_PAGE;
+
+	return spi_nand_read_page_pipelined(sc->nand, page, next_page,
+										ops, n_ops, statusptr);
+}
+
+int spi_nand_stripe_read_chunk_async(struct spi_nand_stripe *s,
+									 uint32_t chunk,
+									 struct spi_nand_buffer_op *ops,
+									 uint32_t n_ops,
+									 struct spi_nand_request *req)
+{
+	struct spi_nand_stripe_chip *sc;
+	uint32_t page;
+
+	sc = spi_nand_stripe_map(s, chunk, &page);
+	spi_nand_stripe_chip_wait(s, sc);
+
+	return spi_nand_read_page_async(sc->nand, page, ops, n_ops,
+									req, NULL, NULL);
+}
+
+int spi_nand_stripe_write_chunk(struct spi_nand_stripe *s,
+								uint32_t chunk,
+								struct spi_nand_buffer_op *ops,
+								uint32_t n_ops)
+{
+	struct spi_nand_stripe_chip *sc;
+	uint32_t page;
+
+	sc = spi_nand_stripe_map(s, chunk, &page);
+	spi_nand_stripe_chip_wait(s, sc);
+
+	return spi_nand_stripe_program(sc, page, ops, n_ops);
+}
+
+int spi_nand_stripe_write_chunk_async(struct spi_nand_stripe *s,
+									  uint32_t chunk,
+									  struct spi_nand_buffer_op *ops,
+									  uint32_t n_ops)
+{
+	struct spi_nand_stripe_chip *sc;
+	struct spi_nand_buffer_op bops[SPI_NAND_REQUEST_MAX_OPS];
+	uint32_t page;
+	uint32_t i;
+
+	sc = spi_nand_stripe_map(s, chunk, &page);
+	spi_nand_stripe_chip_wait(s, sc);
+
+	/* Every chip's program in flight may yet fail and need keeping. */
+	if (n_ops > SPI_NAND_REQUEST_MAX_OPS ||
+		s->n_failed + s->n_chips > SPI_NAND_STRIPE_MAX_FAILED)
+		return spi_nand_stripe_program(sc, page, ops, n_ops);
+
+	for (i = 0; i < n_ops; i++) {
+		if (ops[i].offset + ops[i].nbytes > SPI_NAND_STRIPE_MAX_PAGE)
+			return -1;
+		memcpy(&sc->buffer[ops[i].offset], ops[i].buffer, ops[i].nbytes);
+		bops[i].offset = ops[i].offset;
+		bops[i].buffer = &sc->buffer[ops[i].offset];
+		bops[i].nbytes = ops[i].nbytes;
+	}
+
+	if (spi_nand_write_page_async(sc->nand, page, bops, n_ops,
+								  &sc->req, NULL, NULL) < 0)
+		return -1;
+	sc->writing = 1;
+	sc->chunk = chunk;
+
+	return 0;
+}
+
+int spi_nand_stripe_finish_writes(struct spi_nand_stripe *s,
+								  uint32_t *failed, uint32_t max)
+{
+	uint32_t n_failed;
+
+	spi_nand_stripe_wait_all(s);
+
+	n_failed = s->n_failed;
+	if (max > n_failed)
+		max = n_failed;
+	memcpy(failed, s->failed, max * sizeof(*failed));
+	s->n_failed = 0;
+
+	return n_failed;
+}
+
+int spi_nand_stripe_copy_chunk(struct spi_nand_stripe *s,
+							   uint32_t src_chunk,
+							   uint32_t dst_chunk,
+							   struct spi_nand_buffer_op *ops,
+							   uint32_t n_ops)
+{
+	struct spi_nand_stripe_chip *ssc;
+	struct spi_nand_stripe_chip *dsc;
+	struct spi_nand_buffer_op dops[SPI_NAND_REQUEST_MAX_OPS];
+	uint32_t src_page;
+	uint32_t dst_page;
+	uint8_t status;
+	int ret;
+
+	if (n_ops >= SPI_NAND_REQUEST_MAX_OPS)
+		return -1;
+
+	ssc = spi_nand_stripe_map(s, src_chunk, &src_page);
+	dsc = spi_nand_stripe_map(s, dst_chunk, &dst_page);
+	spi_nand_stripe_chip_wait(s, ssc);
+	spi_nand_stripe_chip_wait(s, dsc);
+
+	if (ssc == dsc && spi_nand_same_plane(dsc->nand, src_page, dst_page)) {
+		ret = spi_nand_copy_page(dsc->nand, src_page, dst_page,
+								 ops, n_ops, &status);
+		if (ret < 0 || (status & STATUS_P_FAIL))
+			return -1;
+		return 0;
+	}
+
+	/*
+	 * Different chips or planes. Bring the data across through the
+	 * destination chip's buffer and write it with the new bytes.
+	 */
+	dops[0].offset = 0;
+	dops[0].buffer = dsc->buffer;
+	dops[0].nbytes = dsc->nand->geo.data_bytes_per_page;
+
+	ret = spi_nand_read_page(ssc->nand, src_page, dops, 1, &status);
+	if (ret < 0 || ((status >> 4) & 7) == 2)
+		return -1;
+
+	memcpy(&dops[1], ops, n_ops * sizeof(*ops));
+
+	return spi_nand_stripe_program(dsc, dst_page, dops, n_ops + 1);
+}
+
+int spi_nand_stripe_erase_block(struct spi_nand_stripe *s, uint32_t block)
+{
+	struct spi_nand_stripe_chip *sc;
+	int issued[SPI_NAND_STRIPE_MAX_CHIPS];
+	uint32_t i;
+	uint8_t status;
+	int ret = 0;
+
+	spi_nand_stripe_wait_all(s);
+
+	/* Start the erase on every chip, then wait for them all. */
+	for (i = 0; i < s->n_chips; i++) {
+		sc = &s->chip[i];
+		issued[i] = spi_nand_erase_block_async(sc->nand, block, &sc->req,
+											   NULL, NULL) == 0;
+		if (!issued[i])
+			ret = -1;
+	}
+
+	for (i = 0; i < s->n_chips; i++) {
+		sc = &s->chip[i];
+		if (issued[i] && (spi_nand_request_wait(&sc->req, &status) < 0 ||
+						  (status & STATUS_E_FAIL)))
+			ret = -1;
+	}
+
+	return ret;
+}
+
+int spi_nand_stripe_check_block_ok(struct spi_nand_stripe *s,
+								   uint32_t block, uint32_t *is_ok)
+{
+	uint32_t i;
+
+	if (block >= s->n_blocks) {
+		*is_ok = 0;
+		return -1;
+	}
+
+	*is_ok = 1;
+	for (i = 0; i < s->n_chips; i++)
+		if (spi_nand_bbt_is_bad(s->chip[i].nand, block))
+			*is_ok = 0;
+
+	return 0;
+}
+
+int spi_nand_stripe_mark_block_bad(struct spi_nand_stripe *s, uint32_t block)
+{
+	struct spi_nand_stripe_chip *sc;
+	uint32_t i;
+	int ret = 0;
+
+	if (block >= s->n_blocks)
+		return -1;
+
+	spi_nand_stripe_wait_all(s);
+
+	for (i = 0; i < s->n_chips; i++) {
+		sc = &s->chip[i];
+		if (spi_nand_bbt_mark_bad(sc->nand, block) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+int spi_nand_stripe_sync(struct spi_nand_stripe *s)
+{
+	struct spi_nand_stripe_chip *sc;
+	uint32_t i;
+	int ret = 0;
+
+	spi_nand_stripe_wait_all(s);
+
+	for (i = 0; i < s->n_chips; i++) {
+		sc = &s->chip[i];
+		if (spi_nand_lock_down(sc->nand) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
@@ -0,0 +1,144 @@
+#include "spi_nand_timing.h"
+#include <string.h>
+#include <stdio.h>
+
+/*
+ * EWMA weight is 1/2^EWMA_SHIFT of each new sample.
+ * Averages are kept in 1/16 us to keep some precision for short
+ * operations.
+ */
+#define EWMA_SHIFT			3
+#define EWMA_SCALE			16
+
+/* Stay off the bus for 7/8 of the expected busy time. */
+#define FIRST_POLL_NUM		7
+#define FIRST_POLL_DEN		8
+
+/* Then poll 16 times over the expected busy time, but not too often. */
+#define POLL_DIVISOR		16
+#define MIN_POLL_INTERVAL_US	2
+
+/*
+ * Typical times from the data sheet, used until we have measured some.
+ */
+static const uint32_t seed_us[SPI_NAND_N_OPS] = {
+	[SPI_NAND_OP_READ] = 50,
+	[SPI_NAND_OP_CACHE_READ] = 5,
+	[SPI_NAND_OP_PROGRAM] = 200,
+	[SPI_NAND_OP_ERASE] = 2000,
+	[SPI_NAND_OP_OTHER] = 5,
+};
+
+static const char *op_names[SPI_NAND_N_OPS] = {
+	[SPI_NAND_OP_READ] = "read",
+	[SPI_NAND_OP_CACHE_READ] = "cache read",
+	[SPI_NAND_OP_PROGRAM] = "program",
+	[SPI_NAND_OP_ERASE] = "erase",
+	[SPI_NAND_OP_OTHER] = "other",
+};
+
+static struct spi_nand_latency latency[SPI_NAND_TIMING_N_DIES][SPI_NAND_N_OPS];
+
+static struct spi_nand_latency *spi_nand_timing_lat(uint32_t die,
+													enum spi_nand_timing_op op)
+{
+	if (die >= SPI_NAND_TIMING_N_DIES)
+		die = 0;
+	if (op >= SPI_NAND_N_OPS)
+		op = SPI_NAND_OP_OTHER;
+	return &latency[die][op];
+}
+
+void spi_nand_timing_init(uint32_t die)
+{
+	uint32_t op;
+
+	if (die >= SPI_NAND_TIMING_N_DIES)
+		return;
+
+	memset(latency[die], 0, sizeof(latency[die]));
+
+	for (op = 0; op < SPI_NAND_N_OPS; op++)
+		latency[die][op].ewma_x16 = seed_us[op] * EWMA_SCALE;
+}
+
+void spi_nand_timing_seed(uint32_t die, enum spi_nand_timing_op op, uint32_t us)
+{
+	struct spi_nand_latency *lat = spi_nand_timing_lat(die, op);
+
+	if (!lat->n)
+		lat->ewma_x16 = us * EWMA_SCALE;
+}
+
+uint32_t spi_nand_timing_first_poll_us(uint32_t die, enum spi_nand_timing_op op)
+{
+	struct spi_nand_latency *lat = spi_nand_timing_lat(die, op);
+	uint32_t us;
+
+	us = lat->ewma_x16 / EWMA_SCALE * FIRST_POLL_NUM / FIRST_POLL_DEN;
+
+	/* Never wait longer than the quickest one we have seen. */
+	if (lat->n && us > lat->min_us)
+		us = lat->min_us;
+
+	return us;
+}
+
+uint32_t spi_nand_timing_poll_interval_us(uint32_t die, enum spi_nand_timing_op op)
+{
+	struct spi_nand_latency *lat = spi_nand_timing_lat(die, op);
+	uint32_t us;
+
+	us = lat->ewma_x16 / EWMA_SCALE / POLL_DIVISOR;
+	if (us < MIN_POLL_INTERVAL_US)
+		us = MIN_POLL_INTERVAL_US;
+
+	return us;
+}
+
+void spi_nand_timing_record(uint32_t die, enum spi_nand_timing_op op,
+							uint32_t busy_us, uint32_t n_polls)
+{
+	struct spi_nand_latency *lat = spi_nand_timing_lat(die, op);
+	int32_t delta;
+
+	if (!lat->n || busy_us < lat->min_us)
+		lat->min_us = busy_us;
+	if (busy_us > lat->max_us)
+		lat->max_us = busy_us;
+
+	delta = (int32_t)(busy_us * EWMA_SCALE) - (int32_t)lat->ewma_x16;
+	lat->ewma_x16 += delta / (1 << EWMA_SHIFT);
+
+	lat->n++;
+	lat->n_polls += n_polls;
+	lat->total_us += busy_us;
+}
+
+void spi_nand_timing_get(uint32_t die, enum spi_nand_timing_op op,
+						 struct spi_nand_latency *lat)
+{
+	*lat = *spi_nand_timing_lat(die, op);
+}
+
+void spi_nand_timing_print(void)
+{
+	uint32_t die;
+	uint32_t op;
+	struct spi_nand_latency *lat;
+
+	for (die = 0; die < SPI_NAND_TIMING_N_DIES; die++) {
+		for (op = 0; op < SPI_NAND_N_OPS; op++) {
+			lat = &latency[die][op];
+			if (!lat->n)
+				continue;
+			printf("die %lu %-10s n %8lu min %6lu avg %6lu ewma %6lu max %6lu us, %lu polls\n",
+					die, op_names[op], lat->n,
+					lat->min_us,
+					(uint32_t)(lat->total_us / lat->n),
+					lat->ewma_x16 / EWMA_SCALE,
+					lat->max_us,
+					lat->n_polls);
+		}
+	}
+}
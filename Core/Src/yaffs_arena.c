@@ -0,0 +1,314 @@
+#include "yaffs_arena.h"
+#include <stdio.h>
+#include <string.h>
+#ifdef YAFFS_ARENA_HEAP
+#include <stdlib.h>
+#endif
+
+#define ARENA_MAGIC			0xa7e0
+#define ARENA_MAGIC_FREE	0xa7ef
+#define ARENA_POOL_MOUNT	0xff
+#define ARENA_POOL_HEAP		0xfe
+
+/* Ahead of every block; payloads stay YAFFS_ARENA_ALIGN aligned. */
+struct yaffs_arena_header {
+	uint32_t size;				/* Payload bytes */
+	uint8_t mem_class;
+	uint8_t pool;
+	uint16_t magic;
+};
+
+struct yaffs_arena_pool {
+	uint8_t mem_class;
+	uint32_t size;				/* Payload bytes of the pool's blocks */
+	void *free_list;			/* Linked through the payloads */
+};
+
+static struct {
+	uint8_t *base;
+	uint8_t *low;				/* Pool blocks are carved up from here */
+	uint8_t *high;				/* Mount allocations are bumped down from here */
+	uint8_t *end;
+	uint32_t n_mount;			/* Mount allocations not freed */
+	uint32_t heap;				/* Heap block bytes, with headers */
+	uint32_t peak;
+	uint32_t n_pools;
+	struct yaffs_arena_pool pool[YAFFS_ARENA_N_POOLS];
+	struct yaffs_arena_stats stats[YAFFS_MEM_N_CLASSES];
+	uint32_t carved[YAFFS_MEM_N_CLASSES];	/* Pool bytes, with headers */
+	uint32_t limit[YAFFS_MEM_N_CLASSES];	/* 0 for none */
+} arena;
+
+static const char *yaffs_arena_class_name[YAFFS_MEM_N_CLASSES] = {
+	"general", "tnodes", "objects", "chunk", "mount", "dirindex",
+};
+
+void yaffs_arena_init(void *mem, uint32_t size)
+{
+	memset(&arena, 0, sizeof(arena));
+	arena.base = mem;
+	arena.low = mem;
+	arena.end = arena.base + (size & ~(YAFFS_ARENA_ALIGN - 1));
+	arena.high = arena.end;
+}
+
+static uint32_t yaffs_arena_in_use(void)
+{
+	return (arena.low - arena.base) + (arena.end - arena.high) + arena.heap;
+}
+
+static void yaffs_arena_account(uint32_t mem_class, uint32_t size)
+{
+	struct yaffs_arena_stats *st = &arena.stats[mem_class];
+	uint32_t in_use = yaffs_arena_in_use();
+
+	st->n_allocs++;
+	st->cur_bytes += size;
+	if (st->cur_bytes > st->peak_bytes)
+		st->peak_bytes = st->cur_bytes;
+	if (in_use > arena.peak)
+		arena.peak = in_use;
+}
+
+/* The payload size of the pool blocks for an allocation of size. */
+static uint32_t yaffs_arena_pool_size(uint32_t mem_class, uint32_t size)
+{
+	uint32_t pool_size;
+
+	size = (size + YAFFS_ARENA_ALIGN - 1) & ~(YAFFS_ARENA_ALIGN - 1);
+	if (mem_class != YAFFS_MEM_GENERAL && mem_class != YAFFS_MEM_DIR_INDEX)
+		return size;
+
+	for (pool_size = YAFFS_ARENA_MIN_GENERAL; pool_size < size; pool_size <<= 1)
+		;
+	return pool_size;
+}
+
+static struct yaffs_arena_pool *yaffs_arena_find_pool(uint32_t mem_class,
+													  uint32_t size)
+{
+	struct yaffs_arena_pool *p;
+	uint32_t i;
+
+	for (i = 0; i < arena.n_pools; i++) {
+		p = &arena.pool[i];
+		if (p->mem_class == mem_class && p->size == size)
+			return p;
+	}
+
+	if (arena.n_pools >= YAFFS_ARENA_N_POOLS)
+		return NULL;
+
+	p = &arena.pool[arena.n_pools++];
+	p->mem_class = mem_class;
+	p->size = size;
+	p->free_list = NULL;
+	return p;
+}
+
+static void *yaffs_arena_alloc_pool(uint32_t mem_class, uint32_t size)
+{
+	struct yaffs_arena_pool *p;
+	struct yaffs_arena_header *hdr;
+	void *ptr;
+
+	p = yaffs_arena_find_pool(mem_class, yaffs_arena_pool_size(mem_class, size));
+	if (!p)
+		return NULL;
+
+	if (p->free_list) {
+		ptr = p->free_list;
+		p->free_list = *(void **)ptr;
+		hdr = (struct yaffs_arena_header *)ptr - 1;
+	} else {
+		if ((uint32_t)(arena.high - arena.low) < YAFFS_ARENA_HEADER + p->size)
+			return NULL;
+		if (arena.limit[mem_class] && arena.carved[mem_class] +
+			YAFFS_ARENA_HEADER + p->size > arena.limit[mem_class])
+			return NULL;
+		arena.carved[mem_class] += YAFFS_ARENA_HEADER + p->size;
+		hdr = (struct yaffs_arena_header *)arena.low;
+		arena.low += YAFFS_ARENA_HEADER + p->size;
+		hdr->size = p->size;
+		hdr->mem_class = mem_class;
+		hdr->pool = p - arena.pool;
+		ptr = hdr + 1;
+	}
+	hdr->magic = ARENA_MAGIC;
+
+	yaffs_arena_account(mem_class, p->size);
+	return ptr;
+}
+
+static void *yaffs_arena_alloc_mount(uint32_t size)
+{
+	struct yaffs_arena_header *hdr;
+	uint32_t bytes = YAFFS_ARENA_BLOCK_BYTES(size);
+
+	if ((uint32_t)(arena.high - arena.low) < bytes)
+		return NULL;
+
+	arena.high -= bytes;
+	hdr = (struct yaffs_arena_header *)arena.high;
+	hdr->size = bytes - YAFFS_ARENA_HEADER;
+	hdr->mem_class = YAFFS_MEM_MOUNT;
+	hdr->pool = ARENA_POOL_MOUNT;
+	hdr->magic = ARENA_MAGIC;
+	arena.n_mount++;
+
+	yaffs_arena_account(YAFFS_MEM_MOUNT, hdr->size);
+	return hdr + 1;
+}
+
+#ifdef YAFFS_ARENA_HEAP
+/* Tnode and object batches past the region, see yaffs_arena.h. */
+static void *yaffs_arena_alloc_heap(uint32_t mem_class, uint32_t size)
+{
+	struct yaffs_arena_header *hdr;
+	uint32_t bytes = YAFFS_ARENA_BLOCK_BYTES(size);
+
+	if (mem_class != YAFFS_MEM_TNODES && mem_class != YAFFS_MEM_OBJECTS)
+		return NULL;
+
+	hdr = malloc(bytes);
+	if (!hdr)
+		return NULL;
+	hdr->size = bytes - YAFFS_ARENA_HEADER;
+	hdr->mem_class = mem_class;
+	hdr->pool = ARENA_POOL_HEAP;
+	hdr->magic = ARENA_MAGIC;
+	arena.heap += bytes;
+	arena.stats[mem_class].heap_bytes += hdr->size;
+
+	yaffs_arena_account(mem_class, hdr->size);
+	return hdr + 1;
+}
+#endif
+
+void *yaffs_arena_alloc(enum yaffs_mem_class mem_class, uint32_t size)
+{
+	void *ptr;
+
+	if ((uint32_t)mem_class >= YAFFS_MEM_N_CLASSES || !arena.base)
+		return NULL;
+
+	if (mem_class == YAFFS_MEM_MOUNT)
+		ptr = yaffs_arena_alloc_mount(size);
+	else
+		ptr = yaffs_arena_alloc_pool(mem_class, size);
+#ifdef YAFFS_ARENA_HEAP
+	if (!ptr)
+		ptr = yaffs_arena_alloc_heap(mem_class, size);
+#endif
+
+	if (!ptr)
+		arena.stats[mem_class].n_fails++;
+	return ptr;
+}
+
+/*
+ * Give back the space of freed mount allocations at the bottom of the
+ * mount arena, or all of it once none are left.
+ */
+static void yaffs_arena_trim_mount(void)
+{
+	struct yaffs_arena_header *hdr;
+
+	if (!arena.n_mount) {
+		arena.high = arena.end;
+		return;
+	}
+
+	while (arena.high < arena.end) {
+		hdr = (struct yaffs_arena_header *)arena.high;
+		if (hdr->magic != ARENA_MAGIC_FREE)
+			break;
+		arena.high += YAFFS_ARENA_HEADER + hdr->size;
+	}
+}
+
+void yaffs_arena_free(void *ptr)
+{
+	struct yaffs_arena_header *hdr;
+	struct yaffs_arena_pool *p;
+
+	if (!ptr)
+		return;
+
+	hdr = (struct yaffs_arena_header *)ptr - 1;
+#ifdef YAFFS_ARENA_HEAP
+	if (((uint8_t *)ptr < arena.base || (uint8_t *)ptr >= arena.end) &&
+		hdr->magic == ARENA_MAGIC && hdr->pool == ARENA_POOL_HEAP) {
+		hdr->magic = ARENA_MAGIC_FREE;
+		arena.stats[hdr->mem_class].cur_bytes -= hdr->size;
+		arena.stats[hdr->mem_class].heap_bytes -= hdr->size;
+		arena.heap -= YAFFS_ARENA_HEADER + hdr->size;
+		free(hdr);
+		return;
+	}
+#endif
+	if ((uint8_t *)hdr < arena.base || (uint8_t *)ptr >= arena.end ||
+		hdr->magic != ARENA_MAGIC) {
+		printf("yaffs arena: bad free of %p\n", ptr);
+		return;
+	}
+
+	hdr->magic = ARENA_MAGIC_FREE;
+	arena.stats[hdr->mem_class].cur_bytes -= hdr->size;
+
+	if (hdr->pool == ARENA_POOL_MOUNT) {
+		arena.n_mount--;
+		yaffs_arena_trim_mount();
+		return;
+	}
+
+	p = &arena.pool[hdr->pool];
+	*(void **)ptr = p->free_list;
+	p->free_list = ptr;
+}
+
+void yaffs_arena_set_limit(enum yaffs_mem_class mem_class, uint32_t bytes)
+{
+	if ((uint32_t)mem_class < YAFFS_MEM_N_CLASSES &&
+		mem_class != YAFFS_MEM_MOUNT)
+		arena.limit[mem_class] = bytes;
+}
+
+void yaffs_arena_get_stats(enum yaffs_mem_class mem_class,
+						   struct yaffs_arena_stats *stats)
+{
+	if ((uint32_t)mem_class < YAFFS_MEM_N_CLASSES)
+		*stats = arena.stats[mem_class];
+	else
+		memset(stats, 0, sizeof(*stats));
+}
+
+void yaffs_arena_get_usage(uint32_t *current, uint32_t *high_water)
+{
+	if (current)
+		*current = yaffs_arena_in_use();
+	if (high_water)
+		*high_water = arena.peak;
+}
+
+void yaffs_arena_print_stats(void)
+{
+	const struct yaffs_arena_stats *st;
+	uint32_t i;
+
+	printf("yaffs arena: %lu bytes, %lu in use, peak %lu, %lu pools\n",
+		   (unsigned long)(arena.end - arena.base),
+		   (unsigned long)yaffs_arena_in_use(),
+		   (unsigned long)arena.peak,
+		   (unsigned long)arena.n_pools);
+#ifdef YAFFS_ARENA_HEAP
+	printf("  %lu bytes of it from the heap\n", (unsigned long)arena.heap);
+#endif
+	for (i = 0; i < YAFFS_MEM_N_CLASSES; i++) {
+		st = &arena.stats[i];
+		printf("  %-8s %7lu bytes, peak %7lu, %lu allocs, %lu failed\n",
+			   yaffs_arena_class_name[i],
+			   (unsigned long)st->cur_bytes, (unsigned long)st->peak_bytes,
+			   (unsigned long)st->n_allocs, (unsigned long)st->n_fails);
+	}
+}
@@ -0,0 +1,814 @@
+#include "yaffs_bench.h"
+#include "yaffsfs.h"
+#include "yaffs_guts.h"
+#include "yaffs_cache.h"
+#include "spi_nand.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Latencies are kept in a histogram with 8 buckets for each power of two,
+ * so percentiles come out within 1/8 of the true value.
+ */
+#define BENCH_HIST_SUB_BITS		3
+#define BENCH_HIST_SUB			(1 << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_BUCKETS		((32 - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB)
+
+#define BENCH_NAME_MAX			48
+
+struct yaffs_bench_nand {
+	uint32_t page_reads;
+	uint32_t page_writes;
+	uint32_t erasures;
+	uint32_t gc_copies;
+};
+
+struct yaffs_bench_result {
+	const char *name;
+	uint32_t io_size;
+	uint32_t n_ops;
+	uint32_t n_errors;
+	uint64_t bytes;
+	uint64_t start_us;
+	uint32_t max_us;
+	uint32_t hist[BENCH_HIST_BUCKETS];
+	struct yaffs_bench_nand nand_start;
+	struct yaffs_bench_nand nand;	/* Counted since begin */
+	int no_nand;					/* The counts are not known */
+};
+
+static struct yaffs_bench_result bench_result[2];
+static uint8_t bench_buffer[YAFFS_BENCH_MAX_IO];
+
+static struct yaffs_dev *bench_dev;
+static const char *bench_mount;
+static uint32_t bench_seed;
+
+/* The driver's clock, run on into 64 bits of us. */
+static uint64_t bench_now_us;
+static uint32_t bench_last_cycles;
+
+static uint64_t yaffs_bench_now(void)
+{
+	uint32_t per_us = spi_nand_clock_cycles_per_us();
+	uint32_t us = (spi_nand_clock_cycles() - bench_last_cycles) / per_us;
+
+	bench_last_cycles += us * per_us;
+	bench_now_us += us;
+	return bench_now_us;
+}
+
+static uint32_t yaffs_bench_random(void)
+{
+	bench_seed = bench_seed * 1103515245 + 12345;
+	return bench_seed >> 8;
+}
+
+static void yaffs_bench_path(char *path, const char *name, uint32_t n)
+{
+	snprintf(path, BENCH_NAME_MAX, "%s/%s%lu", bench_mount, name,
+			 (unsigned long)n);
+}
+
+static void yaffs_bench_get_nand(struct yaffs_bench_nand *nand)
+{
+	nand->page_reads = bench_dev->n_page_reads;
+	nand->page_writes = bench_dev->n_page_writes;
+	nand->erasures = bench_dev->n_erasures;
+	nand->gc_copies = bench_dev->n_gc_copies;
+}
+
+/* Start counting NAND operations for r... */
+static void yaffs_bench_nand_mark(struct yaffs_bench_result *r)
+{
+	yaffs_bench_get_nand(&r->nand_start);
+}
+
+/* ...and add those since. */
+static void yaffs_bench_nand_add(struct yaffs_bench_result *r)
+{
+	struct yaffs_bench_nand now;
+
+	yaffs_bench_get_nand(&now);
+	r->nand.page_reads += now.page_reads - r->nand_start.page_reads;
+	r->nand.page_writes += now.page_writes - r->nand_start.page_writes;
+	r->nand.erasures += now.erasures - r->nand_start.erasures;
+	r->nand.gc_copies += now.gc_copies - r->nand_start.gc_copies;
+	r->nand_start = now;
+}
+
+static uint32_t yaffs_bench_bucket(uint32_t us)
+{
+	uint32_t msb;
+
+	if (us < BENCH_HIST_SUB)
+		return us;
+	msb = 31 - __builtin_clz(us);
+	return (msb - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB +
+		   ((us >> (msb - BENCH_HIST_SUB_BITS)) & (BENCH_HIST_SUB - 1));
+}
+
+/* The largest latency that falls in bucket. */
+static uint32_t yaffs_bench_bucket_max(uint32_t bucket)
+{
+	uint32_t shift;
+	uint32_t sub;
+
+	if (bucket < BENCH_HIST_SUB)
+		return bucket;
+	shift = bucket / BENCH_HIST_SUB - 1;
+	sub = bucket % BENCH_HIST_SUB;
+	return ((BENCH_HIST_SUB + sub + 1) << shift) - 1;
+}
+
+static uint32_t yaffs_bench_percentile(const struct yaffs_bench_result *r,
+									   uint32_t percent)
+{
+	uint32_t want = (r->n_ops * percent + 99) / 100;
+	uint32_t seen = 0;
+	uint32_t us;
+	uint32_t i;
+
+	for (i = 0; i < BENCH_HIST_BUCKETS; i++) {
+		seen += r->hist[i];
+		if (seen >= want && seen > 0) {
+			us = yaffs_bench_bucket_max(i);
+			return us < r->max_us ? us : r->max_us;
+		}
+	}
+	return r->max_us;
+}
+
+static void yaffs_bench_begin(struct yaffs_bench_result *r, const char *name,
+							  uint32_t io_size)
+{
+	memset(r, 0, sizeof(*r));
+	r->name = name;
+	r->io_size = io_size;
+	yaffs_bench_nand_mark(r);
+	r->start_us = yaffs_bench_now();
+}
+
+static void yaffs_bench_op_done(struct yaffs_bench_result *r, uint64_t op_start,
+								uint32_t bytes, int ok)
+{
+	uint32_t us = yaffs_bench_now() - op_start;
+
+	r->n_ops++;
+	r->bytes += bytes;
+	if (!ok)
+		r->n_errors++;
+	if (us > r->max_us)
+		r->max_us = us;
+	r->hist[yaffs_bench_bucket(us)]++;
+}
+
+static void yaffs_bench_print_header(void)
+{
+	printf("%-14s %5s %6s %8s %7s %7s %7s %7s %8s %6s %6s %6s %6s\n",
+		   "test", "size", "ops", "MB/s", "IOPS", "p50us", "p90us", "p99us",
+		   "maxus", "reads", "writes", "erases", "gccopy");
+}
+
+/*
+ * Print the result, timed up to now. The rates print as "-" if no time
+ * went by. Returns 1 if any op failed.
+ */
+static int yaffs_bench_end(struct yaffs_bench_result *r, uint64_t end_us)
+{
+	uint64_t us = end_us - r->start_us;
+	uint32_t mb_x100;
+	uint32_t iops;
+
+	yaffs_bench_nand_add(r);
+	printf("%-14s %5lu %6lu", r->name, (unsigned long)r->io_size,
+		   (unsigned long)r->n_ops);
+	if (us) {
+		mb_x100 = r->bytes * 100 / us;
+		iops = (uint64_t)r->n_ops * 1000000 / us;
+		printf(" %5lu.%02lu %7lu", (unsigned long)(mb_x100 / 100),
+			   (unsigned long)(mb_x100 % 100), (unsigned long)iops);
+	} else {
+		printf(" %8s %7s", "-", "-");
+	}
+	printf(" %7lu %7lu %7lu %8lu",
+		   (unsigned long)yaffs_bench_percentile(r, 50),
+		   (unsigned long)yaffs_bench_percentile(r, 90),
+		   (unsigned long)yaffs_bench_percentile(r, 99),
+		   (unsigned long)r->max_us);
+	if (r->no_nand)
+		printf(" %6s %6s %6s %6s", "-", "-", "-", "-");
+	else
+		printf(" %6lu %6lu %6lu %6lu",
+			   (unsigned long)r->nand.page_reads,
+			   (unsigned long)r->nand.page_writes,
+			   (unsigned long)r->nand.erasures,
+			   (unsigned long)r->nand.gc_copies);
+	if (r->n_errors)
+		printf("  %lu failed", (unsigned long)r->n_errors);
+	printf("\n");
+
+	return r->n_errors ? 1 : 0;
+}
+
+/* Write a file of size bytes, untimed, for the tests to work on. */
+static int yaffs_bench_make_file(const char *path, uint32_t size)
+{
+	uint32_t n;
+	int ret = 0;
+	int h;
+
+	h = yaffs_open(path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+	if (h < 0)
+		return -1;
+
+	while (size > 0) {
+		n = size < sizeof(bench_buffer) ? size : sizeof(bench_buffer);
+		if (yaffs_write(h, bench_buffer, n) != (int)n) {
+			ret = -1;
+			break;
+		}
+		size -= n;
+	}
+	yaffs_fsync(h);
+	yaffs_close(h);
+
+	return ret;
+}
+
+static int yaffs_bench_seq(const struct yaffs_bench_config *cfg)
+{
+	struct yaffs_bench_result *r = &bench_result[0];
+	char path[BENCH_NAME_MAX];
+	uint64_t t;
+	uint32_t left;
+	uint32_t n;
+	uint32_t i;
+	int fails = 0;
+	int h;
+
+	yaffs_bench_path(path, "seq", 0);
+
+	for (i = 0; i < cfg->n_io_sizes; i++) {
+		h = yaffs_open(path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+		if (h < 0)
+			return 1;
+		yaffs_bench_begin(r, "seq write", cfg->io_size[i]);
+		for (left = cfg->seq_file_bytes; left > 0; left -= n) {
+			n = left < cfg->io_size[i] ? left : cfg->io_size[i];
+			t = yaffs_bench_now();
+			yaffs_bench_op_done(r, t, n,
+								yaffs_write(h, bench_buffer, n) == (int)n);
+		}
+		yaffs_fsync(h);
+		fails += yaffs_bench_end(r, yaffs_bench_now());
+		yaffs_close(h);
+
+		h = yaffs_open(path, O_RDONLY, 0);
+		yaffs_bench_begin(r, "seq read", cfg->io_size[i]);
+		for (left = cfg->seq_file_bytes; left > 0; left -= n) {
+			n = left < cfg->io_size[i] ? left : cfg->io_size[i];
+			t = yaffs_bench_now();
+			yaffs_bench_op_done(r, t, n,
+								yaffs_read(h, bench_buffer, n) == (int)n);
+		}
+		fails += yaffs_bench_end(r, yaffs_bench_now());
+		yaffs_close(h);
+	}
+
+	yaffs_unlink(path);
+	return fails;
+}
+
+/* n_ops reads or writes of io_size at random io_size aligned offsets. */
+static int yaffs_bench_random_ops(struct yaffs_bench_result *r, int h,
+								  uint32_t file_bytes, uint32_t io_size,
+								  uint32_t n_ops, int write)
+{
+	uint32_t n_slots = file_bytes / io_size;
+	uint64_t t;
+	uint32_t i;
+	int n;
+
+	if (!n_slots)
+		return 1;
+
+	for (i = 0; i < n_ops; i++) {
+		t = yaffs_bench_now();
+		yaffs_lseek(h, (yaffs_bench_random() % n_slots) * io_size, SEEK_SET);
+		if (write)
+			n = yaffs_write(h, bench_buffer, io_size);
+		else
+			n = yaffs_read(h, bench_buffer, io_size);
+		yaffs_bench_op_done(r, t, io_size, n == (int)io_size);
+	}
+	if (write)
+		yaffs_fsync(h);
+
+	return yaffs_bench_end(r, yaffs_bench_now());
+}
+
+static int yaffs_bench_random_test(const struct yaffs_bench_config *cfg)
+{
+	struct yaffs_bench_result *r = &bench_result[0];
+	char path[BENCH_NAME_MAX];
+	uint32_t i;
+	int fails = 0;
+	int h;
+
+	yaffs_bench_path(path, "rand", 0);
+	if (yaffs_bench_make_file(path, cfg->random_file_bytes) < 0)
+		return 1;
+
+	h = yaffs_open(path, O_RDWR, 0);
+	for (i = 0; i < cfg->n_io_sizes; i++) {
+		yaffs_bench_begin(r, "random read", cfg->io_size[i]);
+		fails += yaffs_bench_random_ops(r, h, cfg->random_file_bytes,
+										cfg->io_size[i], cfg->n_random_ops, 0);
+	}
+	for (i = 0; i < cfg->n_io_sizes; i++) {
+		yaffs_bench_begin(r, "random write", cfg->io_size[i]);
+		fails += yaffs_bench_random_ops(r, h, cfg->random_file_bytes,
+										cfg->io_size[i], cfg->n_random_ops, 1);
+	}
+	yaffs_close(h);
+
+	yaffs_unlink(path);
+	return fails;
+}
+
+static int yaffs_bench_small_files(const struct yaffs_bench_config *cfg)
+{
+	struct yaffs_bench_result *r = &bench_result[0];
+	char path[BENCH_NAME_MAX];
+	uint64_t t;
+	uint32_t i;
+	int fails = 0;
+	int ok;
+	int h;
+
+	yaffs_bench_begin(r, "small create", cfg->small_file_bytes);
+	for (i = 0; i < cfg->n_small_files; i++) {
+		yaffs_bench_path(path, "small", i);
+		t = yaffs_bench_now();
+		h = yaffs_open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+		ok = h >= 0 &&
+			 yaffs_write(h, bench_buffer, cfg->small_file_bytes) ==
+				(int)cfg->small_file_bytes &&
+			 yaffs_fsync(h) == 0;
+		if (h >= 0)
+			yaffs_close(h);
+		yaffs_bench_op_done(r, t, cfg->small_file_bytes, ok);
+	}
+	fails += yaffs_bench_end(r, yaffs_bench_now());
+
+	yaffs_bench_begin(r, "small unlink", 0);
+	for (i = 0; i < cfg->n_small_files; i++) {
+		yaffs_bench_path(path, "small", i);
+		t = yaffs_bench_now();
+		yaffs_bench_op_done(r, t, 0, yaffs_unlink(path) == 0);
+	}
+	yaffs_sync(bench_mount);
+	fails += yaffs_bench_end(r, yaffs_bench_now());
+
+	return fails;
+}
+
+/* Each op makes a directory, fills it with empty files and removes it. */
+static int yaffs_bench_dirs(const struct yaffs_bench_config *cfg)
+{
+	struct yaffs_bench_result *r = &bench_result[0];
+	char dir[BENCH_NAME_MAX];
+	char path[2 * BENCH_NAME_MAX];
+	uint64_t t;
+	uint32_t i;
+	uint32_t j;
+	int ok;
+	int h;
+
+	yaffs_bench_begin(r, "dir churn", cfg->n_files_per_dir);
+	for (i = 0; i < cfg->n_dir_rounds; i++) {
+		yaffs_bench_path(dir, "dir", i);
+		t = yaffs_bench_now();
+		ok = yaffs_mkdir(dir, 0777) == 0;
+		for (j = 0; j < cfg->n_files_per_dir; j++) {
+			snprintf(path, sizeof(path), "%s/f%lu", dir, (unsigned long)j);
+			h = yaffs_open(path, O_CREAT | O_WRONLY, 0666);
+			if (h < 0)
+				ok = 0;
+			else
+				yaffs_close(h);
+		}
+		for (j = 0; j < cfg->n_files_per_dir; j++) {
+			snprintf(path, sizeof(path), "%s/f%lu", dir, (unsigned long)j);
+			if (yaffs_unlink(path) < 0)
+				ok = 0;
+		}
+		if (yaffs_rmdir(dir) < 0)
+			ok = 0;
+		yaffs_bench_op_done(r, t, 0, ok);
+	}
+	yaffs_sync(bench_mount);
+
+	return yaffs_bench_end(r, yaffs_bench_now());
+}
+
+/*
+ * Unmount and mount again. Each unmount is timed after a small write, so
+ * that like a real one it has the checkpoint to write.
+ */
+static int yaffs_bench_mount(const struct yaffs_bench_config *cfg)
+{
+	struct yaffs_bench_result *ru = &bench_result[0];
+	struct yaffs_bench_result *rm = &bench_result[1];
+	char path[BENCH_NAME_MAX];
+	uint64_t t;
+	uint64_t mount_us = 0;
+	uint64_t unmount_us = 0;
+	uint32_t i;
+	int fails = 0;
+
+	yaffs_bench_path(path, "mnt", 0);
+	yaffs_bench_begin(ru, "unmount", 0);
+	yaffs_bench_begin(rm, "mount", 0);
+	for (i = 0; i < cfg->n_mounts; i++) {
+		if (yaffs_bench_make_file(path, 1000) < 0)
+			fails++;
+		yaffs_bench_nand_mark(ru);
+		t = yaffs_bench_now();
+		yaffs_bench_op_done(ru, t, 0, yaffs_unmount(bench_mount) == 0);
+		unmount_us += yaffs_bench_now() - t;
+		yaffs_bench_nand_add(ru);
+
+		t = yaffs_bench_now();
+		yaffs_bench_op_done(rm, t, 0, yaffs_mount(bench_mount) == 0);
+		mount_us += yaffs_bench_now() - t;
+	}
+	/*
+	 * Each is timed and counted over its own ops only. The device's
+	 * counts start again from 0 at the end of a mount, so the mount's
+	 * own operations are not known.
+	 */
+	yaffs_bench_nand_mark(ru);
+	rm->no_nand = 1;
+	fails += yaffs_bench_end(ru, ru->start_us + unmount_us);
+	fails += yaffs_bench_end(rm, rm->start_us + mount_us);
+	yaffs_unlink(path);
+
+	return fails;
+}
+
+/*
+ * Fill the volume to each percentage with a file, then rewrite another
+ * file at random, so that gc has to work for the space. The test is named
+ * for how full the volume really got.
+ */
+static int yaffs_bench_steady(const struct yaffs_bench_config *cfg)
+{
+	static char names[YAFFS_BENCH_MAX_FILLS][32];
+	struct yaffs_bench_result *r = &bench_result[0];
+	char work[BENCH_NAME_MAX];
+	char fill[BENCH_NAME_MAX];
+	uint64_t total;
+	uint64_t used;
+	uint64_t want;
+	uint32_t i;
+	int fails = 0;
+	int h;
+
+	yaffs_bench_path(work, "work", 0);
+	yaffs_bench_path(fill, "fill", 0);
+
+	for (i = 0; i < cfg->n_fills; i++) {
+		if (yaffs_bench_make_file(work, cfg->steady_file_bytes) < 0)
+			return fails + 1;
+
+		total = yaffs_totalspace(bench_mount);
+		used = total - yaffs_freespace(bench_mount);
+		want = total * cfg->fill_percent[i] / 100;
+		if (want > used && want - used > 0xffffffffu)
+			want = used + 0xffffffffu;
+		if (want > used)
+			yaffs_bench_make_file(fill, want - used);
+		used = total - yaffs_freespace(bench_mount);
+
+		snprintf(names[i], sizeof(names[i]), "steady %lu%%",
+				 (unsigned long)(total ? used * 100 / total : 0));
+
+		h = yaffs_open(work, O_RDWR, 0);
+		yaffs_bench_begin(r, names[i], cfg->steady_io_size);
+		fails += yaffs_bench_random_ops(r, h, cfg->steady_file_bytes,
+										cfg->steady_io_size,
+										cfg->steady_bytes / cfg->steady_io_size,
+										1);
+		yaffs_close(h);
+
+		yaffs_unlink(fill);
+		yaffs_unlink(work);
+	}
+	yaffs_sync(bench_mount);
+
+	return fails;
+}
+
+/* Read a whole file in short reads, as a config file is parsed. */
+static int yaffs_bench_read_file(const char *path, uint32_t io_size)
+{
+	int ok = 1;
+	int n;
+	int h;
+
+	h = yaffs_open(path, O_RDONLY, 0);
+	if (h < 0)
+		return 0;
+	do {
+		n = yaffs_read(h, bench_buffer, io_size);
+		if (n < 0)
+			ok = 0;
+	} while (n > 0);
+	yaffs_close(h);
+
+	return ok;
+}
+
+/*
+ * A trace of the mix the board sees: records appended to a log, small
+ * config files read again and again, and now and then a big file read
+ * straight through, run against each cache replacement policy. Each op is
+ * one of those. The hit rate is the share of chunk lookups the short op
+ * cache had; the promotions are chunks ARC took as re-referenced.
+ */
+static int yaffs_bench_cache(const struct yaffs_bench_config *cfg)
+{
+	static char names[YAFFS_CACHE_N_POLICIES][16];
+	struct yaffs_bench_result *r = &bench_result[0];
+	struct yaffs_cache_stats before;
+	struct yaffs_cache_stats *st;
+	char log[BENCH_NAME_MAX];
+	char scan[BENCH_NAME_MAX];
+	char path[BENCH_NAME_MAX];
+	uint32_t old_policy = bench_dev->param.cache_policy;
+	uint32_t scan_pos;
+	uint32_t lookups;
+	uint32_t policy;
+	uint32_t pick;
+	uint32_t n;
+	uint32_t i;
+	uint64_t t;
+	int fails = 0;
+	int ok;
+	int hl;
+	int hs;
+
+	yaffs_bench_path(log, "log", 0);
+	yaffs_bench_path(scan, "scan", 0);
+
+	for (policy = 0; policy < YAFFS_CACHE_N_POLICIES; policy++) {
+		yaffs_unmount(bench_mount);
+		bench_dev->param.cache_policy = policy;
+		if (yaffs_mount(bench_mount) < 0) {
+			fails++;
+			break;
+		}
+
+		for (i = 0; i < cfg->n_config_files; i++) {
+			yaffs_bench_path(path, "conf", i);
+			if (yaffs_bench_make_file(path, cfg->config_file_bytes) < 0)
+				fails++;
+		}
+		if (yaffs_bench_make_file(scan, cfg->scan_file_bytes) < 0)
+			fails++;
+		hl = yaffs_open(log, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0666);
+		hs = yaffs_open(scan, O_RDONLY, 0);
+		scan_pos = 0;
+
+		snprintf(names[policy], sizeof(names[policy]), "cache %s",
+				 yaffs_cache_policy_name(policy));
+		st = &bench_dev->cache_mgr.stats;
+		before = *st;
+		yaffs_bench_begin(r, names[policy], cfg->log_append_bytes);
+		for (i = 0; i < cfg->n_cache_ops; i++) {
+			pick = yaffs_bench_random() % 10;
+			t = yaffs_bench_now();
+			if (pick < 5) {
+				n = cfg->log_append_bytes;
+				ok = yaffs_write(hl, bench_buffer, n) == (int)n;
+			} else if (pick < 9 || !cfg->scan_file_bytes) {
+				yaffs_bench_path(path, "conf",
+								 yaffs_bench_random() % cfg->n_config_files);
+				n = cfg->config_file_bytes;
+				ok = yaffs_bench_read_file(path, 128);
+			} else {
+				/* 16KB more of the big file, in 1000 byte reads. */
+				for (n = 0, ok = 1; n < 16 * 1024; n += 1000) {
+					if (scan_pos + 1000 > cfg->scan_file_bytes) {
+						scan_pos = 0;
+						yaffs_lseek(hs, 0, SEEK_SET);
+					}
+					if (yaffs_read(hs, bench_buffer, 1000) != 1000)
+						ok = 0;
+					scan_pos += 1000;
+				}
+			}
+			yaffs_bench_op_done(r, t, n, ok);
+		}
+		yaffs_fsync(hl);
+		fails += yaffs_bench_end(r, yaffs_bench_now());
+
+		lookups = (st->hits - before.hits) + (st->misses - before.misses);
+		printf("  hits %lu misses %lu (%lu%%) evictions %lu dirty %lu"
+			   " promotions %lu\n",
+			   (unsigned long)(st->hits - before.hits),
+			   (unsigned long)(st->misses - before.misses),
+			   (unsigned long)(lookups ?
+				   (uint64_t)(st->hits - before.hits) * 100 / lookups : 0),
+			   (unsigned long)(st->evictions - before.evictions),
+			   (unsigned long)(st->dirty_evictions - before.dirty_evictions),
+			   (unsigned long)(st->promotions - before.promotions));
+
+		yaffs_close(hs);
+		yaffs_close(hl);
+		yaffs_unlink(log);
+		yaffs_unlink(scan);
+		for (i = 0; i < cfg->n_config_files; i++) {
+			yaffs_bench_path(path, "conf", i);
+			yaffs_unlink(path);
+		}
+	}
+
+	yaffs_sync(bench_mount);
+	yaffs_unmount(bench_mount);
+	bench_dev->param.cache_policy = old_policy;
+	if (yaffs_mount(bench_mount) < 0)
+		fails++;
+
+	return fails;
+}
+
+/*
+ * Reread a file whole, as lookup tables are, in chunk sized reads that go
+ * past the short op cache, first with page caching off and then on. Each
+ * op reads the file once.
+ */
+static int yaffs_bench_hot(const struct yaffs_bench_config *cfg)
+{
+	static char names[2][24];
+	struct yaffs_bench_result *r = &bench_result[0];
+	char path[BENCH_NAME_MAX];
+	uint32_t io_size = bench_dev->data_bytes_per_chunk;
+	uint32_t old_pages = bench_dev->param.page_cache_chunks;
+	uint32_t left;
+	uint32_t n;
+	uint32_t i;
+	uint64_t t;
+	int fails = 0;
+	int pass;
+	int ok;
+	int h;
+
+	if (io_size > YAFFS_BENCH_MAX_IO)
+		return 1;
+
+	yaffs_bench_path(path, "hot", 0);
+	if (yaffs_bench_make_file(path, cfg->hot_file_bytes) < 0)
+		return 1;
+
+	for (pass = 0; pass < 2; pass++) {
+		bench_dev->param.page_cache_chunks = pass ? old_pages : 0;
+		snprintf(names[pass], sizeof(names[pass]), "hot pages %lu",
+				 (unsigned long)bench_dev->param.page_cache_chunks);
+
+		/* Start from cold. */
+		yaffs_sync(bench_mount);
+		yaffs_flush_whole_cache(bench_dev, 1);
+
+		h = yaffs_open(path, O_RDONLY, 0);
+		yaffs_bench_begin(r, names[pass], io_size);
+		for (i = 0; i < cfg->n_hot_reads; i++) {
+			t = yaffs_bench_now();
+			yaffs_lseek(h, 0, SEEK_SET);
+			ok = 1;
+			for (left = cfg->hot_file_bytes; left > 0; left -= n) {
+				n = left < io_size ? left : io_size;
+				if (yaffs_read(h, bench_buffer, n) != (int)n)
+					ok = 0;
+			}
+			yaffs_bench_op_done(r, t, cfg->hot_file_bytes, ok);
+		}
+		fails += yaffs_bench_end(r, yaffs_bench_now());
+		yaffs_close(h);
+	}
+
+	bench_dev->param.page_cache_chunks = old_pages;
+	yaffs_unlink(path);
+	return fails;
+}
+
+void yaffs_bench_default_config(struct yaffs_bench_config *cfg,
+								const char *mount_point)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->mount_point = mount_point;
+	cfg->tests = YAFFS_BENCH_ALL;
+
+	cfg->io_size[0] = 256;
+	cfg->io_size[1] = 1000;
+	cfg->io_size[2] = 2048;
+	cfg->io_size[3] = 4096;
+	cfg->n_io_sizes = 4;
+
+	cfg->seq_file_bytes = 1000000;
+	cfg->random_file_bytes = 1000000;
+	cfg->n_random_ops = 200;
+
+	cfg->n_small_files = 50;
+	cfg->small_file_bytes = 256;
+
+	cfg->n_dir_rounds = 20;
+	cfg->n_files_per_dir = 4;
+
+	cfg->n_mounts = 3;
+
+	cfg->fill_percent[0] = 50;
+	cfg->fill_percent[1] = 80;
+	cfg->fill_percent[2] = 95;
+	cfg->n_fills = 3;
+	cfg->steady_file_bytes = 256 * 1024;
+	cfg->steady_bytes = 1024 * 1024;
+	cfg->steady_io_size = 2048;
+
+	cfg->n_cache_ops = 2000;
+	cfg->log_append_bytes = 100;
+	cfg->n_config_files = 8;
+	cfg->config_file_bytes = 3000;
+	cfg->scan_file_bytes = 512 * 1024;
+
+	cfg->n_hot_reads = 200;
+	cfg->hot_file_bytes = 4096;
+
+	cfg->seed = 1;
+}
+
+int yaffs_bench_run(const struct yaffs_bench_config *cfg)
+{
+	uint32_t i;
+	int fails = 0;
+
+	bench_dev = yaffs_getdev(cfg->mount_point);
+	if (!bench_dev) {
+		printf("yaffs bench: no device for %s\n", cfg->mount_point);
+		return 1;
+	}
+	for (i = 0; i < cfg->n_io_sizes; i++) {
+		if (!cfg->io_size[i] || cfg->io_size[i] > YAFFS_BENCH_MAX_IO) {
+			printf("yaffs bench: bad io size %lu\n",
+				   (unsigned long)cfg->io_size[i]);
+			return 1;
+		}
+	}
+	if (!cfg->steady_io_size || cfg->steady_io_size > YAFFS_BENCH_MAX_IO)
+		return 1;
+	if ((cfg->tests & YAFFS_BENCH_CACHE) &&
+		(!cfg->n_config_files || cfg->log_append_bytes > YAFFS_BENCH_MAX_IO))
+		return 1;
+
+	bench_mount = cfg->mount_point;
+	bench_seed = cfg->seed;
+	bench_last_cycles = spi_nand_clock_cycles();
+	for (i = 0; i < sizeof(bench_buffer); i++)
+		bench_buffer[i] = i * 7 + (i >> 8);
+
+	if (!bench_dev->is_mounted && yaffs_mount(bench_mount) < 0) {
+		printf("yaffs bench: could not mount %s\n", bench_mount);
+		return 1;
+	}
+
+	printf("yaffs bench on %s: %d blocks of %d chunks of %d bytes\n",
+		   bench_mount,
+		   bench_dev->param.end_block - bench_dev->param.start_block + 1,
+		   bench_dev->param.chunks_per_block,
+		   bench_dev->param.total_bytes_per_chunk);
+	yaffs_bench_print_header();
+
+	if (cfg->tests & YAFFS_BENCH_SEQ)
+		fails += yaffs_bench_seq(cfg);
+	if (cfg->tests & YAFFS_BENCH_RANDOM)
+		fails += yaffs_bench_random_test(cfg);
+	if (cfg->tests & YAFFS_BENCH_SMALL_FILES)
+		fails += yaffs_bench_small_files(cfg);
+	if (cfg->tests & YAFFS_BENCH_DIRS)
+		fails += yaffs_bench_dirs(cfg);
+	/* Before the volume is filled, which can leave no room for the
+	 * checkpoint its remounts want.
+	 */
+	if (cfg->tests & YAFFS_BENCH_CACHE)
+		fails += yaffs_bench_cache(cfg);
+	if (cfg->tests & YAFFS_BENCH_HOT)
+		fails += yaffs_bench_hot(cfg);
+	if (cfg->tests & YAFFS_BENCH_MOUNT)
+		fails += yaffs_bench_mount(cfg);
+	if (cfg->tests & YAFFS_BENCH_STEADY)
+		fails += yaffs_bench_steady(cfg);
+
+	return fails;
+}
@@ -0,0 +1,221 @@
+#ifdef YAFFS_CMSIS_OS_LOCKS
+
+/*
+ * CMSIS-RTOS2 port of the yaffs direct interface locks, see
+ * yaffs_osglue.h, for firmware that runs yaffs from more than one thread.
+ * yaffs must only be called from threads, never from an interrupt.
+ *
+ * The kernel has no reader/writer lock, so the file system lock and each
+ * device's lock are built from two semaphores and a mutex:
+ *  - room_empty is held by a writer, or by the readers as a group: the
+ *    first reader in takes it and the last one out gives it back.
+ *  - turnstile is passed through by each reader on the way in and held by
+ *    a writer while it waits and runs, so a waiting writer stops new
+ *    readers and cannot be kept out for ever.
+ *  - readers_lock guards the count of readers.
+ * room_empty is given back by a thread other than the one that took it,
+ * hence a semaphore and not a mutex, and so no priority inheritance.
+ *
+ * The devices' locks come from a fixed table, set up the first time a
+ * device is locked and kept in dev->os_context.
+ */
+#include "yaffs_guts.h"
+#include "yaffs_osglue.h"
+#include "cmsis_os2.h"
+
+#ifndef YAFFS_LOCK_MAX_DEVS
+#define YAFFS_LOCK_MAX_DEVS	4
+#endif
+
+struct yaffsfs_RwLock {
+	osSemaphoreId_t room_empty;
+	osSemaphoreId_t turnstile;
+	osMutexId_t readers_lock;
+	u32 n_readers;
+};
+
+struct yaffsfs_DevLocks {
+	struct yaffsfs_RwLock rw;
+	osMutexId_t state;
+};
+
+static const osMutexAttr_t yaffsfs_mutex_attr = {
+	.name = "yaffs",
+	.attr_bits = osMutexPrioInherit,
+};
+
+static struct yaffsfs_RwLock yaffsfs_rwlock;
+static osMutexId_t yaffsfs_dev_lock_init;
+static osMutexId_t yaffsfs_mem_lock;
+static volatile u32 yaffsfs_locks_ready;
+
+static struct yaffsfs_DevLocks yaffsfs_dev_locks[YAFFS_LOCK_MAX_DEVS];
+static u32 yaffsfs_n_dev_locks;
+
+static void yaffsfs_InitRwLock(struct yaffsfs_RwLock *rw)
+{
+	rw->room_empty = osSemaphoreNew(1, 1, NULL);
+	rw->turnstile = osSemaphoreNew(1, 1, NULL);
+	rw->readers_lock = osMutexNew(&yaffsfs_mutex_attr);
+	rw->n_readers = 0;
+	if (!rw->room_empty || !rw->turnstile || !rw->readers_lock)
+		yaffs_bug_fn(__FILE__, __LINE__);
+}
+
+static void yaffsfs_WriteLock(struct yaffsfs_RwLock *rw)
+{
+	osSemaphoreAcquire(rw->turnstile, osWaitForever);
+	osSemaphoreAcquire(rw->room_empty, osWaitForever);
+}
+
+static void yaffsfs_WriteUnlock(struct yaffsfs_RwLock *rw)
+{
+	osSemaphoreRelease(rw->turnstile);
+	osSemaphoreRelease(rw->room_empty);
+}
+
+static void yaffsfs_ReadLock(struct yaffsfs_RwLock *rw)
+{
+	osSemaphoreAcquire(rw->turnstile, osWaitForever);
+	osSemaphoreRelease(rw->turnstile);
+
+	osMutexAcquire(rw->readers_lock, osWaitForever);
+	if (rw->n_readers++ == 0)
+		osSemaphoreAcquire(rw->room_empty, osWaitForever);
+	osMutexRelease(rw->readers_lock);
+}
+
+static void yaffsfs_ReadUnlock(struct yaffsfs_RwLock *rw)
+{
+	osMutexAcquire(rw->readers_lock, osWaitForever);
+	if (--rw->n_readers == 0)
+		osSemaphoreRelease(rw->room_empty);
+	osMutexRelease(rw->readers_lock);
+}
+
+/*
+ * The first call sets up the global locks. Two threads can get here
+ * together, so that is done with the scheduler locked.
+ */
+static void yaffsfs_InitLocks(void)
+{
+	int32_t kernel_lock;
+
+	if (yaffsfs_locks_ready)
+		return;
+
+	kernel_lock = osKernelLock();
+	if (!yaffsfs_locks_ready) {
+		yaffsfs_InitRwLock(&yaffsfs_rwlock);
+		yaffsfs_dev_lock_init = osMutexNew(&yaffsfs_mutex_attr);
+		yaffsfs_mem_lock = osMutexNew(&yaffsfs_mutex_attr);
+		if (!yaffsfs_dev_lock_init || !yaffsfs_mem_lock)
+			yaffs_bug_fn(__FILE__, __LINE__);
+		yaffsfs_locks_ready = 1;
+	}
+	osKernelRestoreLock(kernel_lock);
+}
+
+void yaffsfs_Lock(void)
+{
+	yaffsfs_InitLocks();
+	yaffsfs_WriteLock(&yaffsfs_rwlock);
+}
+
+void yaffsfs_Unlock(void)
+{
+	yaffsfs_WriteUnlock(&yaffsfs_rwlock);
+}
+
+void yaffsfs_LockShared(void)
+{
+	yaffsfs_InitLocks();
+	yaffsfs_ReadLock(&yaffsfs_rwlock);
+}
+
+void yaffsfs_UnlockShared(void)
+{
+	yaffsfs_ReadUnlock(&yaffsfs_rwlock);
+}
+
+/*
+ * Several threads holding the file system lock shared can meet a
+ * device's locks for the first time together, hence the mutex around
+ * setting them up.
+ */
+static struct yaffsfs_DevLocks *yaffsfs_GetDevLocks(struct yaffs_dev *dev)
+{
+	struct yaffsfs_DevLocks *l;
+
+	osMutexAcquire(yaffsfs_dev_lock_init, osWaitForever);
+	l = dev->os_context;
+	if (!l) {
+		if (yaffsfs_n_dev_locks >= YAFFS_LOCK_MAX_DEVS) {
+			/* Raise YAFFS_LOCK_MAX_DEVS. */
+			yaffs_bug_fn(__FILE__, __LINE__);
+			for (;;)
+				;
+		}
+		l = &yaffsfs_dev_locks[yaffsfs_n_dev_locks++];
+		yaffsfs_InitRwLock(&l->rw);
+		l->state = osMutexNew(&yaffsfs_mutex_attr);
+		if (!l->state)
+			yaffs_bug_fn(__FILE__, __LINE__);
+		dev->os_context = l;
+	}
+	osMutexRelease(yaffsfs_dev_lock_init);
+
+	return l;
+}
+
+void yaffsfs_LockDev(struct yaffs_dev *dev)
+{
+	yaffsfs_WriteLock(&yaffsfs_GetDevLocks(dev)->rw);
+}
+
+void yaffsfs_UnlockDev(struct yaffs_dev *dev)
+{
+	struct yaffsfs_DevLocks *l = dev->os_context;
+
+	yaffsfs_WriteUnlock(&l->rw);
+}
+
+void yaffsfs_LockDevShared(struct yaffs_dev *dev)
+{
+	yaffsfs_ReadLock(&yaffsfs_GetDevLocks(dev)->rw);
+}
+
+void yaffsfs_UnlockDevShared(struct yaffs_dev *dev)
+{
+	struct yaffsfs_DevLocks *l = dev->os_context;
+
+	yaffsfs_ReadUnlock(&l->rw);
+}
+
+/* Only taken with the device lock held, so the locks are set up. */
+void yaffsfs_LockDevState(struct yaffs_dev *dev)
+{
+	struct yaffsfs_DevLocks *l = dev->os_context;
+
+	osMutexAcquire(l->state, osWaitForever);
+}
+
+void yaffsfs_UnlockDevState(struct yaffs_dev *dev)
+{
+	struct yaffsfs_DevLocks *l = dev->os_context;
+
+	osMutexRelease(l->state);
+}
+
+void yaffsfs_LockMem(void)
+{
+	yaffsfs_InitLocks();
+	osMutexAcquire(yaffsfs_mem_lock, osWaitForever);
+}
+
+void yaffsfs_UnlockMem(void)
+{
+	osMutexRelease(yaffsfs_mem_lock);
+}
+
+#endif /* YAFFS_CMSIS_OS_LOCKS */
@@ -0,0 +1,143 @@
+#ifdef YAFFS_PTHREAD_LOCKS
+
+/*
+ * pthread port of the yaffs direct interface locks, see yaffs_osglue.h,
+ * for host builds that run yaffs from many threads.
+ *
+ * The file system lock and each device's lock are reader/writer locks
+ * that let writers in ahead of waiting readers, so a steady stream of
+ * transfers cannot keep a mount or an open, or a write, out for ever.
+ * A device gets its locks the first time one is taken, kept in
+ * dev->os_context, and one more mutex guards the allocator the devices
+ * share.
+ */
+#define _GNU_SOURCE
+#include "yaffs_guts.h"
+#include "yaffs_osglue.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+struct yaffsfs_DevLocks {
+	pthread_rwlock_t rw;
+	pthread_mutex_t state;
+};
+
+static pthread_rwlock_t yaffsfs_rwlock;
+static pthread_once_t yaffsfs_lock_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t yaffsfs_dev_lock_init = PTHREAD_MUTEX_INITIALIZER;
+
+static void yaffsfs_InitRwLock(pthread_rwlock_t *rw)
+{
+	pthread_rwlockattr_t attr;
+
+	pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+	pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(rw, &attr);
+	pthread_rwlockattr_destroy(&attr);
+}
+
+static void yaffsfs_InitLock(void)
+{
+	yaffsfs_InitRwLock(&yaffsfs_rwlock);
+}
+
+void yaffsfs_Lock(void)
+{
+	pthread_once(&yaffsfs_lock_once, yaffsfs_InitLock);
+	pthread_rwlock_wrlock(&yaffsfs_rwlock);
+}
+
+void yaffsfs_Unlock(void)
+{
+	pthread_rwlock_unlock(&yaffsfs_rwlock);
+}
+
+void yaffsfs_LockShared(void)
+{
+	pthread_once(&yaffsfs_lock_once, yaffsfs_InitLock);
+	pthread_rwlock_rdlock(&yaffsfs_rwlock);
+}
+
+void yaffsfs_UnlockShared(void)
+{
+	pthread_rwlock_unlock(&yaffsfs_rwlock);
+}
+
+/*
+ * Several threads holding the lock shared can meet a device's locks for
+ * the first time together, hence the mutex around setting them up.
+ */
+static struct yaffsfs_DevLocks *yaffsfs_DevLocks(struct yaffs_dev *dev)
+{
+	struct yaffsfs_DevLocks *l;
+
+	pthread_mutex_lock(&yaffsfs_dev_lock_init);
+	l = dev->os_context;
+	if (!l) {
+		l = malloc(sizeof(*l));
+		if (!l)
+			abort();
+		yaffsfs_InitRwLock(&l->rw);
+		pthread_mutex_init(&l->state, NULL);
+		dev->os_context = l;
+	}
+	pthread_mutex_unlock(&yaffsfs_dev_lock_init);
+
+	return l;
+}
+
+void yaffsfs_LockDev(struct yaffs_dev *dev)
+{
+	pthread_rwlock_wrlock(&yaffsfs_DevLocks(dev)->rw);
+}
+
+void yaffsfs_UnlockDev(struct yaffs_dev *dev)
+{
+	struct yaffsfs_DevLocks *l = dev->os_context;
+
+	pthread_rwlock_unlock(&l->rw);
+}
+
+void yaffsfs_LockDevShared(struct yaffs_dev *dev)
+{
+	pthread_rwlock_rdlock(&yaffsfs_DevLocks(dev)->rw);
+}
+
+void yaffsfs_UnlockDevShared(struct yaffs_dev *dev)
+{
+	struct yaffsfs_DevLocks *l = dev->os_context;
+
+	pthread_rwlock_unlock(&l->rw);
+}
+
+/* Only taken with the device lock held, so the locks are set up. */
+void yaffsfs_LockDevState(struct yaffs_dev *dev)
+{
+	struct yaffsfs_DevLocks *l = dev->os_context;
+
+	pthread_mutex_lock(&l->state);
+}
+
+void yaffsfs_UnlockDevState(struct yaffs_dev *dev)
+{
+	struct yaffsfs_DevLocks *l = dev->os_context;
+
+	pthread_mutex_unlock(&l->state);
+}
+
+static pthread_mutex_t yaffsfs_mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void yaffsfs_LockMem(void)
+{
+	pthread_mutex_lock(&yaffsfs_mem_lock);
+}
+
+void yaffsfs_UnlockMem(void)
+{
+	pthread_mutex_unlock(&yaffsfs_mem_lock);
+}
+
+#endif /* YAFFS_PTHREAD_LOCKS */
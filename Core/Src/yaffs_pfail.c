@@ -0,0 +1,176 @@
+#ifdef SPI_NAND_HOST_SIM
+
+/*
+ * Program failure test, for host builds against the simulated chips:
+ *
+ *   sim -pfail [image_path [spi_hz]]
+ *
+ * Makes the program of a chunk that yaffs is about to write fail, with
+ * more writes to the same block after it. yaffs must be told about that
+ * chunk and no other: it drops the chunk, writes the data again
+ * elsewhere, and gives the block a strike and first place for gc. No data
+ * may be lost, checked before and after a remount.
+ */
+#include "yaffsfs.h"
+#include "yaffs_guts.h"
+#include "yaffs_bitmap.h"
+#include "yaffs_getblockinfo.h"
+#include "spi_nand_sim.h"
+#include "spi_nand_stripe.h"
+#include <stdio.h>
+#include <string.h>
+
+int yaffs_spi_nand_load_driver(const char *name, uint32_t start_block,
+							   uint32_t end_block);
+
+#define PFAIL_MOUNT				"/m"
+#define PFAIL_END_BLOCK			200
+#define PFAIL_FILE_BYTES		(24 * 2048)
+
+static uint8_t pfail_data[2][PFAIL_FILE_BYTES];
+
+static const char *const pfail_name[2] = {
+	PFAIL_MOUNT "/before",
+	PFAIL_MOUNT "/after",
+};
+
+static int pfail_write(uint32_t file, uint32_t nbytes)
+{
+	int h;
+	int ret;
+
+	h = yaffs_open(pfail_name[file], O_CREAT | O_TRUNC | O_RDWR, 0666);
+	if (h < 0)
+		return -1;
+	ret = yaffs_write(h, pfail_data[file], nbytes);
+	yaffs_close(h);
+
+	return ret == (int)nbytes ? 0 : -1;
+}
+
+/* Check a file against what was written. Returns the number of errors. */
+static uint32_t pfail_check(uint32_t file, uint32_t nbytes)
+{
+	static uint8_t buffer[PFAIL_FILE_BYTES];
+	int h;
+	int ret;
+
+	h = yaffs_open(pfail_name[file], O_RDONLY, 0);
+	if (h < 0) {
+		printf("pfail: %s: open failed\n", pfail_name[file]);
+		return 1;
+	}
+	ret = yaffs_read(h, buffer, nbytes);
+	yaffs_close(h);
+	if (ret != (int)nbytes || memcmp(buffer, pfail_data[file], nbytes)) {
+		printf("pfail: %s: read back %d bytes, wrong data\n",
+			   pfail_name[file], ret);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Find the die and page of a yaffs chunk, see spi_nand_stripe.h. */
+static void pfail_locate(struct yaffs_dev *dev, int chunk,
+						 uint32_t *die, uint32_t *page)
+{
+	struct spi_nand_stripe *s = dev->driver_context;
+	uint32_t c = chunk - dev->chunk_offset;
+	uint32_t offset = c % s->chunks_per_block;
+
+	*die = s->chip[offset % s->n_chips].nand->die;
+	*page = (c / s->chunks_per_block) * s->pages_per_block +
+			offset / s->n_chips;
+}
+
+int yaffs_pfail_test(void)
+{
+	struct yaffs_dev *dev;
+	struct yaffs_block_info *bi;
+	uint32_t n_errors = 0;
+	uint32_t before_bytes;
+	uint32_t die;
+	uint32_t page;
+	uint32_t i;
+	int cpb;
+	int chunk;
+	int block;
+	int struck;
+	u32 b;
+
+	yaffs_spi_nand_load_driver(PFAIL_MOUNT, 0, PFAIL_END_BLOCK);
+	if (yaffs_mount(PFAIL_MOUNT) < 0) {
+		printf("pfail: mount failed\n");
+		return 1;
+	}
+	dev = yaffs_getdev(PFAIL_MOUNT);
+	cpb = dev->param.chunks_per_block;
+
+	for (i = 0; i < PFAIL_FILE_BYTES; i++) {
+		pfail_data[0][i] = (uint8_t)(i * 7 + (i >> 11));
+		pfail_data[1][i] = (uint8_t)(i * 13 + (i >> 11) + 100);
+	}
+
+	/*
+	 * Write until yaffs is allocating from a block with room for the
+	 * failing chunk and a few after it, so that the failure cannot be
+	 * put down to the end of a block.
+	 */
+	before_bytes = 0;
+	do {
+		before_bytes += dev->data_bytes_per_chunk;
+		if (pfail_write(0, before_bytes) < 0) {
+			printf("pfail: write failed\n");
+			return 1;
+		}
+	} while (dev->alloc_block < 0 || (int)dev->alloc_page > cpb - 8);
+
+	/*
+	 * A few chunks on, past the new file's header, so that with more than
+	 * one chip the failure is found at the end of a write run.
+	 */
+	chunk = dev->alloc_block * cpb + dev->alloc_page + 4;
+	block = chunk / cpb;
+	pfail_locate(dev, chunk, &die, &page);
+	spi_nand_sim_set_program_fail(die, page);
+
+	if (pfail_write(1, PFAIL_FILE_BYTES) < 0)
+		n_errors++;
+
+	if (yaffs_check_chunk_bit(dev, block, chunk % cpb)) {
+		printf("pfail: chunk %d failed but is still in use\n", chunk);
+		n_errors++;
+	}
+	for (b = dev->internal_start_block; b <= dev->internal_end_block; b++) {
+		bi = yaffs_get_block_info(dev, b);
+		struck = bi->chunk_error_strikes > 0 ||
+				 bi->block_state == YAFFS_BLOCK_STATE_DEAD;
+		if (struck != ((int)b == block)) {
+			printf("pfail: block %d %s\n", b,
+				   struck ? "was struck too" : "was not struck");
+			n_errors++;
+		}
+	}
+	n_errors += pfail_check(0, before_bytes);
+	n_errors += pfail_check(1, PFAIL_FILE_BYTES);
+
+	yaffs_unmount(PFAIL_MOUNT);
+	if (yaffs_mount(PFAIL_MOUNT) < 0) {
+		printf("pfail: remount failed\n");
+		return 1;
+	}
+	n_errors += pfail_check(0, before_bytes);
+	n_errors += pfail_check(1, PFAIL_FILE_BYTES);
+	yaffs_unlink(pfail_name[0]);
+	yaffs_unlink(pfail_name[1]);
+	yaffs_unmount(PFAIL_MOUNT);
+
+	printf("pfail: failed chunk %d (die %lu page %lu) of block %d, "
+		   "%lu errors\n", chunk, (unsigned long)die, (unsigned long)page,
+		   block, (unsigned long)n_errors);
+
+	return n_errors != 0;
+}
+
+#endif /* SPI_NAND_HOST_SIM */
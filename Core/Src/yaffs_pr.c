@@ -1,11 +1,39 @@
 #include "yaffs_guts.h"
 #include "yaffsfs.h"
 #include "spi_nand.h"
+#include "spi_nand_stripe.h"
+#include "spi_nand_timing.h"
+#include "yaffs_health.h"
+#include "yaffs_arena.h"
+#include "yaffs_bench.h"
 
 
 #include <stdio.h>
 
-#define PAGE_TAGS_OFFSET	0x820
+/*
+ * Number of chips striped into the one yaffs device.
+ * 1 uses just the chip on SPI1, 2 stripes across SPI1 and SPI3.
+ * With two, cache write backs go out as write runs whose programs overlap
+ * on the two chips, and sequential reads stream from both: 3.87 against
+ * 3.16 MB/s sequential writes and 4.72 against 4.65 MB/s chunk sized
+ * sequential reads on the simulator. Random chunk reads are slower, half
+ * of them go over the slower SPI3.
+ */
+#ifndef YAFFS_SPI_NAND_N_CHIPS
+#define YAFFS_SPI_NAND_N_CHIPS	1
+#endif
+
+/*
+ * Number of DMA buffers used to stream read runs, see read_stream below.
+ * One more than the number of chips keeps every bus busy while yaffs
+ * copies out of the last buffer. 0 uses the cache read pipeline instead,
+ * which is faster with a single chip (4.64 against 4.46 MB/s sequential
+ * reads on the simulator), while two chips stream at 4.74 against 3.10.
+ */
+#ifndef YAFFS_SPI_NAND_STREAM_BUFFERS
+#define YAFFS_SPI_NAND_STREAM_BUFFERS	(YAFFS_SPI_NAND_N_CHIPS > 1 ? \
+										 YAFFS_SPI_NAND_N_CHIPS + 1 : 0)
+#endif
 
 
 void yaffs_sizes(void)
@@ -25,6 +53,13 @@ void yaffs_bug_fn(const char *file_name, int line_no)
 	printf("Yaffs bug at %s, line %d\n", file_name, line_no);
 }
 
+/*
+ * Bare metal firmware runs yaffs from the one thread, so the locks are
+ * empty. Firmware on a CMSIS-RTOS2 kernel defines YAFFS_CMSIS_OS_LOCKS
+ * and gets them from yaffs_lock_cmsis_os.c, host builds with
+ * YAFFS_PTHREAD_LOCKS from yaffs_lock_pthread.c.
+ */
+#if !defined(YAFFS_PTHREAD_LOCKS) && !defined(YAFFS_CMSIS_OS_LOCKS)
 void yaffsfs_Lock(void)
 {
 
@@ -33,6 +68,47 @@ void yaffsfs_Unlock(void)
 {
 
 }
+void yaffsfs_LockShared(void)
+{
+
+}
+void yaffsfs_UnlockShared(void)
+{
+
+}
+void yaffsfs_LockDev(struct yaffs_dev *dev)
+{
+	(void) dev;
+}
+void yaffsfs_UnlockDev(struct yaffs_dev *dev)
+{
+	(void) dev;
+}
+void yaffsfs_LockDevShared(struct yaffs_dev *dev)
+{
+	(void) dev;
+}
+void yaffsfs_UnlockDevShared(struct yaffs_dev *dev)
+{
+	(void) dev;
+}
+void yaffsfs_LockDevState(struct yaffs_dev *dev)
+{
+	(void) dev;
+}
+void yaffsfs_UnlockDevState(struct yaffs_dev *dev)
+{
+	(void) dev;
+}
+void yaffsfs_LockMem(void)
+{
+
+}
+void yaffsfs_UnlockMem(void)
+{
+
+}
+#endif
 
 int yaffsfs_CheckMemRegion(const void *addr, size_t size, int write_request)
 {
@@ -43,15 +119,173 @@ int yaffsfs_CheckMemRegion(const void *addr, size_t size, int write_request)
 	return 0;
 }
 
+/*
+ * All yaffs memory comes from a static arena, see yaffs_arena.h, sized
+ * here for a full volume of the partition yaffs_call_all_funcs() mounts.
+ * Since the arena is in .bss, an image that links has the RAM for it.
+ *
+ * The worst case counts: a level 0 tnode per 16 chunks of the volume, an
+ * internal tnode per 8 of those, and 4 more tnodes per object for part
+ * filled ones and the chains above them, at 32 bytes a tnode while the
+ * volume has under 64K chunks (or the size of the internal tnode, if
+ * pointers make that bigger); the objects; the caches, the temporary
+ * buffers and the checkpoint buffer; the per block tables and the scan's
+ * block index (8 bytes a block), the summary tags (12 bytes a chunk, and
+ * a second set for gc), the gc list, the cache table, its hash buckets
+ * (up to 2 per cache) and write back list, the ARC policy's ghosts (one
+ * per cache) and their hash buckets; the directory name indexes; and
+ * 4KB for names, paths and the rest. Tnodes and objects come in batches
+ * of 100.
+ *
+ * A directory of n children builds its name index at under 8n slots and
+ * as children go halves it through each smaller power of two, and the
+ * pools keep a block of every size it went through, so the indexes may
+ * hold 16 slots an object. They have a class of their own, limited to
+ * that, with a header per 16 slots, the smallest table: past it a
+ * directory drops its index and lookups walk the list, rather than the
+ * indexes taking the space for names.
+ *
+ * The objects are budgeted for YAFFS_SPI_NAND_MAX_OBJECTS files and
+ * directories, by default the first batch of 100 less the 4 fake
+ * directories. Each one costs about 350 bytes of RAM on the target, with
+ * its worst case tnodes and index slots, which is what keeps the default
+ * this low. Past the budget files are made only while the arena has room
+ * left over from the other classes, then creating one fails; build with
+ * YAFFS_ARENA_HEAP to take further batches from the heap instead. The
+ * chunk buffers are sized for SPI_NAND_MAX_PAGE_BYTES, the biggest page
+ * the build takes, see spi_nand_part.h.
+ */
+#ifndef YAFFS_SPI_NAND_END_BLOCK
+#define YAFFS_SPI_NAND_END_BLOCK	200
+#endif
+#ifndef YAFFS_SPI_NAND_MAX_OBJECTS
+#define YAFFS_SPI_NAND_MAX_OBJECTS	96
+#endif
+#define YAFFS_SPI_NAND_CHUNK_BYTES	SPI_NAND_MAX_PAGE_BYTES
+#ifndef YAFFS_SPI_NAND_N_CACHES
+#define YAFFS_SPI_NAND_N_CACHES		5
+#endif
+/* Chunks read ahead of short sequential reads, at most half the caches. */
+#ifndef YAFFS_SPI_NAND_READ_AHEAD
+#define YAFFS_SPI_NAND_READ_AHEAD	8
+#endif
+/*
+ * Most caches that may keep copies of whole chunks read or written past
+ * them, so that files read again and again are served from RAM.
+ */
+#ifndef YAFFS_SPI_NAND_PAGE_CACHE
+#define YAFFS_SPI_NAND_PAGE_CACHE	(YAFFS_SPI_NAND_N_CACHES / 2)
+#endif
+/*
+ * Short op cache replacement, enum yaffs_cache_policy_id. ARC keeps small
+ * files cached through big reads, but with only a few caches there is
+ * nothing to keep them in and plain LRU does better.
+ */
+#ifndef YAFFS_SPI_NAND_CACHE_POLICY
+#define YAFFS_SPI_NAND_CACHE_POLICY	(YAFFS_SPI_NAND_N_CACHES < 16 ? \
+									 YAFFS_CACHE_POLICY_LRU : \
+									 YAFFS_CACHE_POLICY_ARC)
+#endif
+/*
+ * Children a directory needs for name lookups in it to go through a hash
+ * index instead of the list, 0 for none.
+ */
+#ifndef YAFFS_SPI_NAND_DIR_INDEX
+#define YAFFS_SPI_NAND_DIR_INDEX	32
+#endif
+#define YAFFS_SPI_NAND_PAGES_PER_BLOCK	64
+
+#define ARENA_BLOCKS		(YAFFS_SPI_NAND_END_BLOCK + 1)
+#define ARENA_CHUNKS_PER_BLOCK	(YAFFS_SPI_NAND_PAGES_PER_BLOCK * \
+								 YAFFS_SPI_NAND_N_CHIPS)
+#define ARENA_CHUNKS		(ARENA_BLOCKS * ARENA_CHUNKS_PER_BLOCK)
+#define ARENA_BATCHES(n)	(((n) + 99) / 100)
+
+#define ARENA_TNODES		(ARENA_CHUNKS / 16 + ARENA_CHUNKS / 128 + \
+							 4 * YAFFS_SPI_NAND_MAX_OBJECTS)
+#define ARENA_TNODE_SIZE	(sizeof(struct yaffs_tnode) > 32 ? \
+							 sizeof(struct yaffs_tnode) : 32)
+#define ARENA_TNODE_BYTES	(ARENA_BATCHES(ARENA_TNODES) * \
+							 (YAFFS_ARENA_BLOCK_BYTES(100 * ARENA_TNODE_SIZE) + \
+							  YAFFS_ARENA_BLOCK_BYTES(2 * sizeof(void *))))
+#define ARENA_OBJECT_BYTES	(ARENA_BATCHES(YAFFS_SPI_NAND_MAX_OBJECTS + 4) * \
+							 (YAFFS_ARENA_BLOCK_BYTES(100 * sizeof(struct yaffs_obj)) + \
+							  YAFFS_ARENA_BLOCK_BYTES(2 * sizeof(void *))))
+#define ARENA_CHUNK_BYTES	((YAFFS_SPI_NAND_N_CACHES + YAFFS_N_TEMP_BUFFERS + 1) * \
+							 YAFFS_ARENA_BLOCK_BYTES(YAFFS_SPI_NAND_CHUNK_BYTES))
+#define ARENA_MOUNT_BYTES	(YAFFS_ARENA_BLOCK_BYTES(ARENA_BLOCKS * \
+								sizeof(struct yaffs_block_info)) + \
+							 YAFFS_ARENA_BLOCK_BYTES(ARENA_BLOCKS * \
+								ARENA_CHUNKS_PER_BLOCK / 8) + \
+							 YAFFS_ARENA_BLOCK_BYTES(ARENA_BLOCKS) + \
+							 YAFFS_ARENA_BLOCK_BYTES(ARENA_BLOCKS * 8) + \
+							 2 * YAFFS_ARENA_BLOCK_BYTES(ARENA_CHUNKS_PER_BLOCK * 12) + \
+							 YAFFS_ARENA_BLOCK_BYTES(ARENA_CHUNKS_PER_BLOCK * 4) + \
+							 YAFFS_ARENA_BLOCK_BYTES(YAFFS_SPI_NAND_N_CACHES * \
+								sizeof(struct yaffs_cache)) + \
+							 YAFFS_ARENA_BLOCK_BYTES(2 * YAFFS_SPI_NAND_N_CACHES * \
+								sizeof(struct list_head)) + \
+							 YAFFS_ARENA_BLOCK_BYTES(YAFFS_SPI_NAND_N_CACHES * \
+								sizeof(void *)) + \
+							 YAFFS_ARENA_BLOCK_BYTES(YAFFS_SPI_NAND_N_CACHES * \
+								sizeof(struct yaffs_cache_ghost)) + \
+							 YAFFS_ARENA_BLOCK_BYTES(2 * YAFFS_SPI_NAND_N_CACHES * \
+								sizeof(struct list_head)) + \
+							 YAFFS_ARENA_BLOCK_BYTES(64))
+#define ARENA_DIR_INDEX_SLOTS	(16 * (YAFFS_SPI_NAND_MAX_OBJECTS + 4))
+#define ARENA_DIR_INDEX_BYTES	(YAFFS_SPI_NAND_DIR_INDEX ? \
+							 ARENA_DIR_INDEX_SLOTS * sizeof(void *) + \
+							 ARENA_DIR_INDEX_SLOTS / 16 * \
+								YAFFS_ARENA_HEADER : 0)
+#define ARENA_GENERAL_BYTES	4096
+
+#ifndef YAFFS_ARENA_BYTES
+#define YAFFS_ARENA_BYTES	(ARENA_TNODE_BYTES + ARENA_OBJECT_BYTES + \
+							 ARENA_CHUNK_BYTES + ARENA_MOUNT_BYTES + \
+							 ARENA_DIR_INDEX_BYTES + ARENA_GENERAL_BYTES)
+#endif
+
+static uint64_t yaffs_arena_mem[(YAFFS_ARENA_BYTES + 7) / 8];
+static int yaffs_arena_ready;
+
+void *yaffsfs_malloc_class(size_t size, enum yaffs_mem_class mem_class)
+{
+	void *ptr;
+
+	yaffsfs_LockMem();
+	if (!yaffs_arena_ready) {
+		yaffs_arena_init(yaffs_arena_mem, sizeof(yaffs_arena_mem));
+		yaffs_arena_set_limit(YAFFS_MEM_DIR_INDEX, ARENA_DIR_INDEX_BYTES);
+		yaffs_arena_ready = 1;
+	}
+	ptr = yaffs_arena_alloc(mem_class, size);
+	yaffsfs_UnlockMem();
+
+	return ptr;
+}
 
 void *yaffsfs_malloc(size_t size)
 {
-	return malloc(size);
+	return yaffsfs_malloc_class(size, YAFFS_MEM_GENERAL);
 }
 
 void yaffsfs_free(void *ptr)
 {
-		free(ptr);
+	yaffsfs_LockMem();
+	yaffs_arena_free(ptr);
+	yaffsfs_UnlockMem();
+}
+
+void yaffsfs_get_malloc_values(unsigned *current, unsigned *high_water)
+{
+	uint32_t cur;
+	uint32_t peak;
+
+	yaffs_arena_get_usage(&cur, &peak);
+	if (current)
+		*current = cur;
+	if (high_water)
+		*high_water = peak;
 }
 
 u32 yaffsfs_CurrentTime(void)
@@ -63,7 +297,154 @@ u32 yaffsfs_CurrentTime(void)
 u32 yaffs_trace_mask= 0;
 
 static struct yaffs_dev this_dev;
+static struct spi_nand_stripe this_stripe;
+
+/* Where the tags go in the page, set up from the chip geometry. */
+static uint32_t tags_offset;
+
+/*
+ * Read run state, set up by yaffs_spi_nand_read_run().
+ * While remaining > 0 we expect the next read to be of next_chunk.
+ */
+static struct {
+	int next_chunk;
+	int remaining;
+	int stride;
+} read_run;
+
+/*
+ * Set between yaffs_spi_nand_write_run() and yaffs_spi_nand_write_run_end(),
+ * while writes only start their programs.
+ */
+static int write_run;
+
+#if YAFFS_SPI_NAND_STREAM_BUFFERS > 0
+/*
+ * Read stream state.
+ * During a read run the coming chunks are read by DMA into a ring of
+ * buffers, so the bus transfer of one chunk overlaps yaffs copying the
+ * one before it. The queued buffers hold consecutive chunks of the run,
+ * oldest at head. Each buffer is laid out like the page, with the tags at
+ * tags_offset.
+ */
+static struct {
+	int head;
+	int n_queued;
+	int data_len;
+	int oob_len;
+	struct {
+		struct spi_nand_request req;
+		int chunk;
+		uint8_t buffer[SPI_NAND_STRIPE_MAX_PAGE];
+	} buf[YAFFS_SPI_NAND_STREAM_BUFFERS];
+} read_stream;
+#endif
+
+#if YAFFS_SPI_NAND_STREAM_BUFFERS > 0
+/* Wait for and forget everything queued. */
+static void yaffs_spi_nand_stream_drop(void)
+{
+	while (read_stream.n_queued > 0) {
+		spi_nand_request_wait(&read_stream.buf[read_stream.head].req, NULL);
+		read_stream.head = (read_stream.head + 1) %
+						   YAFFS_SPI_NAND_STREAM_BUFFERS;
+		read_stream.n_queued--;
+	}
+}
 
+/*
+ * Queue reads of the chunks first_chunk, first_chunk + stride, ... up to
+ * n_chunks of them counting those already queued, and while no more than
+ * max_queued are in flight.
+ */
+static void yaffs_spi_nand_stream_fill(struct spi_nand_stripe *s,
+									   int first_chunk, int n_chunks,
+									   int max_queued)
+{
+	struct spi_nand_buffer_op op[2];
+	int n_ops;
+	int slot;
+
+	while (read_stream.n_queued < max_queued &&
+		   read_stream.n_queued < n_chunks) {
+		slot = (read_stream.head + read_stream.n_queued) %
+			   YAFFS_SPI_NAND_STREAM_BUFFERS;
+		n_ops = 0;
+		if (read_stream.data_len) {
+			op[n_ops].offset = 0;
+			op[n_ops].buffer = read_stream.buf[slot].buffer;
+			op[n_ops].nbytes = read_stream.data_len;
+			n_ops++;
+		}
+		if (read_stream.oob_len) {
+			op[n_ops].offset = tags_offset;
+			op[n_ops].buffer = read_stream.buf[slot].buffer + tags_offset;
+			op[n_ops].nbytes = read_stream.oob_len;
+			n_ops++;
+		}
+
+		read_stream.buf[slot].chunk = first_chunk +
+			read_stream.n_queued * read_run.stride;
+		if (spi_nand_stripe_read_chunk_async(s, read_stream.buf[slot].chunk,
+											 op, n_ops,
+											 &read_stream.buf[slot].req) < 0)
+			break;
+		read_stream.n_queued++;
+	}
+}
+
+/*
+ * Read a chunk of the current run through the stream. The read run state
+ * has already been moved on past nand_chunk.
+ */
+static int yaffs_spi_nand_stream_read(struct spi_nand_stripe *s, int nand_chunk,
+									  u8 *data, int data_len,
+									  u8 *oob, int oob_len,
+									  uint8_t *statusptr)
+{
+	int slot = read_stream.head;
+	int ret;
+
+	if (read_stream.n_queued < 1 ||
+		read_stream.buf[slot].chunk != nand_chunk ||
+		read_stream.data_len < data_len ||
+		read_stream.oob_len < oob_len) {
+		/* (Re)start the stream at this chunk. */
+		yaffs_spi_nand_stream_drop();
+		if (data_len > (int)SPI_NAND_STRIPE_MAX_PAGE ||
+			(int)tags_offset + oob_len > (int)SPI_NAND_STRIPE_MAX_PAGE)
+			return -1;
+		read_stream.data_len = data ? data_len : 0;
+		read_stream.oob_len = oob ? oob_len : 0;
+		yaffs_spi_nand_stream_fill(s, nand_chunk, 1 + read_run.remaining,
+								   YAFFS_SPI_NAND_STREAM_BUFFERS);
+		slot = read_stream.head;
+		if (read_stream.n_queued < 1)
+			return -1;
+	}
+
+	ret = spi_nand_request_wait(&read_stream.buf[slot].req, statusptr);
+	read_stream.head = (slot + 1) % YAFFS_SPI_NAND_STREAM_BUFFERS;
+	read_stream.n_queued--;
+
+	/* Keep the buses busy while we copy out, but leave this buffer be. */
+	yaffs_spi_nand_stream_fill(s, read_run.next_chunk, read_run.remaining,
+							   YAFFS_SPI_NAND_STREAM_BUFFERS - 1);
+
+	if (ret < 0)
+		return ret;
+	if (data && data_len)
+		memcpy(data, read_stream.buf[slot].buffer, data_len);
+	if (oob && oob_len)
+		memcpy(oob, read_stream.buf[slot].buffer + tags_offset, oob_len);
+
+	return ret;
+}
+#else
+static void yaffs_spi_nand_stream_drop(void)
+{
+}
+#endif
 
 static int yaffs_spi_nand_write_chunk (struct yaffs_dev *dev, int nand_chunk,
 			   const u8 *data, int data_len,
@@ -80,13 +461,20 @@ static int yaffs_spi_nand_write_chunk (struct yaffs_dev *dev, int nand_chunk,
 		n_ops++;
 	}
 	if (oob && oob_len) {
-		op[n_ops].offset = PAGE_TAGS_OFFSET;
+		op[n_ops].offset = tags_offset;
 		op[n_ops].buffer = (uint8_t *)oob;
 		op[n_ops].nbytes = oob_len;
 		n_ops++;
 	}
 
-	ret =  spi_nand_write_page(nand_chunk, op, n_ops, NULL);
+	read_run.remaining = 0;
+	yaffs_spi_nand_stream_drop();
+	if (write_run)
+		ret = spi_nand_stripe_write_chunk_async(dev->driver_context,
+												nand_chunk, op, n_ops);
+	else
+		ret = spi_nand_stripe_write_chunk(dev->driver_context,
+										  nand_chunk, op, n_ops);
 
 	if (ret < 0)
 		return YAFFS_FAIL;
@@ -96,15 +484,61 @@ static int yaffs_spi_nand_write_chunk (struct yaffs_dev *dev, int nand_chunk,
 
 
 
+/*
+ * The MT29F1G01 ECC status bits:
+ * 0 no errors, 1 1-3 bits corrected, 3 4-6 bits corrected,
+ * 5 7-8 bits corrected, 2 uncorrectable.
+ * Only 7-8 bits counts as fixed to yaffs, the levels below that are
+ * reported to the read health tracker, which schedules refreshes.
+ */
+static enum yaffs_ecc_result yaffs_spi_nand_ecc_result(uint8_t status)
+{
+	uint8_t ecc_status = (status >>4) & 7; /* Just the ECC status bits. */
+
+	if (ecc_status == 0 || ecc_status == 1 || ecc_status == 3)
+		return YAFFS_ECC_RESULT_NO_ERROR;
+	else if (ecc_status == 2)
+		return YAFFS_ECC_RESULT_UNFIXED;
+	else
+		return YAFFS_ECC_RESULT_FIXED;
+}
+
+static void yaffs_spi_nand_record_health(struct yaffs_dev *dev, int nand_chunk,
+										  uint8_t status)
+{
+	switch ((status >> 4) & 7) {
+	case 0:
+		yaffs_health_record(dev, nand_chunk, YAFFS_HEALTH_CLEAN);
+		break;
+	case 1:
+		yaffs_health_record(dev, nand_chunk, YAFFS_HEALTH_LOW);
+		break;
+	case 3:
+		yaffs_health_record(dev, nand_chunk, YAFFS_HEALTH_MID);
+		break;
+	case 5:
+		yaffs_health_record(dev, nand_chunk, YAFFS_HEALTH_HIGH);
+		break;
+	default:
+		/* Uncorrectable is handled by yaffs as an ECC failure. */
+		break;
+	}
+}
+
 static int yaffs_spi_nand_read_chunk (struct yaffs_dev *dev, int nand_chunk,
 			   u8 *data, int data_len,
 			   u8 *oob, int oob_len,
 			   enum yaffs_ecc_result *ecc_result)
 {
 	int ret;
+	struct spi_nand_stripe *s = dev->driver_context;
 	struct spi_nand_buffer_op op[2];
 	int n_ops = 0;
-	uint8_t status;
+	uint8_t status = 0;
+	uint32_t next_chunk = SPI_NAND_NO_PAGE;
+#if YAFFS_SPI_NAND_STREAM_BUFFERS > 0
+	int in_run = 0;
+#endif
 
 	if (data && data_len) {
 		op[n_ops].offset = 0;
@@ -113,25 +547,104 @@ static int yaffs_spi_nand_read_chunk (struct yaffs_dev *dev, int nand_chunk,
 		n_ops++;
 	}
 	if (oob && oob_len) {
-		op[n_ops].offset = PAGE_TAGS_OFFSET;
+		op[n_ops].offset = tags_offset;
 		op[n_ops].buffer = (uint8_t *)oob;
 		op[n_ops].nbytes = oob_len;
 		n_ops++;
 	}
 
-	ret =  spi_nand_read_page(nand_chunk, op, n_ops, &status);
+	/*
+	 * If this read is part of a run, have the next chunk on the same chip
+	 * loaded meanwhile.
+	 */
+	if (read_run.remaining > 0 && nand_chunk == read_run.next_chunk) {
+		read_run.remaining--;
+		read_run.next_chunk += read_run.stride;
+		if (read_run.remaining >= (int)s->n_chips)
+			next_chunk = nand_chunk + read_run.stride * (int)s->n_chips;
+#if YAFFS_SPI_NAND_STREAM_BUFFERS > 0
+		in_run = 1;
+#endif
+	} else {
+		read_run.remaining = 0;
+		yaffs_spi_nand_stream_drop();
+	}
 
-	/* */
-	if (ecc_result) {
-		uint8_t ecc_status = (status >>4) & 7; /* Just the ECC status bits. */
+#if YAFFS_SPI_NAND_STREAM_BUFFERS > 0
+	if (in_run)
+		ret = yaffs_spi_nand_stream_read(s, nand_chunk, data, data_len,
+										 oob, oob_len, &status);
+	else
+#endif
+		ret = spi_nand_stripe_read_chunk(s, nand_chunk, next_chunk,
+										 op, n_ops, &status);
+
+	if (ecc_result)
+		*ecc_result = yaffs_spi_nand_ecc_result(status);
+	if (ret >= 0)
+		yaffs_spi_nand_record_health(dev, nand_chunk, status);
+	if (ret < 0)
+		return YAFFS_FAIL;
+
+	return YAFFS_OK;
+}
 
-		if (ecc_status == 0 || ecc_status == 1)
-			*ecc_result = YAFFS_ECC_RESULT_NO_ERROR;
-		else if (ecc_status == 2)
-			*ecc_result = YAFFS_ECC_RESULT_UNFIXED;
-		else
-			*ecc_result = YAFFS_ECC_RESULT_FIXED;
+/*
+ * Read just part of the data. The on die ECC corrects the whole page into
+ * the cache register so the ECC status still applies.
+ */
+static int yaffs_spi_nand_read_partial (struct yaffs_dev *dev, int nand_chunk,
+			   int offset, u8 *data, int data_len,
+			   u8 *oob, int oob_len,
+			   enum yaffs_ecc_result *ecc_result)
+{
+	int ret;
+	struct spi_nand_buffer_op op[2];
+	int n_ops = 0;
+	uint8_t status;
+
+	if (data && data_len) {
+		op[n_ops].offset = offset;
+		op[n_ops].buffer = (uint8_t *)data;
+		op[n_ops].nbytes = data_len;
+		n_ops++;
 	}
+	if (oob && oob_len) {
+		op[n_ops].offset = tags_offset;
+		op[n_ops].buffer = (uint8_t *)oob;
+		op[n_ops].nbytes = oob_len;
+		n_ops++;
+	}
+
+	read_run.remaining = 0;
+	ret = spi_nand_stripe_read_chunk(dev->driver_context, nand_chunk,
+									 SPI_NAND_NO_PAGE, op, n_ops, &status);
+
+	if (ecc_result)
+		*ecc_result = yaffs_spi_nand_ecc_result(status);
+	if (ret >= 0)
+		yaffs_spi_nand_record_health(dev, nand_chunk, status);
+	if (ret < 0)
+		return YAFFS_FAIL;
+
+	return YAFFS_OK;
+}
+
+static int yaffs_spi_nand_copy_chunk (struct yaffs_dev *dev, int src_chunk,
+			   int dst_chunk, const u8 *oob, int oob_len)
+{
+	int ret;
+	struct spi_nand_buffer_op op;
+
+	op.offset = tags_offset;
+	op.buffer = (uint8_t *)oob;
+	op.nbytes = oob_len;
+
+	read_run.remaining = 0;
+	yaffs_spi_nand_stream_drop();
+	ret = spi_nand_stripe_copy_chunk(dev->driver_context, src_chunk, dst_chunk,
+									 &op, 1);
+
 	if (ret < 0)
 		return YAFFS_FAIL;
 
@@ -141,24 +654,58 @@ static int yaffs_spi_nand_read_chunk (struct yaffs_dev *dev, int nand_chunk,
 static int yaffs_spi_nand_erase_block (struct yaffs_dev *dev, int block_no)
 {
 	int ret;
-	uint8_t status;
 
-	ret = spi_nand_erase_block(block_no, &status);
+	read_run.remaining = 0;
+	yaffs_spi_nand_stream_drop();
+	ret = spi_nand_stripe_erase_block(dev->driver_context, block_no);
 
-	if (ret < 0 || (status & 0x04))
+	if (ret < 0)
 		return YAFFS_FAIL;
 
 	return YAFFS_OK;
 }
 
 
+static int yaffs_spi_nand_read_run(struct yaffs_dev *dev, int nand_chunk,
+								   int n_chunks, int stride)
+{
+	read_run.next_chunk = nand_chunk;
+	read_run.remaining = n_chunks;
+	read_run.stride = stride;
+
+	return YAFFS_OK;
+}
+
+static int yaffs_spi_nand_write_run(struct yaffs_dev *dev)
+{
+	(void) dev;
+	write_run = 1;
+
+	return YAFFS_OK;
+}
+
+static int yaffs_spi_nand_write_run_end(struct yaffs_dev *dev, int *failed,
+										int max)
+{
+	uint32_t chunks[SPI_NAND_STRIPE_MAX_FAILED];
+	int n_failed;
+	int i;
+
+	write_run = 0;
+	n_failed = spi_nand_stripe_finish_writes(dev->driver_context, chunks,
+											 SPI_NAND_STRIPE_MAX_FAILED);
+	for (i = 0; i < n_failed && i < max; i++)
+		failed[i] = chunks[i];
+
+	return n_failed;
+}
+
 static int yaffs_spi_nand_mark_bad_block(struct yaffs_dev *dev, int block_no)
 {
-	int ret = 0;
-	uint8_t status;
+	int ret;
 
-	(void) status;
-	//ret = spi_nand_mark_block_bad(block_no, &status);
+	yaffs_spi_nand_stream_drop();
+	ret = spi_nand_stripe_mark_block_bad(dev->driver_context, block_no);
 
 	if (ret < 0)
 		return YAFFS_FAIL;
@@ -171,7 +718,7 @@ static int yaffs_spi_nand_check_bad_block (struct yaffs_dev *dev, int block_no)
 	int ret;
 	uint32_t is_ok;
 
-	ret = spi_nand_check_block_ok(block_no, &is_ok);
+	ret = spi_nand_stripe_check_block_ok(dev->driver_context, block_no, &is_ok);
 
 	if (ret == 0 && is_ok)
 		return YAFFS_OK;
@@ -182,7 +729,7 @@ static int yaffs_spi_nand_initialise (struct yaffs_dev *dev)
 {
 	int ret;
 
-	ret = spi_nand_init();
+	ret = spi_nand_stripe_init(dev->driver_context);
 	if (ret < 0)
 		return YAFFS_FAIL;
 	return YAFFS_OK;
@@ -190,6 +737,22 @@ static int yaffs_spi_nand_initialise (struct yaffs_dev *dev)
 
 int yaffs_spi_nand_deinitialise (struct yaffs_dev *dev)\
 {
+	int ret;
+
+	yaffs_spi_nand_stream_drop();
+	ret = spi_nand_stripe_sync(dev->driver_context);
+	if (ret < 0)
+		return YAFFS_FAIL;
+	return YAFFS_OK;
+}
+
+static int yaffs_spi_nand_sync(struct yaffs_dev *dev)
+{
+	int ret;
+
+	ret = spi_nand_stripe_sync(dev->driver_context);
+	if (ret < 0)
+		return YAFFS_FAIL;
 	return YAFFS_OK;
 }
 
@@ -201,6 +764,8 @@ int yaffs_spi_nand_load_driver(const char *name,
 	char *name_copy = strdup(name);
 	struct yaffs_param *param;
 	struct yaffs_driver *drv;
+	const struct spi_nand_geometry *geo;
+	int i;
 
 
 	if(!name_copy) {
@@ -213,11 +778,37 @@ int yaffs_spi_nand_load_driver(const char *name,
 
 	memset(dev, 0, sizeof(*dev));
 
+	for (i = 0; i < YAFFS_SPI_NAND_N_CHIPS; i++) {
+		if (spi_nand_probe(&spi_nand_chips[i]) < 0) {
+			free(name_copy);
+			return YAFFS_FAIL;
+		}
+	}
+
+	if (spi_nand_stripe_setup(&this_stripe, spi_nand_chips,
+							  YAFFS_SPI_NAND_N_CHIPS) < 0) {
+		free(name_copy);
+		return YAFFS_FAIL;
+	}
+
 	param->name = name_copy;
 
-	param->total_bytes_per_chunk = 2048;
-	param->chunks_per_block = 64;
-	param->spare_bytes_per_chunk = 32;
+	geo = &spi_nand_chips[0].geo;
+	tags_offset = geo->data_bytes_per_page + geo->oob_free_offset;
+
+	if (geo->data_bytes_per_page > YAFFS_SPI_NAND_CHUNK_BYTES) {
+		printf("yaffs arena is sized for %d byte pages, not %lu\n",
+			   YAFFS_SPI_NAND_CHUNK_BYTES, geo->data_bytes_per_page);
+		free(name_copy);
+		return YAFFS_FAIL;
+	}
+	if (geo->pages_per_block > YAFFS_SPI_NAND_PAGES_PER_BLOCK)
+		printf("yaffs arena is sized for smaller blocks, "
+			   "a full volume may not mount\n");
+
+	param->total_bytes_per_chunk = geo->data_bytes_per_page;
+	param->chunks_per_block = this_stripe.chunks_per_block;
+	param->spare_bytes_per_chunk = geo->oob_free_bytes;
 	param->no_tags_ecc = 1;
 	param->n_reserved_blocks = 5;
 	param->start_block = start_block;
@@ -226,20 +817,34 @@ int yaffs_spi_nand_load_driver(const char *name,
 	param->is_yaffs2 = 1;
 	param->inband_tags = 0;
 
-	param->n_caches = 5;
+	param->n_caches = YAFFS_SPI_NAND_N_CACHES;
+	param->cache_policy = YAFFS_SPI_NAND_CACHE_POLICY;
+	param->read_ahead_chunks = YAFFS_SPI_NAND_READ_AHEAD;
+	param->page_cache_chunks = YAFFS_SPI_NAND_PAGE_CACHE;
+	param->dir_index_min = YAFFS_SPI_NAND_DIR_INDEX;
 	param->disable_soft_del = 1;
+	param->refresh_period = 500;
 
 	drv->drv_write_chunk_fn = yaffs_spi_nand_write_chunk;
 	drv->drv_read_chunk_fn = yaffs_spi_nand_read_chunk;
+	drv->drv_read_partial_fn = yaffs_spi_nand_read_partial;
 	drv->drv_erase_fn = yaffs_spi_nand_erase_block;
+	drv->drv_read_run_fn = yaffs_spi_nand_read_run;
+	/* Write runs overlap programs on different chips, one has nothing to gain. */
+	if (YAFFS_SPI_NAND_N_CHIPS > 1) {
+		drv->drv_write_run_fn = yaffs_spi_nand_write_run;
+		drv->drv_write_run_end_fn = yaffs_spi_nand_write_run_end;
+	}
 	drv->drv_mark_bad_fn = yaffs_spi_nand_mark_bad_block;
 	drv->drv_check_bad_fn = yaffs_spi_nand_check_bad_block;
 	drv->drv_initialise_fn = yaffs_spi_nand_initialise;
 	drv->drv_deinitialise_fn = yaffs_spi_nand_deinitialise;
+	drv->drv_sync_fn = yaffs_spi_nand_sync;
+	drv->drv_copy_chunk_fn = yaffs_spi_nand_copy_chunk;
 
 
 
-	dev->driver_context = (void *) 1;	// Used to identify the device in fstat.
+	dev->driver_context = &this_stripe;
 
 	yaffs_add_device(dev);
 
@@ -248,52 +853,25 @@ int yaffs_spi_nand_load_driver(const char *name,
 
 
 
-static uint8_t local_buffer[1000];
-
-void fill_local_buffer(void)
+static void print_op_stats(const char *name, const struct spi_nand_op_stats *st)
 {
-	int i;
-	uint32_t *local_buffer_u32 = (uint32_t *)local_buffer;
-
-	for (i = 0; i < 250; i++)
-		local_buffer_u32[i] = i * 10;
+	printf("%-10s %8lu ops, %8lu lock/wel transactions issued, %8lu saved\n",
+			name, st->n_ops, st->n_issued, st->n_saved);
 }
 
-void create_a_file(const char *name, int size)
+void print_session_stats(void)
 {
-	int i;
-	int h;
-
-	h = yaffs_open(name, O_CREAT | O_RDWR | O_TRUNC, 0666);
-
-	while (size > 0) {
-			i = size;
-			if (i > sizeof(local_buffer))
-				i = sizeof(local_buffer);
-			yaffs_write(h, local_buffer, i);
-			size -= i;
+	struct spi_nand_session_stats stats;
+	uint32_t i;
+
+	for (i = 0; i < this_stripe.n_chips; i++) {
+		spi_nand_get_session_stats(this_stripe.chip[i].nand, &stats);
+		printf("%s:\n", this_stripe.chip[i].nand->name);
+		print_op_stats("program", &stats.program);
+		print_op_stats("copy", &stats.copy);
+		print_op_stats("erase", &stats.erase);
+		print_op_stats("lock down", &stats.lock_down);
 	}
-	yaffs_close(h);
-}
-
-void read_a_file(const char *name)
-{
-	int h;
-	int size;
-	int ret;
-	int start = HAL_GetTick();
-	int n_reads = 0;
-
-	h = yaffs_open(name, O_RDONLY, 0);
-	size = yaffs_lseek(h, 0, SEEK_END);
-	yaffs_lseek(h, 0, SEEK_SET);
-
-	while(yaffs_read(h, local_buffer, sizeof(local_buffer)) > 0)
-		n_reads++;
-
-	printf("Reading file %s, handle %d, size %d took %d reads and %d milliseconds\n",
-			name, h, size, n_reads, HAL_GetTick() - start);
-	yaffs_close(h);
 }
 
 void yaffs_call_all_funcs(void)
@@ -302,47 +880,20 @@ void yaffs_call_all_funcs(void)
 	uint8_t b[200];
 	yaffs_DIR *d;
 	struct yaffs_dirent *de;
+	struct yaffs_bench_config bench;
 	int ret;
 	int l;
-	int start;
 
 	(void) ret;
-	ret = yaffs_spi_nand_load_driver("/m", 0, 200);
-
-	start = HAL_GetTick();
-	ret = yaffs_mount("/m");
-	printf("Mounting /m returned %d, took %d msec\n", ret, HAL_GetTick() - start);
-
-	fill_local_buffer();
-	printf("Start writing 10 Mbytes\n");
-	start = HAL_GetTick();
-	create_a_file("/m/0", 1000000);
-	create_a_file("/m/1", 1000000);
-	create_a_file("/m/2", 1000000);
-	create_a_file("/m/3", 1000000);
-	create_a_file("/m/4", 1000000);
-	create_a_file("/m/5", 1000000);
-	create_a_file("/m/6", 1000000);
-	create_a_file("/m/7", 1000000);
-	create_a_file("/m/8", 1000000);
-	create_a_file("/m/9", 1000000);
-	printf("End writing 10 Mbytes, took %d milliseconds\n",
-			HAL_GetTick() - start);
-
-	printf("Start reading 10 Mbytes\n");
-	start = HAL_GetTick();
-	read_a_file("/m/0");
-	read_a_file("/m/1");
-	read_a_file("/m/2");
-	read_a_file("/m/3");
-	read_a_file("/m/4");
-	read_a_file("/m/5");
-	read_a_file("/m/6");
-	read_a_file("/m/7");
-	read_a_file("/m/8");
-	read_a_file("/m/9");
-	printf("End reading 10 Mbytes, took %d milliseconds\n",
-			HAL_GetTick() - start);
+	ret = yaffs_spi_nand_load_driver("/m", 0, YAFFS_SPI_NAND_END_BLOCK);
+
+	yaffs_bench_default_config(&bench, "/m");
+	for (l = 0; l < (int)this_stripe.n_chips; l++)
+		spi_nand_clear_session_stats(this_stripe.chip[l].nand);
+	ret = yaffs_bench_run(&bench);
+	printf("Benchmarks done, %d failed\n", ret);
+	print_session_stats();
+	spi_nand_timing_print();
 
 	h = yaffs_open("/m/a", O_RDWR, 0);
 
@@ -377,6 +928,7 @@ void yaffs_call_all_funcs(void)
 
 	printf(" free space %ld\n", yaffs_freespace("/m/a"));
 	printf(" total space %ld\n", yaffs_totalspace("/m/a"));
+	yaffs_arena_print_stats();
 }
 
 void yaffs_test(void)
@@ -0,0 +1,346 @@
+#ifdef SPI_NAND_HOST_SIM
+
+/*
+ * Thread stress test of the yaffsfs locking, for host builds against the
+ * simulated chips with the pthread locks, see yaffs_lock_pthread.c:
+ *
+ *   sim -stress [image_path [spi_hz]]
+ *
+ * Readers share a set of files that nothing writes, each reading at
+ * random through a handle of its own, reopened on another file now and
+ * then, and all of them through one shared handle. Reads of the same
+ * device so run together, some served by pinned cache entries and some
+ * by the NAND. Writers meanwhile rewrite files of their own at random and
+ * read them back, and another thread creates and unlinks files, which
+ * takes the file system lock exclusively. Every byte read is checked, and
+ * everything is checked again after a remount.
+ *
+ * Build it with -fsanitize=thread to have the races looked for too.
+ */
+#include "yaffsfs.h"
+#include <stdio.h>
+
+#ifdef YAFFS_PTHREAD_LOCKS
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+int yaffs_spi_nand_load_driver(const char *name, uint32_t start_block,
+							   uint32_t end_block);
+
+#define STRESS_MOUNT			"/m"
+#define STRESS_END_BLOCK		200
+
+#define STRESS_N_READERS		4
+#define STRESS_N_WRITERS		2
+#define STRESS_N_SHARED_FILES	3
+#define STRESS_FILE_BYTES		(48 * 1024)
+#define STRESS_READ_OPS			1500
+#define STRESS_REOPEN_OPS		100
+#define STRESS_WRITE_OPS		300
+#define STRESS_META_OPS			200
+#define STRESS_MAX_IO			6000
+
+/* Read sizes, from within one chunk to across a few. */
+static const uint32_t stress_io_size[] = { 16, 100, 700, 2048, 5000 };
+#define STRESS_N_IO_SIZES	(sizeof(stress_io_size) / sizeof(stress_io_size[0]))
+
+struct stress_thread {
+	pthread_t thread;
+	uint32_t id;
+	unsigned int seed;
+	uint32_t n_ops;
+	uint32_t n_errors;
+	uint8_t *expect;		/* A writer's copy of its file */
+};
+
+static int stress_shared_handle;
+
+static uint8_t stress_pattern(uint32_t file, uint32_t offset)
+{
+	return (uint8_t)(file * 37 + offset * 7 + (offset >> 11));
+}
+
+static void stress_fill(uint8_t *buffer, uint32_t file, uint32_t offset,
+						uint32_t nbytes)
+{
+	uint32_t i;
+
+	for (i = 0; i < nbytes; i++)
+		buffer[i] = stress_pattern(file, offset + i);
+}
+
+static void stress_name(char *name, const char *kind, uint32_t index)
+{
+	sprintf(name, STRESS_MOUNT "/%s%lu", kind, (unsigned long)index);
+}
+
+static int stress_write_file(const char *name, const uint8_t *data,
+							 uint32_t nbytes)
+{
+	int h;
+	int ret;
+
+	h = yaffs_open(name, O_CREAT | O_TRUNC | O_RDWR, 0666);
+	if (h < 0)
+		return -1;
+	ret = yaffs_write(h, data, nbytes);
+	yaffs_close(h);
+
+	return ret == (int)nbytes ? 0 : -1;
+}
+
+/* Check a whole file against expect. Returns the number of errors. */
+static uint32_t stress_check_file(const char *name, const uint8_t *expect,
+								  uint32_t nbytes)
+{
+	static uint8_t buffer[STRESS_FILE_BYTES];
+	int h;
+	int ret;
+
+	h = yaffs_open(name, O_RDONLY, 0);
+	if (h < 0) {
+		printf("stress: %s: open failed\n", name);
+		return 1;
+	}
+	ret = yaffs_read(h, buffer, nbytes);
+	yaffs_close(h);
+	if (ret != (int)nbytes || memcmp(buffer, expect, nbytes)) {
+		printf("stress: %s: read back %d bytes, wrong data\n", name, ret);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void *stress_reader(void *arg)
+{
+	struct stress_thread *t = arg;
+	uint8_t buffer[STRESS_MAX_IO];
+	uint8_t expect[STRESS_MAX_IO];
+	char name[32];
+	uint32_t own_file = 0;
+	uint32_t i;
+	uint32_t file;
+	uint32_t offset;
+	uint32_t nbytes;
+	int own = -1;
+	int h;
+	int ret;
+
+	for (i = 0; i < STRESS_READ_OPS; i++) {
+		/*
+		 * Handles are few, so each reader has one of its own and moves
+		 * it to another file now and then.
+		 */
+		if (i % STRESS_REOPEN_OPS == 0) {
+			if (own >= 0)
+				yaffs_close(own);
+			own_file = rand_r(&t->seed) % STRESS_N_SHARED_FILES;
+			stress_name(name, "shared", own_file);
+			own = yaffs_open(name, O_RDONLY, 0);
+		}
+
+		/* One read in four through the handle all the readers share. */
+		if (rand_r(&t->seed) % 4 == 0) {
+			file = 0;
+			h = stress_shared_handle;
+		} else {
+			file = own_file;
+			h = own;
+		}
+		nbytes = stress_io_size[rand_r(&t->seed) % STRESS_N_IO_SIZES];
+		offset = rand_r(&t->seed) % (STRESS_FILE_BYTES - nbytes);
+		/* Sometimes chunk aligned, so whole chunks go past the cache. */
+		if (rand_r(&t->seed) % 2)
+			offset &= ~2047u;
+
+		ret = yaffs_pread(h, buffer, nbytes, offset);
+		stress_fill(expect, file, offset, nbytes);
+		if (ret != (int)nbytes || memcmp(buffer, expect, nbytes)) {
+			printf("stress: reader %lu: file %lu at %lu size %lu "
+				   "returned %d, wrong data\n",
+				   (unsigned long)t->id, (unsigned long)file,
+				   (unsigned long)offset, (unsigned long)nbytes, ret);
+			t->n_errors++;
+		}
+		t->n_ops++;
+	}
+
+	yaffs_close(own);
+
+	return NULL;
+}
+
+static void *stress_writer(void *arg)
+{
+	struct stress_thread *t = arg;
+	uint8_t buffer[STRESS_MAX_IO];
+	char name[32];
+	uint32_t i;
+	uint32_t offset;
+	uint32_t nbytes;
+	int h;
+	int ret;
+
+	stress_name(name, "own", t->id);
+	h = yaffs_open(name, O_RDWR, 0);
+	if (h < 0) {
+		t->n_errors++;
+		return NULL;
+	}
+
+	for (i = 0; i < STRESS_WRITE_OPS; i++) {
+		nbytes = stress_io_size[rand_r(&t->seed) % STRESS_N_IO_SIZES];
+		offset = rand_r(&t->seed) % (STRESS_FILE_BYTES - nbytes);
+		stress_fill(&t->expect[offset], t->id * 100 + i, offset, nbytes);
+
+		ret = yaffs_pwrite(h, &t->expect[offset], nbytes, offset);
+		if (ret != (int)nbytes)
+			t->n_errors++;
+
+		ret = yaffs_pread(h, buffer, nbytes, offset);
+		if (ret != (int)nbytes ||
+			memcmp(buffer, &t->expect[offset], nbytes)) {
+			printf("stress: writer %lu: read back at %lu size %lu "
+				   "returned %d, wrong data\n",
+				   (unsigned long)t->id, (unsigned long)offset,
+				   (unsigned long)nbytes, ret);
+			t->n_errors++;
+		}
+		t->n_ops++;
+	}
+
+	yaffs_close(h);
+	return NULL;
+}
+
+static void *stress_meta(void *arg)
+{
+	struct stress_thread *t = arg;
+	struct yaffs_stat st;
+	char name[32];
+	uint32_t i;
+	int h;
+
+	for (i = 0; i < STRESS_META_OPS; i++) {
+		stress_name(name, "tmp", i % 7);
+		h = yaffs_open(name, O_CREAT | O_RDWR, 0666);
+		if (h < 0) {
+			t->n_errors++;
+			continue;
+		}
+		yaffs_write(h, name, strlen(name));
+		yaffs_close(h);
+		if (yaffs_stat(name, &st) < 0 || yaffs_unlink(name) < 0)
+			t->n_errors++;
+		t->n_ops++;
+	}
+
+	return NULL;
+}
+
+int yaffs_stress_test(void)
+{
+	static uint8_t data[STRESS_FILE_BYTES];
+	struct stress_thread readers[STRESS_N_READERS];
+	struct stress_thread writers[STRESS_N_WRITERS];
+	struct stress_thread meta;
+	char name[32];
+	uint32_t n_errors = 0;
+	uint32_t i;
+
+	yaffs_spi_nand_load_driver(STRESS_MOUNT, 0, STRESS_END_BLOCK);
+	if (yaffs_mount(STRESS_MOUNT) < 0) {
+		printf("stress: mount failed\n");
+		return 1;
+	}
+
+	for (i = 0; i < STRESS_N_SHARED_FILES; i++) {
+		stress_name(name, "shared", i);
+		stress_fill(data, i, 0, STRESS_FILE_BYTES);
+		if (stress_write_file(name, data, STRESS_FILE_BYTES) < 0)
+			n_errors++;
+	}
+	memset(writers, 0, sizeof(writers));
+	for (i = 0; i < STRESS_N_WRITERS; i++) {
+		writers[i].id = i;
+		writers[i].seed = 1000 + i;
+		writers[i].expect = malloc(STRESS_FILE_BYTES);
+		stress_fill(writers[i].expect, 50 + i, 0, STRESS_FILE_BYTES);
+		stress_name(name, "own", i);
+		if (stress_write_file(name, writers[i].expect,
+							  STRESS_FILE_BYTES) < 0)
+			n_errors++;
+	}
+
+	stress_name(name, "shared", 0);
+	stress_shared_handle = yaffs_open(name, O_RDONLY, 0);
+
+	memset(readers, 0, sizeof(readers));
+	memset(&meta, 0, sizeof(meta));
+	for (i = 0; i < STRESS_N_READERS; i++) {
+		readers[i].id = i;
+		readers[i].seed = i + 1;
+		pthread_create(&readers[i].thread, NULL, stress_reader, &readers[i]);
+	}
+	for (i = 0; i < STRESS_N_WRITERS; i++)
+		pthread_create(&writers[i].thread, NULL, stress_writer, &writers[i]);
+	pthread_create(&meta.thread, NULL, stress_meta, &meta);
+
+	for (i = 0; i < STRESS_N_READERS; i++) {
+		pthread_join(readers[i].thread, NULL);
+		n_errors += readers[i].n_errors;
+	}
+	for (i = 0; i < STRESS_N_WRITERS; i++) {
+		pthread_join(writers[i].thread, NULL);
+		n_errors += writers[i].n_errors;
+	}
+	pthread_join(meta.thread, NULL);
+	n_errors += meta.n_errors;
+
+	yaffs_close(stress_shared_handle);
+
+	/* Everything must have reached the NAND intact. */
+	yaffs_unmount(STRESS_MOUNT);
+	if (yaffs_mount(STRESS_MOUNT) < 0) {
+		printf("stress: remount failed\n");
+		return 1;
+	}
+	for (i = 0; i < STRESS_N_SHARED_FILES; i++) {
+		stress_name(name, "shared", i);
+		stress_fill(data, i, 0, STRESS_FILE_BYTES);
+		n_errors += stress_check_file(name, data, STRESS_FILE_BYTES);
+		yaffs_unlink(name);
+	}
+	for (i = 0; i < STRESS_N_WRITERS; i++) {
+		stress_name(name, "own", i);
+		n_errors += stress_check_file(name, writers[i].expect,
+									  STRESS_FILE_BYTES);
+		yaffs_unlink(name);
+		free(writers[i].expect);
+	}
+
+	printf("stress: %d readers %lu reads, %d writers %lu writes, "
+		   "%lu meta ops, %lu errors\n",
+		   STRESS_N_READERS,
+		   (unsigned long)(STRESS_N_READERS * STRESS_READ_OPS),
+		   STRESS_N_WRITERS,
+		   (unsigned long)(STRESS_N_WRITERS * STRESS_WRITE_OPS),
+		   (unsigned long)meta.n_ops, (unsigned long)n_errors);
+
+	return n_errors != 0;
+}
+
+#else
+
+int yaffs_stress_test(void)
+{
+	printf("stress: build with YAFFS_PTHREAD_LOCKS to run it\n");
+	return 1;
+}
+
+#endif /* YAFFS_PTHREAD_LOCKS */
+
+#endif /* SPI_NAND_HOST_SIM */